@@ -0,0 +1,321 @@
+#include "wolfidps_internal.h"
+
+/* rule admission -- see wolfidps_event_report().
+ *
+ * a source is only worth a route once it has been reported against a rule
+ * threshold times, and most sources never are.  so reports are tallied in
+ * a count-min sketch instead of a table, one counter per row picked by
+ * hashes of the key, and read back as the least of them.  increments are
+ * conservative -- only counters below the new estimate are raised -- to
+ * keep collisions from inflating one another.  all of the counters are
+ * halved every half_life, by whichever report first finds it due.
+ */
+
+#ifndef WOLFIDPS_ADMISSION_DEPTH
+#define WOLFIDPS_ADMISSION_DEPTH 4
+#endif
+#ifndef WOLFIDPS_ADMISSION_WIDTH
+#define WOLFIDPS_ADMISSION_WIDTH 65536
+#endif
+#ifndef WOLFIDPS_ADMISSION_MAX_KEYS
+#define WOLFIDPS_ADMISSION_MAX_KEYS 8 /* distinct prefixes counted per report */
+#endif
+
+/* WOLFIDPS_ADMISSION_DEPTH rows of width counters. */
+struct wolfidps_admission_sketch {
+    uint32_t width; /* a power of 2 */
+    uint32_t counters[];
+};
+
+/* the src prefix a rule tallies and penalizes the flow by. */
+static unsigned int wolfidps_admission_prefix_len(const struct wolfidps_rule *rule, const struct wolfidps_sockaddr *src) {
+    if ((rule->prefix_len == 0) || (rule->prefix_len > src->addr_len))
+        return src->addr_len;
+    return rule->prefix_len;
+}
+
+/* fnv-1a over { family, prefix, event }. */
+static uint64_t wolfidps_admission_hash(const struct wolfidps_sockaddr *src, unsigned int prefix_len, wolfidps_ent_id_t event_id) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned int i, n = WOLFIDPS_BITS_TO_BYTES(prefix_len);
+
+    hash = (hash ^ (src->sa_family & 0xff)) * 0x100000001b3ULL;
+    hash = (hash ^ (src->sa_family >> 8)) * 0x100000001b3ULL;
+    hash = (hash ^ prefix_len) * 0x100000001b3ULL;
+    for (i = 0; i < n; ++i) {
+        u_char b = src->addr[i];
+        if ((i == n - 1) && (prefix_len & 7))
+            b &= (u_char)(0xff << (8 - (prefix_len & 7)));
+        hash = (hash ^ b) * 0x100000001b3ULL;
+    }
+    for (i = 0; i < sizeof event_id; ++i)
+        hash = (hash ^ ((event_id >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+    return hash;
+}
+
+static void wolfidps_admission_cells(struct wolfidps_admission_sketch *sketch, uint64_t hash, uint32_t **cells) {
+    uint32_t h1 = (uint32_t)hash, h2 = (uint32_t)(hash >> 32) | 1;
+    int i;
+    for (i = 0; i < WOLFIDPS_ADMISSION_DEPTH; ++i)
+        cells[i] = &sketch->counters[((size_t)i * sketch->width) + ((h1 + (uint32_t)i * h2) & (sketch->width - 1))];
+}
+
+static uint32_t wolfidps_admission_estimate(uint32_t **cells) {
+    uint32_t est = ~0U, v;
+    int i;
+    for (i = 0; i < WOLFIDPS_ADMISSION_DEPTH; ++i) {
+        if ((v = __atomic_load_n(cells[i], __ATOMIC_RELAXED)) < est)
+            est = v;
+    }
+    return est;
+}
+
+/* conservative update.  returns the new estimate. */
+static uint32_t wolfidps_admission_add(uint32_t **cells) {
+    uint32_t est = wolfidps_admission_estimate(cells);
+    int i;
+
+    if (est != ~0U)
+        ++est;
+    for (i = 0; i < WOLFIDPS_ADMISSION_DEPTH; ++i) {
+        uint32_t v = __atomic_load_n(cells[i], __ATOMIC_RELAXED);
+        while ((v < est) && (! __atomic_compare_exchange_n(cells[i], &v, est, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+            ;
+    }
+    return est;
+}
+
+static void wolfidps_admission_sub(uint32_t **cells, uint32_t n) {
+    int i;
+    for (i = 0; i < WOLFIDPS_ADMISSION_DEPTH; ++i) {
+        uint32_t v = __atomic_load_n(cells[i], __ATOMIC_RELAXED);
+        while (! __atomic_compare_exchange_n(cells[i], &v, (v > n) ? v - n : 0, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+static void wolfidps_admission_decay(struct wolfidps_admission *admission, struct wolfidps_admission_sketch *sketch, woldidps_time_t now) {
+    size_t i, n = (size_t)sketch->width * WOLFIDPS_ADMISSION_DEPTH;
+
+    if ((admission->half_life == 0) ||
+        (now - __atomic_load_n(&admission->decay_at, __ATOMIC_RELAXED) < 0) ||
+        __atomic_exchange_n(&admission->decaying, 1, __ATOMIC_ACQUIRE))
+        return;
+    if (now - admission->decay_at >= 0) {
+        for (i = 0; i < n; ++i)
+            __atomic_store_n(&sketch->counters[i], __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+        admission->decay_at = now + (woldidps_time_t)admission->half_life;
+    }
+    WOLFIDPS_ATOMIC_STORE_RELEASE(admission->decaying, 0);
+}
+
+static int wolfidps_admission_rule_applies(const struct wolfidps_rule *rule, const struct wolfidps_sockaddr *src, const struct wolfidps_sockaddr *dst) {
+    if ((! rule->flags.sa_family_wildcard) && (rule->sa_family != src->sa_family))
+        return 0;
+    if ((! rule->flags.sa_proto_wildcard) && (rule->sa_proto != src->sa_proto))
+        return 0;
+    if ((! rule->flags.sa_dst_port_wildcard) && (rule->sa_port != dst->sa_port))
+        return 0;
+    return 1;
+}
+
+/* the route a rule instantiates for src.  called with the table lock
+ * held.  returns 1 if a route was inserted, 0 if one was there already.
+ */
+static int wolfidps_admission_promote(struct wolfidps_context *wolfidps, struct wolfidps_rule *rule, const struct wolfidps_sockaddr *flow_src, const struct wolfidps_sockaddr *flow_dst) {
+    uint64_t src_buf[(sizeof(struct wolfidps_sockaddr) + sizeof(wolfidps_address_mask_t) + 7) / 8];
+    uint64_t dst_buf[(sizeof(struct wolfidps_sockaddr) + 7) / 8];
+    struct wolfidps_sockaddr *src = (struct wolfidps_sockaddr *)src_buf, *dst = (struct wolfidps_sockaddr *)dst_buf;
+    unsigned int prefix_len = wolfidps_admission_prefix_len(rule, flow_src);
+    wolfidps_route_flags_t flags;
+    struct wolfidps_route *route;
+    int ret;
+
+    memset(src, 0, sizeof *src);
+    memset(dst, 0, sizeof *dst);
+    src->sa_family = dst->sa_family = flow_src->sa_family;
+    src->addr_len = (u_char)prefix_len;
+    memcpy(src->addr, flow_src->addr, WOLFIDPS_BITS_TO_BYTES(prefix_len));
+    flags.flags = 0;
+    flags.src_if_id_wildcard = flags.dst_if_id_wildcard = 1;
+    flags.sa_dst_addr_wildcard = 1;
+    flags.sa_src_port_wildcard = 1;
+    if ((flags.sa_proto_wildcard = rule->flags.sa_proto_wildcard) == 0)
+        src->sa_proto = dst->sa_proto = flow_src->sa_proto;
+    if ((flags.sa_dst_port_wildcard = rule->flags.sa_dst_port_wildcard) == 0)
+        dst->sa_port = flow_dst->sa_port;
+
+    ++rule->event->refcount;
+    if ((ret = wolfidps_route_insert_1(wolfidps, src, dst, flags, rule->event, rule->duration, &route)) < 0) {
+        (void)wolfidps_event_dropreference(wolfidps, rule->event);
+        return (ret == WOLFIDPS_ROUTE_EXISTS_E) ? 0 : ret;
+    }
+    if ((route->action = rule->action))
+        ++route->action->refcount;
+    return 1;
+}
+
+static int wolfidps_admission_install(struct wolfidps_context *wolfidps, int width, wolfidps_time_t half_life, int replace) {
+    struct wolfidps_admission *admission = &wolfidps->admission;
+    struct wolfidps_admission_sketch *sketch, *old;
+    uint32_t n = 1;
+    woldidps_time_t now;
+    size_t size;
+
+    if ((width <= 0) || (width > (1 << 28)))
+        return BAD_FUNC_ARG;
+    while (n < (uint32_t)width)
+        n <<= 1;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0)
+        return -1;
+    size = sizeof *sketch + ((size_t)n * WOLFIDPS_ADMISSION_DEPTH * sizeof sketch->counters[0]);
+    if ((sketch = (struct wolfidps_admission_sketch *)wolfidps->allocator.malloc(wolfidps->allocator.context, size)) == NULL)
+        return MEMORY_E;
+    memset(sketch, 0, size);
+    sketch->width = n;
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0) {
+        wolfidps->allocator.free(wolfidps->allocator.context, sketch);
+        return -1;
+    }
+    if ((old = admission->sketch) && (! replace)) {
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+        wolfidps->allocator.free(wolfidps->allocator.context, sketch);
+        return 0;
+    }
+    admission->half_life = half_life;
+    admission->decay_at = now + (woldidps_time_t)half_life;
+    WOLFIDPS_ATOMIC_STORE_RELEASE(admission->sketch, sketch);
+    if (old)
+        wolfidps_epoch_retire(wolfidps, old);
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return 0;
+}
+
+int wolfidps_admission_configure(struct wolfidps_context *wolfidps, int width, wolfidps_time_t half_life) {
+    return wolfidps_admission_install(wolfidps, width, half_life, 1);
+}
+
+int wolfidps_event_report(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id, const struct wolfidps_sockaddr *src, const struct wolfidps_sockaddr *dst) {
+    struct wolfidps_admission *admission = &wolfidps->admission;
+    uint64_t keys[WOLFIDPS_ADMISSION_MAX_KEYS];
+    uint32_t *cells[WOLFIDPS_ADMISSION_DEPTH];
+    struct wolfidps_admission_sketch *sketch;
+    struct wolfidps_epoch_slot *epoch_slot;
+    struct wolfidps_table_ent_generic *i;
+    struct wolfidps_event *event;
+    woldidps_time_t now;
+    int n_keys = 0, n_due = 0, n_promoted = 0, seen = 0, k, ret;
+
+    if (src->sa_family != dst->sa_family)
+        return BAD_FUNC_ARG;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0)
+        return -1;
+    if ((WOLFIDPS_ATOMIC_LOAD_ACQUIRE(admission->sketch) == NULL) &&
+        ((ret = wolfidps_admission_install(wolfidps, WOLFIDPS_ADMISSION_WIDTH, 0, 0)) < 0))
+        return ret;
+
+    if (((epoch_slot = wolfidps_epoch_enter(wolfidps)) == NULL) &&
+        (wolfidps_lock_readonly(&wolfidps->lock) < 0))
+        return -1;
+    if ((event = wolfidps_event_by_id(wolfidps, id)) == NULL) {
+        ret = BAD_FUNC_ARG;
+        goto out;
+    }
+    wolfidps_counter_inc(wolfidps, epoch_slot, event->hitcount);
+    sketch = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(admission->sketch);
+    wolfidps_admission_decay(admission, sketch, now);
+
+    /* rules are sorted by keyword, so the event's are together. */
+    for (i = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->rules.header.head); i; i = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(i->generic.next)) {
+        struct wolfidps_rule *rule = &i->rule;
+        uint64_t hash;
+        if (rule->event != event) {
+            if (seen)
+                break;
+            continue;
+        }
+        seen = 1;
+        if (! wolfidps_admission_rule_applies(rule, src, dst))
+            continue;
+        wolfidps_counter_inc(wolfidps, epoch_slot, rule->hitcount);
+        if (rule->threshold <= 1) {
+            ++n_due;
+            continue;
+        }
+        /* each prefix is counted once per report, however many rules
+         * share it.
+         */
+        hash = wolfidps_admission_hash(src, wolfidps_admission_prefix_len(rule, src), id);
+        wolfidps_admission_cells(sketch, hash, cells);
+        for (k = 0; (k < n_keys) && (keys[k] != hash); ++k)
+            ;
+        if (k < n_keys) {
+            if (wolfidps_admission_estimate(cells) >= rule->threshold)
+                ++n_due;
+        } else {
+            if (n_keys < WOLFIDPS_ADMISSION_MAX_KEYS)
+                keys[n_keys++] = hash;
+            if (wolfidps_admission_add(cells) >= rule->threshold)
+                ++n_due;
+        }
+    }
+    ret = 0;
+
+  out:
+    if (epoch_slot)
+        wolfidps_epoch_leave(epoch_slot);
+    else
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    if ((ret < 0) || (n_due == 0))
+        return ret;
+
+    /* over a threshold -- go back for the routes with the lock held for
+     * writing, rechecking everything, since the rules may have changed.
+     */
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    sketch = admission->sketch;
+    n_keys = 0;
+    if ((event = wolfidps_event_by_id(wolfidps, id)) != NULL) {
+        for (i = wolfidps->rules.header.head; i; i = i->generic.next) {
+            struct wolfidps_rule *rule = &i->rule;
+            uint64_t hash = 0;
+            uint32_t est = 0;
+            if ((rule->event != event) || (! wolfidps_admission_rule_applies(rule, src, dst)))
+                continue;
+            if (rule->threshold > 1) {
+                hash = wolfidps_admission_hash(src, wolfidps_admission_prefix_len(rule, src), id);
+                wolfidps_admission_cells(sketch, hash, cells);
+                if ((est = wolfidps_admission_estimate(cells)) < rule->threshold)
+                    continue;
+            }
+            if ((ret = wolfidps_admission_promote(wolfidps, rule, src, dst)) < 0)
+                break;
+            n_promoted += ret;
+            if (est) {
+                for (k = 0; (k < n_keys) && (keys[k] != hash); ++k)
+                    ;
+                if ((k == n_keys) && (n_keys < WOLFIDPS_ADMISSION_MAX_KEYS))
+                    keys[n_keys++] = hash;
+            }
+        }
+        /* the routes answer for the source from here on, so take back
+         * the tallies that got it them -- only once each rule sharing one
+         * has seen it.
+         */
+        for (k = 0; k < n_keys; ++k) {
+            wolfidps_admission_cells(sketch, keys[k], cells);
+            wolfidps_admission_sub(cells, wolfidps_admission_estimate(cells));
+        }
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return (ret < 0) ? ret : n_promoted;
+}
+
+/* shutdown. */
+void wolfidps_admission_free(struct wolfidps_context *wolfidps) {
+    if (wolfidps->admission.sketch)
+        wolfidps->allocator.free(wolfidps->allocator.context, wolfidps->admission.sketch);
+    wolfidps->admission.sketch = NULL;
+}
@@ -0,0 +1,473 @@
+#include "wolfidps_internal.h"
+
+/* benchmark and load generator, built as its own program with
+ *
+ *   make bench
+ *
+ * for each table size (by default 1k, 100k, 1M and 10M entries; 10M takes
+ * about 4GB), builds a synthetic mix of IPv4 and IPv6 prefix
+ * rules, with lengths drawn from a distribution shaped like a real-world
+ * routing table, and host penalty routes, then times insert, dispatch over
+ * a zipf-skewed trace of flows drawn from them (plus some misses), delete,
+ * and expiry, at 1, 2, 4, ... up to the thread count.  results go to
+ * stdout as a single JSON document, one record per operation, size and
+ * thread count, with ns/op and p50/p99/p999 latency of single calls (of a
+ * whole budget-limited wolfidps_expire() call, for expiry).
+ *
+ * the clock callback is a plain load, so that clock reads don't weigh on
+ * the figures, and expiry can be driven deterministically.
+ */
+
+#ifdef WOLFIDPS_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_EXPIRE_BUDGET 1024
+
+/* a struct wolfidps_sockaddr with room for an IPv6 address. */
+struct bench_addr {
+    union {
+        struct wolfidps_sockaddr sa;
+        u_char buf[sizeof(struct wolfidps_sockaddr) + 16];
+    } u;
+};
+
+#define BENCH_SA(a) (&(a)->u.sa)
+
+struct bench_config {
+    int n_sizes;
+    long sizes[16];
+    int max_threads;
+    long n_dispatch_ops; /* per thread */
+    int n_flows;
+    double zipf_s;
+    int inet6_pct, penalty_pct, miss_pct;
+    int dispatch_cache;
+    uint64_t seed;
+};
+
+static volatile woldidps_time_t bench_now = 1;
+
+static int bench_get_time(void *context, woldidps_time_t *ts) {
+    (void)context;
+    *ts = __atomic_load_n(&bench_now, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline uint64_t bench_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64* */
+static inline uint64_t bench_rand(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/* prefix lengths, weighted roughly as in the global routing tables. */
+static const struct { unsigned int len, weight; } bench_inet_lens[] = {
+    { 8, 1 }, { 12, 1 }, { 16, 4 }, { 18, 2 }, { 19, 4 }, { 20, 6 },
+    { 21, 6 }, { 22, 14 }, { 23, 10 }, { 24, 52 }
+}, bench_inet6_lens[] = {
+    { 29, 3 }, { 32, 16 }, { 36, 4 }, { 40, 6 }, { 44, 8 }, { 48, 52 },
+    { 56, 4 }, { 64, 7 }
+};
+
+static unsigned int bench_pick_len(uint64_t *rng, int inet6) {
+    unsigned int total = 0, r, i, n = inet6 ? sizeof bench_inet6_lens / sizeof bench_inet6_lens[0] : sizeof bench_inet_lens / sizeof bench_inet_lens[0];
+    for (i = 0; i < n; ++i)
+        total += inet6 ? bench_inet6_lens[i].weight : bench_inet_lens[i].weight;
+    r = (unsigned int)(bench_rand(rng) % total);
+    for (i = 0; i < n; ++i) {
+        unsigned int w = inet6 ? bench_inet6_lens[i].weight : bench_inet_lens[i].weight;
+        if (r < w)
+            break;
+        r -= w;
+    }
+    return inet6 ? bench_inet6_lens[i].len : bench_inet_lens[i].len;
+}
+
+static void bench_random_addr(uint64_t *rng, struct bench_addr *a, int inet6, unsigned int len) {
+    struct wolfidps_sockaddr *sa = BENCH_SA(a);
+    unsigned int i, n_bytes = inet6 ? 16 : 4;
+    memset(a, 0, sizeof *a);
+    sa->sa_family = inet6 ? AF_INET6 : AF_INET;
+    sa->addr_len = (u_char)len;
+    for (i = 0; i < n_bytes; ++i)
+        sa->addr[i] = (u_char)bench_rand(rng);
+    /* keep clear of the unspecified and multicast ranges, for realism. */
+    sa->addr[0] = inet6 ? (u_char)(0x20 | (sa->addr[0] & 0x0f)) : (u_char)(1 + (sa->addr[0] % 223));
+    for (i = len; i < n_bytes * 8; ++i)
+        sa->addr[i >> 3] &= (u_char)~(0x80 >> (i & 7));
+}
+
+/* the routes of a table size: prefix rules, then host penalties. */
+static void bench_make_routes(const struct bench_config *config, long n, struct bench_addr *routes) {
+    uint64_t rng = config->seed;
+    long i;
+    for (i = 0; i < n; ++i) {
+        int inet6 = (int)(bench_rand(&rng) % 100) < config->inet6_pct;
+        int penalty = (int)(bench_rand(&rng) % 100) < config->penalty_pct;
+        bench_random_addr(&rng, &routes[i], inet6, penalty ? (inet6 ? 128 : 32) : bench_pick_len(&rng, inet6));
+    }
+}
+
+/* flows from hosts within random routes, or anywhere, for misses. */
+static void bench_make_flows(const struct bench_config *config, long n_routes, const struct bench_addr *routes, struct bench_addr *srcs, struct bench_addr *dsts) {
+    uint64_t rng = config->seed ^ 0x5deece66dULL;
+    int i;
+    for (i = 0; i < config->n_flows; ++i) {
+        const struct wolfidps_sockaddr *route = BENCH_SA(&routes[bench_rand(&rng) % (uint64_t)n_routes]);
+        int inet6 = route->sa_family == AF_INET6;
+        struct wolfidps_sockaddr *src, *dst;
+        unsigned int full = inet6 ? 128 : 32, j;
+
+        bench_random_addr(&rng, &srcs[i], inet6, full);
+        bench_random_addr(&rng, &dsts[i], inet6, full);
+        src = BENCH_SA(&srcs[i]);
+        dst = BENCH_SA(&dsts[i]);
+        if ((int)(bench_rand(&rng) % 100) >= config->miss_pct) {
+            for (j = 0; j < route->addr_len; ++j) {
+                u_char bit = (u_char)(0x80 >> (j & 7));
+                src->addr[j >> 3] = (u_char)((src->addr[j >> 3] & ~bit) | (route->addr[j >> 3] & bit));
+            }
+        }
+        src->sa_proto = dst->sa_proto = 6;
+        src->sa_port = (wolfidps_port_t)(1024 + bench_rand(&rng) % 64512);
+        dst->sa_port = (wolfidps_port_t)((bench_rand(&rng) & 1) ? 443 : 1 + bench_rand(&rng) % 1024);
+    }
+}
+
+/* indexes into the flows, zipf distributed with exponent s. */
+static void bench_make_trace(const struct bench_config *config, long n, int *trace) {
+    double *cdf = (double *)malloc((size_t)config->n_flows * sizeof *cdf), total = 0.0;
+    uint64_t rng = config->seed ^ 0x2545f4914f6cdd1dULL;
+    long i;
+    int lo, hi;
+
+    for (i = 0; i < config->n_flows; ++i) {
+        total += 1.0 / pow((double)(i + 1), config->zipf_s);
+        cdf[i] = total;
+    }
+    for (i = 0; i < n; ++i) {
+        double u = (double)(bench_rand(&rng) >> 11) / (double)(1ULL << 53) * total;
+        for (lo = 0, hi = config->n_flows - 1; lo < hi; ) {
+            int mid = (lo + hi) >> 1;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        trace[i] = lo;
+    }
+    free(cdf);
+}
+
+static int bench_cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* one phase: n_threads workers each doing n_ops calls of op, timed one by one. */
+struct bench_phase;
+typedef int (*bench_op_fn_t)(struct bench_phase *phase, int thread, long i);
+
+struct bench_phase {
+    const char *name;
+    struct wolfidps_context *wolfidps;
+    long n_entries;
+    int n_threads;
+    long n_ops; /* per thread */
+    bench_op_fn_t op;
+    struct bench_addr *routes, *srcs, *dsts;
+    const int *trace;
+    long trace_len;
+    uint32_t *samples; /* n_threads * n_ops */
+    long n_failed;
+    long n_items; /* units of work behind the ops, if not one each */
+    pthread_barrier_t barrier;
+    uint64_t start_ns, end_ns;
+};
+
+struct bench_worker {
+    struct bench_phase *phase;
+    int thread;
+};
+
+static const wolfidps_route_flags_t bench_route_flags = {
+    .sa_proto_wildcard = 1, .sa_src_port_wildcard = 1, .sa_dst_addr_wildcard = 1,
+    .sa_dst_port_wildcard = 1, .src_if_id_wildcard = 1, .dst_if_id_wildcard = 1
+};
+
+/* routes match any dst, of the family of their src. */
+static struct bench_addr bench_route_dsts[2];
+
+static struct bench_addr *bench_route_dst(const struct wolfidps_sockaddr *src) {
+    return &bench_route_dsts[src->sa_family == AF_INET6];
+}
+
+/* the i'th op of thread covers its own slice of the routes. */
+static inline struct bench_addr *bench_route_of(struct bench_phase *phase, int thread, long i) {
+    return &phase->routes[(long)thread * phase->n_ops + i];
+}
+
+static int bench_op_insert(struct bench_phase *phase, int thread, long i) {
+    struct bench_addr *route = bench_route_of(phase, thread, i);
+    return wolfidps_route_insert(phase->wolfidps, BENCH_SA(route), BENCH_SA(bench_route_dst(BENCH_SA(route))), bench_route_flags, 5, "bench", WOLFIDPS_TIME_NEVER);
+}
+
+static int bench_op_delete(struct bench_phase *phase, int thread, long i) {
+    struct bench_addr *route = bench_route_of(phase, thread, i);
+    return wolfidps_route_delete(phase->wolfidps, BENCH_SA(route), BENCH_SA(bench_route_dst(BENCH_SA(route))), bench_route_flags, 5, "bench");
+}
+
+static int bench_op_dispatch(struct bench_phase *phase, int thread, long i) {
+    int flow = phase->trace[((long)thread * 7919 + i) % phase->trace_len];
+    wolfidps_disposition_t disposition;
+    wolfidps_time_t ttl;
+    return wolfidps_route_dispatch(phase->wolfidps, BENCH_SA(&phase->srcs[flow]), BENCH_SA(&phase->dsts[flow]), NULL, &disposition, &ttl);
+}
+
+static int bench_op_expire(struct bench_phase *phase, int thread, long i) {
+    int ret;
+    (void)thread;
+    (void)i;
+    if ((ret = wolfidps_expire(phase->wolfidps, WOLFIDPS_TIME_NEVER, BENCH_EXPIRE_BUDGET)) < 0)
+        return ret;
+    phase->n_items += ret;
+    return 0;
+}
+
+static void *bench_worker(void *arg) {
+    struct bench_worker *worker = (struct bench_worker *)arg;
+    struct bench_phase *phase = worker->phase;
+    uint32_t *samples = phase->samples + (long)worker->thread * phase->n_ops;
+    long i, n_failed = 0;
+
+    pthread_barrier_wait(&phase->barrier);
+    if (worker->thread == 0)
+        phase->start_ns = bench_ns();
+    for (i = 0; i < phase->n_ops; ++i) {
+        uint64_t t0 = bench_ns();
+        if (phase->op(phase, worker->thread, i) < 0)
+            ++n_failed;
+        samples[i] = (uint32_t)(bench_ns() - t0);
+    }
+    __atomic_add_fetch(&phase->n_failed, n_failed, __ATOMIC_RELAXED);
+    pthread_barrier_wait(&phase->barrier);
+    if (worker->thread == 0)
+        phase->end_ns = bench_ns();
+    (void)wolfidps_thread_detach(phase->wolfidps);
+    return NULL;
+}
+
+static int bench_run(struct bench_phase *phase, int *first_record) {
+    struct bench_worker workers[BENCH_MAX_THREADS];
+    pthread_t threads[BENCH_MAX_THREADS];
+    long n_samples = (long)phase->n_threads * phase->n_ops, items;
+    double elapsed;
+    int i;
+
+    if ((n_samples == 0) ||
+        ((phase->samples = (uint32_t *)malloc((size_t)n_samples * sizeof *phase->samples)) == NULL))
+        return -1;
+    phase->n_failed = 0;
+    pthread_barrier_init(&phase->barrier, NULL, (unsigned int)phase->n_threads);
+    for (i = 0; i < phase->n_threads; ++i) {
+        workers[i].phase = phase;
+        workers[i].thread = i;
+        if (i > 0)
+            pthread_create(&threads[i], NULL, bench_worker, &workers[i]);
+    }
+    bench_worker(&workers[0]);
+    for (i = 1; i < phase->n_threads; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&phase->barrier);
+
+    qsort(phase->samples, (size_t)n_samples, sizeof *phase->samples, bench_cmp_u32);
+    elapsed = (double)(phase->end_ns - phase->start_ns);
+    items = phase->n_items ? phase->n_items : n_samples;
+    printf("%s    {\"op\": \"%s\", \"entries\": %ld, \"threads\": %d, \"ops\": %ld, \"failed\": %ld, "
+           "\"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, \"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u}",
+           *first_record ? "" : ",\n", phase->name, phase->n_entries, phase->n_threads, items, phase->n_failed,
+           elapsed * phase->n_threads / (double)items, (double)items * 1e9 / elapsed,
+           phase->samples[n_samples / 2], phase->samples[n_samples * 99 / 100], phase->samples[n_samples * 999 / 1000]);
+    *first_record = 0;
+    fflush(stdout);
+    free(phase->samples);
+    phase->samples = NULL;
+    return 0;
+}
+
+static struct wolfidps_context *bench_context(const struct bench_config *config) {
+    struct wolfidps_context *wolfidps;
+    if (wolfidps_init(NULL, &wolfidps) < 0)
+        return NULL;
+    (void)wolfidps_set_callback_get_time(wolfidps, bench_get_time, NULL);
+    if ((wolfidps_set_dispatch_cache(wolfidps, config->dispatch_cache) < 0) ||
+        (wolfidps_set_lockless_dispatch(wolfidps, config->max_threads) < 0)) {
+        (void)wolfidps_shutdown(&wolfidps);
+        return NULL;
+    }
+    return wolfidps;
+}
+
+static int bench_size(const struct bench_config *config, long n, int *first_record) {
+    struct bench_addr *routes, *srcs, *dsts;
+    struct bench_phase phase;
+    int *trace, n_threads;
+    long i, trace_len = 1 << 20;
+    int ret = -1;
+
+    memset(&phase, 0, sizeof phase);
+    routes = (struct bench_addr *)malloc((size_t)n * sizeof *routes);
+    srcs = (struct bench_addr *)malloc((size_t)config->n_flows * sizeof *srcs);
+    dsts = (struct bench_addr *)malloc((size_t)config->n_flows * sizeof *dsts);
+    trace = (int *)malloc((size_t)trace_len * sizeof *trace);
+    if ((routes == NULL) || (srcs == NULL) || (dsts == NULL) || (trace == NULL))
+        goto out;
+    bench_make_routes(config, n, routes);
+    bench_make_flows(config, n, routes, srcs, dsts);
+    bench_make_trace(config, trace_len, trace);
+
+    phase.n_entries = n;
+    phase.routes = routes;
+    phase.srcs = srcs;
+    phase.dsts = dsts;
+    phase.trace = trace;
+    phase.trace_len = trace_len;
+
+    for (n_threads = 1; n_threads <= config->max_threads; n_threads <<= 1) {
+        /* insert and delete split the routes between the threads. */
+        if ((phase.wolfidps = bench_context(config)) == NULL)
+            goto out;
+        phase.n_threads = n_threads;
+        phase.n_ops = n / n_threads;
+        phase.name = "insert";
+        phase.op = bench_op_insert;
+        if (bench_run(&phase, first_record) < 0)
+            goto out;
+        phase.name = "dispatch";
+        phase.op = bench_op_dispatch;
+        phase.n_ops = config->n_dispatch_ops;
+        if (bench_run(&phase, first_record) < 0)
+            goto out;
+        phase.name = "delete";
+        phase.op = bench_op_delete;
+        phase.n_ops = n / n_threads;
+        if (bench_run(&phase, first_record) < 0)
+            goto out;
+        (void)wolfidps_shutdown(&phase.wolfidps);
+    }
+
+    /* expiry: every route with a ttl, all run out at once. */
+    if ((phase.wolfidps = bench_context(config)) == NULL)
+        goto out;
+    for (i = 0; i < n; ++i)
+        (void)wolfidps_route_insert(phase.wolfidps, BENCH_SA(&routes[i]), BENCH_SA(bench_route_dst(BENCH_SA(&routes[i]))), bench_route_flags, 5, "bench", 1000);
+    bench_now += 1000 + 1;
+    phase.name = "expire";
+    phase.op = bench_op_expire;
+    phase.n_threads = 1;
+    phase.n_ops = (phase.wolfidps->routes.n_routes + BENCH_EXPIRE_BUDGET - 1) / BENCH_EXPIRE_BUDGET + 1;
+    ret = bench_run(&phase, first_record);
+
+  out:
+    if (phase.wolfidps)
+        (void)wolfidps_shutdown(&phase.wolfidps);
+    free(routes);
+    free(srcs);
+    free(dsts);
+    free(trace);
+    return ret;
+}
+
+static void bench_usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [-n entries[,entries...]] [-t max threads] [-o dispatch ops per thread]\n"
+            "    [-f distinct flows] [-z zipf exponent] [-6 IPv6 percent] [-p penalty percent]\n"
+            "    [-m miss percent] [-c dispatch cache entries] [-s seed]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    struct bench_config config = {
+        .n_sizes = 4, .sizes = { 1000, 100000, 1000000, 10000000 }, .max_threads = 4,
+        .n_dispatch_ops = 1000000, .n_flows = 65536, .zipf_s = 1.0,
+        .inet6_pct = 20, .penalty_pct = 50, .miss_pct = 10, .dispatch_cache = 0,
+        .seed = 0x9e3779b97f4a7c15ULL
+    };
+    int opt, i, first_record = 1;
+    char *p;
+
+    while ((opt = getopt(argc, argv, "n:t:o:f:z:6:p:m:c:s:")) != -1) {
+        if (opt == 'n') {
+            for (config.n_sizes = 0, p = optarg; *p && (config.n_sizes < 16); ++config.n_sizes) {
+                config.sizes[config.n_sizes] = strtol(p, &p, 0);
+                if (*p == ',')
+                    ++p;
+            }
+        } else if (opt == 't')
+            config.max_threads = atoi(optarg);
+        else if (opt == 'o')
+            config.n_dispatch_ops = atol(optarg);
+        else if (opt == 'f')
+            config.n_flows = atoi(optarg);
+        else if (opt == 'z')
+            config.zipf_s = atof(optarg);
+        else if (opt == '6')
+            config.inet6_pct = atoi(optarg);
+        else if (opt == 'p')
+            config.penalty_pct = atoi(optarg);
+        else if (opt == 'm')
+            config.miss_pct = atoi(optarg);
+        else if (opt == 'c')
+            config.dispatch_cache = atoi(optarg);
+        else if (opt == 's')
+            config.seed = strtoull(optarg, NULL, 0) | 1;
+        else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if ((config.max_threads < 1) || (config.max_threads > BENCH_MAX_THREADS) ||
+        (config.n_dispatch_ops < 1) || (config.n_flows < 1)) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    for (i = 0; i < config.n_sizes; ++i) {
+        if (config.sizes[i] < config.max_threads) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    BENCH_SA(&bench_route_dsts[0])->sa_family = AF_INET;
+    BENCH_SA(&bench_route_dsts[1])->sa_family = AF_INET6;
+
+    printf("{\n  \"benchmark\": \"wolfidps\",\n  \"config\": {\"max_threads\": %d, \"dispatch_ops\": %ld, \"flows\": %d, "
+           "\"zipf_s\": %.2f, \"inet6_pct\": %d, \"penalty_pct\": %d, \"miss_pct\": %d, \"dispatch_cache\": %d, \"seed\": %" PRIu64 "},\n"
+           "  \"results\": [\n",
+           config.max_threads, config.n_dispatch_ops, config.n_flows, config.zipf_s, config.inet6_pct,
+           config.penalty_pct, config.miss_pct, config.dispatch_cache, config.seed);
+    for (i = 0; i < config.n_sizes; ++i) {
+        if (bench_size(&config, config.sizes[i], &first_record) < 0) {
+            fprintf(stderr, "benchmark of %ld entries failed\n", config.sizes[i]);
+            printf("\n  ]\n}\n");
+            return 1;
+        }
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
+
+#endif /* WOLFIDPS_BENCH */
@@ -0,0 +1,396 @@
+#include "wolfidps_internal.h"
+
+/* bulk route loading, for blocklist feeds of up to millions of prefixes,
+ * and a streaming route export.
+ *
+ * wolfidps_route_insert_bulk() does all it can before taking the table
+ * lock: the prefixes are sorted and deduplicated, their routes allocated,
+ * and a private trie built from them bottom-up.  under the lock, the
+ * routes are only checked against those in place and given their
+ * counters and timers, and the private trie is merged into the live one.
+ * the export walk takes the lock for one chunk at a time, and resumes by
+ * index and prefix, so that it never holds up writers for the whole table.
+ */
+
+/* src prefixes in preorder: by family, then bit by bit, with a prefix
+ * ahead of its extensions.  bits past a prefix are ignored.
+ */
+static int wolfidps_route_prefix_cmp_1(const struct wolfidps_route_prefix *left, const struct wolfidps_route_prefix *right) {
+    unsigned int min_len = (left->addr_len < right->addr_len) ? left->addr_len : right->addr_len, common;
+
+    if (left->sa_family != right->sa_family)
+        return (left->sa_family < right->sa_family) ? -1 : 1;
+    common = wolfidps_addr_common_bits(left->addr, right->addr, 0, min_len);
+    if (common < min_len)
+        return wolfidps_addr_bit(left->addr, common) ? 1 : -1;
+    if (left->addr_len != right->addr_len)
+        return (left->addr_len < right->addr_len) ? -1 : 1;
+    return 0;
+}
+
+/* qsort callback, for arrays of pointers to prefixes. */
+static int wolfidps_route_prefix_cmp(const void *left, const void *right) {
+    return wolfidps_route_prefix_cmp_1(*(const struct wolfidps_route_prefix * const *)left, *(const struct wolfidps_route_prefix * const *)right);
+}
+
+/* *sorted is set to pointers to the distinct prefixes, in preorder, for
+ * the caller to free.
+ */
+static int wolfidps_route_prefixes_sort(
+    struct wolfidps_context *wolfidps,
+    int n_prefixes,
+    const struct wolfidps_route_prefix *prefixes,
+    const struct wolfidps_route_prefix ***sorted,
+    size_t *n_sorted)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < (size_t)n_prefixes; ++i) {
+        if (prefixes[i].addr_len > 8 * sizeof prefixes[i].addr)
+            return BAD_FUNC_ARG;
+    }
+    *sorted = (const struct wolfidps_route_prefix **)wolfidps->allocator.malloc(wolfidps->allocator.context, (size_t)n_prefixes * sizeof **sorted);
+    if (*sorted == NULL)
+        return MEMORY_E;
+    for (i = 0; i < (size_t)n_prefixes; ++i)
+        (*sorted)[i] = &prefixes[i];
+    qsort(*sorted, (size_t)n_prefixes, sizeof **sorted, wolfidps_route_prefix_cmp);
+    for (i = 0; i < (size_t)n_prefixes; ++i) {
+        if ((n == 0) || (wolfidps_route_prefix_cmp_1((*sorted)[n - 1], (*sorted)[i]) != 0))
+            (*sorted)[n++] = (*sorted)[i];
+    }
+    *n_sorted = n;
+    return 0;
+}
+
+/* a bulk route runs from its src block to anywhere, on any proto and port. */
+static wolfidps_route_flags_t wolfidps_route_bulk_flags(wolfidps_route_flags_t flags) {
+    flags.src_if_id_wildcard = flags.dst_if_id_wildcard = 1;
+    flags.sa_dst_addr_wildcard = 1;
+    flags.sa_proto_wildcard = 1;
+    flags.sa_src_port_wildcard = flags.sa_dst_port_wildcard = 1;
+    return flags;
+}
+
+static void wolfidps_route_bulk_endpoints(const struct wolfidps_route_prefix *prefix, struct wolfidps_sockaddr *src, struct wolfidps_sockaddr *dst) {
+    memset(src, 0, sizeof *src);
+    memset(dst, 0, sizeof *dst);
+    src->sa_family = dst->sa_family = prefix->sa_family;
+    src->addr_len = prefix->addr_len;
+    memcpy(src->addr, prefix->addr, WOLFIDPS_BITS_TO_BYTES(prefix->addr_len));
+}
+
+int wolfidps_route_insert_bulk(
+    struct wolfidps_context *wolfidps,
+    int n_prefixes,
+    const struct wolfidps_route_prefix *prefixes,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label,
+    wolfidps_time_t ttl
+    ) {
+    uint64_t src_buf[(sizeof(struct wolfidps_sockaddr) + sizeof(wolfidps_address_mask_t) + 7) / 8];
+    uint64_t dst_buf[(sizeof(struct wolfidps_sockaddr) + 7) / 8];
+    struct wolfidps_sockaddr *src = (struct wolfidps_sockaddr *)src_buf, *dst = (struct wolfidps_sockaddr *)dst_buf;
+    const struct wolfidps_route_prefix **sorted = NULL;
+    struct wolfidps_route **routes = NULL;
+    struct wolfidps_route_table scratch;
+    struct wolfidps_event *event = NULL;
+    size_t n = 0, n_new = 0, i = 0, j;
+    long n_evict;
+    woldidps_time_t now;
+    int ret;
+
+    if ((n_prefixes < 0) || ((n_prefixes > 0) && (prefixes == NULL)) ||
+        (event_label && ((event_label_len <= 0) || (event_label_len > 255))))
+        return BAD_FUNC_ARG;
+    if (n_prefixes == 0)
+        return 0;
+    flags = wolfidps_route_bulk_flags(flags);
+    memset(&scratch, 0, sizeof scratch);
+    scratch.header.cmp_fn = wolfidps->routes.header.cmp_fn;
+
+    if ((ret = wolfidps_route_prefixes_sort(wolfidps, n_prefixes, prefixes, &sorted, &n)) < 0)
+        return ret;
+    if ((routes = (struct wolfidps_route **)wolfidps->allocator.malloc(wolfidps->allocator.context, n * sizeof *routes)) == NULL) {
+        ret = MEMORY_E;
+        goto out;
+    }
+    memset(routes, 0, n * sizeof *routes);
+    for (j = 0; j < n; ++j) {
+        wolfidps_route_bulk_endpoints(sorted[j], src, dst);
+        if ((ret = wolfidps_route_new(wolfidps, src, dst, flags, &routes[j])) < 0)
+            goto out;
+    }
+    if ((ret = wolfidps_route_trie_build(wolfidps, &scratch, routes, n)) < 0)
+        goto out;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0) {
+        ret = -1;
+        goto out;
+    }
+    if (event_label && ((ret = wolfidps_event_getreference(wolfidps, event_label_len, event_label, &event)) < 0))
+        goto unlock;
+
+    for (j = 0; j < n; ++j) {
+        if (wolfidps_route_present(wolfidps, routes[j], event)) {
+            /* in place already -- take it back out of the private trie. */
+            wolfidps_route_trie_delete_1(wolfidps, &scratch, &routes[j]->ent);
+            wolfidps_route_discard(wolfidps, routes[j]);
+            routes[j] = NULL;
+            continue;
+        }
+        ++n_new;
+    }
+
+    /* everything that can fail is done before the live table is touched,
+     * so that on failure it is as it was: the room the batch needs is
+     * checked for, the timer wheel started (so that arming can't fail),
+     * and each route given its counter.
+     */
+    if ((n_evict = wolfidps_evict_needed(wolfidps, (long)n_new)) < 0) {
+        ret = (int)n_evict;
+        goto release;
+    }
+    if ((ttl != WOLFIDPS_TIME_NEVER) && (n_new > 0) && (wolfidps_timer_start(wolfidps) < 0)) {
+        ret = -1;
+        goto release;
+    }
+    for (i = 0; i < n; ++i) {
+        if (routes[i] && ((ret = wolfidps_route_attach(wolfidps, routes[i], event, ttl, now)) < 0))
+            goto detach;
+    }
+    if ((ret = wolfidps_route_trie_splice(wolfidps, &wolfidps->routes, &scratch)) < 0)
+        goto detach;
+
+    /* the new routes are on neither the eviction ring nor the timer wheel
+     * yet, so none of them can be chosen as a victim, and the check above
+     * leaves enough old ones to choose from.
+     */
+    for (; n_evict > 0; --n_evict)
+        (void)wolfidps_evict_1(wolfidps);
+    for (j = 0; j < n; ++j) {
+        if (routes[j]) {
+            wolfidps_evict_link(&wolfidps->routes, routes[j]);
+            (void)wolfidps_route_arm(wolfidps, routes[j], now);
+        }
+    }
+    /* a reference per route, in place of the one taken above. */
+    if (event) {
+        event->refcount += (int)n_new;
+        (void)wolfidps_event_dropreference(wolfidps, event);
+    }
+    ret = (int)n_new;
+    goto unlock;
+
+  detach:
+    for (j = 0; j < i; ++j) {
+        if (routes[j])
+            wolfidps_route_detach(wolfidps, routes[j]);
+    }
+  release:
+    if (event)
+        (void)wolfidps_event_dropreference(wolfidps, event);
+  unlock:
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+
+  out:
+    if (ret < 0) {
+        wolfidps_route_trie_free(wolfidps, &scratch);
+        for (j = 0; routes && (j < n); ++j) {
+            if (routes[j])
+                wolfidps_route_discard(wolfidps, routes[j]);
+        }
+    }
+    if (routes)
+        wolfidps->allocator.free(wolfidps->allocator.context, routes);
+    wolfidps->allocator.free(wolfidps->allocator.context, sorted);
+    return ret;
+}
+
+int wolfidps_route_delete_bulk(
+    struct wolfidps_context *wolfidps,
+    int n_prefixes,
+    const struct wolfidps_route_prefix *prefixes,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label
+    ) {
+    uint64_t src_buf[(sizeof(struct wolfidps_sockaddr) + sizeof(wolfidps_address_mask_t) + 7) / 8];
+    uint64_t dst_buf[(sizeof(struct wolfidps_sockaddr) + 7) / 8];
+    struct wolfidps_sockaddr *src = (struct wolfidps_sockaddr *)src_buf, *dst = (struct wolfidps_sockaddr *)dst_buf;
+    const struct wolfidps_route_prefix **sorted;
+    struct wolfidps_route *route;
+    size_t n, i;
+    uint32_t rule;
+    int ret, n_deleted = 0;
+
+    if ((n_prefixes < 0) || ((n_prefixes > 0) && (prefixes == NULL)))
+        return BAD_FUNC_ARG;
+    if (n_prefixes == 0)
+        return 0;
+    flags = wolfidps_route_bulk_flags(flags);
+    /* in order, the lookups share their upper trie levels. */
+    if ((ret = wolfidps_route_prefixes_sort(wolfidps, n_prefixes, prefixes, &sorted, &n)) < 0)
+        return ret;
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0) {
+        wolfidps->allocator.free(wolfidps->allocator.context, sorted);
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        wolfidps_route_bulk_endpoints(sorted[i], src, dst);
+        if (wolfidps_route_lookup(wolfidps, src, dst, flags, event_label_len, event_label, &route, &rule) < 0)
+            continue;
+        if (route)
+            (void)wolfidps_route_delete_1(wolfidps, route);
+        else
+            wolfidps_policy_rule_delete(wolfidps, rule);
+        ++n_deleted;
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+
+    wolfidps->allocator.free(wolfidps->allocator.context, sorted);
+    return n_deleted;
+}
+
+int wolfidps_route_export_init(struct wolfidps_context *wolfidps, struct wolfidps_route_export **export) {
+    if (*export == NULL)
+        *export = (struct wolfidps_route_export *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof **export);
+    if (*export == NULL)
+        return MEMORY_E;
+    memset(*export, 0, sizeof **export);
+    return 0;
+}
+
+int wolfidps_route_export_free(struct wolfidps_context *wolfidps, struct wolfidps_route_export **export) {
+    if (*export == NULL)
+        return BAD_FUNC_ARG;
+    wolfidps->allocator.free(wolfidps->allocator.context, *export);
+    *export = NULL;
+    return 0;
+}
+
+/* the trie of the lowest family numbered at least sa_family in the index
+ * of ent_type.
+ */
+static struct wolfidps_route_trie_family *wolfidps_route_export_family(struct wolfidps_route_table *table, int ent_type, wolfidps_family_t sa_family) {
+    struct wolfidps_route_trie_family *i, *best = NULL;
+    for (i = table->families[ent_type]; i; i = i->next) {
+        if ((i->sa_family >= sa_family) && ((best == NULL) || (i->sa_family < best->sa_family)))
+            best = i;
+    }
+    return best;
+}
+
+/* move the walk on to the dst index, from its first family.  returns 0
+ * if it was already there, and so is done.
+ */
+static int wolfidps_route_export_next_index(struct wolfidps_route_export *export) {
+    if (export->ent_type == WOLFIDPS_ROUTE_TABLE_DST_ENT) {
+        export->done = 1;
+        return 0;
+    }
+    export->ent_type = WOLFIDPS_ROUTE_TABLE_DST_ENT;
+    export->sa_family = 0;
+    export->started = 0;
+    return 1;
+}
+
+static void wolfidps_route_export_1(const struct wolfidps_route *route, woldidps_time_t now, struct wolfidps_route_export_ent *ent) {
+    memset(ent, 0, sizeof *ent);
+    ent->flags = route->flags;
+    ent->sa_family = route->sa_family;
+    ent->sa_proto = route->sa_proto;
+    ent->src_port = route->src.sa_port;
+    ent->dst_port = route->dst.sa_port;
+    ent->src_if_id = route->src.if_id;
+    ent->dst_if_id = route->dst.if_id;
+    ent->src_addr_len = route->src.addr_len;
+    ent->dst_addr_len = route->dst.addr_len;
+    memcpy(ent->src_addr.address, WOLFIDPS_ROUTE_SRC_ADDR(route), WOLFIDPS_ROUTE_SRC_ADDR_BYTES(route));
+    memcpy(ent->dst_addr.address, WOLFIDPS_ROUTE_DST_ADDR(route), WOLFIDPS_ROUTE_DST_ADDR_BYTES(route));
+    if (route->ttl == WOLFIDPS_TIME_NEVER)
+        ent->ttl = WOLFIDPS_TIME_NEVER;
+    else
+        ent->ttl = (wolfidps_time_t)((woldidps_time_t)route->last_transition_time + (woldidps_time_t)route->ttl - now);
+    if (route->parent_event) {
+        ent->event_label_len = route->parent_event->keyword_len;
+        memcpy(ent->event_label, route->parent_event->keyword, route->parent_event->keyword_len);
+    }
+}
+
+int wolfidps_route_export_next(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_route_export *export,
+    int max_ents,
+    struct wolfidps_route_export_ent *ents,
+    int *n_ents
+    ) {
+    struct wolfidps_route_trie_family *family;
+    struct wolfidps_route_trie_node *node;
+    struct wolfidps_table_ent_generic *ent;
+    woldidps_time_t now;
+    int n = 0, n_node, ret = 0;
+
+    *n_ents = 0;
+    if ((max_ents <= 0) || (ents == NULL))
+        return BAD_FUNC_ARG;
+    if (export->done)
+        return 0;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0)
+        return -1;
+    if (wolfidps_lock_readonly(&wolfidps->lock) < 0)
+        return -1;
+
+    while (n < max_ents) {
+        if ((family = wolfidps_route_export_family(&wolfidps->routes, export->ent_type, export->sa_family)) == NULL) {
+            if (! wolfidps_route_export_next_index(export))
+                break;
+            continue;
+        }
+        if (family->sa_family != export->sa_family) {
+            export->sa_family = family->sa_family;
+            export->started = 0;
+        }
+        if ((node = wolfidps_route_trie_next(family, export->started ? export->prefix.address : NULL, export->prefix_len)) == NULL) {
+            if (export->sa_family == (wolfidps_family_t)~0U) {
+                if (! wolfidps_route_export_next_index(export))
+                    break;
+                continue;
+            }
+            ++export->sa_family;
+            export->started = 0;
+            continue;
+        }
+
+        /* whole prefixes only, so that the walk resumes by prefix alone. */
+        export->ents.point = node->ents.head;
+        for (n_node = 0, (void)wolfidps_table_cursor_current(&export->ents, &ent); ent; (void)wolfidps_table_cursor_next(&export->ents, &ent))
+            ++n_node;
+        if (n + n_node > max_ents) {
+            if (n == 0)
+                ret = BUFFER_E;
+            break;
+        }
+        export->ents.point = node->ents.head;
+        for ((void)wolfidps_table_cursor_current(&export->ents, &ent); ent; (void)wolfidps_table_cursor_next(&export->ents, &ent)) {
+            if (! wolfidps_route_expired(ent->route.route, now))
+                wolfidps_route_export_1(ent->route.route, now, &ents[n++]);
+        }
+
+        export->started = 1;
+        export->prefix_len = node->prefix_len;
+        memcpy(export->prefix.address, node->prefix, WOLFIDPS_BITS_TO_BYTES(node->prefix_len));
+    }
+    /* nothing in the table is held on to past the lock. */
+    export->ents.point = NULL;
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+
+    *n_ents = n;
+    return ret;
+}
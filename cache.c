@@ -0,0 +1,147 @@
+#include "wolfidps_internal.h"
+
+/* per-thread dispatch cache.
+ *
+ * each reader slot can carry a direct-mapped table of its recent route
+ * lookups, keyed on the flow.  only the owning thread ever touches it, so
+ * a repeated flow costs a hash and a compare, with no shared writes.
+ * writers bump the route table generation after every change to what
+ * dispatch can match, which invalidates every entry in every cache at
+ * once.  entries also record the policy image they were looked up in,
+ * since a reader may load a new image ahead of the generation bump that
+ * follows it.  only the lookup is cached -- counting, rate limits and
+ * actions still run on every hit.
+ */
+
+#ifndef WOLFIDPS_DISPATCH_CACHE_MAX_ENTRIES
+#define WOLFIDPS_DISPATCH_CACHE_MAX_ENTRIES (1 << 20)
+#endif
+
+/* no table generation ever reaches this. */
+#define WOLFIDPS_DISPATCH_CACHE_INVALID (~(uint64_t)0)
+
+int wolfidps_set_dispatch_cache(struct wolfidps_context *wolfidps, int n_entries) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    int size, i, ret;
+
+    if ((n_entries < 0) || (n_entries > WOLFIDPS_DISPATCH_CACHE_MAX_ENTRIES))
+        return BAD_FUNC_ARG;
+    for (size = n_entries ? 1 : 0; size < n_entries; size <<= 1)
+        ;
+
+    for (i = 0; i < epoch->n_slots; ++i)
+        wolfidps_dispatch_cache_free(wolfidps, &epoch->slots[i]);
+    epoch->dispatch_cache_size = size;
+    for (i = 0; i < epoch->n_slots; ++i) {
+        if ((ret = wolfidps_dispatch_cache_init(wolfidps, &epoch->slots[i])) < 0) {
+            while (--i >= 0)
+                wolfidps_dispatch_cache_free(wolfidps, &epoch->slots[i]);
+            epoch->dispatch_cache_size = 0;
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int wolfidps_dispatch_cache_init(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    struct wolfidps_dispatch_cache *cache;
+    size_t cache_size;
+    uint32_t i, size = (uint32_t)wolfidps->epoch.dispatch_cache_size;
+
+    slot->dispatch_cache = NULL;
+    if (size == 0)
+        return 0;
+    cache_size = sizeof *cache + (size_t)size * sizeof cache->ents[0];
+    if (wolfidps->allocator.memalign)
+        cache = (struct wolfidps_dispatch_cache *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, cache_size);
+    else
+        cache = (struct wolfidps_dispatch_cache *)wolfidps->allocator.malloc(wolfidps->allocator.context, cache_size);
+    if (cache == NULL)
+        return MEMORY_E;
+    memset(cache, 0, cache_size);
+    cache->mask = size - 1;
+    for (i = 0; i < size; ++i)
+        cache->ents[i].generation = WOLFIDPS_DISPATCH_CACHE_INVALID;
+    slot->dispatch_cache = cache;
+    return 0;
+}
+
+/* no reader may be using the slot. */
+void wolfidps_dispatch_cache_free(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    if (slot->dispatch_cache == NULL)
+        return;
+    wolfidps->allocator.free(wolfidps->allocator.context, slot->dispatch_cache);
+    slot->dispatch_cache = NULL;
+}
+
+static inline uint32_t wolfidps_dispatch_cache_hash(const union wolfidps_dispatch_cache_key *key) {
+    uint64_t hash = 0;
+    int i;
+    for (i = 0; i < WOLFIDPS_DISPATCH_CACHE_KEY_WORDS; ++i) {
+        hash = (hash ^ key->words[i]) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    return (uint32_t)(hash >> 32);
+}
+
+/* returns 1 on a hit, with the lookup result in *route and *rule, as left
+ * by wolfidps_route_match_merge() (*rule is WOLFIDPS_POLICY_NONE for no
+ * match).  on a miss, returns 0, with *ent the entry to pass to
+ * wolfidps_dispatch_cache_put() after the full lookup, or NULL if the
+ * flow can't be cached.  called from within an epoch, under which a hit's
+ * route is safe to use.
+ */
+int wolfidps_dispatch_cache_get(
+    struct wolfidps_dispatch_cache *cache,
+    uint64_t generation,
+    const struct wolfidps_policy_image *image,
+    const struct wolfidps_sockaddr *src,
+    const struct wolfidps_sockaddr *dst,
+    woldidps_time_t now,
+    struct wolfidps_dispatch_cache_ent **ent,
+    struct wolfidps_route **route,
+    uint32_t *rule)
+{
+    union wolfidps_dispatch_cache_key key;
+    struct wolfidps_dispatch_cache_ent *e;
+    int i;
+
+    *ent = NULL;
+    if ((src->addr_len > WOLFIDPS_DISPATCH_CACHE_ADDR_BYTES * 8) ||
+        (dst->addr_len > WOLFIDPS_DISPATCH_CACHE_ADDR_BYTES * 8))
+        return 0;
+
+    memset(&key, 0, sizeof key);
+    key.flow.sa_family = src->sa_family;
+    key.flow.sa_proto = src->sa_proto;
+    key.flow.src_port = src->sa_port;
+    key.flow.dst_port = dst->sa_port;
+    key.flow.src_if_id = src->if_id;
+    key.flow.dst_if_id = dst->if_id;
+    key.flow.src_len = src->addr_len;
+    key.flow.dst_len = dst->addr_len;
+    memcpy(key.flow.src_addr, src->addr, WOLFIDPS_BITS_TO_BYTES(src->addr_len));
+    memcpy(key.flow.dst_addr, dst->addr, WOLFIDPS_BITS_TO_BYTES(dst->addr_len));
+
+    e = &cache->ents[wolfidps_dispatch_cache_hash(&key) & cache->mask];
+    for (i = 0; i < WOLFIDPS_DISPATCH_CACHE_KEY_WORDS; ++i) {
+        if (e->key.words[i] != key.words[i])
+            break;
+    }
+    /* the route is only dereferenced once the generation shows it live.
+     * a route that has since expired may uncover a shorter one.
+     */
+    if ((i == WOLFIDPS_DISPATCH_CACHE_KEY_WORDS) &&
+        (e->generation == generation) &&
+        (e->image == image) &&
+        ((e->route == NULL) || (! wolfidps_route_expired(e->route, now)))) {
+        *route = e->route;
+        *rule = e->rule;
+        return 1;
+    }
+
+    e->key = key;
+    e->generation = WOLFIDPS_DISPATCH_CACHE_INVALID;
+    *ent = e;
+    return 0;
+}
@@ -0,0 +1,257 @@
+#include "wolfidps_internal.h"
+
+#include <sched.h>
+
+/* trigger coalescing -- see wolfidps_action_set_coalescing().
+ *
+ * each ent of the table holds the merged triggers of one { action, route }
+ * key, and pins the action and event, as a queued record does.  ents are
+ * claimed by dispatch and emptied by whoever delivers them, under a spin
+ * lock of their own, so that no trigger is ever lost or counted twice.
+ * delivery itself runs with the ent unlocked.
+ */
+
+#ifndef WOLFIDPS_COALESCE_TABLE_SIZE
+#define WOLFIDPS_COALESCE_TABLE_SIZE 1024 /* ents, a power of 2 */
+#endif
+#ifndef WOLFIDPS_COALESCE_MAX_PROBES
+#define WOLFIDPS_COALESCE_MAX_PROBES 8
+#endif
+
+struct wolfidps_coalesce_ent {
+    volatile int lock;
+    struct wolfidps_action *action; /* NULL while the ent is free */
+    struct wolfidps_event *event;
+    uint64_t key;
+    wolfidps_count_t count;
+    woldidps_time_t first_seen, last_seen;
+    int has_route;
+    uint64_t route_buf[WOLFIDPS_ROUTE_SNAPSHOT_WORDS];
+};
+
+/* merged triggers taken out of an ent, with its pins, for delivery. */
+struct wolfidps_coalesce_batch {
+    struct wolfidps_action *action;
+    struct wolfidps_event *event;
+    wolfidps_count_t count;
+    woldidps_time_t first_seen, last_seen;
+    int has_route;
+    uint64_t route_buf[WOLFIDPS_ROUTE_SNAPSHOT_WORDS];
+};
+
+static void wolfidps_coalesce_lock(struct wolfidps_coalesce_ent *ent) {
+    while (__atomic_exchange_n(&ent->lock, 1, __ATOMIC_ACQUIRE))
+        (void)sched_yield();
+}
+
+static void wolfidps_coalesce_unlock(struct wolfidps_coalesce_ent *ent) {
+    WOLFIDPS_ATOMIC_STORE_RELEASE(ent->lock, 0);
+}
+
+/* routes are keyed on their id, and compiled rules with no route on their
+ * index, with the top bit set.
+ */
+static uint64_t wolfidps_coalesce_key(const struct wolfidps_route *route, uint32_t rule) {
+    return route ? route->id : (((uint64_t)1 << 63) | rule);
+}
+
+static void wolfidps_coalesce_deliver(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_action *action,
+    struct wolfidps_event *event,
+    const struct wolfidps_route *route,
+    wolfidps_count_t count,
+    woldidps_time_t first_seen,
+    woldidps_time_t last_seen)
+{
+    struct wolfidps_action_trigger trigger;
+    wolfidps_action_coalesced_callback_t *handler;
+
+    trigger.event = event;
+    trigger.route = route;
+    trigger.count = count;
+    trigger.first_seen = (wolfidps_time_t)first_seen;
+    trigger.last_seen = (wolfidps_time_t)last_seen;
+    if (wolfidps_action_is_queued(wolfidps, action))
+        (void)wolfidps_action_queue_push(wolfidps, slot, action, event, NULL, NULL, &trigger);
+    else if ((handler = __atomic_load_n(&action->coalesced_handler, __ATOMIC_RELAXED)))
+        handler(action->handler_context, &trigger);
+}
+
+static void wolfidps_coalesce_take(struct wolfidps_coalesce_ent *ent, struct wolfidps_coalesce_batch *batch) {
+    batch->action = ent->action;
+    batch->event = ent->event;
+    batch->count = ent->count;
+    batch->first_seen = ent->first_seen;
+    batch->last_seen = ent->last_seen;
+    if ((batch->has_route = ent->has_route))
+        memcpy(batch->route_buf, ent->route_buf, ((const struct wolfidps_route *)ent->route_buf)->buf_alloced);
+    ent->action = NULL;
+}
+
+/* deliver batch, then drop the pins it took over from its ent. */
+static void wolfidps_coalesce_deliver_batch(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, struct wolfidps_coalesce_batch *batch) {
+    wolfidps_coalesce_deliver(wolfidps, slot, batch->action, batch->event, batch->has_route ? (const struct wolfidps_route *)batch->route_buf : NULL, batch->count, batch->first_seen, batch->last_seen);
+    if (batch->event)
+        wolfidps_action_queue_unpin(wolfidps, &batch->event->queue_refs, batch->event);
+    wolfidps_action_queue_unpin(wolfidps, &batch->action->queue_refs, batch->action);
+}
+
+static void wolfidps_coalesce_fill(
+    struct wolfidps_coalesce_ent *ent,
+    struct wolfidps_action *action,
+    struct wolfidps_event *event,
+    const struct wolfidps_route *route,
+    uint64_t key,
+    woldidps_time_t now)
+{
+    __atomic_add_fetch(&action->queue_refs, 1, __ATOMIC_RELAXED);
+    if (event)
+        __atomic_add_fetch(&event->queue_refs, 1, __ATOMIC_RELAXED);
+    ent->action = action;
+    ent->event = event;
+    ent->key = key;
+    ent->count = 1;
+    ent->first_seen = ent->last_seen = now;
+    if ((ent->has_route = (route != NULL)))
+        wolfidps_route_snapshot(ent->route_buf, route);
+}
+
+/* account for a trigger of a coalescing action.  called by dispatch, in
+ * an epoch or with the table lock held.
+ */
+int wolfidps_action_coalesce(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_action *action,
+    struct wolfidps_event *event,
+    const struct wolfidps_route *route,
+    uint32_t rule,
+    woldidps_time_t now)
+{
+    struct wolfidps_coalesce_ent *ents = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->coalescer.ents);
+    struct wolfidps_coalesce_batch batch;
+    uint64_t key = wolfidps_coalesce_key(route, rule);
+    uint32_t hash, i;
+
+    if (ents == NULL) {
+        wolfidps_coalesce_deliver(wolfidps, slot, action, event, route, 1, now, now);
+        return 0;
+    }
+    hash = (uint32_t)((((uint64_t)action->id << 48) ^ key) * 0x9E3779B97F4A7C15ULL >> 32);
+    for (i = 0; i < WOLFIDPS_COALESCE_MAX_PROBES; ++i) {
+        struct wolfidps_coalesce_ent *ent = &ents[(hash + i) & (wolfidps->coalescer.n_ents - 1)];
+        wolfidps_coalesce_lock(ent);
+        if ((ent->action == action) && (ent->key == key) && (ent->event == event)) {
+            if (now - ent->first_seen < (woldidps_time_t)action->coalesce_window) {
+                ++ent->count;
+                if (now > ent->last_seen)
+                    ent->last_seen = now;
+                wolfidps_coalesce_unlock(ent);
+                wolfidps_counter_inc(wolfidps, slot, action->n_coalesced);
+                return 0;
+            }
+            /* the window has passed -- deliver it, and open the next. */
+            wolfidps_coalesce_take(ent, &batch);
+            wolfidps_coalesce_fill(ent, action, event, route, key, now);
+            wolfidps_coalesce_unlock(ent);
+            wolfidps_coalesce_deliver_batch(wolfidps, slot, &batch);
+            return 0;
+        }
+        if (ent->action == NULL) {
+            wolfidps_coalesce_fill(ent, action, event, route, key, now);
+            wolfidps_coalesce_unlock(ent);
+            return 0;
+        }
+        if (now - ent->first_seen >= (woldidps_time_t)ent->action->coalesce_window) {
+            wolfidps_coalesce_take(ent, &batch);
+            wolfidps_coalesce_fill(ent, action, event, route, key, now);
+            wolfidps_coalesce_unlock(ent);
+            wolfidps_coalesce_deliver_batch(wolfidps, slot, &batch);
+            return 0;
+        }
+        wolfidps_coalesce_unlock(ent);
+    }
+    /* no room. */
+    wolfidps_coalesce_deliver(wolfidps, slot, action, event, route, 1, now, now);
+    return 0;
+}
+
+int wolfidps_action_coalesce_flush_1(struct wolfidps_context *wolfidps, woldidps_time_t now, int all) {
+    struct wolfidps_coalesce_ent *ents = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->coalescer.ents);
+    struct wolfidps_coalesce_batch batch;
+    uint32_t i;
+    int n = 0;
+
+    if (ents == NULL)
+        return 0;
+    for (i = 0; i < wolfidps->coalescer.n_ents; ++i) {
+        struct wolfidps_coalesce_ent *ent = &ents[i];
+        if (__atomic_load_n(&ent->action, __ATOMIC_RELAXED) == NULL)
+            continue;
+        wolfidps_coalesce_lock(ent);
+        if (ent->action &&
+            (all || (now - ent->first_seen >= (woldidps_time_t)ent->action->coalesce_window))) {
+            wolfidps_coalesce_take(ent, &batch);
+            wolfidps_coalesce_unlock(ent);
+            wolfidps_coalesce_deliver_batch(wolfidps, NULL, &batch);
+            ++n;
+        } else
+            wolfidps_coalesce_unlock(ent);
+    }
+    wolfidps_action_queue_flush(wolfidps);
+    return n;
+}
+
+int wolfidps_action_coalesce_flush(struct wolfidps_context *wolfidps, wolfidps_time_t now) {
+    woldidps_time_t now_1 = (woldidps_time_t)now;
+    if ((now == WOLFIDPS_TIME_NEVER) &&
+        (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now_1) < 0))
+        return -1;
+    return wolfidps_action_coalesce_flush_1(wolfidps, now_1, 0);
+}
+
+int wolfidps_action_set_coalescing(struct wolfidps_context *wolfidps, int label_len, const char *label, wolfidps_time_t window, wolfidps_action_coalesced_callback_t *handler) {
+    struct wolfidps_coalescer *coalescer = &wolfidps->coalescer;
+    struct wolfidps_action *action;
+    int ret = 0;
+
+    if ((label == NULL) || (label_len <= 0) || (label_len > 255) || (window && (handler == NULL)))
+        return BAD_FUNC_ARG;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((action = wolfidps_action_get(wolfidps, label_len, label)) == NULL)
+        ret = -1;
+    else if (window && (coalescer->ents == NULL)) {
+        struct wolfidps_coalesce_ent *ents;
+        size_t size = (size_t)WOLFIDPS_COALESCE_TABLE_SIZE * sizeof *ents;
+        if (wolfidps->allocator.memalign)
+            ents = (struct wolfidps_coalesce_ent *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, size);
+        else
+            ents = (struct wolfidps_coalesce_ent *)wolfidps->allocator.malloc(wolfidps->allocator.context, size);
+        if (ents == NULL)
+            ret = MEMORY_E;
+        else {
+            memset(ents, 0, size);
+            coalescer->n_ents = WOLFIDPS_COALESCE_TABLE_SIZE;
+            WOLFIDPS_ATOMIC_STORE_RELEASE(coalescer->ents, ents);
+        }
+    }
+    if (ret == 0) {
+        /* the old handler is kept on stopping, for what is still merged. */
+        action->coalesce_window = window;
+        if (window)
+            action->coalesced_handler = handler;
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+/* shutdown -- everything has been flushed. */
+void wolfidps_coalescer_free(struct wolfidps_context *wolfidps) {
+    if (wolfidps->coalescer.ents)
+        wolfidps->allocator.free(wolfidps->allocator.context, wolfidps->coalescer.ents);
+    wolfidps->coalescer.ents = NULL;
+    wolfidps->coalescer.n_ents = 0;
+}
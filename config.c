@@ -0,0 +1,1064 @@
+#include "wolfidps_internal.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+/* text policies -- see wolfidps_config_load().  one statement per line,
+ * with # starting a comment:
+ *
+ *   action <label>
+ *   event <keyword> [action <label>]...
+ *   rule <keyword> <family> <proto> <port> [id <n>] [prefix <bits>]
+ *       [threshold <n>] [disposition accept|reject|drop] [ttl <n>]
+ *       [action <label>]
+ *   route <family> <proto> <src>[/<bits>] <src port> <dst>[/<bits>] <dst port>
+ *       [event <keyword>] [action <label>] [src-if <n>] [dst-if <n>]
+ *       [tcplike] [nocount] [rate <interval> <burst>]
+ *
+ * a family is inet, inet6, or a number, and a proto is tcp, udp, icmp,
+ * icmp6, or a number.  inet and inet6 addresses are written as usual, and
+ * others as hex digits.  * is a wildcard for any family, proto, address,
+ * or port, and in a rule, everything after a wildcard must be one too.
+ * ttls and rate intervals are in the units of the time callbacks.  every action referred to
+ * must be declared.
+ *
+ * statements are keyed as the ents they produce are, and the config last
+ * loaded is kept, sorted by key, with each statement pointing at its live
+ * action, event, or rule.  a load parses and sorts the new text, then
+ * merges it against the old to find what was added, removed, or changed,
+ * and allocates what it can, all without the table lock.  only applying
+ * the diff takes the lock.
+ */
+
+#ifndef WOLFIDPS_CONFIG_MAX_SIZE
+#define WOLFIDPS_CONFIG_MAX_SIZE ((size_t)1 << 30) /* of a text read by wolfidps_config_load_fd() */
+#endif
+
+/* in key order -- actions first, since everything else refers to them. */
+enum wolfidps_config_type {
+    WOLFIDPS_CONFIG_ACTION = 0,
+    WOLFIDPS_CONFIG_EVENT,
+    WOLFIDPS_CONFIG_RULE,
+    WOLFIDPS_CONFIG_ROUTE
+};
+
+struct wolfidps_config_label {
+    const char *s; /* in the config's copy of the text */
+    uint32_t len;
+};
+
+struct wolfidps_config_stmt {
+    u_char type; /* enum wolfidps_config_type */
+    u_char failed; /* could not be applied, and is dropped from the config */
+    u_char src_len, dst_len; /* in bits */
+    u_char src_if_id, dst_if_id;
+    u_char prefix_len;
+    int line;
+    struct wolfidps_config_label name; /* label or keyword, empty for a route with no event */
+    struct wolfidps_config_label action; /* of a rule or route, empty for none */
+    union {
+        size_t off; /* while parsing */
+        const struct wolfidps_config_label *p;
+    } labels; /* of an event's actions */
+    uint32_t n_labels;
+    union {
+        size_t off; /* while parsing */
+        const u_char *p;
+    } addrs; /* a route's src and then dst address */
+    uint32_t id;
+    wolfidps_route_flags_t flags;
+    wolfidps_family_t sa_family;
+    wolfidps_proto_t sa_proto;
+    wolfidps_port_t src_port, dst_port; /* a rule's port is its dst_port */
+    wolfidps_disposition_t disposition;
+    wolfidps_count_t threshold;
+    wolfidps_time_t ttl;
+    wolfidps_time_t rate_interval; /* of a route, 0 for no limit */
+    uint32_t rate_burst;
+    void *live; /* the action, event, or rule it produced */
+};
+
+struct wolfidps_config {
+    char *text;
+    struct wolfidps_config_stmt *stmts; /* sorted by wolfidps_config_key_cmp() */
+    size_t n_stmts, stmts_alloced;
+    struct wolfidps_config_label *labels;
+    size_t n_labels, labels_alloced;
+    u_char *addrs;
+    size_t n_addr_bytes, addrs_alloced;
+};
+
+enum wolfidps_config_op_kind {
+    WOLFIDPS_CONFIG_INSERT = 0,
+    WOLFIDPS_CONFIG_DELETE,
+    WOLFIDPS_CONFIG_CHANGE
+};
+
+struct wolfidps_config_op {
+    u_char kind; /* enum wolfidps_config_op_kind */
+    struct wolfidps_config_stmt *old, *new;
+    struct wolfidps_rule *rule; /* preallocated, for an inserted rule */
+    struct wolfidps_rule *rule_prev; /* an inserted rule goes right after this one, or at the head if NULL */
+    struct wolfidps_action_list_ent *ents; /* preallocated, for an event's action list, chained through header.next */
+};
+
+struct wolfidps_config_parser {
+    struct wolfidps_config *config;
+    struct wolfidps_context *wolfidps;
+    const char *p, *eol; /* the rest of the current line */
+    int line;
+};
+
+static int wolfidps_config_grow(struct wolfidps_context *wolfidps, void **array, size_t *alloced, size_t n, size_t size) {
+    size_t new_alloced;
+    void *new;
+    if (n < *alloced)
+        return 0;
+    new_alloced = *alloced ? (*alloced * 2) : 64;
+    if ((new = wolfidps->allocator.realloc(wolfidps->allocator.context, *array, new_alloced * size)) == NULL)
+        return MEMORY_E;
+    *array = new;
+    *alloced = new_alloced;
+    return 0;
+}
+
+static void wolfidps_config_release(struct wolfidps_context *wolfidps, struct wolfidps_config *config) {
+    if (config == NULL)
+        return;
+    if (config->text)
+        wolfidps->allocator.free(wolfidps->allocator.context, config->text);
+    if (config->stmts)
+        wolfidps->allocator.free(wolfidps->allocator.context, config->stmts);
+    if (config->labels)
+        wolfidps->allocator.free(wolfidps->allocator.context, config->labels);
+    if (config->addrs)
+        wolfidps->allocator.free(wolfidps->allocator.context, config->addrs);
+    wolfidps->allocator.free(wolfidps->allocator.context, config);
+}
+
+/* the next token on the line, or 0 at the end of it. */
+static int wolfidps_config_token(struct wolfidps_config_parser *parser, struct wolfidps_config_label *token) {
+    const char *p = parser->p;
+    while ((p < parser->eol) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+        ++p;
+    if ((p == parser->eol) || (*p == '#')) {
+        parser->p = parser->eol;
+        return 0;
+    }
+    token->s = p;
+    while ((p < parser->eol) && (*p != ' ') && (*p != '\t') && (*p != '\r'))
+        ++p;
+    token->len = (uint32_t)(p - token->s);
+    parser->p = p;
+    return 1;
+}
+
+static int wolfidps_config_is(const struct wolfidps_config_label *token, const char *word) {
+    size_t len = strlen(word);
+    return (token->len == len) && (! memcmp(token->s, word, len));
+}
+
+static int wolfidps_config_number(const struct wolfidps_config_label *token, uint64_t max, uint64_t *n) {
+    uint32_t i;
+    if (token->len == 0)
+        return BAD_FUNC_ARG;
+    *n = 0;
+    for (i = 0; i < token->len; ++i) {
+        uint64_t digit = (uint64_t)(token->s[i] - '0');
+        if ((token->s[i] < '0') || (token->s[i] > '9') || (*n > (max - digit) / 10))
+            return BAD_FUNC_ARG;
+        *n = (*n * 10) + digit;
+    }
+    return 0;
+}
+
+static int wolfidps_config_next_number(struct wolfidps_config_parser *parser, uint64_t max, uint64_t *n) {
+    struct wolfidps_config_label token;
+    if (! wolfidps_config_token(parser, &token))
+        return BAD_FUNC_ARG;
+    return wolfidps_config_number(&token, max, n);
+}
+
+/* a keyword or label. */
+static int wolfidps_config_next_name(struct wolfidps_config_parser *parser, struct wolfidps_config_label *name) {
+    if ((! wolfidps_config_token(parser, name)) || (name->len > 255))
+        return BAD_FUNC_ARG;
+    return 0;
+}
+
+static int wolfidps_config_family(const struct wolfidps_config_label *token, struct wolfidps_config_stmt *stmt) {
+    uint64_t n;
+    if (wolfidps_config_is(token, "*")) {
+        stmt->flags.sa_family_wildcard = 1;
+        return 0;
+    }
+    if (wolfidps_config_is(token, "inet"))
+        n = AF_INET;
+    else if (wolfidps_config_is(token, "inet6"))
+        n = AF_INET6;
+    else if (wolfidps_config_number(token, 0xffff, &n) < 0)
+        return BAD_FUNC_ARG;
+    stmt->sa_family = (wolfidps_family_t)n;
+    return 0;
+}
+
+static int wolfidps_config_proto(const struct wolfidps_config_label *token, struct wolfidps_config_stmt *stmt) {
+    uint64_t n;
+    if (wolfidps_config_is(token, "*")) {
+        stmt->flags.sa_proto_wildcard = 1;
+        return 0;
+    }
+    if (wolfidps_config_is(token, "tcp"))
+        n = IPPROTO_TCP;
+    else if (wolfidps_config_is(token, "udp"))
+        n = IPPROTO_UDP;
+    else if (wolfidps_config_is(token, "icmp"))
+        n = IPPROTO_ICMP;
+    else if (wolfidps_config_is(token, "icmp6"))
+        n = IPPROTO_ICMPV6;
+    else if (wolfidps_config_number(token, 0xffff, &n) < 0)
+        return BAD_FUNC_ARG;
+    stmt->sa_proto = (wolfidps_proto_t)n;
+    return 0;
+}
+
+static int wolfidps_config_port(const struct wolfidps_config_label *token, wolfidps_port_t *port, int *wildcard) {
+    uint64_t n;
+    if (wolfidps_config_is(token, "*")) {
+        *wildcard = 1;
+        return 0;
+    }
+    if (wolfidps_config_number(token, 0xffff, &n) < 0)
+        return BAD_FUNC_ARG;
+    *port = (wolfidps_port_t)n;
+    return 0;
+}
+
+static int wolfidps_config_hex_digit(char c) {
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* <addr>[/<bits>], or *, appended to the config's addrs[]. */
+static int wolfidps_config_addr(struct wolfidps_config_parser *parser, const struct wolfidps_config_label *token, const struct wolfidps_config_stmt *stmt, u_char *addr_len, int *wildcard) {
+    struct wolfidps_config *config = parser->config;
+    u_char addr[sizeof(wolfidps_address_mask_t)];
+    char buf[INET6_ADDRSTRLEN];
+    const char *slash;
+    uint32_t text_len, i;
+    uint64_t bits;
+    size_t n_bytes;
+    int ret;
+
+    if (wolfidps_config_is(token, "*")) {
+        *wildcard = 1;
+        *addr_len = 0;
+        return 0;
+    }
+    slash = (const char *)memchr(token->s, '/', token->len);
+    text_len = slash ? (uint32_t)(slash - token->s) : token->len;
+    if ((! stmt->flags.sa_family_wildcard) && ((stmt->sa_family == AF_INET) || (stmt->sa_family == AF_INET6))) {
+        if (text_len >= sizeof buf)
+            return BAD_FUNC_ARG;
+        memcpy(buf, token->s, text_len);
+        buf[text_len] = 0;
+        if (inet_pton(stmt->sa_family, buf, addr) != 1)
+            return BAD_FUNC_ARG;
+        bits = (stmt->sa_family == AF_INET) ? 32 : 128;
+    } else {
+        if ((text_len == 0) || (text_len & 1) || (text_len / 2 >= sizeof addr))
+            return BAD_FUNC_ARG;
+        for (i = 0; i < text_len; ++i) {
+            int digit = wolfidps_config_hex_digit(token->s[i]);
+            if (digit < 0)
+                return BAD_FUNC_ARG;
+            if (i & 1)
+                addr[i >> 1] |= (u_char)digit;
+            else
+                addr[i >> 1] = (u_char)(digit << 4);
+        }
+        bits = (uint64_t)text_len * 4;
+    }
+    if (slash) {
+        struct wolfidps_config_label bits_token = { slash + 1, token->len - text_len - 1 };
+        if (wolfidps_config_number(&bits_token, bits, &bits) < 0)
+            return BAD_FUNC_ARG;
+    }
+
+    /* zero the bits past the prefix, so that keys compare bytewise. */
+    n_bytes = WOLFIDPS_BITS_TO_BYTES(bits);
+    if (bits & 7)
+        addr[n_bytes - 1] &= (u_char)(0xff << (8 - (bits & 7)));
+    if ((ret = wolfidps_config_grow(parser->wolfidps, (void **)&config->addrs, &config->addrs_alloced, config->n_addr_bytes + n_bytes, 1)) < 0)
+        return ret;
+    memcpy(config->addrs + config->n_addr_bytes, addr, n_bytes);
+    config->n_addr_bytes += n_bytes;
+    *addr_len = (u_char)bits;
+    return 0;
+}
+
+static int wolfidps_config_parse_action(struct wolfidps_config_parser *parser, struct wolfidps_config_stmt *stmt) {
+    stmt->type = WOLFIDPS_CONFIG_ACTION;
+    return wolfidps_config_next_name(parser, &stmt->name);
+}
+
+static int wolfidps_config_parse_event(struct wolfidps_config_parser *parser, struct wolfidps_config_stmt *stmt) {
+    struct wolfidps_config *config = parser->config;
+    struct wolfidps_config_label token;
+    int ret;
+
+    stmt->type = WOLFIDPS_CONFIG_EVENT;
+    if ((ret = wolfidps_config_next_name(parser, &stmt->name)) < 0)
+        return ret;
+    stmt->labels.off = config->n_labels;
+    while (wolfidps_config_token(parser, &token)) {
+        if (! wolfidps_config_is(&token, "action"))
+            return BAD_FUNC_ARG;
+        if ((ret = wolfidps_config_grow(parser->wolfidps, (void **)&config->labels, &config->labels_alloced, config->n_labels, sizeof *config->labels)) < 0)
+            return ret;
+        if ((ret = wolfidps_config_next_name(parser, &config->labels[config->n_labels])) < 0)
+            return ret;
+        ++config->n_labels;
+        ++stmt->n_labels;
+    }
+    return 0;
+}
+
+static int wolfidps_config_parse_rule(struct wolfidps_config_parser *parser, struct wolfidps_config_stmt *stmt) {
+    struct wolfidps_config_label token;
+    uint64_t n;
+    int wildcard = 0, ret;
+
+    stmt->type = WOLFIDPS_CONFIG_RULE;
+    stmt->threshold = 1;
+    stmt->disposition = WOLFIDPS_REJECT;
+    if ((ret = wolfidps_config_next_name(parser, &stmt->name)) < 0)
+        return ret;
+    if ((! wolfidps_config_token(parser, &token)) || (wolfidps_config_family(&token, stmt) < 0) ||
+        (! wolfidps_config_token(parser, &token)) || (wolfidps_config_proto(&token, stmt) < 0) ||
+        (! wolfidps_config_token(parser, &token)) || (wolfidps_config_port(&token, &stmt->dst_port, &wildcard) < 0))
+        return BAD_FUNC_ARG;
+    stmt->flags.sa_dst_port_wildcard = (uint32_t)wildcard;
+    if ((stmt->flags.sa_family_wildcard && (! stmt->flags.sa_proto_wildcard)) ||
+        (stmt->flags.sa_proto_wildcard && (! stmt->flags.sa_dst_port_wildcard)))
+        return BAD_FUNC_ARG;
+
+    while (wolfidps_config_token(parser, &token)) {
+        if (wolfidps_config_is(&token, "id")) {
+            if (wolfidps_config_next_number(parser, 0xffffffffU, &n) < 0)
+                return BAD_FUNC_ARG;
+            stmt->id = (uint32_t)n;
+        } else if (wolfidps_config_is(&token, "prefix")) {
+            if (wolfidps_config_next_number(parser, 255, &n) < 0)
+                return BAD_FUNC_ARG;
+            stmt->prefix_len = (u_char)n;
+        } else if (wolfidps_config_is(&token, "threshold")) {
+            if (wolfidps_config_next_number(parser, ~(uint64_t)0, &n) < 0)
+                return BAD_FUNC_ARG;
+            stmt->threshold = n;
+        } else if (wolfidps_config_is(&token, "ttl")) {
+            if (wolfidps_config_next_number(parser, (uint64_t)INT64_MAX, &n) < 0)
+                return BAD_FUNC_ARG;
+            stmt->ttl = n;
+        } else if (wolfidps_config_is(&token, "disposition")) {
+            if (! wolfidps_config_token(parser, &token))
+                return BAD_FUNC_ARG;
+            if (wolfidps_config_is(&token, "accept"))
+                stmt->disposition = WOLFIDPS_ACCEPT;
+            else if (wolfidps_config_is(&token, "reject"))
+                stmt->disposition = WOLFIDPS_REJECT;
+            else if (wolfidps_config_is(&token, "drop"))
+                stmt->disposition = WOLFIDPS_DROP;
+            else
+                return BAD_FUNC_ARG;
+        } else if (wolfidps_config_is(&token, "action")) {
+            if ((ret = wolfidps_config_next_name(parser, &stmt->action)) < 0)
+                return ret;
+        } else
+            return BAD_FUNC_ARG;
+    }
+    return 0;
+}
+
+static int wolfidps_config_parse_route(struct wolfidps_config_parser *parser, struct wolfidps_config_stmt *stmt) {
+    struct wolfidps_config_label token;
+    uint64_t n;
+    int wildcard, ret = 0;
+
+    stmt->type = WOLFIDPS_CONFIG_ROUTE;
+    stmt->flags.src_if_id_wildcard = stmt->flags.dst_if_id_wildcard = 1;
+    stmt->addrs.off = parser->config->n_addr_bytes;
+    if ((! wolfidps_config_token(parser, &token)) || (wolfidps_config_family(&token, stmt) < 0) ||
+        (! wolfidps_config_token(parser, &token)) || (wolfidps_config_proto(&token, stmt) < 0))
+        return BAD_FUNC_ARG;
+
+    wildcard = 0;
+    if ((! wolfidps_config_token(parser, &token)) || ((ret = wolfidps_config_addr(parser, &token, stmt, &stmt->src_len, &wildcard)) < 0))
+        return ret ? ret : BAD_FUNC_ARG;
+    stmt->flags.sa_src_addr_wildcard = (uint32_t)wildcard;
+    wildcard = 0;
+    if ((! wolfidps_config_token(parser, &token)) || (wolfidps_config_port(&token, &stmt->src_port, &wildcard) < 0))
+        return BAD_FUNC_ARG;
+    stmt->flags.sa_src_port_wildcard = (uint32_t)wildcard;
+    wildcard = 0;
+    if ((! wolfidps_config_token(parser, &token)) || ((ret = wolfidps_config_addr(parser, &token, stmt, &stmt->dst_len, &wildcard)) < 0))
+        return ret ? ret : BAD_FUNC_ARG;
+    stmt->flags.sa_dst_addr_wildcard = (uint32_t)wildcard;
+    wildcard = 0;
+    if ((! wolfidps_config_token(parser, &token)) || (wolfidps_config_port(&token, &stmt->dst_port, &wildcard) < 0))
+        return BAD_FUNC_ARG;
+    stmt->flags.sa_dst_port_wildcard = (uint32_t)wildcard;
+
+    while (wolfidps_config_token(parser, &token)) {
+        if (wolfidps_config_is(&token, "event")) {
+            if ((ret = wolfidps_config_next_name(parser, &stmt->name)) < 0)
+                return ret;
+        } else if (wolfidps_config_is(&token, "action")) {
+            if ((ret = wolfidps_config_next_name(parser, &stmt->action)) < 0)
+                return ret;
+        } else if (wolfidps_config_is(&token, "src-if")) {
+            if (wolfidps_config_next_number(parser, 255, &n) < 0)
+                return BAD_FUNC_ARG;
+            stmt->src_if_id = (u_char)n;
+            stmt->flags.src_if_id_wildcard = 0;
+        } else if (wolfidps_config_is(&token, "dst-if")) {
+            if (wolfidps_config_next_number(parser, 255, &n) < 0)
+                return BAD_FUNC_ARG;
+            stmt->dst_if_id = (u_char)n;
+            stmt->flags.dst_if_id_wildcard = 0;
+        } else if (wolfidps_config_is(&token, "tcplike"))
+            stmt->flags.tcplike_port_numbers = 1;
+        else if (wolfidps_config_is(&token, "nocount"))
+            stmt->flags.dont_count = 1;
+        else if (wolfidps_config_is(&token, "rate")) {
+            if ((wolfidps_config_next_number(parser, (uint64_t)INT64_MAX, &n) < 0) || (n == 0))
+                return BAD_FUNC_ARG;
+            stmt->rate_interval = n;
+            if ((wolfidps_config_next_number(parser, 0xffffffffU, &n) < 0) || (n == 0) ||
+                (stmt->rate_interval > (uint64_t)INT64_MAX / n))
+                return BAD_FUNC_ARG;
+            stmt->rate_burst = (uint32_t)n;
+        } else
+            return BAD_FUNC_ARG;
+    }
+    return 0;
+}
+
+static int wolfidps_config_parse_line(struct wolfidps_config_parser *parser) {
+    struct wolfidps_config *config = parser->config;
+    struct wolfidps_config_label token;
+    struct wolfidps_config_stmt *stmt;
+    int ret;
+
+    if (! wolfidps_config_token(parser, &token))
+        return 0;
+    if ((ret = wolfidps_config_grow(parser->wolfidps, (void **)&config->stmts, &config->stmts_alloced, config->n_stmts, sizeof *config->stmts)) < 0)
+        return ret;
+    stmt = &config->stmts[config->n_stmts];
+    memset(stmt, 0, sizeof *stmt);
+    stmt->line = parser->line;
+
+    if (wolfidps_config_is(&token, "action"))
+        ret = wolfidps_config_parse_action(parser, stmt);
+    else if (wolfidps_config_is(&token, "event"))
+        ret = wolfidps_config_parse_event(parser, stmt);
+    else if (wolfidps_config_is(&token, "rule"))
+        ret = wolfidps_config_parse_rule(parser, stmt);
+    else if (wolfidps_config_is(&token, "route"))
+        ret = wolfidps_config_parse_route(parser, stmt);
+    else
+        ret = BAD_FUNC_ARG;
+    if (ret < 0)
+        return ret;
+    if (wolfidps_config_token(parser, &token))
+        return BAD_FUNC_ARG;
+    ++config->n_stmts;
+    return 0;
+}
+
+static int wolfidps_config_label_cmp(const struct wolfidps_config_label *left, const struct wolfidps_config_label *right) {
+    uint32_t len = (left->len < right->len) ? left->len : right->len;
+    int cmp = len ? memcmp(left->s, right->s, len) : 0;
+    if (cmp)
+        return cmp;
+    if (left->len != right->len)
+        return (left->len < right->len) ? -1 : 1;
+    return 0;
+}
+
+static int wolfidps_config_num_cmp(uint64_t left, uint64_t right) {
+    if (left != right)
+        return (left < right) ? -1 : 1;
+    return 0;
+}
+
+/* by type, then as for the ents each type produces: actions and events by
+ * name, rules as for wolfidps_rule_key_cmp(), and routes on everything
+ * wolfidps_route_lookup() matches on.
+ */
+static int wolfidps_config_key_cmp(const struct wolfidps_config_stmt *left, const struct wolfidps_config_stmt *right) {
+    wolfidps_route_flags_t left_flags = left->flags, right_flags = right->flags;
+    int cmp;
+
+    if ((cmp = wolfidps_config_num_cmp(left->type, right->type)))
+        return cmp;
+    left_flags.dont_count = right_flags.dont_count = 0;
+
+    if (left->type == WOLFIDPS_CONFIG_ROUTE) {
+        if ((cmp = wolfidps_config_num_cmp(left->sa_family, right->sa_family)) ||
+            (cmp = wolfidps_config_num_cmp(left_flags.flags, right_flags.flags)) ||
+            (cmp = wolfidps_config_num_cmp(left->sa_proto, right->sa_proto)) ||
+            (cmp = wolfidps_config_num_cmp(left->src_len, right->src_len)) ||
+            (cmp = memcmp(left->addrs.p, right->addrs.p, WOLFIDPS_BITS_TO_BYTES(left->src_len))) ||
+            (cmp = wolfidps_config_num_cmp(left->src_port, right->src_port)) ||
+            (cmp = wolfidps_config_num_cmp(left->dst_len, right->dst_len)) ||
+            (cmp = memcmp(left->addrs.p + WOLFIDPS_BITS_TO_BYTES(left->src_len), right->addrs.p + WOLFIDPS_BITS_TO_BYTES(right->src_len), WOLFIDPS_BITS_TO_BYTES(left->dst_len))) ||
+            (cmp = wolfidps_config_num_cmp(left->dst_port, right->dst_port)) ||
+            (cmp = wolfidps_config_num_cmp(left->src_if_id, right->src_if_id)) ||
+            (cmp = wolfidps_config_num_cmp(left->dst_if_id, right->dst_if_id)))
+            return cmp;
+        return wolfidps_config_label_cmp(&left->name, &right->name);
+    }
+
+    if ((cmp = wolfidps_config_label_cmp(&left->name, &right->name)))
+        return cmp;
+    if (left->type == WOLFIDPS_CONFIG_RULE) {
+        if ((cmp = wolfidps_config_num_cmp(left->sa_family, right->sa_family)) ||
+            (cmp = wolfidps_config_num_cmp(left->sa_proto, right->sa_proto)) ||
+            (cmp = wolfidps_config_num_cmp(left->dst_port, right->dst_port)) ||
+            (cmp = wolfidps_config_num_cmp(left_flags.flags, right_flags.flags)) ||
+            (cmp = wolfidps_config_num_cmp(left->id, right->id)))
+            return cmp;
+    }
+    return 0;
+}
+
+/* qsort callback -- duplicates stay in line order. */
+static int wolfidps_config_sort_cmp(const void *left, const void *right) {
+    int cmp = wolfidps_config_key_cmp((const struct wolfidps_config_stmt *)left, (const struct wolfidps_config_stmt *)right);
+    if (cmp)
+        return cmp;
+    return wolfidps_config_num_cmp((uint64_t)((const struct wolfidps_config_stmt *)left)->line, (uint64_t)((const struct wolfidps_config_stmt *)right)->line);
+}
+
+/* true if everything but the key is the same. */
+static int wolfidps_config_attr_eq(const struct wolfidps_config_stmt *left, const struct wolfidps_config_stmt *right) {
+    uint32_t i;
+    if (left->type == WOLFIDPS_CONFIG_EVENT) {
+        if (left->n_labels != right->n_labels)
+            return 0;
+        for (i = 0; i < left->n_labels; ++i) {
+            if (wolfidps_config_label_cmp(&left->labels.p[i], &right->labels.p[i]))
+                return 0;
+        }
+        return 1;
+    }
+    if (left->type == WOLFIDPS_CONFIG_RULE)
+        return (left->prefix_len == right->prefix_len) &&
+            (left->threshold == right->threshold) &&
+            (left->disposition == right->disposition) &&
+            (left->ttl == right->ttl) &&
+            (! wolfidps_config_label_cmp(&left->action, &right->action));
+    if (left->type == WOLFIDPS_CONFIG_ROUTE)
+        return (left->flags.dont_count == right->flags.dont_count) &&
+            (left->rate_interval == right->rate_interval) &&
+            (left->rate_burst == right->rate_burst) &&
+            (! wolfidps_config_label_cmp(&left->action, &right->action));
+    return 1;
+}
+
+/* actions sort first, by label. */
+static int wolfidps_config_action_declared(const struct wolfidps_config *config, size_t n_actions, const struct wolfidps_config_label *label) {
+    size_t lo = 0, hi = n_actions;
+    if (label->len == 0)
+        return 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = wolfidps_config_label_cmp(&config->stmts[mid].name, label);
+        if (cmp == 0)
+            return 1;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+/* parse, sort, and check a copy of text. */
+static int wolfidps_config_parse(struct wolfidps_context *wolfidps, const char *text, size_t len, struct wolfidps_config **config, int *error_line) {
+    struct wolfidps_config_parser parser;
+    const char *end;
+    size_t i, n_actions;
+    int ret = 0;
+
+    if ((*config = (struct wolfidps_config *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof **config)) == NULL)
+        return MEMORY_E;
+    memset(*config, 0, sizeof **config);
+    if (((*config)->text = (char *)wolfidps->allocator.malloc(wolfidps->allocator.context, len ? len : 1)) == NULL) {
+        wolfidps_config_release(wolfidps, *config);
+        return MEMORY_E;
+    }
+    if (len)
+        memcpy((*config)->text, text, len);
+    /* never NULL, so that routes with no address bits compare cleanly. */
+    if (wolfidps_config_grow(wolfidps, (void **)&(*config)->addrs, &(*config)->addrs_alloced, 0, 1) < 0) {
+        wolfidps_config_release(wolfidps, *config);
+        return MEMORY_E;
+    }
+
+    parser.config = *config;
+    parser.wolfidps = wolfidps;
+    parser.p = (*config)->text;
+    end = parser.p + len;
+    for (parser.line = 1; parser.p < end; ++parser.line) {
+        if ((parser.eol = (const char *)memchr(parser.p, '\n', (size_t)(end - parser.p))) == NULL)
+            parser.eol = end;
+        if ((ret = wolfidps_config_parse_line(&parser)) < 0)
+            break;
+        parser.p = (parser.eol < end) ? (parser.eol + 1) : end;
+    }
+
+    if (ret == 0) {
+        struct wolfidps_config_stmt *stmts = (*config)->stmts;
+        for (i = 0; i < (*config)->n_stmts; ++i) {
+            stmts[i].labels.p = (*config)->labels + stmts[i].labels.off;
+            stmts[i].addrs.p = (*config)->addrs + stmts[i].addrs.off;
+        }
+        if ((*config)->n_stmts)
+            qsort(stmts, (*config)->n_stmts, sizeof *stmts, wolfidps_config_sort_cmp);
+        for (n_actions = 0; (n_actions < (*config)->n_stmts) && (stmts[n_actions].type == WOLFIDPS_CONFIG_ACTION); ++n_actions)
+            ;
+        for (i = 0; i < (*config)->n_stmts; ++i) {
+            uint32_t j;
+            parser.line = stmts[i].line;
+            ret = BAD_FUNC_ARG;
+            if ((i > 0) && (wolfidps_config_key_cmp(&stmts[i - 1], &stmts[i]) == 0))
+                break;
+            if (! wolfidps_config_action_declared(*config, n_actions, &stmts[i].action))
+                break;
+            for (j = 0; j < stmts[i].n_labels; ++j) {
+                if (! wolfidps_config_action_declared(*config, n_actions, &stmts[i].labels.p[j]))
+                    break;
+            }
+            if (j < stmts[i].n_labels)
+                break;
+            ret = 0;
+        }
+    }
+
+    if (ret < 0) {
+        if (error_line)
+            *error_line = parser.line;
+        wolfidps_config_release(wolfidps, *config);
+        *config = NULL;
+    }
+    return ret;
+}
+
+static void wolfidps_config_ops_free(struct wolfidps_context *wolfidps, struct wolfidps_config_op *ops, size_t n_ops) {
+    size_t i;
+    for (i = 0; i < n_ops; ++i) {
+        while (ops[i].ents) {
+            struct wolfidps_action_list_ent *ent = ops[i].ents;
+            ops[i].ents = (struct wolfidps_action_list_ent *)ent->header.next;
+            wolfidps->allocator.free(wolfidps->allocator.context, ent);
+        }
+        if (ops[i].rule)
+            wolfidps->allocator.free(wolfidps->allocator.context, ops[i].rule);
+    }
+    wolfidps->allocator.free(wolfidps->allocator.context, ops);
+}
+
+/* merge the sorted old and new configs into a list of changes, in key
+ * order, and preallocate the rules and action list ents they need.
+ * unchanged statements inherit their live ents.
+ */
+static int wolfidps_config_diff(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_config *old,
+    struct wolfidps_config *new,
+    struct wolfidps_config_op **ops,
+    size_t *n_ops)
+{
+    size_t n_old = old ? old->n_stmts : 0, i = 0, j = 0, pending_rules = 0, k;
+    struct wolfidps_config_op *op;
+
+    *n_ops = 0;
+    if ((*ops = (struct wolfidps_config_op *)wolfidps->allocator.malloc(wolfidps->allocator.context, (n_old + new->n_stmts + 1) * sizeof **ops)) == NULL)
+        return MEMORY_E;
+
+    while ((i < n_old) || (j < new->n_stmts)) {
+        int cmp;
+        if (i == n_old)
+            cmp = 1;
+        else if (j == new->n_stmts)
+            cmp = -1;
+        else
+            cmp = wolfidps_config_key_cmp(&old->stmts[i], &new->stmts[j]);
+
+        if (cmp == 0) {
+            new->stmts[j].live = old->stmts[i].live;
+            if (new->stmts[j].type == WOLFIDPS_CONFIG_RULE) {
+                /* rules inserted since the last surviving rule go right
+                 * after this one, which precedes them in the table.
+                 */
+                for (k = pending_rules; k < *n_ops; ++k) {
+                    if (((*ops)[k].kind == WOLFIDPS_CONFIG_INSERT) && ((*ops)[k].new->type == WOLFIDPS_CONFIG_RULE))
+                        (*ops)[k].rule_prev = (struct wolfidps_rule *)old->stmts[i].live;
+                }
+            }
+            if (wolfidps_config_attr_eq(&old->stmts[i], &new->stmts[j])) {
+                if (new->stmts[j].type == WOLFIDPS_CONFIG_RULE)
+                    pending_rules = *n_ops;
+                ++i;
+                ++j;
+                continue;
+            }
+        }
+
+        op = &(*ops)[(*n_ops)++];
+        memset(op, 0, sizeof *op);
+        if (cmp < 0) {
+            op->kind = WOLFIDPS_CONFIG_DELETE;
+            op->old = &old->stmts[i++];
+            continue;
+        }
+        if (cmp == 0) {
+            op->kind = WOLFIDPS_CONFIG_CHANGE;
+            op->old = &old->stmts[i++];
+            if (op->old->type == WOLFIDPS_CONFIG_RULE)
+                pending_rules = *n_ops;
+        } else
+            op->kind = WOLFIDPS_CONFIG_INSERT;
+        op->new = &new->stmts[j++];
+
+        if ((op->kind == WOLFIDPS_CONFIG_INSERT) && (op->new->type == WOLFIDPS_CONFIG_RULE)) {
+            if ((op->rule = (struct wolfidps_rule *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *op->rule)) == NULL)
+                goto nomem;
+            memset(op->rule, 0, sizeof *op->rule);
+        } else if (op->new->type == WOLFIDPS_CONFIG_EVENT) {
+            /* chained in reverse, so that they come out in order. */
+            for (k = op->new->n_labels; k > 0; --k) {
+                struct wolfidps_action_list_ent *ent = (struct wolfidps_action_list_ent *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *ent);
+                if (ent == NULL)
+                    goto nomem;
+                memset(ent, 0, sizeof *ent);
+                ent->header.next = (struct wolfidps_list_ent_generic *)op->ents;
+                op->ents = ent;
+            }
+        }
+    }
+    return 0;
+
+  nomem:
+    wolfidps_config_ops_free(wolfidps, *ops, *n_ops);
+    *ops = NULL;
+    return MEMORY_E;
+}
+
+static void wolfidps_config_list_append(struct wolfidps_action_list *list, struct wolfidps_action_list_ent *ent) {
+    ent->header.next = NULL;
+    ent->header.prev = list->header.tail;
+    if (list->header.tail)
+        WOLFIDPS_ATOMIC_STORE_RELEASE(((struct wolfidps_action_list_ent *)list->header.tail)->header.next, (struct wolfidps_list_ent_generic *)ent);
+    else
+        WOLFIDPS_ATOMIC_STORE_RELEASE(list->header.head, (struct wolfidps_list_ent_generic *)ent);
+    list->header.tail = (struct wolfidps_list_ent_generic *)ent;
+}
+
+/* an action declared by the same config, or NULL if it failed to apply. */
+static struct wolfidps_action *wolfidps_config_action_getreference(struct wolfidps_context *wolfidps, const struct wolfidps_config_label *label) {
+    struct wolfidps_action *action;
+    if ((label->len == 0) || ((action = wolfidps_action_get(wolfidps, (int)label->len, label->s)) == NULL))
+        return NULL;
+    ++action->refcount;
+    return action;
+}
+
+static int wolfidps_config_apply_event(struct wolfidps_context *wolfidps, struct wolfidps_config_op *op) {
+    struct wolfidps_event *event;
+    uint32_t i;
+    int ret;
+
+    if (op->kind != WOLFIDPS_CONFIG_INSERT) {
+        event = (struct wolfidps_event *)op->old->live;
+        wolfidps_action_list_clear(wolfidps, &event->action_list);
+        if (op->kind == WOLFIDPS_CONFIG_DELETE)
+            return wolfidps_event_dropreference(wolfidps, event);
+    } else if ((ret = wolfidps_event_getreference(wolfidps, (int)op->new->name.len, op->new->name.s, &event)) < 0)
+        return ret;
+    op->new->live = event;
+
+    for (i = 0; i < op->new->n_labels; ++i) {
+        struct wolfidps_action_list_ent *ent = op->ents;
+        op->ents = (struct wolfidps_action_list_ent *)ent->header.next;
+        if ((ent->action = wolfidps_config_action_getreference(wolfidps, &op->new->labels.p[i])) == NULL)
+            wolfidps->allocator.free(wolfidps->allocator.context, ent);
+        else
+            wolfidps_config_list_append(&event->action_list, ent);
+    }
+    return 0;
+}
+
+/* retire callback. */
+static void wolfidps_config_rule_free(struct wolfidps_context *wolfidps, void *ptr) {
+    struct wolfidps_rule *rule = (struct wolfidps_rule *)ptr;
+    wolfidps_counter_release(wolfidps, rule->hitcount);
+    wolfidps->allocator.free(wolfidps->allocator.context, rule);
+}
+
+static void wolfidps_config_rule_delete(struct wolfidps_context *wolfidps, struct wolfidps_rule *rule) {
+    wolfidps_table_ent_delete_1((struct wolfidps_table_generic *)&wolfidps->rules, (struct wolfidps_table_ent_generic *)rule);
+    --wolfidps->rules.n_rules;
+    (void)wolfidps_event_dropreference(wolfidps, rule->event);
+    if (rule->action)
+        (void)wolfidps_action_dropreference(wolfidps, rule->action);
+    wolfidps_epoch_retire_cb(wolfidps, rule, wolfidps_config_rule_free);
+}
+
+static void wolfidps_config_rule_set(struct wolfidps_context *wolfidps, struct wolfidps_rule *rule, const struct wolfidps_config_stmt *stmt) {
+    rule->prefix_len = stmt->prefix_len;
+    rule->disposition = stmt->disposition;
+    rule->threshold = stmt->threshold;
+    rule->duration = stmt->ttl;
+    if (rule->action)
+        (void)wolfidps_action_dropreference(wolfidps, rule->action);
+    rule->action = wolfidps_config_action_getreference(wolfidps, &stmt->action);
+}
+
+static int wolfidps_config_apply_rule(struct wolfidps_context *wolfidps, struct wolfidps_config_op *op) {
+    struct wolfidps_rule *rule;
+    int ret;
+
+    if (op->kind == WOLFIDPS_CONFIG_DELETE) {
+        wolfidps_config_rule_delete(wolfidps, (struct wolfidps_rule *)op->old->live);
+        return 0;
+    }
+    if (op->kind == WOLFIDPS_CONFIG_CHANGE) {
+        wolfidps_config_rule_set(wolfidps, (struct wolfidps_rule *)op->old->live, op->new);
+        return 0;
+    }
+
+    rule = op->rule;
+    if ((ret = wolfidps_event_getreference(wolfidps, (int)op->new->name.len, op->new->name.s, &rule->event)) < 0)
+        return ret;
+    if ((ret = wolfidps_counter_alloc(wolfidps, &rule->hitcount)) < 0) {
+        (void)wolfidps_event_dropreference(wolfidps, rule->event);
+        return ret;
+    }
+    op->rule = NULL;
+    rule->id = op->new->id;
+    rule->flags = op->new->flags;
+    rule->sa_family = op->new->sa_family;
+    rule->sa_proto = op->new->sa_proto;
+    rule->sa_port = op->new->dst_port;
+    wolfidps_config_rule_set(wolfidps, rule, op->new);
+    wolfidps_table_ent_insert_after((struct wolfidps_table_ent_generic *)rule, (struct wolfidps_table_generic *)&wolfidps->rules, (struct wolfidps_table_ent_generic *)op->rule_prev);
+    ++wolfidps->rules.n_rules;
+    op->new->live = rule;
+    return 0;
+}
+
+/* room for a sockaddr with a maximum-length address. */
+#define WOLFIDPS_CONFIG_SOCKADDR_WORDS ((sizeof(struct wolfidps_sockaddr) + sizeof(wolfidps_address_mask_t) + 7) / 8)
+
+static void wolfidps_config_sockaddrs(const struct wolfidps_config_stmt *stmt, struct wolfidps_sockaddr *src, struct wolfidps_sockaddr *dst) {
+    src->sa_family = dst->sa_family = stmt->sa_family;
+    src->sa_proto = dst->sa_proto = stmt->sa_proto;
+    src->sa_port = stmt->src_port;
+    dst->sa_port = stmt->dst_port;
+    src->if_id = stmt->src_if_id;
+    dst->if_id = stmt->dst_if_id;
+    src->addr_len = stmt->src_len;
+    dst->addr_len = stmt->dst_len;
+    memcpy(src->addr, stmt->addrs.p, WOLFIDPS_BITS_TO_BYTES(stmt->src_len));
+    memcpy(dst->addr, stmt->addrs.p + WOLFIDPS_BITS_TO_BYTES(stmt->src_len), WOLFIDPS_BITS_TO_BYTES(stmt->dst_len));
+}
+
+/* a changed route is deleted and reinserted, with its hit count carried
+ * over.  a route that has since gone is not an error.
+ */
+static int wolfidps_config_apply_route(struct wolfidps_context *wolfidps, struct wolfidps_config_op *op) {
+    uint64_t src_buf[WOLFIDPS_CONFIG_SOCKADDR_WORDS], dst_buf[WOLFIDPS_CONFIG_SOCKADDR_WORDS];
+    struct wolfidps_sockaddr *src = (struct wolfidps_sockaddr *)src_buf, *dst = (struct wolfidps_sockaddr *)dst_buf;
+    struct wolfidps_event *event = NULL;
+    struct wolfidps_route *route;
+    wolfidps_count_t n_hits = 0;
+    uint32_t rule;
+    int ret;
+
+    if (op->old) {
+        const struct wolfidps_config_stmt *stmt = op->old;
+        wolfidps_config_sockaddrs(stmt, src, dst);
+        if (wolfidps_route_lookup(wolfidps, src, dst, stmt->flags, (int)stmt->name.len, stmt->name.len ? stmt->name.s : NULL, &route, &rule) == 0) {
+            if (route == NULL)
+                wolfidps_policy_rule_delete(wolfidps, rule);
+            else {
+                if ((! route->flags.dont_count) && (wolfidps_counter_get(wolfidps, route->n_hits, &n_hits) < 0))
+                    n_hits = 0;
+                (void)wolfidps_route_delete_1(wolfidps, route);
+            }
+        }
+    }
+    if (op->kind == WOLFIDPS_CONFIG_DELETE)
+        return 0;
+
+    wolfidps_config_sockaddrs(op->new, src, dst);
+    if (op->new->name.len &&
+        ((ret = wolfidps_event_getreference(wolfidps, (int)op->new->name.len, op->new->name.s, &event)) < 0))
+        return ret;
+    if ((ret = wolfidps_route_insert_1(wolfidps, src, dst, op->new->flags, event, WOLFIDPS_TIME_NEVER, &route)) < 0) {
+        if (event)
+            (void)wolfidps_event_dropreference(wolfidps, event);
+        return ret;
+    }
+    route->action = wolfidps_config_action_getreference(wolfidps, &op->new->action);
+    if (op->new->rate_interval)
+        wolfidps_route_rate_limit_1(route, op->new->rate_interval, op->new->rate_burst);
+    if (n_hits && (! route->flags.dont_count))
+        wolfidps_counter_add(wolfidps, route->n_hits, n_hits);
+    return 0;
+}
+
+/* called with the table write lock held.  statements that fail to apply
+ * are marked, and the first error is returned after the rest are applied.
+ */
+static int wolfidps_config_apply(struct wolfidps_context *wolfidps, struct wolfidps_config_op *ops, size_t n_ops) {
+    size_t i;
+    int ret = 0;
+
+    for (i = 0; i < n_ops; ++i) {
+        struct wolfidps_config_op *op = &ops[i];
+        int type = op->old ? op->old->type : op->new->type;
+        int op_ret;
+
+        if (type == WOLFIDPS_CONFIG_ACTION) {
+            if (op->kind == WOLFIDPS_CONFIG_DELETE)
+                op_ret = wolfidps_action_dropreference(wolfidps, (struct wolfidps_action *)op->old->live);
+            else
+                op_ret = wolfidps_action_getreference(wolfidps, (int)op->new->name.len, op->new->name.s, (struct wolfidps_action **)&op->new->live);
+        } else if (type == WOLFIDPS_CONFIG_EVENT)
+            op_ret = wolfidps_config_apply_event(wolfidps, op);
+        else if (type == WOLFIDPS_CONFIG_RULE)
+            op_ret = wolfidps_config_apply_rule(wolfidps, op);
+        else
+            op_ret = wolfidps_config_apply_route(wolfidps, op);
+
+        if (op_ret < 0) {
+            if (op->new)
+                op->new->failed = 1;
+            if (ret == 0)
+                ret = op_ret;
+        }
+    }
+    return ret;
+}
+
+int wolfidps_config_load(struct wolfidps_context *wolfidps, const char *text, size_t len, int *error_line) {
+    struct wolfidps_config *config;
+    struct wolfidps_config_op *ops;
+    size_t n_ops, i, j;
+    int ret;
+
+    if ((text == NULL) && (len > 0))
+        return BAD_FUNC_ARG;
+    if ((ret = wolfidps_config_parse(wolfidps, text, len, &config, error_line)) < 0)
+        return ret;
+
+    if (wolfidps_lock_readwrite(&wolfidps->config_lock) < 0) {
+        wolfidps_config_release(wolfidps, config);
+        return -1;
+    }
+    if ((ret = wolfidps_config_diff(wolfidps, wolfidps->config, config, &ops, &n_ops)) < 0) {
+        (void)wolfidps_lock_unlock(&wolfidps->config_lock);
+        wolfidps_config_release(wolfidps, config);
+        return ret;
+    }
+
+    if (n_ops > 0) {
+        if (wolfidps_table_lock_readwrite(wolfidps) < 0) {
+            wolfidps_config_ops_free(wolfidps, ops, n_ops);
+            (void)wolfidps_lock_unlock(&wolfidps->config_lock);
+            wolfidps_config_release(wolfidps, config);
+            return -1;
+        }
+        ret = wolfidps_config_apply(wolfidps, ops, n_ops);
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    }
+    wolfidps_config_ops_free(wolfidps, ops, n_ops);
+
+    /* what failed is left out, so that the next load retries it. */
+    for (i = j = 0; i < config->n_stmts; ++i) {
+        if (! config->stmts[i].failed)
+            config->stmts[j++] = config->stmts[i];
+    }
+    config->n_stmts = j;
+    wolfidps_config_release(wolfidps, wolfidps->config);
+    wolfidps->config = config;
+    (void)wolfidps_lock_unlock(&wolfidps->config_lock);
+    return ret;
+}
+
+int wolfidps_config_load_fd(struct wolfidps_context *wolfidps, int fd, int *error_line) {
+    struct stat st;
+    char *text;
+    size_t len = 0;
+    int ret;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if ((st.st_size < 0) || ((uint64_t)st.st_size > WOLFIDPS_CONFIG_MAX_SIZE))
+        return BAD_FUNC_ARG;
+    if ((text = (char *)wolfidps->allocator.malloc(wolfidps->allocator.context, (size_t)st.st_size + 1)) == NULL)
+        return MEMORY_E;
+    /* read to end of file, whatever fstat said, up to the buffer. */
+    while (len <= (size_t)st.st_size) {
+        ssize_t n = read(fd, text + len, (size_t)st.st_size + 1 - len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            wolfidps->allocator.free(wolfidps->allocator.context, text);
+            return -1;
+        }
+        if (n == 0)
+            break;
+        len += (size_t)n;
+    }
+    if (len > (size_t)st.st_size)
+        ret = BAD_STATE_E; /* grew as it was read */
+    else
+        ret = wolfidps_config_load(wolfidps, text, len, error_line);
+    wolfidps->allocator.free(wolfidps->allocator.context, text);
+    return ret;
+}
+
+/* shutdown, after the route table has been flushed. */
+void wolfidps_config_free(struct wolfidps_context *wolfidps) {
+    struct wolfidps_config *config = wolfidps->config;
+    size_t i;
+
+    if (config == NULL)
+        return;
+    for (i = config->n_stmts; i > 0; --i) {
+        struct wolfidps_config_stmt *stmt = &config->stmts[i - 1];
+        if (stmt->type == WOLFIDPS_CONFIG_RULE)
+            wolfidps_config_rule_delete(wolfidps, (struct wolfidps_rule *)stmt->live);
+        else if (stmt->type == WOLFIDPS_CONFIG_EVENT) {
+            wolfidps_action_list_clear(wolfidps, &((struct wolfidps_event *)stmt->live)->action_list);
+            (void)wolfidps_event_dropreference(wolfidps, (struct wolfidps_event *)stmt->live);
+        } else if (stmt->type == WOLFIDPS_CONFIG_ACTION)
+            (void)wolfidps_action_dropreference(wolfidps, (struct wolfidps_action *)stmt->live);
+    }
+    wolfidps_config_release(wolfidps, config);
+    wolfidps->config = NULL;
+}
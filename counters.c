@@ -0,0 +1,233 @@
+#include "wolfidps_internal.h"
+
+/* sharded hit counters -- see struct wolfidps_counters.
+ *
+ * ids are allocated and released by writers, with the table lock held.
+ * an id is released only after its owner has been retired, i.e. once no
+ * reader can increment it, so it can be safely zeroed in every shard.
+ * pages and chunks are zeroed before they are published with a release
+ * store, and stay put until the shard is freed, so readers can follow them
+ * with nothing but acquire loads.
+ */
+
+static struct wolfidps_counter_shard *wolfidps_counter_shard_new(struct wolfidps_context *wolfidps) {
+    struct wolfidps_counter_shard *shard = (struct wolfidps_counter_shard *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *shard);
+    if (shard)
+        memset(shard, 0, sizeof *shard);
+    return shard;
+}
+
+static void wolfidps_counter_shard_free(struct wolfidps_context *wolfidps, struct wolfidps_counter_shard *shard) {
+    uint32_t i, j;
+    for (i = 0; i < WOLFIDPS_COUNTER_DIR_SIZE; ++i) {
+        if (shard->pages[i] == NULL)
+            continue;
+        for (j = 0; j < WOLFIDPS_COUNTER_PAGE_SIZE; ++j) {
+            if (shard->pages[i][j])
+                wolfidps->allocator.free(wolfidps->allocator.context, shard->pages[i][j]);
+        }
+        wolfidps->allocator.free(wolfidps->allocator.context, shard->pages[i]);
+    }
+    wolfidps->allocator.free(wolfidps->allocator.context, shard);
+}
+
+static wolfidps_count_t *wolfidps_counter_chunk_new(struct wolfidps_context *wolfidps) {
+    size_t size = WOLFIDPS_COUNTER_CHUNK_SIZE * sizeof(wolfidps_count_t);
+    wolfidps_count_t *chunk;
+    if (wolfidps->allocator.memalign)
+        chunk = (wolfidps_count_t *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, size);
+    else
+        chunk = (wolfidps_count_t *)wolfidps->allocator.malloc(wolfidps->allocator.context, size);
+    if (chunk)
+        memset(chunk, 0, size);
+    return chunk;
+}
+
+/* make sure shard has the chunk holding id.  only the shard's one writer
+ * may call this: for the shared shard, a table writer; for a reader shard,
+ * its owning thread.
+ */
+static int wolfidps_counter_chunk_add(struct wolfidps_context *wolfidps, struct wolfidps_counter_shard *shard, wolfidps_counter_id_t id) {
+    wolfidps_count_t ***page = &shard->pages[id >> (WOLFIDPS_COUNTER_PAGE_BITS + WOLFIDPS_COUNTER_CHUNK_BITS)];
+    wolfidps_count_t **chunk;
+
+    if (*page == NULL) {
+        size_t size = WOLFIDPS_COUNTER_PAGE_SIZE * sizeof(wolfidps_count_t *);
+        wolfidps_count_t **new = (wolfidps_count_t **)wolfidps->allocator.malloc(wolfidps->allocator.context, size);
+        if (new == NULL)
+            return MEMORY_E;
+        memset(new, 0, size);
+        WOLFIDPS_ATOMIC_STORE_RELEASE(*page, new);
+    }
+    chunk = &(*page)[(id >> WOLFIDPS_COUNTER_CHUNK_BITS) & (WOLFIDPS_COUNTER_PAGE_SIZE - 1)];
+    if (*chunk == NULL) {
+        wolfidps_count_t *new = wolfidps_counter_chunk_new(wolfidps);
+        if (new == NULL)
+            return MEMORY_E;
+        WOLFIDPS_ATOMIC_STORE_RELEASE(*chunk, new);
+    }
+    return 0;
+}
+
+int wolfidps_counters_init(struct wolfidps_context *wolfidps) {
+    struct wolfidps_counters *counters = &wolfidps->counters;
+    memset(counters, 0, sizeof *counters);
+    if ((counters->shared = wolfidps_counter_shard_new(wolfidps)) == NULL)
+        return MEMORY_E;
+    counters->next_id = 1;
+    return 0;
+}
+
+void wolfidps_counters_free(struct wolfidps_context *wolfidps) {
+    struct wolfidps_counters *counters = &wolfidps->counters;
+    if (counters->shared == NULL)
+        return;
+    wolfidps_counter_shard_free(wolfidps, counters->shared);
+    counters->shared = NULL;
+    if (counters->free_ids)
+        wolfidps->allocator.free(wolfidps->allocator.context, counters->free_ids);
+    counters->free_ids = NULL;
+    counters->n_free_ids = counters->free_ids_alloced = 0;
+}
+
+int wolfidps_counter_alloc(struct wolfidps_context *wolfidps, wolfidps_counter_id_t *id) {
+    struct wolfidps_counters *counters = &wolfidps->counters;
+    int ret;
+
+    if (counters->n_free_ids) {
+        *id = counters->free_ids[--counters->n_free_ids];
+        return 0;
+    }
+    if (counters->next_id > (wolfidps_counter_id_t)~0U)
+        return MEMORY_E;
+    if ((ret = wolfidps_counter_chunk_add(wolfidps, counters->shared, (wolfidps_counter_id_t)counters->next_id)) < 0)
+        return ret;
+    *id = (wolfidps_counter_id_t)counters->next_id++;
+    return 0;
+}
+
+void wolfidps_counter_release(struct wolfidps_context *wolfidps, wolfidps_counter_id_t id) {
+    struct wolfidps_counters *counters = &wolfidps->counters;
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    wolfidps_count_t *count;
+    int i;
+
+    if (id == 0)
+        return;
+    for (i = 0; i < epoch->n_slots; ++i) {
+        if ((count = wolfidps_counter_ref(epoch->slots[i].counters, id)) != NULL)
+            __atomic_store_n(count, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(wolfidps_counter_ref(counters->shared, id), 0, __ATOMIC_RELAXED);
+
+    if (counters->n_free_ids == counters->free_ids_alloced) {
+        uint32_t n = counters->free_ids_alloced ? counters->free_ids_alloced * 2 : 64;
+        wolfidps_counter_id_t *free_ids = (wolfidps_counter_id_t *)wolfidps->allocator.realloc(wolfidps->allocator.context, counters->free_ids, n * sizeof *free_ids);
+        /* failing that, the id just isn't reused. */
+        if (free_ids == NULL)
+            return;
+        counters->free_ids = free_ids;
+        counters->free_ids_alloced = n;
+    }
+    counters->free_ids[counters->n_free_ids++] = id;
+}
+
+/* n consecutive ids, starting at *base, for tables of counters indexed
+ * by position.  free ids are not reused for this.
+ */
+int wolfidps_counter_alloc_range(struct wolfidps_context *wolfidps, uint32_t n, wolfidps_counter_id_t *base) {
+    struct wolfidps_counters *counters = &wolfidps->counters;
+    uint64_t id;
+    int ret;
+
+    if ((n == 0) || (counters->next_id + n - 1 > (wolfidps_counter_id_t)~0U))
+        return MEMORY_E;
+    for (id = counters->next_id; id < counters->next_id + n; id += WOLFIDPS_COUNTER_CHUNK_SIZE - (id & (WOLFIDPS_COUNTER_CHUNK_SIZE - 1))) {
+        if ((ret = wolfidps_counter_chunk_add(wolfidps, counters->shared, (wolfidps_counter_id_t)id)) < 0)
+            return ret;
+    }
+    *base = (wolfidps_counter_id_t)counters->next_id;
+    counters->next_id += n;
+    return 0;
+}
+
+void wolfidps_counter_release_range(struct wolfidps_context *wolfidps, wolfidps_counter_id_t base, uint32_t n) {
+    uint32_t i;
+    if (base == 0)
+        return;
+    for (i = 0; i < n; ++i)
+        wolfidps_counter_release(wolfidps, base + i);
+}
+
+/* add to a counter out of band, e.g. to carry a count over from another. */
+void wolfidps_counter_add(struct wolfidps_context *wolfidps, wolfidps_counter_id_t id, wolfidps_count_t count) {
+    if (id == 0)
+        return;
+    WOLFIDPS_ATOMIC_ADD(*wolfidps_counter_ref(wolfidps->counters.shared, id), count);
+}
+
+/* give a newly allocated reader slot an empty shard.  its chunks are
+ * allocated by wolfidps_counter_shard_grow(), as its thread counts on them.
+ */
+int wolfidps_counter_shard_init(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    if ((slot->counters = wolfidps_counter_shard_new(wolfidps)) == NULL)
+        return MEMORY_E;
+    return 0;
+}
+
+/* the slow path of wolfidps_counter_inc(), from the slot's owning thread:
+ * id's chunk is missing from the slot's shard.  returns id's count, or
+ * NULL if the chunk can't be allocated.
+ */
+wolfidps_count_t *wolfidps_counter_shard_grow(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_counter_id_t id) {
+    if (wolfidps_counter_chunk_add(wolfidps, slot->counters, id) < 0)
+        return NULL;
+    return wolfidps_counter_ref(slot->counters, id);
+}
+
+/* fold a reader shard into the shared shard and free it.  no reader may
+ * be using the slot.
+ */
+void wolfidps_counter_shard_fold(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    struct wolfidps_counter_shard *shard = slot->counters, *shared = wolfidps->counters.shared;
+    uint32_t i, j, k;
+
+    if (shard == NULL)
+        return;
+    /* free ids are zero in every shard, so they can be folded along with
+     * the rest.  a reader shard only has chunks the shared one has too.
+     */
+    for (i = 0; i < WOLFIDPS_COUNTER_DIR_SIZE; ++i) {
+        if (shard->pages[i] == NULL)
+            continue;
+        for (j = 0; j < WOLFIDPS_COUNTER_PAGE_SIZE; ++j) {
+            wolfidps_count_t *chunk = shard->pages[i][j], *shared_chunk;
+            if (chunk == NULL)
+                continue;
+            shared_chunk = shared->pages[i][j];
+            for (k = 0; k < WOLFIDPS_COUNTER_CHUNK_SIZE; ++k) {
+                if (chunk[k])
+                    WOLFIDPS_ATOMIC_ADD(shared_chunk[k], chunk[k]);
+            }
+        }
+    }
+    wolfidps_counter_shard_free(wolfidps, shard);
+    slot->counters = NULL;
+}
+
+int wolfidps_counter_get(struct wolfidps_context *wolfidps, wolfidps_counter_id_t id, wolfidps_count_t *count) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    wolfidps_count_t total, *slot_count;
+    int i, n_slots_used;
+
+    if ((id == 0) || (id >= wolfidps->counters.next_id))
+        return BAD_FUNC_ARG;
+    total = __atomic_load_n(wolfidps_counter_ref(wolfidps->counters.shared, id), __ATOMIC_RELAXED);
+    n_slots_used = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(epoch->n_slots_used);
+    for (i = 0; i < n_slots_used; ++i) {
+        if ((slot_count = wolfidps_counter_ref(epoch->slots[i].counters, id)) != NULL)
+            total += __atomic_load_n(slot_count, __ATOMIC_RELAXED);
+    }
+    *count = total;
+    return 0;
+}
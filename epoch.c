@@ -0,0 +1,274 @@
+#include "wolfidps_internal.h"
+
+#include <sched.h>
+
+/* epoch-based reclamation for lockless dispatch.
+ *
+ * readers announce the global epoch in their own slot on entry, and clear
+ * the active bit on exit, touching no other shared memory.  writers
+ * (serialized by the table lock) unlink nodes with release stores, and
+ * retire them rather than freeing them.  the global epoch advances only
+ * once every active reader has announced it, so anything retired at epoch
+ * e is unreachable once the global epoch reaches e + 2.
+ */
+
+static uint64_t wolfidps_epoch_serial_next = 0;
+
+/* a thread's slots in the last few contexts it dispatched in, direct
+ * mapped on the context, so that dispatching across shards doesn't fall
+ * back to searching the slots on every entry.
+ */
+#ifndef WOLFIDPS_EPOCH_THREAD_CACHE_SIZE
+#define WOLFIDPS_EPOCH_THREAD_CACHE_SIZE 8 /* a power of 2 */
+#endif
+
+static __thread struct wolfidps_epoch_thread_cache_ent {
+    struct wolfidps_context *wolfidps;
+    uint64_t serial;
+    struct wolfidps_epoch_slot *slot;
+} wolfidps_epoch_thread_cache[WOLFIDPS_EPOCH_THREAD_CACHE_SIZE];
+
+static inline struct wolfidps_epoch_thread_cache_ent *wolfidps_epoch_thread_cache_ent(struct wolfidps_context *wolfidps) {
+    uintptr_t key = (uintptr_t)wolfidps / sizeof *wolfidps;
+    return &wolfidps_epoch_thread_cache[(key ^ (key >> 7)) & (WOLFIDPS_EPOCH_THREAD_CACHE_SIZE - 1)];
+}
+
+/* address is unique among live threads -- used as the slot owner token. */
+static __thread char wolfidps_epoch_thread_token;
+
+int wolfidps_set_lockless_dispatch(struct wolfidps_context *wolfidps, int max_threads) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    size_t slots_size;
+    int i;
+
+    if (max_threads < 0)
+        return BAD_FUNC_ARG;
+
+    if (epoch->enabled) {
+        if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+            return -1;
+        wolfidps_epoch_synchronize(wolfidps);
+        for (i = 0; i < epoch->n_slots; ++i) {
+            wolfidps_counter_shard_fold(wolfidps, &epoch->slots[i]);
+            wolfidps_dispatch_cache_free(wolfidps, &epoch->slots[i]);
+            wolfidps_stats_slot_fold(wolfidps, &epoch->slots[i]);
+        }
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+        wolfidps->allocator.free(wolfidps->allocator.context, epoch->slots);
+        epoch->slots = NULL;
+        epoch->n_slots = epoch->n_slots_used = 0;
+        epoch->enabled = 0;
+    }
+
+    if (max_threads == 0)
+        return 0;
+
+    slots_size = (size_t)max_threads * sizeof *epoch->slots;
+    if (wolfidps->allocator.memalign)
+        epoch->slots = (struct wolfidps_epoch_slot *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, slots_size);
+    else
+        epoch->slots = (struct wolfidps_epoch_slot *)wolfidps->allocator.malloc(wolfidps->allocator.context, slots_size);
+    if (epoch->slots == NULL)
+        return MEMORY_E;
+    memset(epoch->slots, 0, slots_size);
+    for (i = 0; i < max_threads; ++i) {
+        if ((wolfidps_counter_shard_init(wolfidps, &epoch->slots[i]) < 0) ||
+            (wolfidps_dispatch_cache_init(wolfidps, &epoch->slots[i]) < 0) ||
+            (wolfidps_stats_slot_init(wolfidps, &epoch->slots[i]) < 0)) {
+            do {
+                wolfidps_counter_shard_fold(wolfidps, &epoch->slots[i]);
+                wolfidps_dispatch_cache_free(wolfidps, &epoch->slots[i]);
+                wolfidps_stats_slot_fold(wolfidps, &epoch->slots[i]);
+            } while (--i >= 0);
+            wolfidps->allocator.free(wolfidps->allocator.context, epoch->slots);
+            epoch->slots = NULL;
+            return MEMORY_E;
+        }
+    }
+    epoch->n_slots = max_threads;
+    epoch->n_slots_used = 0;
+    epoch->serial = __atomic_add_fetch(&wolfidps_epoch_serial_next, 1, __ATOMIC_RELAXED);
+    epoch->enabled = 1;
+    return 0;
+}
+
+static struct wolfidps_epoch_slot *wolfidps_epoch_thread_slot(struct wolfidps_context *wolfidps) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    struct wolfidps_epoch_thread_cache_ent *cached = wolfidps_epoch_thread_cache_ent(wolfidps);
+    int i;
+
+    if ((cached->wolfidps == wolfidps) &&
+        (cached->serial == epoch->serial))
+        return cached->slot;
+
+    for (i = 0; i < epoch->n_slots; ++i) {
+        void *expected = NULL;
+        struct wolfidps_epoch_slot *slot = &epoch->slots[i];
+        if ((slot->owner == &wolfidps_epoch_thread_token) ||
+            __atomic_compare_exchange_n(&slot->owner, &expected, &wolfidps_epoch_thread_token, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            int used = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(epoch->n_slots_used);
+            while ((used <= i) &&
+                   (! __atomic_compare_exchange_n(&epoch->n_slots_used, &used, i + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)))
+                ;
+            cached->wolfidps = wolfidps;
+            cached->serial = epoch->serial;
+            cached->slot = slot;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+int wolfidps_thread_detach(struct wolfidps_context *wolfidps) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    struct wolfidps_epoch_thread_cache_ent *cached = wolfidps_epoch_thread_cache_ent(wolfidps);
+    int i;
+
+    if (! epoch->enabled)
+        return 0;
+    if ((cached->wolfidps == wolfidps) && (cached->serial == epoch->serial))
+        memset(cached, 0, sizeof *cached);
+    /* the slot may have been evicted from the cache by another context's. */
+    for (i = 0; i < epoch->n_slots; ++i) {
+        struct wolfidps_epoch_slot *slot = &epoch->slots[i];
+        if (slot->owner == &wolfidps_epoch_thread_token) {
+            WOLFIDPS_ATOMIC_STORE_RELEASE(slot->state, 0);
+            WOLFIDPS_ATOMIC_STORE_RELEASE(slot->owner, NULL);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* returns NULL if lockless dispatch is disabled or no slot is available,
+ * in which case the caller must take the table lock instead.
+ */
+struct wolfidps_epoch_slot *wolfidps_epoch_enter(struct wolfidps_context *wolfidps) {
+    struct wolfidps_epoch_slot *slot;
+    uint64_t global_epoch;
+
+    if (! wolfidps->epoch.enabled)
+        return NULL;
+    if ((slot = wolfidps_epoch_thread_slot(wolfidps)) == NULL)
+        return NULL;
+    global_epoch = __atomic_load_n(&wolfidps->epoch.global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->state, (global_epoch << 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return slot;
+}
+
+void wolfidps_epoch_leave(struct wolfidps_epoch_slot *slot) {
+    WOLFIDPS_ATOMIC_STORE_RELEASE(slot->state, 0);
+}
+
+/* the following are called only by writers, with the table lock held. */
+
+static int wolfidps_epoch_try_advance(struct wolfidps_epoch *epoch) {
+    uint64_t global_epoch = epoch->global_epoch;
+    int i, n_slots_used = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(epoch->n_slots_used);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i = 0; i < n_slots_used; ++i) {
+        uint64_t state = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(epoch->slots[i].state);
+        if ((state & 1) && ((state >> 1) != global_epoch))
+            return 0;
+    }
+    WOLFIDPS_ATOMIC_STORE_RELEASE(epoch->global_epoch, global_epoch + 1);
+    return 1;
+}
+
+static void wolfidps_epoch_reclaim(struct wolfidps_context *wolfidps) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    while (epoch->limbo_head && (epoch->limbo_head->epoch + 2 <= epoch->global_epoch)) {
+        struct wolfidps_epoch_limbo *limbo = epoch->limbo_head;
+        epoch->limbo_head = limbo->next;
+        if (epoch->limbo_head == NULL)
+            epoch->limbo_tail = NULL;
+        if (limbo->free_cb)
+            limbo->free_cb(wolfidps, limbo->ptr);
+        else
+            wolfidps->allocator.free(wolfidps->allocator.context, limbo->ptr);
+        wolfidps->allocator.free(wolfidps->allocator.context, limbo);
+    }
+}
+
+/* wait out a full grace period, then free everything in limbo. */
+void wolfidps_epoch_synchronize(struct wolfidps_context *wolfidps) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    uint64_t target = epoch->global_epoch + 2;
+    if (! epoch->enabled)
+        return;
+    while (epoch->global_epoch < target) {
+        if (! wolfidps_epoch_try_advance(epoch))
+            (void)sched_yield();
+    }
+    wolfidps_epoch_reclaim(wolfidps);
+}
+
+/* free ptr, via free_cb if non-NULL, once no lockless reader can still
+ * hold a reference to it.
+ */
+void wolfidps_epoch_retire_cb(struct wolfidps_context *wolfidps, void *ptr, wolfidps_retire_cb_t free_cb) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    struct wolfidps_epoch_limbo *limbo;
+
+    if (epoch->enabled) {
+        limbo = (struct wolfidps_epoch_limbo *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *limbo);
+        if (limbo == NULL)
+            wolfidps_epoch_synchronize(wolfidps);
+    } else
+        limbo = NULL;
+
+    if (limbo == NULL) {
+        if (free_cb)
+            free_cb(wolfidps, ptr);
+        else
+            wolfidps->allocator.free(wolfidps->allocator.context, ptr);
+        return;
+    }
+
+    limbo->next = NULL;
+    limbo->epoch = epoch->global_epoch;
+    limbo->ptr = ptr;
+    limbo->free_cb = free_cb;
+    if (epoch->limbo_tail)
+        epoch->limbo_tail->next = limbo;
+    else
+        epoch->limbo_head = limbo;
+    epoch->limbo_tail = limbo;
+
+    (void)wolfidps_epoch_try_advance(epoch);
+    wolfidps_epoch_reclaim(wolfidps);
+}
+
+void wolfidps_epoch_retire(struct wolfidps_context *wolfidps, void *ptr) {
+    wolfidps_epoch_retire_cb(wolfidps, ptr, NULL);
+}
+
+/* shutdown -- no readers remain. */
+void wolfidps_epoch_free(struct wolfidps_context *wolfidps) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    int i;
+    /* anything the callbacks retire in turn is freed at once. */
+    epoch->enabled = 0;
+    while (epoch->limbo_head) {
+        struct wolfidps_epoch_limbo *limbo = epoch->limbo_head;
+        epoch->limbo_head = limbo->next;
+        if (limbo->free_cb)
+            limbo->free_cb(wolfidps, limbo->ptr);
+        else
+            wolfidps->allocator.free(wolfidps->allocator.context, limbo->ptr);
+        wolfidps->allocator.free(wolfidps->allocator.context, limbo);
+    }
+    epoch->limbo_tail = NULL;
+    if (epoch->slots) {
+        for (i = 0; i < epoch->n_slots; ++i) {
+            wolfidps_counter_shard_fold(wolfidps, &epoch->slots[i]);
+            wolfidps_dispatch_cache_free(wolfidps, &epoch->slots[i]);
+            wolfidps_stats_slot_fold(wolfidps, &epoch->slots[i]);
+        }
+        wolfidps->allocator.free(wolfidps->allocator.context, epoch->slots);
+        epoch->slots = NULL;
+        epoch->n_slots = epoch->n_slots_used = 0;
+    }
+}
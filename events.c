@@ -1,8 +1,420 @@
 #include "wolfidps_internal.h"
 
+/* events and actions.  both are refcounted, and are unlinked from their
+ * table once the last reference is dropped, then retired, since lockless
+ * readers may still hold them through a route.  all of this runs with the
+ * table write lock held.  events are hashed by keyword, so that finding
+ * one costs a probe, and can be named by id to skip even that.
+ */
+
+#ifndef WOLFIDPS_EVENT_MIN_SLOTS
+#define WOLFIDPS_EVENT_MIN_SLOTS 16
+#endif
+#ifndef WOLFIDPS_EVENT_MIN_IDS
+#define WOLFIDPS_EVENT_MIN_IDS 64
+#endif
+
+/* the slot holding the event for keyword, or else the slot to insert it
+ * at -- the first tombstone on its probe sequence, or the empty slot that
+ * ends it.  the index must have an empty slot.
+ */
+static struct wolfidps_event **wolfidps_event_slot(struct wolfidps_event_table *table, int keyword_len, const char *keyword, uint32_t hash) {
+    struct wolfidps_event **slot, **tombstone = NULL;
+    uint32_t j;
+
+    for (j = hash & (table->n_slots - 1); ; j = (j + 1) & (table->n_slots - 1)) {
+        slot = &table->slots[j];
+        if (*slot == NULL)
+            return tombstone ? tombstone : slot;
+        if (*slot == WOLFIDPS_EVENT_TOMBSTONE) {
+            if (tombstone == NULL)
+                tombstone = slot;
+        } else if (((*slot)->hash == hash) && ((*slot)->keyword_len == keyword_len) && (! memcmp((*slot)->keyword, keyword, (size_t)keyword_len)))
+            return slot;
+    }
+}
+
+/* the event for keyword, with no reference taken, or NULL. */
+struct wolfidps_event *wolfidps_event_get(struct wolfidps_context *wolfidps, int keyword_len, const char *keyword, uint32_t hash) {
+    struct wolfidps_event *event;
+    if (wolfidps->events.n_slots == 0)
+        return NULL;
+    event = *wolfidps_event_slot(&wolfidps->events, keyword_len, keyword, hash);
+    return (event == WOLFIDPS_EVENT_TOMBSTONE) ? NULL : event;
+}
+
+/* rehash into n_slots slots, dropping tombstones. */
+static int wolfidps_event_index_resize(struct wolfidps_context *wolfidps, uint32_t n_slots) {
+    struct wolfidps_event_table *table = &wolfidps->events;
+    struct wolfidps_event **new_slots = (struct wolfidps_event **)wolfidps->allocator.malloc(wolfidps->allocator.context, (size_t)n_slots * sizeof *new_slots);
+    uint32_t i, j;
+
+    if (new_slots == NULL)
+        return MEMORY_E;
+    memset(new_slots, 0, (size_t)n_slots * sizeof *new_slots);
+    for (i = 0; i < table->n_slots; ++i) {
+        if ((table->slots[i] == NULL) || (table->slots[i] == WOLFIDPS_EVENT_TOMBSTONE))
+            continue;
+        for (j = table->slots[i]->hash & (n_slots - 1); new_slots[j]; j = (j + 1) & (n_slots - 1))
+            ;
+        new_slots[j] = table->slots[i];
+    }
+    if (table->slots)
+        wolfidps->allocator.free(wolfidps->allocator.context, table->slots);
+    table->slots = new_slots;
+    table->n_slots = n_slots;
+    table->n_tombstones = 0;
+    return 0;
+}
+
+/* make room in the id table for id.  lockless readers may be indexing
+ * the old one, so it is retired rather than freed.
+ */
+static int wolfidps_event_ids_grow(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id) {
+    struct wolfidps_event_table *table = &wolfidps->events;
+    struct wolfidps_event_ids *ids = table->ids, *new_ids;
+    uint32_t n_ids = ids ? ids->n_ids : WOLFIDPS_EVENT_MIN_IDS;
+    wolfidps_ent_id_t *new_free_ids;
+
+    while (n_ids <= id)
+        n_ids <<= 1;
+    if ((new_ids = (struct wolfidps_event_ids *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *new_ids + ((size_t)n_ids * sizeof new_ids->events[0]))) == NULL)
+        return MEMORY_E;
+    /* room to free every id. */
+    if ((new_free_ids = (wolfidps_ent_id_t *)wolfidps->allocator.realloc(wolfidps->allocator.context, table->free_ids, (size_t)n_ids * sizeof *new_free_ids)) == NULL) {
+        wolfidps->allocator.free(wolfidps->allocator.context, new_ids);
+        return MEMORY_E;
+    }
+    table->free_ids = new_free_ids;
+    memset(new_ids->events, 0, (size_t)n_ids * sizeof new_ids->events[0]);
+    if (ids)
+        memcpy(new_ids->events, ids->events, (size_t)ids->n_ids * sizeof ids->events[0]);
+    new_ids->n_ids = n_ids;
+    WOLFIDPS_ATOMIC_STORE_RELEASE(table->ids, new_ids);
+    if (ids)
+        wolfidps_epoch_retire(wolfidps, ids);
+    return 0;
+}
+
+static int wolfidps_event_id_alloc(struct wolfidps_context *wolfidps, wolfidps_ent_id_t *id) {
+    struct wolfidps_event_table *table = &wolfidps->events;
+    int ret;
+
+    if (table->n_free_ids > 0) {
+        *id = table->free_ids[--table->n_free_ids];
+        return 0;
+    }
+    if (table->next_id == (wolfidps_ent_id_t)~0U)
+        return MEMORY_E;
+    if (((table->ids == NULL) || (table->ids->n_ids <= (uint32_t)table->next_id + 1U)) &&
+        ((ret = wolfidps_event_ids_grow(wolfidps, (wolfidps_ent_id_t)(table->next_id + 1U))) < 0))
+        return ret;
+    *id = ++table->next_id;
+    return 0;
+}
+
 int wolfidps_event_getreference(struct wolfidps_context *wolfidps, int event_label_len, const char *event_label, struct wolfidps_event **event) {
+    struct wolfidps_event_table *table = &wolfidps->events;
+    struct wolfidps_event *new, **slot;
+    uint32_t hash, n_slots;
+    int ret;
+
+    if ((event_label_len <= 0) || (event_label_len > 255))
+        return BAD_FUNC_ARG;
+    hash = wolfidps_name_hash(event_label, (uint32_t)event_label_len);
+    if ((new = wolfidps_event_get(wolfidps, event_label_len, event_label, hash))) {
+        ++new->refcount;
+        *event = new;
+        return 0;
+    }
+
+    /* keep the load, tombstones included, at most half. */
+    if ((table->n_events + table->n_tombstones + 1) * 2 > table->n_slots) {
+        for (n_slots = WOLFIDPS_EVENT_MIN_SLOTS; n_slots < (table->n_events + 1) * 4; n_slots <<= 1)
+            ;
+        if ((wolfidps_event_index_resize(wolfidps, n_slots) < 0) &&
+            (table->n_events + table->n_tombstones + 1 >= table->n_slots))
+            return MEMORY_E;
+    }
+
+    new = (struct wolfidps_event *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *new + (size_t)event_label_len);
+    if (new == NULL)
+        return MEMORY_E;
+    memset(new, 0, sizeof *new);
+    if (wolfidps_counter_alloc(wolfidps, &new->hitcount) < 0) {
+        wolfidps->allocator.free(wolfidps->allocator.context, new);
+        return MEMORY_E;
+    }
+    if ((ret = wolfidps_event_id_alloc(wolfidps, &new->id)) < 0) {
+        wolfidps_counter_release(wolfidps, new->hitcount);
+        wolfidps->allocator.free(wolfidps->allocator.context, new);
+        return ret;
+    }
+    new->refcount = 1;
+    new->queue_refs = 1;
+    new->hash = hash;
+    new->keyword_len = (byte)event_label_len;
+    memcpy(new->keyword, event_label, (size_t)event_label_len);
+
+    slot = wolfidps_event_slot(table, event_label_len, event_label, hash);
+    if (*slot == WOLFIDPS_EVENT_TOMBSTONE)
+        --table->n_tombstones;
+    *slot = new;
+    ++table->n_events;
+    WOLFIDPS_ATOMIC_STORE_RELEASE(table->ids->events[new->id], new);
+    *event = new;
+    return 0;
+}
 
+/* drop the references held by the ents of an action list, and free them
+ * once no reader can still be walking it.
+ */
+void wolfidps_action_list_clear(struct wolfidps_context *wolfidps, struct wolfidps_action_list *list) {
+    struct wolfidps_action_list_ent *i = (struct wolfidps_action_list_ent *)list->header.head, *next;
+    list->header.head = list->header.tail = NULL;
+    for (; i; i = next) {
+        next = (struct wolfidps_action_list_ent *)i->header.next;
+        (void)wolfidps_action_dropreference(wolfidps, i->action);
+        wolfidps_epoch_retire(wolfidps, i);
+    }
+}
+
+/* retire callback. */
+static void wolfidps_event_free(struct wolfidps_context *wolfidps, void *ptr) {
+    struct wolfidps_event *event = (struct wolfidps_event *)ptr;
+    wolfidps_counter_release(wolfidps, event->hitcount);
+    wolfidps_action_queue_unpin(wolfidps, &event->queue_refs, event);
 }
 
 int wolfidps_event_dropreference(struct wolfidps_context *wolfidps, struct wolfidps_event *event) {
+    struct wolfidps_event_table *table = &wolfidps->events;
+    struct wolfidps_event **slot;
+    uint32_t j;
+
+    if (--event->refcount > 0)
+        return 0;
+    /* a tombstone is only needed if the probe sequence goes on. */
+    slot = wolfidps_event_slot(table, event->keyword_len, event->keyword, event->hash);
+    j = (uint32_t)(slot - table->slots);
+    if (table->slots[(j + 1) & (table->n_slots - 1)] == NULL)
+        *slot = NULL;
+    else {
+        *slot = WOLFIDPS_EVENT_TOMBSTONE;
+        ++table->n_tombstones;
+    }
+    --table->n_events;
+    /* readers holding a stale id see the event that reuses it, which is
+     * theirs to avoid.
+     */
+    WOLFIDPS_ATOMIC_STORE_RELEASE(table->ids->events[event->id], NULL);
+    table->free_ids[table->n_free_ids++] = event->id;
+    wolfidps_action_list_clear(wolfidps, &event->action_list);
+    wolfidps_epoch_retire_cb(wolfidps, event, wolfidps_event_free);
+    return 0;
+}
+
+int wolfidps_event_intern(struct wolfidps_context *wolfidps, int keyword_len, const char *keyword, wolfidps_ent_id_t *id) {
+    struct wolfidps_event *event;
+    int ret;
+
+    if ((keyword == NULL) || (id == NULL))
+        return BAD_FUNC_ARG;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((ret = wolfidps_event_getreference(wolfidps, keyword_len, keyword, &event)) == 0)
+        *id = event->id;
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+int wolfidps_event_release(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id) {
+    struct wolfidps_event_ids *ids;
+    int ret;
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    ids = wolfidps->events.ids;
+    if (ids && (id < ids->n_ids) && ids->events[id])
+        ret = wolfidps_event_dropreference(wolfidps, ids->events[id]);
+    else
+        ret = BAD_FUNC_ARG;
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+/* the event with id id, or NULL.  the caller is in an epoch or holds the
+ * table lock.
+ */
+struct wolfidps_event *wolfidps_event_by_id(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id) {
+    struct wolfidps_event_ids *ids = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->events.ids);
+    if ((ids == NULL) || (id >= ids->n_ids))
+        return NULL;
+    return WOLFIDPS_ATOMIC_LOAD_ACQUIRE(ids->events[id]);
+}
+
+int wolfidps_event_hit(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id) {
+    struct wolfidps_epoch_slot *epoch_slot;
+    struct wolfidps_event *event;
+    int ret = 0;
+
+    if (((epoch_slot = wolfidps_epoch_enter(wolfidps)) == NULL) &&
+        (wolfidps_lock_readonly(&wolfidps->lock) < 0))
+        return -1;
+    if ((event = wolfidps_event_by_id(wolfidps, id)))
+        wolfidps_counter_inc(wolfidps, epoch_slot, event->hitcount);
+    else
+        ret = BAD_FUNC_ARG;
+    if (epoch_slot)
+        wolfidps_epoch_leave(epoch_slot);
+    else
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+int wolfidps_event_get_hitcount(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id, wolfidps_count_t *count) {
+    struct wolfidps_epoch_slot *epoch_slot;
+    struct wolfidps_event *event;
+    int ret;
+
+    if (count == NULL)
+        return BAD_FUNC_ARG;
+    if (((epoch_slot = wolfidps_epoch_enter(wolfidps)) == NULL) &&
+        (wolfidps_lock_readonly(&wolfidps->lock) < 0))
+        return -1;
+    if ((event = wolfidps_event_by_id(wolfidps, id)))
+        ret = wolfidps_counter_get(wolfidps, event->hitcount, count);
+    else
+        ret = BAD_FUNC_ARG;
+    if (epoch_slot)
+        wolfidps_epoch_leave(epoch_slot);
+    else
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+/* the action labeled label, with no reference taken, or NULL. */
+struct wolfidps_action *wolfidps_action_get(struct wolfidps_context *wolfidps, int label_len, const char *label) {
+    struct wolfidps_table_ent_generic *i;
+    for (i = wolfidps->actions.header.head; i; i = i->generic.next) {
+        if ((i->action.label_len == label_len) && (! memcmp(i->action.label, label, (size_t)label_len)))
+            return &i->action;
+    }
+    return NULL;
+}
+
+int wolfidps_action_getreference(struct wolfidps_context *wolfidps, int label_len, const char *label, struct wolfidps_action **action) {
+    struct wolfidps_action *new;
+
+    if ((label_len <= 0) || (label_len > 255))
+        return BAD_FUNC_ARG;
+    if ((*action = wolfidps_action_get(wolfidps, label_len, label))) {
+        ++(*action)->refcount;
+        return 0;
+    }
+
+    new = (struct wolfidps_action *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *new + (size_t)label_len);
+    if (new == NULL)
+        return MEMORY_E;
+    memset(new, 0, sizeof *new);
+    if ((wolfidps_counter_alloc(wolfidps, &new->hitcount) < 0) ||
+        (wolfidps_counter_alloc(wolfidps, &new->n_queued) < 0) ||
+        (wolfidps_counter_alloc(wolfidps, &new->n_dropped) < 0) ||
+        (wolfidps_counter_alloc(wolfidps, &new->n_coalesced) < 0) ||
+        (wolfidps_counter_alloc(wolfidps, &new->n_dropped_coalesce) < 0)) {
+        wolfidps_counter_release(wolfidps, new->hitcount);
+        wolfidps_counter_release(wolfidps, new->n_queued);
+        wolfidps_counter_release(wolfidps, new->n_dropped);
+        wolfidps_counter_release(wolfidps, new->n_coalesced);
+        wolfidps->allocator.free(wolfidps->allocator.context, new);
+        return MEMORY_E;
+    }
+    new->refcount = 1;
+    new->queue_refs = 1;
+    new->id = ++wolfidps->actions.next_id;
+    new->label_len = (byte)label_len;
+    memcpy(new->label, label, (size_t)label_len);
+    (void)wolfidps_table_ent_insert((struct wolfidps_table_ent_generic *)new, (struct wolfidps_table_generic *)&wolfidps->actions);
+    *action = new;
+    return 0;
+}
+
+/* retire callback. */
+static void wolfidps_action_free(struct wolfidps_context *wolfidps, void *ptr) {
+    struct wolfidps_action *action = (struct wolfidps_action *)ptr;
+    wolfidps_counter_release(wolfidps, action->hitcount);
+    wolfidps_counter_release(wolfidps, action->n_queued);
+    wolfidps_counter_release(wolfidps, action->n_dropped);
+    wolfidps_counter_release(wolfidps, action->n_coalesced);
+    wolfidps_counter_release(wolfidps, action->n_dropped_coalesce);
+    wolfidps_action_queue_unpin(wolfidps, &action->queue_refs, action);
+}
+
+int wolfidps_action_dropreference(struct wolfidps_context *wolfidps, struct wolfidps_action *action) {
+    if (--action->refcount > 0)
+        return 0;
+    wolfidps_table_ent_delete_1((struct wolfidps_table_generic *)&wolfidps->actions, (struct wolfidps_table_ent_generic *)action);
+    wolfidps_epoch_retire_cb(wolfidps, action, wolfidps_action_free);
+    return 0;
+}
+
+/* the binding holds a reference, so that a bound action outlives the
+ * policy that declared it.
+ */
+int wolfidps_action_set_handler(struct wolfidps_context *wolfidps, int label_len, const char *label, wolfidps_action_callback_t *handler, void *handler_context) {
+    struct wolfidps_action *action;
+    int ret = 0;
+
+    if ((label == NULL) || (label_len <= 0) || (label_len > 255))
+        return BAD_FUNC_ARG;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((action = wolfidps_action_get(wolfidps, label_len, label)) == NULL) {
+        if (handler)
+            ret = wolfidps_action_getreference(wolfidps, label_len, label, &action);
+        else
+            ret = -1;
+    } else if (handler && (action->handler == NULL))
+        ++action->refcount;
+    if (ret == 0) {
+        action->handler_context = handler_context;
+        if (handler)
+            action->handler = handler;
+        else if (action->handler) {
+            action->handler = NULL;
+            (void)wolfidps_action_dropreference(wolfidps, action);
+        }
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+/* shutdown -- free whatever is left once every reference has been
+ * dropped but those held by handler bindings.
+ */
+void wolfidps_event_table_free(struct wolfidps_context *wolfidps) {
+    struct wolfidps_event_table *table = &wolfidps->events;
+    struct wolfidps_table_ent_generic *i, *next;
+    uint32_t j;
+
+    for (j = 0; j < table->n_slots; ++j) {
+        if ((table->slots[j] == NULL) || (table->slots[j] == WOLFIDPS_EVENT_TOMBSTONE))
+            continue;
+        wolfidps_action_list_clear(wolfidps, &table->slots[j]->action_list);
+        wolfidps_event_free(wolfidps, table->slots[j]);
+    }
+    if (table->slots)
+        wolfidps->allocator.free(wolfidps->allocator.context, table->slots);
+    if (table->ids)
+        wolfidps->allocator.free(wolfidps->allocator.context, table->ids);
+    if (table->free_ids)
+        wolfidps->allocator.free(wolfidps->allocator.context, table->free_ids);
+    table->slots = NULL;
+    table->ids = NULL;
+    table->free_ids = NULL;
+    table->n_slots = table->n_events = table->n_tombstones = table->n_free_ids = 0;
+    for (i = wolfidps->actions.header.head; i; i = next) {
+        next = i->generic.next;
+        wolfidps_action_free(wolfidps, i);
+    }
+    wolfidps->actions.header.head = wolfidps->actions.header.tail = NULL;
 }
@@ -0,0 +1,162 @@
+#include "wolfidps_internal.h"
+
+/* route eviction under memory pressure -- see wolfidps_set_eviction_policy().
+ *
+ * every route sits on a ring in insertion order, with new routes going in
+ * just behind the clock hand, so that they are examined last.  readers set
+ * route->referenced on each hit, and the hand clears it as it passes.  all
+ * of this runs with the table write lock held.
+ */
+
+#ifndef WOLFIDPS_EVICT_SCAN_MAX
+#define WOLFIDPS_EVICT_SCAN_MAX 64 /* routes passed over by the clock hand per eviction, at most */
+#endif
+
+#ifndef WOLFIDPS_EVICT_SAMPLE
+#define WOLFIDPS_EVICT_SAMPLE 8 /* candidates compared per eviction, for the sampling policies */
+#endif
+
+int wolfidps_set_eviction_policy(struct wolfidps_context *wolfidps, wolfidps_eviction_policy_t policy, long max_routes) {
+    if ((policy < WOLFIDPS_EVICT_NONE) || (policy > WOLFIDPS_EVICT_SOONEST_EXPIRY) || (max_routes < 0))
+        return BAD_FUNC_ARG;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    wolfidps->routes.eviction_policy = policy;
+    wolfidps->routes.max_routes = max_routes;
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return 0;
+}
+
+void wolfidps_evict_link(struct wolfidps_route_table *table, struct wolfidps_route *route) {
+    struct wolfidps_route *hand = table->clock_hand;
+    if (hand == NULL) {
+        route->clock_prev = route->clock_next = route;
+        table->clock_hand = route;
+    } else {
+        route->clock_next = hand;
+        route->clock_prev = hand->clock_prev;
+        hand->clock_prev->clock_next = route;
+        hand->clock_prev = route;
+    }
+    ++table->n_routes;
+}
+
+void wolfidps_evict_unlink(struct wolfidps_route_table *table, struct wolfidps_route *route) {
+    if (route->clock_next == NULL)
+        return;
+    if (route->clock_next == route)
+        table->clock_hand = NULL;
+    else {
+        if (table->clock_hand == route)
+            table->clock_hand = route->clock_next;
+        route->clock_prev->clock_next = route->clock_next;
+        route->clock_next->clock_prev = route->clock_prev;
+    }
+    route->clock_prev = route->clock_next = NULL;
+    --table->n_routes;
+}
+
+typedef struct wolfidps_route *(*wolfidps_evict_select_fn_t)(struct wolfidps_context *wolfidps);
+
+/* second chance: the first route not hit since the hand last passed it,
+ * or failing that, the last route passed.
+ */
+static struct wolfidps_route *wolfidps_evict_select_clock(struct wolfidps_context *wolfidps) {
+    struct wolfidps_route_table *table = &wolfidps->routes;
+    struct wolfidps_route *route = NULL;
+    int i;
+
+    for (i = 0; i < WOLFIDPS_EVICT_SCAN_MAX; ++i) {
+        route = table->clock_hand;
+        table->clock_hand = route->clock_next;
+        if (! route->referenced)
+            break;
+        route->referenced = 0;
+    }
+    return route;
+}
+
+/* the route with the fewest hits among the next few under the hand. */
+static struct wolfidps_route *wolfidps_evict_select_lowest_hits(struct wolfidps_context *wolfidps) {
+    struct wolfidps_route_table *table = &wolfidps->routes;
+    struct wolfidps_route *best = NULL;
+    wolfidps_count_t best_hits = 0;
+    int i;
+
+    for (i = 0; i < WOLFIDPS_EVICT_SAMPLE; ++i) {
+        struct wolfidps_route *route = table->clock_hand;
+        wolfidps_count_t hits;
+        table->clock_hand = route->clock_next;
+        if (route->flags.dont_count || (wolfidps_counter_get(wolfidps, route->n_hits, &hits) < 0))
+            hits = 0;
+        if ((best == NULL) || (hits < best_hits)) {
+            best = route;
+            best_hits = hits;
+        }
+    }
+    return best;
+}
+
+/* only routes with a ttl have timers, so this falls back to the clock when
+ * there are none.
+ */
+static struct wolfidps_route *wolfidps_evict_select_soonest_expiry(struct wolfidps_context *wolfidps) {
+    struct wolfidps_timer *timer = wolfidps_timer_soonest(wolfidps, WOLFIDPS_EVICT_SAMPLE);
+    if (timer == NULL)
+        return wolfidps_evict_select_clock(wolfidps);
+    return WOLFIDPS_CONTAINER_OF(timer, struct wolfidps_route, expiry);
+}
+
+static const wolfidps_evict_select_fn_t wolfidps_evict_selectors[] = {
+    NULL,
+    wolfidps_evict_select_clock,
+    wolfidps_evict_select_lowest_hits,
+    wolfidps_evict_select_soonest_expiry
+};
+
+/* the number of routes to evict before n more fit under max_routes, or
+ * MEMORY_E if that many can't be evicted.
+ */
+long wolfidps_evict_needed(struct wolfidps_context *wolfidps, long n) {
+    struct wolfidps_route_table *table = &wolfidps->routes;
+    long excess;
+
+    if (table->max_routes <= 0)
+        return 0;
+    if ((excess = table->n_routes + n - table->max_routes) <= 0)
+        return 0;
+    if ((table->eviction_policy == WOLFIDPS_EVICT_NONE) || (excess > table->n_routes))
+        return MEMORY_E;
+    return excess;
+}
+
+/* evict as many routes as wolfidps_evict_needed() says.  the routes to go
+ * in must not be linked yet, lest one of them be chosen as a victim.
+ */
+int wolfidps_evict_make_room(struct wolfidps_context *wolfidps, long n) {
+    long needed = wolfidps_evict_needed(wolfidps, n);
+
+    if (needed < 0)
+        return (int)needed;
+    for (; needed > 0; --needed) {
+        if (wolfidps_evict_1(wolfidps) < 0)
+            return MEMORY_E;
+    }
+    return 0;
+}
+
+/* delete one victim route.  returns -1 if eviction is disabled or the
+ * table is empty.
+ */
+int wolfidps_evict_1(struct wolfidps_context *wolfidps) {
+    struct wolfidps_route_table *table = &wolfidps->routes;
+    struct wolfidps_route *victim;
+
+    if ((table->eviction_policy == WOLFIDPS_EVICT_NONE) || (table->clock_hand == NULL))
+        return -1;
+    if ((victim = wolfidps_evict_selectors[table->eviction_policy](wolfidps)) == NULL)
+        return -1;
+    (void)wolfidps_route_delete_1(wolfidps, victim);
+    ++table->n_evictions;
+    return 0;
+}
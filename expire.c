@@ -0,0 +1,248 @@
+#include "wolfidps_internal.h"
+
+/* route ttl expiry, on a hierarchical timing wheel.
+ *
+ * times are converted to ticks relative to the first time the wheel is
+ * used, via the context's diff_time callback, rounding expiry up so that
+ * nothing is ever reaped early.  all wheel state is protected by the
+ * table write lock.
+ */
+
+#ifndef WOLFIDPS_TIMER_DEFAULT_TICK
+#define WOLFIDPS_TIMER_DEFAULT_TICK 1000 /* 1ms with the builtin microsecond clock */
+#endif
+
+#define WOLFIDPS_TIMER_SLOT_MASK (WOLFIDPS_TIMER_SLOTS - 1)
+
+void wolfidps_timer_wheel_init(struct wolfidps_context *wolfidps) {
+    memset(&wolfidps->timers, 0, sizeof wolfidps->timers);
+    wolfidps->timers.tick_len = WOLFIDPS_TIMER_DEFAULT_TICK;
+}
+
+int wolfidps_set_expiry_resolution(struct wolfidps_context *wolfidps, wolfidps_time_t tick_len) {
+    struct wolfidps_timer_wheel *wheel = &wolfidps->timers;
+    int i, ret = 0;
+
+    if ((tick_len == 0) || ((woldidps_time_t)tick_len < 0))
+        return BAD_FUNC_ARG;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    for (i = 0; i < WOLFIDPS_TIMER_LEVELS; ++i) {
+        if (wheel->n_timers[i])
+            ret = BAD_STATE_E;
+    }
+    if (wheel->overflow || wheel->expired)
+        ret = BAD_STATE_E;
+    if (ret == 0) {
+        wheel->tick_len = (woldidps_time_t)tick_len;
+        wheel->started = 0;
+        wheel->now_tick = 0;
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+static void wolfidps_timer_link(struct wolfidps_timer **head, struct wolfidps_timer *timer) {
+    timer->next = *head;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+}
+
+static void wolfidps_timer_unlink(struct wolfidps_timer *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static uint64_t wolfidps_timer_tick(struct wolfidps_context *wolfidps, woldidps_time_t when, int round_up) {
+    struct wolfidps_timer_wheel *wheel = &wolfidps->timers;
+    woldidps_time_t delta = wolfidps->timecbs.diff_time(wheel->base_time, when);
+    if (delta <= 0)
+        return 0;
+    if (round_up)
+        return (uint64_t)((delta + wheel->tick_len - 1) / wheel->tick_len);
+    return (uint64_t)(delta / wheel->tick_len);
+}
+
+/* pin the wheel's base time to now, on first use.  once this has
+ * succeeded, wolfidps_timer_add() can't fail.
+ */
+int wolfidps_timer_start(struct wolfidps_context *wolfidps) {
+    struct wolfidps_timer_wheel *wheel = &wolfidps->timers;
+    if (wheel->started)
+        return 0;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &wheel->base_time) < 0)
+        return -1;
+    wheel->now_tick = 0;
+    wheel->started = 1;
+    return 0;
+}
+
+/* file timer in the level that covers its distance from now_tick. */
+static void wolfidps_timer_file(struct wolfidps_timer_wheel *wheel, struct wolfidps_timer *timer) {
+    uint64_t delta;
+    int level;
+
+    if (timer->expires_tick <= wheel->now_tick) {
+        timer->level = -1;
+        wolfidps_timer_link(&wheel->expired, timer);
+        return;
+    }
+    delta = timer->expires_tick - wheel->now_tick;
+    for (level = 0; level < WOLFIDPS_TIMER_LEVELS; ++level) {
+        if (delta < ((uint64_t)1 << (WOLFIDPS_TIMER_SLOT_BITS * (level + 1)))) {
+            timer->level = level;
+            wolfidps_timer_link(&wheel->slots[level][(timer->expires_tick >> (WOLFIDPS_TIMER_SLOT_BITS * level)) & WOLFIDPS_TIMER_SLOT_MASK], timer);
+            ++wheel->n_timers[level];
+            return;
+        }
+    }
+    timer->level = -1;
+    wolfidps_timer_link(&wheel->overflow, timer);
+}
+
+int wolfidps_timer_add(struct wolfidps_context *wolfidps, struct wolfidps_timer *timer, woldidps_time_t expires) {
+    if (wolfidps_timer_start(wolfidps) < 0)
+        return -1;
+    timer->expires_tick = wolfidps_timer_tick(wolfidps, expires, 1);
+    wolfidps_timer_file(&wolfidps->timers, timer);
+    return 0;
+}
+
+void wolfidps_timer_del(struct wolfidps_context *wolfidps, struct wolfidps_timer *timer) {
+    if (timer->pprev == NULL)
+        return;
+    if (timer->level >= 0)
+        --wolfidps->timers.n_timers[timer->level];
+    wolfidps_timer_unlink(timer);
+}
+
+static struct wolfidps_timer *wolfidps_timer_list_min(struct wolfidps_timer *timer, int max_scan) {
+    struct wolfidps_timer *best = timer;
+    for (; timer && (max_scan > 0); timer = timer->next, --max_scan) {
+        if (timer->expires_tick < best->expires_tick)
+            best = timer;
+    }
+    return best;
+}
+
+/* a timer due at or near the earliest pending expiry, or NULL if there are
+ * none: the soonest of the first max_scan timers in the first occupied
+ * slot of the lowest occupied level.  the cost is bounded by the wheel
+ * size plus max_scan.
+ */
+struct wolfidps_timer *wolfidps_timer_soonest(struct wolfidps_context *wolfidps, int max_scan) {
+    struct wolfidps_timer_wheel *wheel = &wolfidps->timers;
+    int level, i;
+
+    if (wheel->expired)
+        return wheel->expired;
+    for (level = 0; level < WOLFIDPS_TIMER_LEVELS; ++level) {
+        unsigned int slot = (unsigned int)(wheel->now_tick >> (WOLFIDPS_TIMER_SLOT_BITS * level));
+        if (wheel->n_timers[level] == 0)
+            continue;
+        for (i = 0; i < (int)WOLFIDPS_TIMER_SLOTS; ++i) {
+            struct wolfidps_timer *head = wheel->slots[level][(slot + (unsigned int)i) & WOLFIDPS_TIMER_SLOT_MASK];
+            if (head)
+                return wolfidps_timer_list_min(head, max_scan);
+        }
+    }
+    if (wheel->overflow)
+        return wolfidps_timer_list_min(wheel->overflow, max_scan);
+    return NULL;
+}
+
+/* refile everything in a list, each timer moving to a lower level (or to
+ * the expired list) now that it is closer.  the list is detached first,
+ * since overflow timers may land right back on the overflow list.
+ */
+static void wolfidps_timer_cascade(struct wolfidps_timer_wheel *wheel, struct wolfidps_timer **head) {
+    struct wolfidps_timer *timer = *head, *next;
+    *head = NULL;
+    for (; timer; timer = next) {
+        next = timer->next;
+        if (timer->level >= 0)
+            --wheel->n_timers[timer->level];
+        timer->next = NULL;
+        timer->pprev = NULL;
+        wolfidps_timer_file(wheel, timer);
+    }
+}
+
+static void wolfidps_timer_advance(struct wolfidps_timer_wheel *wheel) {
+    int level, top;
+
+    ++wheel->now_tick;
+
+    /* each level whose lower bits just wrapped to zero cascades its
+     * current slot, highest level first.
+     */
+    for (top = 0; top < WOLFIDPS_TIMER_LEVELS; ++top) {
+        if (wheel->now_tick & (((uint64_t)1 << (WOLFIDPS_TIMER_SLOT_BITS * (top + 1))) - 1))
+            break;
+    }
+    if (top == WOLFIDPS_TIMER_LEVELS)
+        wolfidps_timer_cascade(wheel, &wheel->overflow);
+    for (level = (top < WOLFIDPS_TIMER_LEVELS) ? top : (WOLFIDPS_TIMER_LEVELS - 1); level > 0; --level)
+        wolfidps_timer_cascade(wheel, &wheel->slots[level][(wheel->now_tick >> (WOLFIDPS_TIMER_SLOT_BITS * level)) & WOLFIDPS_TIMER_SLOT_MASK]);
+
+    wolfidps_timer_cascade(wheel, &wheel->slots[0][wheel->now_tick & WOLFIDPS_TIMER_SLOT_MASK]);
+}
+
+/* advance toward target_tick, skipping runs of ticks in which nothing can
+ * happen: if levels below k are empty, nothing is due until the next
+ * boundary of level k.
+ */
+static void wolfidps_timer_advance_to(struct wolfidps_timer_wheel *wheel, uint64_t target_tick) {
+    int k;
+    for (k = 0; (k < WOLFIDPS_TIMER_LEVELS) && (wheel->n_timers[k] == 0); ++k)
+        ;
+    if (k > 0) {
+        uint64_t last_before_boundary = wheel->now_tick | (((uint64_t)1 << (WOLFIDPS_TIMER_SLOT_BITS * k)) - 1);
+        if (last_before_boundary >= target_tick) {
+            wheel->now_tick = target_tick;
+            return;
+        }
+        wheel->now_tick = last_before_boundary;
+    }
+    wolfidps_timer_advance(wheel);
+}
+
+int wolfidps_expire(struct wolfidps_context *wolfidps, wolfidps_time_t now, int budget) {
+    struct wolfidps_timer_wheel *wheel = &wolfidps->timers;
+    woldidps_time_t now_time = (woldidps_time_t)now;
+    uint64_t target_tick, start;
+    int n_expired = 0;
+
+    if (budget <= 0)
+        return BAD_FUNC_ARG;
+    if ((now == WOLFIDPS_TIME_NEVER) &&
+        (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now_time) < 0))
+        return -1;
+
+    start = wolfidps_probe_begin(wolfidps, NULL, WOLFIDPS_PROBE_EXPIRE);
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+
+    if (wheel->started) {
+        target_tick = wolfidps_timer_tick(wolfidps, now_time, 0);
+        for (;;) {
+            while (wheel->expired && (n_expired < budget)) {
+                struct wolfidps_route *route = WOLFIDPS_CONTAINER_OF(wheel->expired, struct wolfidps_route, expiry);
+                (void)wolfidps_route_delete_1(wolfidps, route);
+                ++n_expired;
+            }
+            if ((n_expired >= budget) || (wheel->now_tick >= target_tick))
+                break;
+            wolfidps_timer_advance_to(wheel, target_tick);
+        }
+    }
+
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    wolfidps_probe_end(wolfidps, NULL, WOLFIDPS_PROBE_EXPIRE, start);
+    return n_expired;
+}
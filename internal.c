@@ -1,125 +1,315 @@
 #include "wolfidps_internal.h"
 
-int wolfidps_lock_readonly(struct wolfidps_rwlock *lock) {
-    int waited = 0;
-  again:
-    if (sem_wait(&lock->sem) < 0)
-        return -1;
-    if (waited)
-        --lock->read_waiter_count;
-    if (lock->state == WOLFIDPS_LOCK_EXCLUSIVE) {
-        ++lock->read_waiter_count;
-        if (sem_post(&lock->sem) < 0)
-            return -1;
-        if (sem_wait(&lock->sem_read_waiters) < 0)
-            return -1;
-        goto again;
-    } else if (lock->state == WOLFIDPS_LOCK_UNLOCKED)
-        lock->state = WOLFIDPS_LOCK_SHARED;
-    ++lock->shared_count;
-    if (sem_post(&lock->sem) < 0)
-        return -1;
+#include <limits.h>
+#include <sched.h>
+#if defined(__linux__) && ! defined(WOLFIDPS_NO_FUTEX)
+#define WOLFIDPS_HAVE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* a futex rwlock.  uncontended lock and unlock are a single atomic op
+ * on state, with no syscall.  a waiting writer blocks new readers, and an
+ * unlock with both readers and writers parked wakes only one writer, so
+ * writers can't be starved.  contended threads spin briefly before
+ * parking.
+ */
+
+#define WOLFIDPS_LOCK_READ_LOCKED 1U
+#define WOLFIDPS_LOCK_MASK ((1U << 30) - 1)
+#define WOLFIDPS_LOCK_WRITE_LOCKED WOLFIDPS_LOCK_MASK
+#define WOLFIDPS_LOCK_MAX_READERS (WOLFIDPS_LOCK_MASK - 1)
+#define WOLFIDPS_LOCK_READERS_WAITING (1U << 30)
+#define WOLFIDPS_LOCK_WRITERS_WAITING (1U << 31)
+
+#ifndef WOLFIDPS_LOCK_SPIN
+#define WOLFIDPS_LOCK_SPIN 100
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WOLFIDPS_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define WOLFIDPS_CPU_RELAX() do {} while (0)
+#endif
+
+#ifdef WOLFIDPS_HAVE_FUTEX
+
+static void wolfidps_futex_wait(volatile uint32_t *addr, uint32_t expected) {
+    /* EAGAIN and EINTR just send the caller around again. */
+    (void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+/* returns the number of threads woken. */
+static int wolfidps_futex_wake(volatile uint32_t *addr, int n) {
+    long ret = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+    return (ret < 0) ? 0 : (int)ret;
+}
+
+#else
+
+/* no futex (or WOLFIDPS_NO_FUTEX) -- parked threads just yield until the
+ * word changes.
+ */
+static void wolfidps_futex_wait(volatile uint32_t *addr, uint32_t expected) {
+    if (__atomic_load_n(addr, __ATOMIC_RELAXED) == expected)
+        (void)sched_yield();
+}
+
+/* whether anyone is parked can't be told, so none are said to be woken,
+ * lest readers be left parked for a writer that isn't there.
+ */
+static int wolfidps_futex_wake(volatile uint32_t *addr, int n) {
+    (void)addr;
+    (void)n;
     return 0;
 }
 
-int wolfidps_lock_readwrite(struct wolfidps_rwlock *lock) {
-    int waited = 0;
-  again:
-    if (sem_wait(&lock->sem) < 0)
-        return -1;
-    if (waited)
-        --lock->write_waiter_count;
-    if (lock->state != WOLFIDPS_LOCK_UNLOCKED) {
-        ++lock->write_waiter_count;
-        if (sem_post(&lock->sem) < 0)
-            return -1;
-        if (sem_wait(&lock->sem_write_waiters) < 0)
-            return -1;
-        goto again;
-    }
-    lock->state = WOLFIDPS_LOCK_EXCLUSIVE;
-    if (sem_post(&lock->sem) < 0)
-        return -1;
+#endif /* WOLFIDPS_HAVE_FUTEX */
+
+static inline int wolfidps_lock_is_unlocked(uint32_t state) {
+    return (state & WOLFIDPS_LOCK_MASK) == 0;
+}
+
+static inline int wolfidps_lock_is_write_locked(uint32_t state) {
+    return (state & WOLFIDPS_LOCK_MASK) == WOLFIDPS_LOCK_WRITE_LOCKED;
+}
+
+/* readers also hold off while other readers are parked: that only happens
+ * right after an unlock, whose thread may be handing the lock to a writer.
+ */
+static inline int wolfidps_lock_is_read_lockable(uint32_t state) {
+    return ((state & WOLFIDPS_LOCK_MASK) < WOLFIDPS_LOCK_MAX_READERS) &&
+        (! (state & (WOLFIDPS_LOCK_READERS_WAITING | WOLFIDPS_LOCK_WRITERS_WAITING)));
+}
+
+/* a reader woken by wolfidps_lock_write2read() may join the downgraded
+ * lock even with writers waiting, or the downgrade would be pointless.
+ */
+static inline int wolfidps_lock_is_read_lockable_after_wakeup(uint32_t state) {
+    return ((state & WOLFIDPS_LOCK_MASK) < WOLFIDPS_LOCK_MAX_READERS) &&
+        (! (state & WOLFIDPS_LOCK_READERS_WAITING)) &&
+        (! wolfidps_lock_is_write_locked(state)) &&
+        (! wolfidps_lock_is_unlocked(state));
+}
+
+int wolfidps_lock_init(struct wolfidps_rwlock *lock) {
+    memset(lock, 0, sizeof *lock);
     return 0;
 }
 
-int wolfidps_lock_unlock(struct wolfidps_rwlock *lock) {
-    if (sem_wait(&lock->sem) < 0)
-        return -1;
-    if (lock->state == WOLFIDPS_LOCK_SHARED) {
-        if (--lock->shared_count)
-            lock->state == WOLFIDPS_LOCK_UNLOCKED;
-    } else if (lock->state == WOLFIDPS_LOCK_EXCLUSIVE)
-        lock->state == WOLFIDPS_LOCK_UNLOCKED;
-    else {
-        (void)sem_post(&lock->sem);
+int wolfidps_lock_destroy(struct wolfidps_rwlock *lock) {
+    if (! wolfidps_lock_is_unlocked(lock->state))
         return -1;
+    return 0;
+}
+
+static uint32_t wolfidps_lock_spin_read(struct wolfidps_rwlock *lock) {
+    uint32_t state;
+    int spin;
+    for (spin = WOLFIDPS_LOCK_SPIN; ; --spin) {
+        state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if ((! wolfidps_lock_is_write_locked(state)) ||
+            (state & (WOLFIDPS_LOCK_READERS_WAITING | WOLFIDPS_LOCK_WRITERS_WAITING)) ||
+            (spin == 0))
+            return state;
+        WOLFIDPS_CPU_RELAX();
     }
-    if (lock->write_waiter_count > 0) {
-        if (sem_post(&lock->sem_write_waiters) < 0)
+}
+
+static uint32_t wolfidps_lock_spin_write(struct wolfidps_rwlock *lock) {
+    uint32_t state;
+    int spin;
+    for (spin = WOLFIDPS_LOCK_SPIN; ; --spin) {
+        state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (wolfidps_lock_is_unlocked(state) ||
+            (state & WOLFIDPS_LOCK_WRITERS_WAITING) ||
+            (spin == 0))
+            return state;
+        WOLFIDPS_CPU_RELAX();
+    }
+}
+
+static int wolfidps_lock_readonly_contended(struct wolfidps_rwlock *lock) {
+    uint32_t state = wolfidps_lock_spin_read(lock);
+    int slept = 0;
+
+    for (;;) {
+        if ((slept && wolfidps_lock_is_read_lockable_after_wakeup(state)) ||
+            wolfidps_lock_is_read_lockable(state)) {
+            if (__atomic_compare_exchange_n(&lock->state, &state, state + WOLFIDPS_LOCK_READ_LOCKED, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return 0;
+            continue;
+        }
+        if ((state & WOLFIDPS_LOCK_MASK) == WOLFIDPS_LOCK_MAX_READERS)
             return -1;
-    } else if (lock->read_waiter_count > 0) {
-        int i;
-        for (i = 0; i < lock->read_waiter_count; ++i) {
-            if (sem_post(&lock->sem_read_waiters) < 0)
-                return -1;
+        /* the unlocking thread only wakes readers it knows are parked. */
+        if (! (state & WOLFIDPS_LOCK_READERS_WAITING)) {
+            if (! __atomic_compare_exchange_n(&lock->state, &state, state | WOLFIDPS_LOCK_READERS_WAITING, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                continue;
         }
+        wolfidps_futex_wait(&lock->state, state | WOLFIDPS_LOCK_READERS_WAITING);
+        slept = 1;
+        state = wolfidps_lock_spin_read(lock);
     }
-    if (sem_post(&lock->sem) < 0)
-        return -1;
-    return 0;
 }
 
-int wolfidps_lock_write2read(struct wolfidps_rwlock *lock) {
-    if (sem_wait(&lock->sem) < 0)
-        return -1;
-    if (lock->state != WOLFIDPS_LOCK_EXCLUSIVE) {
-        if (sem_post(&lock->sem) < 0)
-            return -1;
-        return -1;
+int wolfidps_lock_readonly(struct wolfidps_rwlock *lock) {
+    uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (wolfidps_lock_is_read_lockable(state) &&
+        __atomic_compare_exchange_n(&lock->state, &state, state + WOLFIDPS_LOCK_READ_LOCKED, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    return wolfidps_lock_readonly_contended(lock);
+}
+
+static int wolfidps_lock_readwrite_contended(struct wolfidps_rwlock *lock) {
+    uint32_t state = wolfidps_lock_spin_write(lock), other_writers_waiting = 0, seq;
+
+    for (;;) {
+        /* keep the writers waiting bit if it was ever set, since other
+         * writers may have parked behind it.
+         */
+        if (wolfidps_lock_is_unlocked(state)) {
+            if (__atomic_compare_exchange_n(&lock->state, &state, state | WOLFIDPS_LOCK_WRITE_LOCKED | other_writers_waiting, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return 0;
+            continue;
+        }
+        if (! (state & WOLFIDPS_LOCK_WRITERS_WAITING)) {
+            if (! __atomic_compare_exchange_n(&lock->state, &state, state | WOLFIDPS_LOCK_WRITERS_WAITING, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                continue;
+        }
+        other_writers_waiting = WOLFIDPS_LOCK_WRITERS_WAITING;
+        /* read the sequence before rechecking state, so that a wakeup
+         * between the two isn't lost.
+         */
+        seq = __atomic_load_n(&lock->writer_notify, __ATOMIC_ACQUIRE);
+        state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (wolfidps_lock_is_unlocked(state) || (! (state & WOLFIDPS_LOCK_WRITERS_WAITING)))
+            continue;
+        wolfidps_futex_wait(&lock->writer_notify, seq);
+        state = wolfidps_lock_spin_write(lock);
     }
-    lock->state == WOLFIDPS_LOCK_SHARED;
-    lock->shared_count = 1;
-    if ((lock->write_waiter_count == 0) &&
-        (lock->read_waiter_count > 0)) {
-        int i;
-        for (i = 0; i < lock->read_waiter_count; ++i) {
-            if (sem_post(&lock->sem_read_waiters) < 0)
-                return -1;
+}
+
+int wolfidps_lock_readwrite(struct wolfidps_rwlock *lock) {
+    uint32_t state = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &state, WOLFIDPS_LOCK_WRITE_LOCKED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    return wolfidps_lock_readwrite_contended(lock);
+}
+
+static int wolfidps_lock_wake_writer(struct wolfidps_rwlock *lock) {
+    (void)__atomic_fetch_add(&lock->writer_notify, 1, __ATOMIC_RELEASE);
+    return wolfidps_futex_wake(&lock->writer_notify, 1);
+}
+
+/* called with the lock just released and someone parked.  if the lock is
+ * taken again meanwhile, its new holder inherits the job.
+ */
+static void wolfidps_lock_wake_waiters(struct wolfidps_rwlock *lock, uint32_t state) {
+    /* new readers may set their bit at any point, but writers never need
+     * their bit to take the lock.
+     */
+    if (state == WOLFIDPS_LOCK_WRITERS_WAITING) {
+        if (__atomic_compare_exchange_n(&lock->state, &state, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            (void)wolfidps_lock_wake_writer(lock);
+            return;
         }
     }
-    if (sem_post(&lock->sem) < 0)
+    /* writers go first, with the readers left parked. */
+    if (state == (WOLFIDPS_LOCK_READERS_WAITING | WOLFIDPS_LOCK_WRITERS_WAITING)) {
+        if (! __atomic_compare_exchange_n(&lock->state, &state, WOLFIDPS_LOCK_READERS_WAITING, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return;
+        if (wolfidps_lock_wake_writer(lock) > 0)
+            return;
+        /* no writer was actually parked, so the readers can't be left. */
+        state = WOLFIDPS_LOCK_READERS_WAITING;
+    }
+    if (state == WOLFIDPS_LOCK_READERS_WAITING) {
+        if (__atomic_compare_exchange_n(&lock->state, &state, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            (void)wolfidps_futex_wake(&lock->state, INT_MAX);
+    }
+}
+
+int wolfidps_lock_unlock(struct wolfidps_rwlock *lock) {
+    uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+
+    if (wolfidps_lock_is_write_locked(state)) {
+        state = __atomic_sub_fetch(&lock->state, WOLFIDPS_LOCK_WRITE_LOCKED, __ATOMIC_RELEASE);
+        if (state & (WOLFIDPS_LOCK_READERS_WAITING | WOLFIDPS_LOCK_WRITERS_WAITING))
+            wolfidps_lock_wake_waiters(lock, state);
+        return 0;
+    }
+    if (wolfidps_lock_is_unlocked(state))
         return -1;
+    state = __atomic_sub_fetch(&lock->state, WOLFIDPS_LOCK_READ_LOCKED, __ATOMIC_RELEASE);
+    /* readers only park behind a read lock when a writer is parked too. */
+    if (wolfidps_lock_is_unlocked(state) && (state & WOLFIDPS_LOCK_WRITERS_WAITING))
+        wolfidps_lock_wake_waiters(lock, state);
     return 0;
 }
 
-int wolfidps_table_ent_insert(struct wolfidps_table_ent_generic *ent, struct wolfidps_table_generic *table) {
-    struct wolfidps_table_ent_generic *i = table->generic.head;
-    while (i) {
-        if (table->generic.cmp_fn((struct wolfidps_ent_generic *)ent, (struct wolfidps_ent_generic *)i) > 0)
-            break;
-        i = i->generic.next;
+int wolfidps_lock_write2read(struct wolfidps_rwlock *lock) {
+    uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+
+    if (! wolfidps_lock_is_write_locked(state))
+        return -1;
+    state = __atomic_fetch_sub(&lock->state, WOLFIDPS_LOCK_WRITE_LOCKED - WOLFIDPS_LOCK_READ_LOCKED, __ATOMIC_RELEASE);
+    /* only the writer could clear the bit, and still holds the lock. */
+    if (state & WOLFIDPS_LOCK_READERS_WAITING) {
+        (void)__atomic_fetch_and(&lock->state, ~WOLFIDPS_LOCK_READERS_WAITING, __ATOMIC_RELAXED);
+        (void)wolfidps_futex_wake(&lock->state, INT_MAX);
     }
+    return 0;
+}
+
+/* link ent in ahead of i, or at the tail if i is NULL.  ent is fully
+ * linked before it becomes reachable from head, so that lockless readers
+ * walking forward never see a half-inserted ent.
+ */
+static void wolfidps_table_ent_link(struct wolfidps_table_ent_generic *ent, struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic *i) {
     if (i) {
         ent->generic.prev = i->generic.prev;
         ent->generic.next = i;
         if (i->generic.prev) {
-            i->generic.prev->generic.next = ent;
+            WOLFIDPS_ATOMIC_STORE_RELEASE(i->generic.prev->generic.next, ent);
         } else {
-            table->generic.head = ent;
+            WOLFIDPS_ATOMIC_STORE_RELEASE(table->generic.head, ent);
         }
         i->generic.prev = ent;
     } else if (table->generic.tail) {
-        table->generic.tail->generic.next = i;
         ent->generic.prev = table->generic.tail;
         ent->generic.next = NULL;
+        WOLFIDPS_ATOMIC_STORE_RELEASE(table->generic.tail->generic.next, ent);
         table->generic.tail = ent;
     } else {
-        table->generic.head = table->generic.tail = ent;
         ent->generic.prev = ent->generic.next = NULL;
+        table->generic.tail = ent;
+        WOLFIDPS_ATOMIC_STORE_RELEASE(table->generic.head, ent);
     }
 }
 
+int wolfidps_table_ent_insert(struct wolfidps_table_ent_generic *ent, struct wolfidps_table_generic *table) {
+    struct wolfidps_table_ent_generic *i = table->generic.head;
+    /* new ents go ahead of any with an equal key, so that runs of equal
+     * keys (e.g. wildcard endpoints) cost O(1) to extend.
+     */
+    while (i) {
+        if (table->generic.cmp_fn((struct wolfidps_ent_generic *)ent, (struct wolfidps_ent_generic *)i) >= 0)
+            break;
+        i = i->generic.next;
+    }
+    wolfidps_table_ent_link(ent, table, i);
+    return 0;
+}
+
+/* O(1) insert for a caller that already knows where ent belongs: right
+ * after prev, or at the head if prev is NULL.
+ */
+void wolfidps_table_ent_insert_after(struct wolfidps_table_ent_generic *ent, struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic *prev) {
+    wolfidps_table_ent_link(ent, table, prev ? prev->generic.next : table->generic.head);
+}
+
 int wolfidps_table_ent_get(struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic **ent) {
     struct wolfidps_table_ent_generic *i = table->generic.head;
     while (i) {
@@ -131,20 +321,23 @@ int wolfidps_table_ent_get(struct wolfidps_table_generic *table, struct wolfidps
             }
             return -1;
         }
+        i = i->generic.next;
     }
     return -1;
 }
 
+/* ent's own links are left intact, so that a lockless reader standing on
+ * it can still walk forward.  it must not be reused until retired.
+ */
 void wolfidps_table_ent_delete_1(struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic *ent) {
     if (ent->generic.prev)
-        ent->generic.prev->generic.next = ent->generic.next;
+        WOLFIDPS_ATOMIC_STORE_RELEASE(ent->generic.prev->generic.next, ent->generic.next);
     else
-        table->generic.head = ent->generic.next;
+        WOLFIDPS_ATOMIC_STORE_RELEASE(table->generic.head, ent->generic.next);
     if (ent->generic.next)
         ent->generic.next->generic.prev = ent->generic.prev;
     else
         table->generic.tail = ent->generic.prev;
-    ent->generic.prev = ent->generic.next = NULL;
 }
 
 int wolfidps_table_ent_delete(struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic **ent) {
@@ -159,13 +352,14 @@ int wolfidps_table_ent_delete(struct wolfidps_table_generic *table, struct wolfi
             }
             return -1;
         }
+        i = i->generic.next;
     }
     return -1;
 }
 
 int wolfidps_table_cursor_init(struct wolfidps_context *wolfidps, struct wolfidps_cursor **cursor) {
     if (*cursor == NULL)
-        *cursor = (struct wolfidps_cursor *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *cursor);
+        *cursor = (struct wolfidps_cursor *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof **cursor);
     if (*cursor == NULL)
         return MEMORY_E;
     memset(*cursor, 0, sizeof **cursor);
@@ -190,6 +384,7 @@ int wolfidps_table_cursor_set(struct wolfidps_table_generic *table, struct wolfi
                 *cursor_position = 1;
             return 0;
         }
+        i = i->generic.next;
     }
     cursor->point = table->generic.tail;
     *cursor_position = -1;
@@ -0,0 +1,358 @@
+#include "wolfidps_internal.h"
+
+#include <stdlib.h>
+
+/* vector matcher for compiled families with few rules.
+ *
+ * the rules of such a family are laid out in match order -- longest src
+ * prefix first, then as in the trie -- in blocks of
+ * WOLFIDPS_LINEAR_BLOCK_RULES, each block holding, per field, an array of
+ * values and one of masks.  a flow matches a lane if, for every field,
+ * the flow's value under the lane's mask equals the lane's value.  the
+ * fields are the first 128 bits of the src prefix, the proto, and the
+ * src and dst ports, which is a superset of what the trie path matches
+ * on, so each candidate is then checked with
+ * wolfidps_policy_rule_matches(), exactly as the trie path checks it, and
+ * the first to pass wins.  results are thus the same as the trie's.
+ */
+
+#ifndef WOLFIDPS_POLICY_LINEAR_MAX_RULES
+#define WOLFIDPS_POLICY_LINEAR_MAX_RULES 256 /* above this, families use the trie */
+#endif
+
+#define WOLFIDPS_LINEAR_BLOCK_RULES 8
+#define WOLFIDPS_LINEAR_FIELDS 6 /* 4 words of src prefix, proto, and src port << 16 | dst port */
+#define WOLFIDPS_LINEAR_BLOCK_WORDS (WOLFIDPS_LINEAR_FIELDS * 2 * WOLFIDPS_LINEAR_BLOCK_RULES)
+#define WOLFIDPS_LINEAR_MAX_PREFIX 128
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && ! defined(WOLFIDPS_NO_SIMD)
+#define WOLFIDPS_LINEAR_X86
+#include <immintrin.h>
+#endif
+
+/* the first block from block on with a candidate, whose lanes are set in
+ * *bits, or n_blocks if none.
+ */
+typedef uint32_t (*wolfidps_linear_scan_fn_t)(const uint32_t *blocks, uint32_t n_blocks, uint32_t block, const uint32_t *key, uint32_t *bits);
+
+struct wolfidps_policy_linear {
+    wolfidps_linear_scan_fn_t scan;
+    uint32_t n_rules, n_blocks;
+    uint32_t *rules; /* image rule index of each lane */
+    uint16_t *prefix_lens;
+    uint32_t *blocks;
+};
+
+static uint32_t wolfidps_linear_scan_scalar(const uint32_t *blocks, uint32_t n_blocks, uint32_t block, const uint32_t *key, uint32_t *bits) {
+    for (; block < n_blocks; ++block) {
+        const uint32_t *b = blocks + ((size_t)block * WOLFIDPS_LINEAR_BLOCK_WORDS);
+        uint32_t found = 0;
+        int j, f;
+        for (j = 0; j < WOLFIDPS_LINEAR_BLOCK_RULES; ++j) {
+            uint32_t miss = 0;
+            for (f = 0; f < WOLFIDPS_LINEAR_FIELDS; ++f)
+                miss |= (key[f] & b[((2 * f + 1) * WOLFIDPS_LINEAR_BLOCK_RULES) + j]) ^ b[(2 * f * WOLFIDPS_LINEAR_BLOCK_RULES) + j];
+            found |= (uint32_t)(miss == 0) << j;
+        }
+        if (found) {
+            *bits = found;
+            return block;
+        }
+    }
+    return n_blocks;
+}
+
+#ifdef WOLFIDPS_LINEAR_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t wolfidps_linear_scan_sse42(const uint32_t *blocks, uint32_t n_blocks, uint32_t block, const uint32_t *key, uint32_t *bits) {
+    __m128i k[WOLFIDPS_LINEAR_FIELDS];
+    int f, h;
+
+    for (f = 0; f < WOLFIDPS_LINEAR_FIELDS; ++f)
+        k[f] = _mm_set1_epi32((int)key[f]);
+    for (; block < n_blocks; ++block) {
+        const uint32_t *b = blocks + ((size_t)block * WOLFIDPS_LINEAR_BLOCK_WORDS);
+        uint32_t found = 0;
+        for (h = 0; h < WOLFIDPS_LINEAR_BLOCK_RULES; h += 4) {
+            __m128i hit = _mm_set1_epi32(-1);
+            for (f = 0; f < WOLFIDPS_LINEAR_FIELDS; ++f) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(b + (2 * f * WOLFIDPS_LINEAR_BLOCK_RULES) + h));
+                __m128i m = _mm_loadu_si128((const __m128i *)(b + ((2 * f + 1) * WOLFIDPS_LINEAR_BLOCK_RULES) + h));
+                hit = _mm_and_si128(hit, _mm_cmpeq_epi32(_mm_and_si128(k[f], m), v));
+            }
+            found |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(hit)) << h;
+        }
+        if (found) {
+            *bits = found;
+            return block;
+        }
+    }
+    return n_blocks;
+}
+
+__attribute__((target("avx2")))
+static uint32_t wolfidps_linear_scan_avx2(const uint32_t *blocks, uint32_t n_blocks, uint32_t block, const uint32_t *key, uint32_t *bits) {
+    __m256i k[WOLFIDPS_LINEAR_FIELDS];
+    int f;
+
+    for (f = 0; f < WOLFIDPS_LINEAR_FIELDS; ++f)
+        k[f] = _mm256_set1_epi32((int)key[f]);
+    for (; block < n_blocks; ++block) {
+        const uint32_t *b = blocks + ((size_t)block * WOLFIDPS_LINEAR_BLOCK_WORDS);
+        __m256i hit = _mm256_set1_epi32(-1);
+        uint32_t found;
+        for (f = 0; f < WOLFIDPS_LINEAR_FIELDS; ++f) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(b + (2 * f * WOLFIDPS_LINEAR_BLOCK_RULES)));
+            __m256i m = _mm256_loadu_si256((const __m256i *)(b + ((2 * f + 1) * WOLFIDPS_LINEAR_BLOCK_RULES)));
+            hit = _mm256_and_si256(hit, _mm256_cmpeq_epi32(_mm256_and_si256(k[f], m), v));
+        }
+        if ((found = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(hit)))) {
+            *bits = found;
+            return block;
+        }
+    }
+    return n_blocks;
+}
+
+#endif /* WOLFIDPS_LINEAR_X86 */
+
+/* kernel, or NULL if this build or cpu lacks it. */
+static wolfidps_linear_scan_fn_t wolfidps_linear_scan_get(wolfidps_linear_kernel_t kernel) {
+#ifdef WOLFIDPS_LINEAR_X86
+    __builtin_cpu_init();
+    if ((kernel == WOLFIDPS_LINEAR_KERNEL_AVX2) && __builtin_cpu_supports("avx2"))
+        return wolfidps_linear_scan_avx2;
+    if ((kernel == WOLFIDPS_LINEAR_KERNEL_SSE42) && __builtin_cpu_supports("sse4.2"))
+        return wolfidps_linear_scan_sse42;
+#endif
+    if (kernel == WOLFIDPS_LINEAR_KERNEL_SCALAR)
+        return wolfidps_linear_scan_scalar;
+    return NULL;
+}
+
+static wolfidps_linear_scan_fn_t wolfidps_linear_scan_select(void) {
+    wolfidps_linear_scan_fn_t scan;
+    if ((scan = wolfidps_linear_scan_get(WOLFIDPS_LINEAR_KERNEL_AVX2)) ||
+        (scan = wolfidps_linear_scan_get(WOLFIDPS_LINEAR_KERNEL_SSE42)))
+        return scan;
+    return wolfidps_linear_scan_scalar;
+}
+
+/* the first 128 bits of a prefix, as loaded from memory, with its mask. */
+static void wolfidps_linear_prefix_words(const u_char *prefix, unsigned int prefix_len, uint32_t *words, uint32_t *masks) {
+    u_char buf[WOLFIDPS_LINEAR_MAX_PREFIX / 8], mask[WOLFIDPS_LINEAR_MAX_PREFIX / 8];
+    unsigned int i;
+
+    memset(buf, 0, sizeof buf);
+    memset(mask, 0, sizeof mask);
+    memcpy(buf, prefix, WOLFIDPS_BITS_TO_BYTES(prefix_len));
+    for (i = 0; i < prefix_len; ++i)
+        mask[i >> 3] |= (u_char)(0x80 >> (i & 7));
+    for (i = 0; i < sizeof buf; ++i)
+        buf[i] &= mask[i];
+    memcpy(words, buf, sizeof buf);
+    memcpy(masks, mask, sizeof mask);
+}
+
+struct wolfidps_linear_ent {
+    uint32_t rule;
+    const struct wolfidps_policy_node *node;
+};
+
+static int wolfidps_linear_ent_cmp(const void *left, const void *right) {
+    const struct wolfidps_linear_ent *l = (const struct wolfidps_linear_ent *)left, *r = (const struct wolfidps_linear_ent *)right;
+    if (l->node->prefix_len != r->node->prefix_len)
+        return (l->node->prefix_len > r->node->prefix_len) ? -1 : 1;
+    return (l->rule < r->rule) ? -1 : (l->rule > r->rule);
+}
+
+/* gather the rules under root into ents, or return -1 if there are too
+ * many, or a prefix is too long.
+ */
+static int wolfidps_linear_gather(const struct wolfidps_policy_image *image, uint32_t root, struct wolfidps_linear_ent *ents, uint32_t *n_ents) {
+    uint32_t stack[WOLFIDPS_LINEAR_MAX_PREFIX + 2], n_stack = 0, i;
+
+    stack[n_stack++] = root;
+    while (n_stack > 0) {
+        const struct wolfidps_policy_node *node = &image->nodes[stack[--n_stack]];
+        if (node->prefix_len > WOLFIDPS_LINEAR_MAX_PREFIX)
+            return -1;
+        if (*n_ents + node->n_rules > WOLFIDPS_POLICY_LINEAR_MAX_RULES)
+            return -1;
+        for (i = 0; i < node->n_rules; ++i) {
+            ents[*n_ents].rule = node->rules + i;
+            ents[*n_ents].node = node;
+            ++*n_ents;
+        }
+        /* children are strictly longer, so a path holds at most
+         * WOLFIDPS_LINEAR_MAX_PREFIX + 1 nodes, and the stack one more
+         * than that.
+         */
+        if (n_stack + 2 > sizeof stack / sizeof stack[0])
+            return -1;
+        if (node->child[0])
+            stack[n_stack++] = node->child[0];
+        if (node->child[1])
+            stack[n_stack++] = node->child[1];
+    }
+    return 0;
+}
+
+static struct wolfidps_policy_linear *wolfidps_linear_build_family(struct wolfidps_context *wolfidps, const struct wolfidps_policy_image *image, uint32_t root, wolfidps_linear_scan_fn_t scan) {
+    struct wolfidps_linear_ent *ents;
+    struct wolfidps_policy_linear *linear = NULL;
+    uint32_t n_ents = 0, n_blocks, i;
+    size_t blocks_size, size;
+
+    ents = (struct wolfidps_linear_ent *)wolfidps->allocator.malloc(wolfidps->allocator.context, WOLFIDPS_POLICY_LINEAR_MAX_RULES * sizeof *ents);
+    if (ents == NULL)
+        return NULL;
+    if ((wolfidps_linear_gather(image, root, ents, &n_ents) < 0) || (n_ents == 0))
+        goto out;
+    qsort(ents, n_ents, sizeof *ents, wolfidps_linear_ent_cmp);
+
+    n_blocks = (n_ents + WOLFIDPS_LINEAR_BLOCK_RULES - 1) / WOLFIDPS_LINEAR_BLOCK_RULES;
+    blocks_size = (size_t)n_blocks * WOLFIDPS_LINEAR_BLOCK_WORDS * sizeof(uint32_t);
+    /* blocks first, for alignment. */
+    size = blocks_size + sizeof *linear + ((size_t)n_ents * (sizeof *linear->rules + sizeof *linear->prefix_lens));
+    if (wolfidps->allocator.memalign)
+        linear = (struct wolfidps_policy_linear *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, size);
+    else
+        linear = (struct wolfidps_policy_linear *)wolfidps->allocator.malloc(wolfidps->allocator.context, size);
+    if (linear == NULL)
+        goto out;
+    {
+        uint32_t *blocks = (uint32_t *)linear;
+        linear = (struct wolfidps_policy_linear *)((u_char *)blocks + blocks_size);
+        linear->blocks = blocks;
+    }
+    linear->scan = scan;
+    linear->n_rules = n_ents;
+    linear->n_blocks = n_blocks;
+    linear->rules = (uint32_t *)(linear + 1);
+    linear->prefix_lens = (uint16_t *)(linear->rules + n_ents);
+
+    /* padding lanes can never match: 0 under a 0 mask is never 1. */
+    memset(linear->blocks, 0, blocks_size);
+    for (i = n_ents; i < n_blocks * WOLFIDPS_LINEAR_BLOCK_RULES; ++i)
+        linear->blocks[((size_t)(i / WOLFIDPS_LINEAR_BLOCK_RULES) * WOLFIDPS_LINEAR_BLOCK_WORDS) + (i % WOLFIDPS_LINEAR_BLOCK_RULES)] = 1;
+
+    for (i = 0; i < n_ents; ++i) {
+        const struct wolfidps_policy_rule *rule = &image->rules[ents[i].rule];
+        uint32_t *b = linear->blocks + ((size_t)(i / WOLFIDPS_LINEAR_BLOCK_RULES) * WOLFIDPS_LINEAR_BLOCK_WORDS);
+        uint32_t words[4], masks[4], lane = i % WOLFIDPS_LINEAR_BLOCK_RULES;
+        wolfidps_route_flags_t flags;
+        int f;
+
+        flags.flags = rule->flags;
+        wolfidps_linear_prefix_words(image->prefixes + ents[i].node->prefix, ents[i].node->prefix_len, words, masks);
+        for (f = 0; f < 4; ++f) {
+            b[(2 * f * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] = words[f];
+            b[((2 * f + 1) * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] = masks[f];
+        }
+        if (! flags.sa_proto_wildcard) {
+            b[(8 * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] = rule->sa_proto;
+            b[(9 * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] = 0xffff;
+        }
+        if (! flags.sa_src_port_wildcard) {
+            b[(10 * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] |= (uint32_t)rule->src_port << 16;
+            b[(11 * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] |= 0xffff0000U;
+        }
+        if (! flags.sa_dst_port_wildcard) {
+            b[(10 * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] |= rule->dst_port;
+            b[(11 * WOLFIDPS_LINEAR_BLOCK_RULES) + lane] |= 0xffffU;
+        }
+        linear->rules[i] = ents[i].rule;
+        linear->prefix_lens[i] = ents[i].node->prefix_len;
+    }
+
+  out:
+    wolfidps->allocator.free(wolfidps->allocator.context, ents);
+    return linear;
+}
+
+/* build vector matchers for the families of image that are small enough.
+ * best effort -- a family with none uses the trie.
+ */
+void wolfidps_policy_linear_build(struct wolfidps_context *wolfidps, struct wolfidps_policy_image *image) {
+    wolfidps_linear_scan_fn_t scan;
+    int i;
+
+    if (image->n_families == 0)
+        return;
+    image->linear = (struct wolfidps_policy_linear **)wolfidps->allocator.malloc(wolfidps->allocator.context, (size_t)image->n_families * sizeof *image->linear);
+    if (image->linear == NULL)
+        return;
+    scan = wolfidps_linear_scan_select();
+    for (i = 0; i < image->n_families; ++i)
+        image->linear[i] = wolfidps_linear_build_family(wolfidps, image, image->families[i].root, scan);
+}
+
+void wolfidps_policy_linear_free(struct wolfidps_context *wolfidps, struct wolfidps_policy_image *image) {
+    int i;
+    if (image->linear == NULL)
+        return;
+    for (i = 0; i < image->n_families; ++i) {
+        if (image->linear[i])
+            wolfidps->allocator.free(wolfidps->allocator.context, image->linear[i]->blocks);
+    }
+    wolfidps->allocator.free(wolfidps->allocator.context, image->linear);
+    image->linear = NULL;
+}
+
+/* have the vector matchers of image scan with kernel rather than the
+ * best the cpu has, so that the kernels can be tested against each other.
+ * image must not be in use.
+ */
+int wolfidps_policy_linear_set_kernel(struct wolfidps_policy_image *image, wolfidps_linear_kernel_t kernel) {
+    wolfidps_linear_scan_fn_t scan = wolfidps_linear_scan_get(kernel);
+    int i;
+
+    if (scan == NULL)
+        return BAD_FUNC_ARG;
+    if (image->linear == NULL)
+        return 0;
+    for (i = 0; i < image->n_families; ++i) {
+        if (image->linear[i])
+            image->linear[i]->scan = scan;
+    }
+    return 0;
+}
+
+/* as for wolfidps_policy_match(), with linear the family's matcher. */
+int wolfidps_policy_linear_match(
+    const struct wolfidps_policy_image *image,
+    const struct wolfidps_policy_linear *linear,
+    const struct wolfidps_route_match_context *match,
+    uint32_t *rule,
+    unsigned int *prefix_len)
+{
+    const struct wolfidps_sockaddr *src = match->src, *dst = match->dst;
+    u_char addr[WOLFIDPS_LINEAR_MAX_PREFIX / 8];
+    uint32_t key[WOLFIDPS_LINEAR_FIELDS], block, bits;
+    unsigned int addr_bytes = WOLFIDPS_BITS_TO_BYTES(src->addr_len);
+
+    /* bits past addr_len are zero here, and the lengths are checked on
+     * each candidate.
+     */
+    memset(addr, 0, sizeof addr);
+    memcpy(addr, src->addr, (addr_bytes < sizeof addr) ? addr_bytes : sizeof addr);
+    memcpy(key, addr, sizeof addr);
+    key[4] = src->sa_proto;
+    key[5] = ((uint32_t)src->sa_port << 16) | dst->sa_port;
+
+    for (block = 0; (block = linear->scan(linear->blocks, linear->n_blocks, block, key, &bits)) < linear->n_blocks; ++block) {
+        for (; bits; bits &= bits - 1) {
+            uint32_t i = (block * WOLFIDPS_LINEAR_BLOCK_RULES) + (uint32_t)__builtin_ctz(bits);
+            if (linear->prefix_lens[i] > src->addr_len)
+                continue;
+            if (wolfidps_policy_rule_matches(image, &image->rules[linear->rules[i]], match)) {
+                *rule = linear->rules[i];
+                *prefix_len = linear->prefix_lens[i];
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,340 @@
+#include "wolfidps_internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* policy files -- see struct wolfidps_policy_header.
+ *
+ * a policy file is a policy image block, exactly as compiled, followed by
+ * records of the dynamic routes.  loading checks every index and offset
+ * in the block against its bounds, in one pass that reads but never writes
+ * it, and then uses it as is.
+ */
+
+#define WOLFIDPS_POLICY_MAX_PREFIX_LEN 256
+
+static int wolfidps_policy_name_check(uint32_t index, uint32_t n) {
+    return (index == WOLFIDPS_POLICY_NONE) || (index < n);
+}
+
+/* whether node hasn't been reached before, marking it reached. */
+static int wolfidps_policy_reach(uint64_t *reached, uint32_t node) {
+    uint64_t mask = (uint64_t)1 << (node & 63);
+    if (reached[node >> 6] & mask)
+        return 0;
+    reached[node >> 6] |= mask;
+    return 1;
+}
+
+/* the family roots and nodes.  children come after their parents, with
+ * longer prefixes, so that every descent terminates within
+ * WOLFIDPS_POLICY_MAX_DEPTH nodes, and every node is reached just once,
+ * so that a walk of the whole trie is linear in its size.
+ */
+static int wolfidps_policy_check_nodes(
+    const struct wolfidps_policy_header *header,
+    const struct wolfidps_policy_family *families,
+    const struct wolfidps_policy_node *nodes,
+    uint64_t prefixes_size,
+    uint64_t *reached)
+{
+    uint32_t i, k;
+
+    for (i = 0; i < header->n_families; ++i) {
+        if ((families[i].root >= header->n_nodes) || (! wolfidps_policy_reach(reached, families[i].root)))
+            return BAD_FUNC_ARG;
+    }
+    for (i = 0; i < header->n_nodes; ++i) {
+        if ((nodes[i].prefix_len > WOLFIDPS_POLICY_MAX_PREFIX_LEN) ||
+            ((uint64_t)nodes[i].prefix + WOLFIDPS_BITS_TO_BYTES(nodes[i].prefix_len) > prefixes_size) ||
+            ((uint64_t)nodes[i].rules + nodes[i].n_rules > header->n_rules))
+            return BAD_FUNC_ARG;
+        for (k = 0; k < 2; ++k) {
+            uint32_t child = nodes[i].child[k];
+            if ((child != 0) &&
+                ((child <= i) || (child >= header->n_nodes) || (nodes[child].prefix_len <= nodes[i].prefix_len) ||
+                 (! wolfidps_policy_reach(reached, child))))
+                return BAD_FUNC_ARG;
+        }
+    }
+    return 0;
+}
+
+static int wolfidps_policy_check(struct wolfidps_context *wolfidps, const struct wolfidps_policy_header *header, size_t size) {
+    const u_char *block = (const u_char *)header;
+    const struct wolfidps_policy_family *families;
+    const struct wolfidps_policy_node *nodes;
+    const struct wolfidps_policy_rule *rules;
+    const struct wolfidps_policy_name *names;
+    uint64_t prefixes_size, strings_size, offset, *reached;
+    uint32_t i;
+    int ret;
+
+    if (size < sizeof *header)
+        return BAD_FUNC_ARG;
+    if ((header->magic != WOLFIDPS_POLICY_MAGIC) ||
+        (header->version != WOLFIDPS_POLICY_VERSION) ||
+        (header->byte_order != WOLFIDPS_POLICY_BYTE_ORDER) ||
+        (header->size != size))
+        return BAD_FUNC_ARG;
+
+    /* sections in order, each aligned for its contents, and big enough. */
+    if ((header->families < sizeof *header) ||
+        (header->nodes < header->families) ||
+        (header->rules < header->nodes) ||
+        (header->names < header->rules) ||
+        (header->prefixes < header->names) ||
+        (header->strings < header->prefixes) ||
+        (header->records < header->strings) ||
+        (header->records > size))
+        return BAD_FUNC_ARG;
+    if ((header->families | header->nodes | header->rules | header->names | header->records) & 7)
+        return BAD_FUNC_ARG;
+    if (((uint64_t)header->n_families * sizeof *families > header->nodes - header->families) ||
+        ((uint64_t)header->n_nodes * sizeof *nodes > header->rules - header->nodes) ||
+        ((uint64_t)header->n_rules * sizeof *rules > header->names - header->rules) ||
+        (((uint64_t)header->n_events + header->n_actions) * sizeof *names > header->prefixes - header->names))
+        return BAD_FUNC_ARG;
+    prefixes_size = header->strings - header->prefixes;
+    strings_size = header->records - header->strings;
+
+    families = (const struct wolfidps_policy_family *)(block + header->families);
+    nodes = (const struct wolfidps_policy_node *)(block + header->nodes);
+    rules = (const struct wolfidps_policy_rule *)(block + header->rules);
+    names = (const struct wolfidps_policy_name *)(block + header->names);
+
+    /* a bit per node reached so far, from a family root or a parent. */
+    if ((reached = (uint64_t *)wolfidps->allocator.malloc(wolfidps->allocator.context, ((size_t)header->n_nodes / 64 + 1) * sizeof *reached)) == NULL)
+        return MEMORY_E;
+    memset(reached, 0, ((size_t)header->n_nodes / 64 + 1) * sizeof *reached);
+    ret = wolfidps_policy_check_nodes(header, families, nodes, prefixes_size, reached);
+    wolfidps->allocator.free(wolfidps->allocator.context, reached);
+    if (ret < 0)
+        return ret;
+    for (i = 0; i < header->n_rules; ++i) {
+        if (((uint64_t)rules[i].dst_prefix + WOLFIDPS_BITS_TO_BYTES(rules[i].dst_len) > prefixes_size) ||
+            (! wolfidps_policy_name_check(rules[i].event, header->n_events)) ||
+            (! wolfidps_policy_name_check(rules[i].action, header->n_actions)))
+            return BAD_FUNC_ARG;
+    }
+    for (i = 0; i < header->n_events + header->n_actions; ++i) {
+        if ((names[i].len > 255) || ((uint64_t)names[i].offset + names[i].len > strings_size))
+            return BAD_FUNC_ARG;
+    }
+
+    offset = header->records;
+    for (i = 0; i < header->n_records; ++i) {
+        const struct wolfidps_policy_record *record = (const struct wolfidps_policy_record *)(block + offset);
+        if ((size - offset < sizeof *record) ||
+            (size - offset < WOLFIDPS_POLICY_RECORD_SIZE(record->src_len, record->dst_len)) ||
+            (! wolfidps_policy_name_check(record->event, header->n_events)) ||
+            (! wolfidps_policy_name_check(record->action, header->n_actions)))
+            return BAD_FUNC_ARG;
+        offset += WOLFIDPS_POLICY_RECORD_SIZE(record->src_len, record->dst_len);
+    }
+    if (offset != size)
+        return BAD_FUNC_ARG;
+    return 0;
+}
+
+/* room for a sockaddr with a maximum-length address. */
+#define WOLFIDPS_POLICY_SOCKADDR_WORDS ((sizeof(struct wolfidps_sockaddr) + sizeof(wolfidps_address_mask_t) + 7) / 8)
+
+/* reinsert the routes with a ttl, less the time since export.  those that
+ * have expired since, or can no longer be inserted, are skipped.
+ */
+static void wolfidps_policy_restore(struct wolfidps_context *wolfidps, const struct wolfidps_policy_image *image, woldidps_time_t now) {
+    const struct wolfidps_policy_header *header = image->header;
+    const u_char *p = (const u_char *)header + header->records;
+    uint64_t src_buf[WOLFIDPS_POLICY_SOCKADDR_WORDS], dst_buf[WOLFIDPS_POLICY_SOCKADDR_WORDS];
+    struct wolfidps_sockaddr *src = (struct wolfidps_sockaddr *)src_buf, *dst = (struct wolfidps_sockaddr *)dst_buf;
+    uint32_t i;
+
+    for (i = 0; i < header->n_records; ++i) {
+        const struct wolfidps_policy_record *record = (const struct wolfidps_policy_record *)p;
+        const u_char *addr = (const u_char *)(record + 1);
+        woldidps_time_t ttl = wolfidps->timecbs.diff_time(now, (woldidps_time_t)record->expires);
+        struct wolfidps_event *event = NULL;
+        struct wolfidps_route *route;
+        wolfidps_route_flags_t flags;
+
+        p += WOLFIDPS_POLICY_RECORD_SIZE(record->src_len, record->dst_len);
+        if (ttl <= 0)
+            continue;
+
+        src->sa_family = dst->sa_family = record->sa_family;
+        src->sa_proto = dst->sa_proto = record->sa_proto;
+        src->sa_port = record->src_port;
+        dst->sa_port = record->dst_port;
+        src->if_id = record->src_if_id;
+        dst->if_id = record->dst_if_id;
+        src->addr_len = record->src_len;
+        dst->addr_len = record->dst_len;
+        memcpy(src->addr, addr, WOLFIDPS_BITS_TO_BYTES(record->src_len));
+        memcpy(dst->addr, addr + WOLFIDPS_BITS_TO_BYTES(record->src_len), WOLFIDPS_BITS_TO_BYTES(record->dst_len));
+        flags.flags = record->flags;
+
+        if ((record->event != WOLFIDPS_POLICY_NONE) &&
+            (wolfidps_event_getreference(wolfidps, (int)image->names[record->event].len, image->strings + image->names[record->event].offset, &event) < 0))
+            continue;
+        if (wolfidps_route_insert_1(wolfidps, src, dst, flags, event, (wolfidps_time_t)ttl, &route) < 0) {
+            if (event)
+                wolfidps_event_dropreference(wolfidps, event);
+            continue;
+        }
+        if ((record->action != WOLFIDPS_POLICY_NONE) && image->actions[record->action]) {
+            route->action = image->actions[record->action];
+            ++route->action->refcount;
+        }
+        if (! flags.dont_count)
+            wolfidps_counter_add(wolfidps, route->n_hits, record->n_hits);
+    }
+}
+
+/* install a block, which the context takes over on success. */
+static int wolfidps_policy_install(struct wolfidps_context *wolfidps, struct wolfidps_policy_header *header, size_t size, size_t map_len) {
+    struct wolfidps_policy_image *image;
+    woldidps_time_t now;
+    int ret;
+
+    if ((ret = wolfidps_policy_check(wolfidps, header, size)) < 0)
+        return ret;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0)
+        return -1;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((ret = wolfidps_policy_image_open(wolfidps, header, map_len, 0, 1, &image)) == 0) {
+        wolfidps_policy_replace(wolfidps, image);
+        wolfidps_policy_restore(wolfidps, image, now);
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+int wolfidps_policy_load_fd(struct wolfidps_context *wolfidps, int fd) {
+    struct stat st;
+    void *map;
+    size_t size;
+    int ret;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if ((st.st_size < (off_t)sizeof(struct wolfidps_policy_header)) || ((uint64_t)st.st_size > (size_t)~0UL))
+        return BAD_FUNC_ARG;
+    size = (size_t)st.st_size;
+    /* private and writable, so that deleting a rule copies just the page
+     * holding its dead flag.
+     */
+    if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        return -1;
+    if ((ret = wolfidps_policy_install(wolfidps, (struct wolfidps_policy_header *)map, size, size)) < 0)
+        (void)munmap(map, size);
+    return ret;
+}
+
+int wolfidps_policy_load(struct wolfidps_context *wolfidps, const void *buf, size_t len) {
+    struct wolfidps_policy_header *header;
+    int ret;
+
+    if ((buf == NULL) || (len < sizeof *header))
+        return BAD_FUNC_ARG;
+    if (wolfidps->allocator.memalign)
+        header = (struct wolfidps_policy_header *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, len);
+    else
+        header = (struct wolfidps_policy_header *)wolfidps->allocator.malloc(wolfidps->allocator.context, len);
+    if (header == NULL)
+        return MEMORY_E;
+    memcpy(header, buf, len);
+    if ((ret = wolfidps_policy_install(wolfidps, header, len, 0)) < 0)
+        wolfidps->allocator.free(wolfidps->allocator.context, header);
+    return ret;
+}
+
+static int wolfidps_policy_write(int fd, const u_char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* fsync the directory holding path, so that a rename into it is durable. */
+static int wolfidps_policy_sync_dir(struct wolfidps_context *wolfidps, const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? ((slash == path) ? 1 : (size_t)(slash - path)) : 0;
+    char *dir;
+    int fd, ret;
+
+    if (len == 0) {
+        path = ".";
+        len = 1;
+    }
+    if ((dir = (char *)wolfidps->allocator.malloc(wolfidps->allocator.context, len + 1)) == NULL)
+        return MEMORY_E;
+    memcpy(dir, path, len);
+    dir[len] = 0;
+    fd = open(dir, O_RDONLY);
+    wolfidps->allocator.free(wolfidps->allocator.context, dir);
+    if (fd < 0)
+        return -1;
+    ret = fsync(fd);
+    (void)close(fd);
+    return ret;
+}
+
+int wolfidps_policy_export(struct wolfidps_context *wolfidps, const char *path) {
+    struct wolfidps_policy_header *header;
+    woldidps_time_t now;
+    size_t path_len;
+    char *tmp_path;
+    int fd, ret = 0;
+
+    if (path == NULL)
+        return BAD_FUNC_ARG;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0)
+        return -1;
+    if (wolfidps_lock_readonly(&wolfidps->lock) < 0)
+        return -1;
+    header = wolfidps_policy_export_block(wolfidps, now);
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    if (header == NULL)
+        return MEMORY_E;
+
+    path_len = strlen(path);
+    if ((tmp_path = (char *)wolfidps->allocator.malloc(wolfidps->allocator.context, path_len + sizeof ".tmp")) == NULL) {
+        wolfidps->allocator.free(wolfidps->allocator.context, header);
+        return MEMORY_E;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof ".tmp");
+
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        ret = -1;
+    else {
+        if ((wolfidps_policy_write(fd, (const u_char *)header, (size_t)header->size) < 0) ||
+            (fsync(fd) < 0))
+            ret = -1;
+        if (close(fd) < 0)
+            ret = -1;
+        if ((ret == 0) && (rename(tmp_path, path) < 0))
+            ret = -1;
+        if (ret < 0)
+            (void)unlink(tmp_path);
+        else
+            ret = wolfidps_policy_sync_dir(wolfidps, path);
+    }
+
+    wolfidps->allocator.free(wolfidps->allocator.context, tmp_path);
+    wolfidps->allocator.free(wolfidps->allocator.context, header);
+    return ret;
+}
@@ -0,0 +1,920 @@
+#include "wolfidps_internal.h"
+
+#include <sys/mman.h>
+
+/* compiled policy image -- see struct wolfidps_policy_image.
+ *
+ * the image is built from the static routes sorted by { family, src
+ * prefix }, in which order every subtree of the patricia trie is a
+ * contiguous run, so that it can be laid out in one pass with no
+ * intermediate pointer structure.  once published it is never modified,
+ * except that deleting a rule sets its dead flag.  images are replaced
+ * wholesale, and retired via wolfidps_epoch_retire_cb().
+ *
+ * a rule compiled from a route keeps a pointer to it.  a rule loaded from
+ * a policy file (see persist.c) has none, and stays that way: later
+ * compiles carry it over as a rule, so a loaded policy never costs a
+ * route allocation per entry.
+ */
+
+/* a patricia path has strictly increasing prefix lengths. */
+#define WOLFIDPS_POLICY_MAX_DEPTH 257
+
+#define WOLFIDPS_POLICY_ALIGN(x) (((x) + (WOLFIDPS_CACHE_LINE_SIZE - 1)) & ~((size_t)WOLFIDPS_CACHE_LINE_SIZE - 1))
+
+/* a rule to be laid out: a static route, or a rule of the current image
+ * with no route.
+ */
+struct wolfidps_policy_src {
+    struct wolfidps_route *route; /* NULL for a rule with no route */
+    wolfidps_counter_id_t n_hits; /* its counter in the current image, for a rule with no route */
+    wolfidps_family_t sa_family;
+    unsigned int src_len;
+    const u_char *src_addr, *dst_addr;
+    const char *event, *action;
+    uint32_t event_len, action_len;
+    struct wolfidps_policy_rule rule; /* all but dst_prefix, event, and action */
+    uint32_t index; /* of its rule, once laid out */
+};
+
+/* event keywords or action labels, each laid out once, in order of first
+ * use, and found again by hash.
+ */
+struct wolfidps_policy_names {
+    const char **names;
+    uint32_t *lens;
+    uint32_t *slots; /* 1 + index, or 0 for empty */
+    uint32_t n, n_slots;
+    size_t n_bytes;
+};
+
+struct wolfidps_policy_build {
+    struct wolfidps_context *wolfidps;
+    struct wolfidps_policy_src *srcs; /* sorted */
+    size_t n_srcs;
+    struct wolfidps_route **records; /* routes with a ttl, for export */
+    size_t n_records;
+    struct wolfidps_policy_names events, actions;
+    struct wolfidps_policy_header *header; /* NULL while sizing */
+    struct wolfidps_policy_family *families;
+    struct wolfidps_policy_node *nodes;
+    struct wolfidps_policy_rule *rules;
+    u_char *prefixes, *record_buf;
+    int n_families;
+    uint32_t n_nodes, n_rules;
+    size_t n_prefix_bytes, n_record_bytes;
+    int ret;
+};
+
+static int wolfidps_policy_names_grow(struct wolfidps_context *wolfidps, struct wolfidps_policy_names *names) {
+    uint32_t n_slots = names->n_slots ? (names->n_slots << 1) : 16, i, j;
+    size_t size = ((size_t)(n_slots >> 1) * (sizeof(const char *) + sizeof(uint32_t))) + ((size_t)n_slots * sizeof(uint32_t));
+    const char **new_names = (const char **)wolfidps->allocator.malloc(wolfidps->allocator.context, size);
+    uint32_t *new_lens, *new_slots;
+
+    if (new_names == NULL)
+        return MEMORY_E;
+    new_lens = (uint32_t *)(new_names + (n_slots >> 1));
+    new_slots = new_lens + (n_slots >> 1);
+    memset(new_slots, 0, (size_t)n_slots * sizeof(uint32_t));
+    for (i = 0; i < names->n; ++i) {
+        new_names[i] = names->names[i];
+        new_lens[i] = names->lens[i];
+        for (j = wolfidps_name_hash(new_names[i], new_lens[i]) & (n_slots - 1); new_slots[j]; j = (j + 1) & (n_slots - 1))
+            ;
+        new_slots[j] = i + 1;
+    }
+    if (names->names)
+        wolfidps->allocator.free(wolfidps->allocator.context, (void *)names->names);
+    names->names = new_names;
+    names->lens = new_lens;
+    names->slots = new_slots;
+    names->n_slots = n_slots;
+    return 0;
+}
+
+/* the index of name, added if new, or WOLFIDPS_POLICY_NONE for NULL. */
+static int wolfidps_policy_names_add(struct wolfidps_context *wolfidps, struct wolfidps_policy_names *names, const char *name, uint32_t len, uint32_t *index) {
+    uint32_t j;
+    int ret;
+
+    if (name == NULL) {
+        *index = WOLFIDPS_POLICY_NONE;
+        return 0;
+    }
+    if ((names->n + 1 > (names->n_slots >> 1)) &&
+        ((ret = wolfidps_policy_names_grow(wolfidps, names)) < 0))
+        return ret;
+    for (j = wolfidps_name_hash(name, len) & (names->n_slots - 1); names->slots[j]; j = (j + 1) & (names->n_slots - 1)) {
+        uint32_t k = names->slots[j] - 1;
+        if ((names->lens[k] == len) && (! memcmp(names->names[k], name, len))) {
+            *index = k;
+            return 0;
+        }
+    }
+    *index = names->n++;
+    names->slots[j] = names->n;
+    names->names[*index] = name;
+    names->lens[*index] = len;
+    names->n_bytes += len;
+    return 0;
+}
+
+static void wolfidps_policy_names_free(struct wolfidps_context *wolfidps, struct wolfidps_policy_names *names) {
+    if (names->names)
+        wolfidps->allocator.free(wolfidps->allocator.context, (void *)names->names);
+    memset(names, 0, sizeof *names);
+}
+
+static void wolfidps_policy_src_from_route(struct wolfidps_policy_src *src, struct wolfidps_route *route) {
+    memset(src, 0, sizeof *src);
+    src->route = route;
+    src->sa_family = route->sa_family;
+    src->src_len = route->src.addr_len;
+    src->src_addr = WOLFIDPS_ROUTE_SRC_ADDR(route);
+    src->dst_addr = WOLFIDPS_ROUTE_DST_ADDR(route);
+    if (route->parent_event) {
+        src->event = route->parent_event->keyword;
+        src->event_len = route->parent_event->keyword_len;
+    }
+    if (route->action) {
+        src->action = route->action->label;
+        src->action_len = route->action->label_len;
+    }
+    src->rule.flags = route->flags.flags;
+    src->rule.sa_proto = route->sa_proto;
+    src->rule.src_port = route->src.sa_port;
+    src->rule.dst_port = route->dst.sa_port;
+    src->rule.dst_len = route->dst.addr_len;
+    src->rule.src_if_id = route->src.if_id;
+    src->rule.dst_if_id = route->dst.if_id;
+}
+
+/* the live rules of image with no route, in preorder, or just their count
+ * if srcs is NULL.
+ */
+static size_t wolfidps_policy_gather_rules(const struct wolfidps_policy_image *image, struct wolfidps_policy_src *srcs) {
+    uint32_t stack[WOLFIDPS_POLICY_MAX_DEPTH + 1], i;
+    size_t n = 0;
+    int f, n_stack;
+
+    for (f = 0; f < image->n_families; ++f) {
+        n_stack = 0;
+        stack[n_stack++] = image->families[f].root;
+        while (n_stack > 0) {
+            const struct wolfidps_policy_node *node = &image->nodes[stack[--n_stack]];
+            for (i = node->rules; i < node->rules + node->n_rules; ++i) {
+                const struct wolfidps_policy_rule *rule = &image->rules[i];
+                if (rule->dead || (image->routes && image->routes[i]))
+                    continue;
+                if (srcs) {
+                    struct wolfidps_policy_src *src = &srcs[n];
+                    memset(src, 0, sizeof *src);
+                    src->n_hits = image->counter_base + i;
+                    src->sa_family = image->families[f].sa_family;
+                    src->src_len = node->prefix_len;
+                    src->src_addr = image->prefixes + node->prefix;
+                    src->dst_addr = image->prefixes + rule->dst_prefix;
+                    if (rule->event != WOLFIDPS_POLICY_NONE) {
+                        src->event = image->strings + image->names[rule->event].offset;
+                        src->event_len = image->names[rule->event].len;
+                    }
+                    if (rule->action != WOLFIDPS_POLICY_NONE) {
+                        src->action = image->strings + image->names[image->n_events + rule->action].offset;
+                        src->action_len = image->names[image->n_events + rule->action].len;
+                    }
+                    src->rule = *rule;
+                }
+                ++n;
+            }
+            if (node->child[1])
+                stack[n_stack++] = node->child[1];
+            if (node->child[0])
+                stack[n_stack++] = node->child[0];
+        }
+    }
+    return n;
+}
+
+static int wolfidps_policy_src_cmp(const void *left, const void *right) {
+    const struct wolfidps_policy_src *l = (const struct wolfidps_policy_src *)left;
+    const struct wolfidps_policy_src *r = (const struct wolfidps_policy_src *)right;
+    wolfidps_route_flags_t l_flags, r_flags;
+    unsigned int min_len, common;
+    int cmp;
+
+    if (l->sa_family != r->sa_family)
+        return (l->sa_family < r->sa_family) ? -1 : 1;
+    min_len = (l->src_len < r->src_len) ? l->src_len : r->src_len;
+    common = wolfidps_addr_common_bits(l->src_addr, r->src_addr, 0, min_len);
+    if (common < min_len)
+        return wolfidps_addr_bit(l->src_addr, common) ? 1 : -1;
+    /* a prefix sorts ahead of its extensions. */
+    if (l->src_len != r->src_len)
+        return (l->src_len < r->src_len) ? -1 : 1;
+    /* as on trie node ent lists (see wolfidps_route_key_cmp()), descending
+     * by proto and then port, so that wildcard (zero) values come last.
+     */
+    if (l->rule.sa_proto != r->rule.sa_proto)
+        return (l->rule.sa_proto > r->rule.sa_proto) ? -1 : 1;
+    if (l->rule.src_port != r->rule.src_port)
+        return (l->rule.src_port > r->rule.src_port) ? -1 : 1;
+    /* keys that differ only on the dst side -- more specific first. */
+    if (l->rule.dst_len != r->rule.dst_len)
+        return (l->rule.dst_len > r->rule.dst_len) ? -1 : 1;
+    if ((cmp = memcmp(l->dst_addr, r->dst_addr, WOLFIDPS_BITS_TO_BYTES(l->rule.dst_len))))
+        return cmp;
+    l_flags.flags = l->rule.flags;
+    r_flags.flags = r->rule.flags;
+    if (l_flags.sa_dst_port_wildcard != r_flags.sa_dst_port_wildcard)
+        return l_flags.sa_dst_port_wildcard ? 1 : -1;
+    if (l->rule.dst_port != r->rule.dst_port)
+        return (l->rule.dst_port > r->rule.dst_port) ? -1 : 1;
+    return 0;
+}
+
+static void wolfidps_policy_build_rule(struct wolfidps_policy_build *build, struct wolfidps_policy_src *src) {
+    uint32_t index = build->n_rules++, event, action;
+    size_t dst_prefix = build->n_prefix_bytes;
+
+    build->n_prefix_bytes += WOLFIDPS_BITS_TO_BYTES(src->rule.dst_len);
+    if ((wolfidps_policy_names_add(build->wolfidps, &build->events, src->event, src->event_len, &event) < 0) ||
+        (wolfidps_policy_names_add(build->wolfidps, &build->actions, src->action, src->action_len, &action) < 0))
+        build->ret = MEMORY_E;
+    if (build->header) {
+        struct wolfidps_policy_rule *rule = &build->rules[index];
+        *rule = src->rule;
+        rule->dst_prefix = (uint32_t)dst_prefix;
+        rule->event = event;
+        rule->action = action;
+        rule->dead = 0;
+        memcpy(build->prefixes + dst_prefix, src->dst_addr, WOLFIDPS_BITS_TO_BYTES(src->rule.dst_len));
+        src->index = index;
+    }
+}
+
+/* lay out the subtree for srcs[lo, hi), all of one family, in preorder.
+ * its root prefix is the longest one common to the whole run, which, the
+ * run being sorted, is the one common to its first and last entries.
+ */
+static uint32_t wolfidps_policy_build_node(struct wolfidps_policy_build *build, size_t lo, size_t hi) {
+    const struct wolfidps_policy_src *first = &build->srcs[lo], *last = &build->srcs[hi - 1];
+    unsigned int min_len = (first->src_len < last->src_len) ? first->src_len : last->src_len;
+    unsigned int prefix_len = wolfidps_addr_common_bits(first->src_addr, last->src_addr, 0, min_len);
+    uint32_t index = build->n_nodes++, rules = build->n_rules, child[2];
+    size_t prefix = build->n_prefix_bytes, mid, split;
+
+    build->n_prefix_bytes += WOLFIDPS_BITS_TO_BYTES(prefix_len);
+
+    /* entries with exactly the common prefix sort first, then those that
+     * continue with a 0 bit, then those that continue with a 1.
+     */
+    for (mid = lo; (mid < hi) && (build->srcs[mid].src_len == prefix_len); ++mid)
+        wolfidps_policy_build_rule(build, &build->srcs[mid]);
+    for (split = mid; (split < hi) && (! wolfidps_addr_bit(build->srcs[split].src_addr, prefix_len)); ++split)
+        ;
+    child[0] = (split > mid) ? wolfidps_policy_build_node(build, mid, split) : 0;
+    child[1] = (hi > split) ? wolfidps_policy_build_node(build, split, hi) : 0;
+
+    if (build->header) {
+        struct wolfidps_policy_node *node = &build->nodes[index];
+        node->child[0] = child[0];
+        node->child[1] = child[1];
+        node->prefix = (uint32_t)prefix;
+        node->rules = rules;
+        node->n_rules = (uint32_t)(mid - lo);
+        node->prefix_len = (uint16_t)prefix_len;
+        memcpy(build->prefixes + prefix, first->src_addr, WOLFIDPS_BITS_TO_BYTES(prefix_len));
+        if (prefix_len & 7)
+            build->prefixes[prefix + (prefix_len >> 3)] &= (u_char)(0xff << (8 - (prefix_len & 7)));
+    }
+    return index;
+}
+
+static void wolfidps_policy_build_record(struct wolfidps_policy_build *build, struct wolfidps_route *route) {
+    struct wolfidps_context *wolfidps = build->wolfidps;
+    size_t offset = build->n_record_bytes;
+    uint32_t event, action;
+
+    build->n_record_bytes += WOLFIDPS_POLICY_RECORD_SIZE(route->src.addr_len, route->dst.addr_len);
+    if ((wolfidps_policy_names_add(wolfidps, &build->events,
+                                   route->parent_event ? route->parent_event->keyword : NULL,
+                                   route->parent_event ? route->parent_event->keyword_len : 0, &event) < 0) ||
+        (wolfidps_policy_names_add(wolfidps, &build->actions,
+                                   route->action ? route->action->label : NULL,
+                                   route->action ? route->action->label_len : 0, &action) < 0))
+        build->ret = MEMORY_E;
+    if (build->header) {
+        struct wolfidps_policy_record *record = (struct wolfidps_policy_record *)(build->record_buf + offset);
+        record->flags = route->flags.flags;
+        record->event = event;
+        record->action = action;
+        record->sa_family = route->sa_family;
+        record->sa_proto = route->sa_proto;
+        record->src_port = route->src.sa_port;
+        record->dst_port = route->dst.sa_port;
+        record->src_len = route->src.addr_len;
+        record->dst_len = route->dst.addr_len;
+        record->src_if_id = route->src.if_id;
+        record->dst_if_id = route->dst.if_id;
+        record->expires = (uint64_t)wolfidps->timecbs.add_time((woldidps_time_t)route->last_transition_time, (woldidps_time_t)route->ttl);
+        if (route->flags.dont_count || (wolfidps_counter_get(wolfidps, route->n_hits, &record->n_hits) < 0))
+            record->n_hits = 0;
+        memcpy(record + 1, route->addr_buf, WOLFIDPS_ROUTE_SRC_ADDR_BYTES(route) + WOLFIDPS_ROUTE_DST_ADDR_BYTES(route));
+    }
+}
+
+static void wolfidps_policy_build(struct wolfidps_policy_build *build) {
+    size_t lo, hi;
+    for (lo = 0; lo < build->n_srcs; lo = hi) {
+        uint32_t root;
+        for (hi = lo + 1; (hi < build->n_srcs) && (build->srcs[hi].sa_family == build->srcs[lo].sa_family); ++hi)
+            ;
+        root = wolfidps_policy_build_node(build, lo, hi);
+        if (build->header) {
+            build->families[build->n_families].sa_family = build->srcs[lo].sa_family;
+            build->families[build->n_families].root = root;
+        }
+        ++build->n_families;
+    }
+    for (lo = 0; lo < build->n_records; ++lo)
+        wolfidps_policy_build_record(build, build->records[lo]);
+}
+
+static void wolfidps_policy_build_names(struct wolfidps_policy_name *names, char *strings, size_t *offset, const struct wolfidps_policy_names *from) {
+    uint32_t i;
+    for (i = 0; i < from->n; ++i) {
+        names[i].offset = (uint32_t)*offset;
+        names[i].len = from->lens[i];
+        memcpy(strings + *offset, from->names[i], from->lens[i]);
+        *offset += from->lens[i];
+    }
+}
+
+/* lay out build->srcs and build->records as a new block, in two passes:
+ * the first only sizes it.
+ */
+static struct wolfidps_policy_header *wolfidps_policy_block_new(struct wolfidps_policy_build *build) {
+    struct wolfidps_context *wolfidps = build->wolfidps;
+    struct wolfidps_policy_header *header;
+    size_t families_off, nodes_off, rules_off, names_off, prefixes_off, strings_off, records_off, size, offset;
+    uint32_t n_names;
+
+    wolfidps_policy_build(build);
+    if (build->ret < 0)
+        return NULL;
+    n_names = build->events.n + build->actions.n;
+
+    families_off = WOLFIDPS_POLICY_ALIGN(sizeof *header);
+    nodes_off = families_off + WOLFIDPS_POLICY_ALIGN((size_t)build->n_families * sizeof(struct wolfidps_policy_family));
+    rules_off = nodes_off + WOLFIDPS_POLICY_ALIGN((size_t)build->n_nodes * sizeof(struct wolfidps_policy_node));
+    names_off = rules_off + WOLFIDPS_POLICY_ALIGN((size_t)build->n_rules * sizeof(struct wolfidps_policy_rule));
+    prefixes_off = names_off + WOLFIDPS_POLICY_ALIGN((size_t)n_names * sizeof(struct wolfidps_policy_name));
+    strings_off = prefixes_off + WOLFIDPS_POLICY_ALIGN(build->n_prefix_bytes);
+    records_off = strings_off + WOLFIDPS_POLICY_ALIGN(build->events.n_bytes + build->actions.n_bytes);
+    size = records_off + build->n_record_bytes;
+    if ((build->n_prefix_bytes > (uint32_t)~0U) || (build->events.n_bytes + build->actions.n_bytes > (uint32_t)~0U))
+        return NULL;
+
+    if (wolfidps->allocator.memalign)
+        header = (struct wolfidps_policy_header *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, size);
+    else
+        header = (struct wolfidps_policy_header *)wolfidps->allocator.malloc(wolfidps->allocator.context, size);
+    if (header == NULL)
+        return NULL;
+    memset(header, 0, size);
+    header->magic = WOLFIDPS_POLICY_MAGIC;
+    header->version = WOLFIDPS_POLICY_VERSION;
+    header->byte_order = WOLFIDPS_POLICY_BYTE_ORDER;
+    header->n_families = (uint32_t)build->n_families;
+    header->n_nodes = build->n_nodes;
+    header->n_rules = build->n_rules;
+    header->n_events = build->events.n;
+    header->n_actions = build->actions.n;
+    header->n_records = (uint32_t)build->n_records;
+    header->size = size;
+    header->families = families_off;
+    header->nodes = nodes_off;
+    header->rules = rules_off;
+    header->names = names_off;
+    header->prefixes = prefixes_off;
+    header->strings = strings_off;
+    header->records = records_off;
+
+    build->header = header;
+    build->families = (struct wolfidps_policy_family *)((u_char *)header + families_off);
+    build->nodes = (struct wolfidps_policy_node *)((u_char *)header + nodes_off);
+    build->rules = (struct wolfidps_policy_rule *)((u_char *)header + rules_off);
+    build->prefixes = (u_char *)header + prefixes_off;
+    build->record_buf = (u_char *)header + records_off;
+    build->n_families = 0;
+    build->n_nodes = build->n_rules = 0;
+    build->n_prefix_bytes = build->n_record_bytes = 0;
+    wolfidps_policy_build(build);
+
+    offset = 0;
+    wolfidps_policy_build_names((struct wolfidps_policy_name *)((u_char *)header + names_off), (char *)header + strings_off, &offset, &build->events);
+    wolfidps_policy_build_names((struct wolfidps_policy_name *)((u_char *)header + names_off) + build->events.n, (char *)header + strings_off, &offset, &build->actions);
+    return header;
+}
+
+/* static routes with extra ports or a rate limit are left in the trie,
+ * which alone matches them.  so are those keyed on their dst prefix, which
+ * the image, indexed by src prefix only, would match in the wrong order.
+ */
+static int wolfidps_policy_route_is_compilable(const struct wolfidps_route *route) {
+    return (route->ttl == WOLFIDPS_TIME_NEVER) &&
+        (route->ent.ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) &&
+        wolfidps_route_is_packable(route);
+}
+
+/* every static route, and every live rule of the current image with no
+ * route, sorted for wolfidps_policy_build().
+ */
+static int wolfidps_policy_gather(struct wolfidps_context *wolfidps, struct wolfidps_policy_src **srcs, size_t *n_srcs) {
+    struct wolfidps_policy_image *image = wolfidps->policy;
+    struct wolfidps_route *route;
+    size_t n = 0, i = 0;
+
+    /* the eviction ring holds every route, compiled or not. */
+    if ((route = wolfidps->routes.clock_hand)) {
+        do {
+            if (wolfidps_policy_route_is_compilable(route))
+                ++n;
+            route = route->clock_next;
+        } while (route != wolfidps->routes.clock_hand);
+    }
+    if (image)
+        n += wolfidps_policy_gather_rules(image, NULL);
+
+    *srcs = NULL;
+    *n_srcs = n;
+    if (n == 0)
+        return 0;
+    if ((*srcs = (struct wolfidps_policy_src *)wolfidps->allocator.malloc(wolfidps->allocator.context, n * sizeof **srcs)) == NULL)
+        return MEMORY_E;
+    if (route) {
+        do {
+            if (wolfidps_policy_route_is_compilable(route))
+                wolfidps_policy_src_from_route(&(*srcs)[i++], route);
+            route = route->clock_next;
+        } while (route != wolfidps->routes.clock_hand);
+    }
+    if (image)
+        (void)wolfidps_policy_gather_rules(image, *srcs + i);
+    qsort(*srcs, n, sizeof **srcs, wolfidps_policy_src_cmp);
+    return 0;
+}
+
+/* ++refcount on the registered action labeled name, if any. */
+static struct wolfidps_action *wolfidps_policy_action_get(struct wolfidps_context *wolfidps, const char *name, uint32_t len) {
+    struct wolfidps_action *action = wolfidps_action_get(wolfidps, (int)len, name);
+    if (action)
+        ++action->refcount;
+    return action;
+}
+
+/* retire callback. */
+void wolfidps_policy_image_free(struct wolfidps_context *wolfidps, void *ptr) {
+    struct wolfidps_policy_image *image = (struct wolfidps_policy_image *)ptr;
+    uint32_t i;
+
+    for (i = 0; i < image->n_events; ++i) {
+        if (image->events[i])
+            wolfidps_event_dropreference(wolfidps, image->events[i]);
+    }
+    for (i = 0; i < image->n_actions; ++i) {
+        if (image->actions[i])
+            (void)wolfidps_action_dropreference(wolfidps, image->actions[i]);
+    }
+    wolfidps_counter_release_range(wolfidps, image->counter_base, image->n_rules);
+    wolfidps_policy_linear_free(wolfidps, image);
+    if (image->map_len)
+        (void)munmap(image->header, image->map_len);
+    else
+        wolfidps->allocator.free(wolfidps->allocator.context, image->header);
+    wolfidps->allocator.free(wolfidps->allocator.context, image);
+}
+
+/* wrap a block, which must already have been checked, in a new image,
+ * which takes ownership of it.  with_routes gives it a routes[] to fill
+ * in; with_counters gives its rules with no route their counters.
+ */
+int wolfidps_policy_image_open(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_policy_header *header,
+    size_t map_len,
+    int with_routes,
+    int with_counters,
+    struct wolfidps_policy_image **image_out)
+{
+    struct wolfidps_policy_image *image;
+    size_t size = sizeof *image + ((size_t)(header->n_events + header->n_actions) * sizeof(void *));
+    uint32_t i;
+    int ret;
+
+    if (with_routes)
+        size += (size_t)header->n_rules * sizeof(struct wolfidps_route *);
+    if ((image = (struct wolfidps_policy_image *)wolfidps->allocator.malloc(wolfidps->allocator.context, size)) == NULL)
+        return MEMORY_E;
+    memset(image, 0, size);
+    image->header = header;
+    image->map_len = map_len;
+    image->n_families = (int)header->n_families;
+    image->n_nodes = header->n_nodes;
+    image->n_rules = header->n_rules;
+    image->families = (struct wolfidps_policy_family *)((u_char *)header + header->families);
+    image->nodes = (struct wolfidps_policy_node *)((u_char *)header + header->nodes);
+    image->rules = (struct wolfidps_policy_rule *)((u_char *)header + header->rules);
+    image->names = (struct wolfidps_policy_name *)((u_char *)header + header->names);
+    image->prefixes = (u_char *)header + header->prefixes;
+    image->strings = (const char *)header + header->strings;
+    image->events = (struct wolfidps_event **)(image + 1);
+    image->actions = (struct wolfidps_action **)(image->events + header->n_events);
+    if (with_routes)
+        image->routes = (struct wolfidps_route **)(image->actions + header->n_actions);
+
+    /* n_events and n_actions only count what has been resolved, so that
+     * a failure part way can be unwound by wolfidps_policy_image_free().
+     */
+    for (i = 0; i < header->n_events; ++i) {
+        if ((ret = wolfidps_event_getreference(wolfidps, (int)image->names[i].len, image->strings + image->names[i].offset, &image->events[i])) < 0)
+            goto fail;
+        ++image->n_events;
+    }
+    for (i = 0; i < header->n_actions; ++i) {
+        image->actions[i] = wolfidps_policy_action_get(wolfidps, image->strings + image->names[header->n_events + i].offset, image->names[header->n_events + i].len);
+        ++image->n_actions;
+    }
+    if (with_counters && (header->n_rules > 0) &&
+        ((ret = wolfidps_counter_alloc_range(wolfidps, header->n_rules, &image->counter_base)) < 0))
+        goto fail;
+    wolfidps_policy_linear_build(wolfidps, image);
+
+    *image_out = image;
+    return 0;
+
+  fail:
+    for (i = 0; i < image->n_events; ++i)
+        wolfidps_event_dropreference(wolfidps, image->events[i]);
+    for (i = 0; i < image->n_actions; ++i) {
+        if (image->actions[i])
+            (void)wolfidps_action_dropreference(wolfidps, image->actions[i]);
+    }
+    wolfidps->allocator.free(wolfidps->allocator.context, image);
+    return ret;
+}
+
+/* publish image in place of the current one, which is retired. */
+static void wolfidps_policy_publish(struct wolfidps_context *wolfidps, struct wolfidps_policy_image *image) {
+    struct wolfidps_policy_image *old = wolfidps->policy;
+    WOLFIDPS_ATOMIC_STORE_RELEASE(wolfidps->policy, image);
+    wolfidps_route_table_changed(&wolfidps->routes);
+    if (old)
+        wolfidps_epoch_retire_cb(wolfidps, old, wolfidps_policy_image_free);
+}
+
+int wolfidps_policy_compile(struct wolfidps_context *wolfidps) {
+    struct wolfidps_policy_build build;
+    struct wolfidps_policy_image *image = NULL;
+    struct wolfidps_policy_header *header;
+    struct wolfidps_policy_src *srcs = NULL;
+    size_t n_srcs, n_routes = 0, i;
+    int ret;
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    memset(&build, 0, sizeof build);
+
+    if ((ret = wolfidps_policy_gather(wolfidps, &srcs, &n_srcs)) < 0)
+        goto out;
+    if (n_srcs > 0) {
+        build.wolfidps = wolfidps;
+        build.srcs = srcs;
+        build.n_srcs = n_srcs;
+        if ((header = wolfidps_policy_block_new(&build)) == NULL) {
+            ret = MEMORY_E;
+            goto out;
+        }
+        for (i = 0; i < n_srcs; ++i) {
+            if (srcs[i].route)
+                ++n_routes;
+        }
+        if ((ret = wolfidps_policy_image_open(wolfidps, header, 0, n_routes > 0, n_routes < n_srcs, &image)) < 0) {
+            wolfidps->allocator.free(wolfidps->allocator.context, header);
+            goto out;
+        }
+        for (i = 0; i < n_srcs; ++i) {
+            struct wolfidps_route *route = srcs[i].route;
+            if (route) {
+                image->routes[srcs[i].index] = route;
+                route->policy_rule = srcs[i].index;
+            } else {
+                wolfidps_count_t count;
+                if (wolfidps_counter_get(wolfidps, srcs[i].n_hits, &count) == 0)
+                    wolfidps_counter_add(wolfidps, image->counter_base + srcs[i].index, count);
+            }
+        }
+    }
+
+    /* publish the new image before taking the newly compiled routes out of
+     * the trie, so that readers always find them in one or the other.
+     */
+    wolfidps_policy_publish(wolfidps, image);
+    for (i = 0; i < n_srcs; ++i) {
+        struct wolfidps_route *route = srcs[i].route;
+        if ((route == NULL) || route->compiled)
+            continue;
+        wolfidps_route_trie_delete_1(wolfidps, &wolfidps->routes, &route->ent);
+        route->compiled = 1;
+    }
+
+  out:
+    wolfidps_policy_names_free(wolfidps, &build.events);
+    wolfidps_policy_names_free(wolfidps, &build.actions);
+    if (srcs)
+        wolfidps->allocator.free(wolfidps->allocator.context, srcs);
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+/* a new block holding the whole static policy, as for a compile, along
+ * with every unexpired, packable route with a ttl.  the caller holds the
+ * table lock, and frees the block.
+ */
+struct wolfidps_policy_header *wolfidps_policy_export_block(struct wolfidps_context *wolfidps, woldidps_time_t now) {
+    struct wolfidps_policy_build build;
+    struct wolfidps_policy_header *header = NULL;
+    struct wolfidps_route *route;
+    size_t n_records = 0;
+
+    memset(&build, 0, sizeof build);
+    build.wolfidps = wolfidps;
+    if (wolfidps_policy_gather(wolfidps, &build.srcs, &build.n_srcs) < 0)
+        return NULL;
+
+    if ((route = wolfidps->routes.clock_hand)) {
+        do {
+            if ((route->ttl != WOLFIDPS_TIME_NEVER) && (now - (woldidps_time_t)route->last_transition_time < (woldidps_time_t)route->ttl) &&
+                wolfidps_route_is_packable(route))
+                ++n_records;
+            route = route->clock_next;
+        } while (route != wolfidps->routes.clock_hand);
+    }
+    if (n_records > 0) {
+        if ((build.records = (struct wolfidps_route **)wolfidps->allocator.malloc(wolfidps->allocator.context, n_records * sizeof *build.records)) == NULL)
+            goto out;
+        do {
+            if ((route->ttl != WOLFIDPS_TIME_NEVER) && (now - (woldidps_time_t)route->last_transition_time < (woldidps_time_t)route->ttl) &&
+                wolfidps_route_is_packable(route))
+                build.records[build.n_records++] = route;
+            route = route->clock_next;
+        } while (route != wolfidps->routes.clock_hand);
+    }
+
+    header = wolfidps_policy_block_new(&build);
+
+  out:
+    wolfidps_policy_names_free(wolfidps, &build.events);
+    wolfidps_policy_names_free(wolfidps, &build.actions);
+    if (build.records)
+        wolfidps->allocator.free(wolfidps->allocator.context, build.records);
+    if (build.srcs)
+        wolfidps->allocator.free(wolfidps->allocator.context, build.srcs);
+    return header;
+}
+
+/* make image the whole static policy: every static route goes, compiled
+ * or not, and image replaces the current image.
+ */
+void wolfidps_policy_replace(struct wolfidps_context *wolfidps, struct wolfidps_policy_image *image) {
+    struct wolfidps_route *route = wolfidps->routes.clock_hand, *next;
+    long n = wolfidps->routes.n_routes;
+
+    for (; n > 0; --n, route = next) {
+        next = route->clock_next;
+        if (route->ttl == WOLFIDPS_TIME_NEVER)
+            (void)wolfidps_route_delete_1(wolfidps, route);
+    }
+    wolfidps_policy_publish(wolfidps, image);
+}
+
+static const struct wolfidps_policy_family *wolfidps_policy_family_get(const struct wolfidps_policy_image *image, wolfidps_family_t sa_family) {
+    int i;
+    for (i = 0; i < image->n_families; ++i) {
+        if (image->families[i].sa_family == sa_family)
+            return &image->families[i];
+    }
+    return NULL;
+}
+
+/* as for wolfidps_route_matches(), on the packed rule.  static routes
+ * have no ttl.
+ */
+int wolfidps_policy_rule_matches(const struct wolfidps_policy_image *image, const struct wolfidps_policy_rule *rule, const struct wolfidps_route_match_context *match) {
+    const struct wolfidps_sockaddr *src = match->src, *dst = match->dst;
+    wolfidps_route_flags_t flags;
+
+    if (rule->dead)
+        return 0;
+    flags.flags = rule->flags;
+    if ((! flags.sa_proto_wildcard) && (rule->sa_proto != src->sa_proto))
+        return 0;
+    if ((! flags.sa_src_port_wildcard) && (rule->src_port != src->sa_port))
+        return 0;
+    if ((! flags.sa_dst_port_wildcard) && (rule->dst_port != dst->sa_port))
+        return 0;
+    if ((! flags.src_if_id_wildcard) && (rule->src_if_id != src->if_id))
+        return 0;
+    if ((! flags.dst_if_id_wildcard) && (rule->dst_if_id != dst->if_id))
+        return 0;
+    if ((! flags.sa_dst_addr_wildcard) &&
+        ((dst->addr_len < rule->dst_len) ||
+         (! wolfidps_addr_prefix_match(dst->addr, image->prefixes + rule->dst_prefix, rule->dst_len))))
+        return 0;
+    return 1;
+}
+
+/* whether rule comes ahead of route, a src-keyed route on the same src
+ * prefix, in wolfidps_route_key_cmp() order.
+ */
+int wolfidps_policy_rule_precedes(const struct wolfidps_policy_rule *rule, const struct wolfidps_route *route) {
+    if (rule->sa_proto != route->sa_proto)
+        return rule->sa_proto > route->sa_proto;
+    if (rule->src_port != route->src.sa_port)
+        return rule->src_port > route->src.sa_port;
+    if (rule->dst_len != route->dst.addr_len)
+        return rule->dst_len > route->dst.addr_len;
+    return rule->dst_port > route->dst.sa_port;
+}
+
+/* longest-prefix match of match->src within one family, by the family's
+ * vector matcher if it has one.  otherwise, the descent only tests branch
+ * bits, noting the nodes with rules on the way down; prefixes
+ * are then checked deepest first, and once one matches, all of its
+ * ancestors do too.
+ */
+int wolfidps_policy_match(
+    const struct wolfidps_policy_image *image,
+    wolfidps_family_t sa_family,
+    const struct wolfidps_route_match_context *match,
+    uint32_t *rule,
+    unsigned int *prefix_len)
+{
+    const struct wolfidps_sockaddr *src = match->src;
+    const struct wolfidps_policy_family *family;
+    const struct wolfidps_policy_node *node;
+    uint32_t path[WOLFIDPS_POLICY_MAX_DEPTH], index, i;
+    int n_path = 0, verified = 0;
+
+    if ((family = wolfidps_policy_family_get(image, sa_family)) == NULL)
+        return -1;
+    if (image->linear && image->linear[family - image->families])
+        return wolfidps_policy_linear_match(image, image->linear[family - image->families], match, rule, prefix_len);
+
+    for (index = family->root; ; ) {
+        node = &image->nodes[index];
+        if (node->prefix_len > src->addr_len)
+            break;
+        if (node->n_rules)
+            path[n_path++] = index;
+        if (node->prefix_len == src->addr_len)
+            break;
+        if ((index = node->child[wolfidps_addr_bit(src->addr, node->prefix_len)]) == 0)
+            break;
+    }
+
+    while (--n_path >= 0) {
+        node = &image->nodes[path[n_path]];
+        if (! verified) {
+            if (! wolfidps_addr_prefix_match(src->addr, image->prefixes + node->prefix, node->prefix_len))
+                continue;
+            verified = 1;
+        }
+        for (i = node->rules; i < node->rules + node->n_rules; ++i) {
+            if (wolfidps_policy_rule_matches(image, &image->rules[i], match)) {
+                *rule = i;
+                *prefix_len = node->prefix_len;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/* the live rule keyed exactly as key, with event event_label -- the
+ * counterpart of wolfidps_route_key_eq() and wolfidps_route_event_eq().
+ */
+int wolfidps_policy_find(const struct wolfidps_policy_image *image, const struct wolfidps_route *key, int event_label_len, const char *event_label, uint32_t *rule) {
+    const struct wolfidps_policy_family *family;
+    const struct wolfidps_policy_node *node;
+    wolfidps_route_flags_t key_flags = key->flags, flags;
+    uint32_t index, i;
+
+    if ((family = wolfidps_policy_family_get(image, key->sa_family)) == NULL)
+        return -1;
+    for (index = family->root; ; ) {
+        node = &image->nodes[index];
+        if (node->prefix_len > key->src.addr_len)
+            return -1;
+        if (node->prefix_len == key->src.addr_len)
+            break;
+        if ((index = node->child[wolfidps_addr_bit(WOLFIDPS_ROUTE_SRC_ADDR(key), node->prefix_len)]) == 0)
+            return -1;
+    }
+    if (memcmp(WOLFIDPS_ROUTE_SRC_ADDR(key), image->prefixes + node->prefix, WOLFIDPS_ROUTE_SRC_ADDR_BYTES(key)))
+        return -1;
+
+    key_flags.dont_count = 0;
+    for (i = node->rules; i < node->rules + node->n_rules; ++i) {
+        const struct wolfidps_policy_rule *r = &image->rules[i];
+        flags.flags = r->flags;
+        flags.dont_count = 0;
+        if (r->dead ||
+            (flags.flags != key_flags.flags) ||
+            (r->sa_proto != key->sa_proto) ||
+            (r->src_port != key->src.sa_port) ||
+            (r->src_if_id != key->src.if_id) ||
+            (r->dst_port != key->dst.sa_port) ||
+            (r->dst_len != key->dst.addr_len) ||
+            (r->dst_if_id != key->dst.if_id) ||
+            memcmp(WOLFIDPS_ROUTE_DST_ADDR(key), image->prefixes + r->dst_prefix, WOLFIDPS_ROUTE_DST_ADDR_BYTES(key)))
+            continue;
+        if (r->event == WOLFIDPS_POLICY_NONE) {
+            if (event_label != NULL)
+                continue;
+        } else if ((event_label == NULL) ||
+                   (image->names[r->event].len != (uint32_t)event_label_len) ||
+                   memcmp(image->strings + image->names[r->event].offset, event_label, (size_t)event_label_len))
+            continue;
+        *rule = i;
+        return 0;
+    }
+    return -1;
+}
+
+/* stop matching a rule. */
+void wolfidps_policy_rule_delete(struct wolfidps_context *wolfidps, uint32_t rule) {
+    struct wolfidps_policy_image *image = wolfidps->policy;
+    WOLFIDPS_ATOMIC_STORE_RELEASE(image->rules[rule].dead, 1);
+    ++image->n_dead;
+    wolfidps_route_table_changed(&wolfidps->routes);
+}
+
+/* delete every compiled route, and drop the image. */
+void wolfidps_policy_flush(struct wolfidps_context *wolfidps) {
+    struct wolfidps_policy_image *image = wolfidps->policy;
+    uint32_t i;
+
+    if (image == NULL)
+        return;
+    if (image->routes) {
+        for (i = 0; i < image->n_rules; ++i) {
+            if ((! image->rules[i].dead) && image->routes[i])
+                (void)wolfidps_route_delete_1(wolfidps, image->routes[i]);
+        }
+    }
+    wolfidps_policy_publish(wolfidps, NULL);
+}
+
+/* as for wolfidps_route_dispatch_1(), for a rule with no route.  its
+ * action handler, if any, is passed a NULL route.
+ */
+int wolfidps_policy_dispatch_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    const struct wolfidps_policy_image *image,
+    uint32_t rule,
+    woldidps_time_t now,
+    void *context,
+    wolfidps_disposition_t *disposition,
+    wolfidps_time_t *ttl)
+{
+    const struct wolfidps_policy_rule *r = &image->rules[rule];
+    struct wolfidps_event *event = (r->event != WOLFIDPS_POLICY_NONE) ? image->events[r->event] : NULL;
+    struct wolfidps_action *action = (r->action != WOLFIDPS_POLICY_NONE) ? image->actions[r->action] : NULL;
+    wolfidps_route_flags_t flags;
+
+    flags.flags = r->flags;
+    if (! flags.dont_count) {
+        wolfidps_counter_inc(wolfidps, slot, image->counter_base + rule);
+        if (event)
+            wolfidps_counter_inc(wolfidps, slot, event->hitcount);
+        if (action)
+            wolfidps_counter_inc(wolfidps, slot, action->hitcount);
+    }
+
+    *disposition = WOLFIDPS_REJECT;
+    if (action && wolfidps_action_is_coalesced(action))
+        (void)wolfidps_action_coalesce(wolfidps, slot, action, event, NULL, rule, now);
+    else if (action && action->handler && wolfidps_action_is_queued(wolfidps, action))
+        (void)wolfidps_action_queue_push(wolfidps, slot, action, event, NULL, context, NULL);
+    else if (action && action->handler) {
+        wolfidps_disposition_t *action_disposition = action->handler(action->handler_context, context, event, NULL);
+        if (action_disposition)
+            *disposition = *action_disposition;
+    }
+    if (ttl)
+        *ttl = WOLFIDPS_TIME_NEVER;
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "wolfidps_internal.h"
+
+/* port sets -- the extra ports of a route endpoint.  see
+ * wolfidps_route_set_extra_ports().
+ *
+ * the ranges given are sorted and merged.  a set of up to
+ * WOLFIDPS_PORT_SET_MAX_RANGES ranges keeps them, and is bisected; past
+ * that it becomes a bitmap of all the ports instead, so that a blocklist
+ * of hundreds of scattered ports costs one load to test.
+ */
+
+#ifndef WOLFIDPS_PORT_SET_MAX_RANGES
+#define WOLFIDPS_PORT_SET_MAX_RANGES 64
+#endif
+
+static int wolfidps_port_range_cmp(const void *left, const void *right) {
+    const struct wolfidps_port_range *l = (const struct wolfidps_port_range *)left;
+    const struct wolfidps_port_range *r = (const struct wolfidps_port_range *)right;
+    if (l->lo != r->lo)
+        return (l->lo < r->lo) ? -1 : 1;
+    if (l->hi != r->hi)
+        return (l->hi < r->hi) ? -1 : 1;
+    return 0;
+}
+
+int wolfidps_port_set_new(struct wolfidps_context *wolfidps, int n_ranges, const struct wolfidps_port_range *ranges, struct wolfidps_port_set **set) {
+    struct wolfidps_port_range *sorted;
+    struct wolfidps_port_set *new;
+    uint32_t n_merged = 0, n_ports = 0;
+    int i;
+
+    *set = NULL;
+    if (n_ranges == 0)
+        return 0;
+    if ((n_ranges < 0) || (ranges == NULL))
+        return BAD_FUNC_ARG;
+    for (i = 0; i < n_ranges; ++i) {
+        if (ranges[i].lo > ranges[i].hi)
+            return BAD_FUNC_ARG;
+    }
+
+    if ((sorted = (struct wolfidps_port_range *)wolfidps->allocator.malloc(wolfidps->allocator.context, (size_t)n_ranges * sizeof *sorted)) == NULL)
+        return MEMORY_E;
+    memcpy(sorted, ranges, (size_t)n_ranges * sizeof *sorted);
+    qsort(sorted, (size_t)n_ranges, sizeof *sorted, wolfidps_port_range_cmp);
+
+    /* merge in place, joining overlapping and adjacent ranges. */
+    for (i = 0; i < n_ranges; ++i) {
+        if ((n_merged > 0) && ((uint32_t)sorted[i].lo <= (uint32_t)sorted[n_merged - 1].hi + 1)) {
+            if (sorted[i].hi > sorted[n_merged - 1].hi)
+                sorted[n_merged - 1].hi = sorted[i].hi;
+        } else
+            sorted[n_merged++] = sorted[i];
+    }
+    for (i = 0; i < (int)n_merged; ++i)
+        n_ports += (uint32_t)sorted[i].hi - sorted[i].lo + 1;
+
+    if (n_merged <= WOLFIDPS_PORT_SET_MAX_RANGES) {
+        size_t size = sizeof *new + ((n_merged * sizeof *sorted + 7) & ~(size_t)7);
+        if ((new = (struct wolfidps_port_set *)wolfidps->allocator.malloc(wolfidps->allocator.context, size)) != NULL) {
+            memset(new, 0, size);
+            new->n_ranges = n_merged;
+            memcpy(new->buf, sorted, n_merged * sizeof *sorted);
+        }
+    } else {
+        size_t size = sizeof *new + WOLFIDPS_PORT_SET_BITMAP_WORDS * sizeof new->buf[0];
+        if ((new = (struct wolfidps_port_set *)wolfidps->allocator.malloc(wolfidps->allocator.context, size)) != NULL) {
+            memset(new, 0, size);
+            for (i = 0; i < (int)n_merged; ++i) {
+                uint32_t port;
+                for (port = sorted[i].lo; port <= sorted[i].hi; ++port)
+                    new->buf[port >> 6] |= (uint64_t)1 << (port & 63);
+            }
+        }
+    }
+    wolfidps->allocator.free(wolfidps->allocator.context, sorted);
+    if (new == NULL)
+        return MEMORY_E;
+    new->n_ports = n_ports;
+    *set = new;
+    return 0;
+}
+
+/* retire callback, as well. */
+void wolfidps_port_set_free(struct wolfidps_context *wolfidps, void *ptr) {
+    wolfidps->allocator.free(wolfidps->allocator.context, ptr);
+}
@@ -0,0 +1,371 @@
+#include "wolfidps_internal.h"
+
+#include <sched.h>
+
+/* action queue -- see struct wolfidps_action_queue.
+ *
+ * a record pins its action and event through their queue_refs, so that
+ * they are only freed once the last record naming them has run, by
+ * whichever of the retire callback and the worker lets go last.  routes
+ * are not pinned, but copied into the record.
+ */
+
+struct wolfidps_action_queue_cell {
+    volatile uint64_t seq;
+    struct wolfidps_action *action;
+    struct wolfidps_event *event;
+    void *caller_context;
+    int has_route;
+    wolfidps_count_t count; /* of merged triggers, or 0 for a plain handler call */
+    wolfidps_time_t first_seen, last_seen;
+    uint64_t route_buf[WOLFIDPS_ROUTE_SNAPSHOT_WORDS];
+};
+
+/* drop a pin taken by wolfidps_action_queue_push(), or the live one by
+ * the retire callback, freeing the memory on the last.
+ */
+void wolfidps_action_queue_unpin(struct wolfidps_context *wolfidps, volatile int *queue_refs, void *ptr) {
+    if (__atomic_sub_fetch(queue_refs, 1, __ATOMIC_ACQ_REL) == 0)
+        wolfidps->allocator.free(wolfidps->allocator.context, ptr);
+}
+
+/* copy route into buf, dropping its extra ports if they would not fit,
+ * and its port sets, and clearing everything that links it to the table but parent_event
+ * and action.
+ */
+void wolfidps_route_snapshot(uint64_t *buf, const struct wolfidps_route *route) {
+    struct wolfidps_route *copy = (struct wolfidps_route *)buf;
+    size_t buf_size = route->buf_alloced - offsetof(struct wolfidps_route, addr_buf);
+
+    memcpy(copy, route, offsetof(struct wolfidps_route, addr_buf));
+    if (buf_size > WOLFIDPS_ROUTE_SNAPSHOT_BUF_SIZE) {
+        buf_size = WOLFIDPS_ROUTE_SRC_ADDR_BYTES(route) + WOLFIDPS_ROUTE_DST_ADDR_BYTES(route);
+        copy->src.extra_port_count = copy->dst.extra_port_count = 0;
+    }
+    memcpy(copy->addr_buf, route->addr_buf, buf_size);
+    copy->buf_alloced = (uint16_t)(offsetof(struct wolfidps_route, addr_buf) + buf_size);
+    memset(&copy->ent, 0, sizeof copy->ent);
+    memset(&copy->expiry, 0, sizeof copy->expiry);
+    copy->clock_prev = copy->clock_next = NULL;
+    copy->extra_ports[0] = copy->extra_ports[1] = NULL;
+}
+
+/* a record that found the ring full under WOLFIDPS_BACKPRESSURE_BLOCK or
+ * WOLFIDPS_BACKPRESSURE_COALESCE, held by the thread that made it, in
+ * push order, until wolfidps_action_queue_flush().  it holds its pins as a
+ * queued one would.
+ */
+struct wolfidps_action_queue_deferred {
+    struct wolfidps_action_queue_deferred *next;
+    struct wolfidps_context *wolfidps;
+    struct wolfidps_action_queue_cell cell;
+};
+
+static __thread struct wolfidps_action_queue_deferred *wolfidps_action_queue_deferred;
+
+/* claim a cell at the tail, or return NULL if the ring is full. */
+static struct wolfidps_action_queue_cell *wolfidps_action_queue_claim(struct wolfidps_action_queue *queue, uint64_t *pos) {
+    struct wolfidps_action_queue_cell *cell;
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int64_t dif;
+        cell = &queue->cells[tail & (queue->n_cells - 1)];
+        dif = (int64_t)(WOLFIDPS_ATOMIC_LOAD_ACQUIRE(cell->seq) - tail);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = tail;
+                return cell;
+            }
+        } else if (dif < 0)
+            return NULL;
+        else
+            tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    }
+}
+
+static void wolfidps_action_queue_wake(struct wolfidps_action_queue *queue) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&queue->n_idle, __ATOMIC_RELAXED) > 0)
+        (void)sem_post(&queue->work);
+}
+
+/* queue a call to action's handler, or, given a trigger, to its
+ * coalesced handler, in which case route and caller_context are ignored.
+ * the caller is in an epoch, holds the table lock, or holds pins, so
+ * that action, event and route are live.  it must not wait for room
+ * there, as a worker may be running a handler that wants the table lock,
+ * so a record that finds the ring full is either dropped or deferred, by
+ * the backpressure policy, and the caller pushes what it deferred with
+ * wolfidps_action_queue_flush() once it has let go.
+ */
+int wolfidps_action_queue_push(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_action *action,
+    struct wolfidps_event *event,
+    const struct wolfidps_route *route,
+    void *caller_context,
+    const struct wolfidps_action_trigger *trigger)
+{
+    struct wolfidps_action_queue *queue = &wolfidps->action_queue;
+    struct wolfidps_action_queue_deferred *deferred = NULL, **tail;
+    struct wolfidps_action_queue_cell *cell;
+    uint64_t pos = 0;
+    int depth, max_depth;
+
+    if ((cell = wolfidps_action_queue_claim(queue, &pos)) == NULL) {
+        if ((queue->backpressure == WOLFIDPS_BACKPRESSURE_COALESCE) &&
+            (__atomic_load_n(&action->queue_refs, __ATOMIC_RELAXED) > 1)) {
+            wolfidps_counter_inc(wolfidps, slot, action->n_dropped_coalesce);
+            return 0;
+        }
+        if ((queue->backpressure == WOLFIDPS_BACKPRESSURE_DROP) ||
+            ((deferred = (struct wolfidps_action_queue_deferred *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *deferred)) == NULL)) {
+            wolfidps_counter_inc(wolfidps, slot, action->n_dropped);
+            return 0;
+        }
+        cell = &deferred->cell;
+    }
+
+    depth = __atomic_add_fetch(&action->queue_refs, 1, __ATOMIC_RELAXED) - 1;
+    max_depth = __atomic_load_n(&action->queue_max_depth, __ATOMIC_RELAXED);
+    while ((depth > max_depth) &&
+           (! __atomic_compare_exchange_n(&action->queue_max_depth, &max_depth, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+        ;
+    if (event)
+        __atomic_add_fetch(&event->queue_refs, 1, __ATOMIC_RELAXED);
+    wolfidps_counter_inc(wolfidps, slot, action->n_queued);
+
+    cell->action = action;
+    cell->event = event;
+    cell->caller_context = caller_context;
+    cell->count = 0;
+    if (trigger) {
+        route = trigger->route;
+        cell->caller_context = NULL;
+        cell->count = trigger->count;
+        cell->first_seen = trigger->first_seen;
+        cell->last_seen = trigger->last_seen;
+    }
+    if ((cell->has_route = (route != NULL)))
+        wolfidps_route_snapshot(cell->route_buf, route);
+
+    if (deferred) {
+        deferred->next = NULL;
+        deferred->wolfidps = wolfidps;
+        for (tail = &wolfidps_action_queue_deferred; *tail; tail = &(*tail)->next)
+            ;
+        *tail = deferred;
+        return 0;
+    }
+    WOLFIDPS_ATOMIC_STORE_RELEASE(cell->seq, pos + 1);
+    wolfidps_action_queue_wake(queue);
+    return 0;
+}
+
+/* push the records this thread deferred for wolfidps, waiting for room as
+ * need be.  called by dispatch once it has left its epoch or dropped the
+ * table lock, so that the workers can drain the ring meanwhile.
+ */
+void wolfidps_action_queue_flush(struct wolfidps_context *wolfidps) {
+    struct wolfidps_action_queue *queue = &wolfidps->action_queue;
+    struct wolfidps_action_queue_deferred *deferred, **prev = &wolfidps_action_queue_deferred;
+    struct wolfidps_action_queue_cell *cell;
+    uint64_t pos;
+
+    while ((deferred = *prev) != NULL) {
+        if (deferred->wolfidps != wolfidps) {
+            prev = &deferred->next;
+            continue;
+        }
+        *prev = deferred->next;
+        while ((cell = wolfidps_action_queue_claim(queue, &pos)) == NULL)
+            (void)sched_yield();
+        memcpy(&cell->action, &deferred->cell.action, sizeof *cell - offsetof(struct wolfidps_action_queue_cell, action));
+        WOLFIDPS_ATOMIC_STORE_RELEASE(cell->seq, pos + 1);
+        wolfidps_action_queue_wake(queue);
+        wolfidps->allocator.free(wolfidps->allocator.context, deferred);
+    }
+}
+
+/* run the record at the head, if any.  returns 0 if the ring was empty. */
+static int wolfidps_action_queue_run_1(struct wolfidps_context *wolfidps) {
+    struct wolfidps_action_queue *queue = &wolfidps->action_queue;
+    struct wolfidps_action_queue_cell *cell;
+    struct wolfidps_action *action;
+    struct wolfidps_event *event;
+    wolfidps_action_callback_t *handler;
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int64_t dif;
+        cell = &queue->cells[head & (queue->n_cells - 1)];
+        dif = (int64_t)(WOLFIDPS_ATOMIC_LOAD_ACQUIRE(cell->seq) - (head + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&queue->head, &head, head + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0)
+            return 0;
+        else
+            head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    }
+
+    action = cell->action;
+    event = cell->event;
+    if (cell->count) {
+        struct wolfidps_action_trigger trigger;
+        wolfidps_action_coalesced_callback_t *coalesced_handler = __atomic_load_n(&action->coalesced_handler, __ATOMIC_RELAXED);
+        trigger.event = event;
+        trigger.route = cell->has_route ? (const struct wolfidps_route *)cell->route_buf : NULL;
+        trigger.count = cell->count;
+        trigger.first_seen = cell->first_seen;
+        trigger.last_seen = cell->last_seen;
+        if (coalesced_handler)
+            coalesced_handler(action->handler_context, &trigger);
+    } else if ((handler = __atomic_load_n(&action->handler, __ATOMIC_RELAXED)))
+        (void)handler(action->handler_context, cell->caller_context, event, cell->has_route ? (const struct wolfidps_route *)cell->route_buf : NULL);
+    WOLFIDPS_ATOMIC_STORE_RELEASE(cell->seq, head + queue->n_cells);
+
+    if (event)
+        wolfidps_action_queue_unpin(wolfidps, &event->queue_refs, event);
+    wolfidps_action_queue_unpin(wolfidps, &action->queue_refs, action);
+    return 1;
+}
+
+static void *wolfidps_action_queue_worker(void *arg) {
+    struct wolfidps_context *wolfidps = (struct wolfidps_context *)arg;
+    struct wolfidps_action_queue *queue = &wolfidps->action_queue;
+
+    for (;;) {
+        if (wolfidps_action_queue_run_1(wolfidps))
+            continue;
+        if (WOLFIDPS_ATOMIC_LOAD_ACQUIRE(queue->stopping))
+            break;
+        /* announce, then look again, so that a push racing with us
+         * either is seen here or sees us idle and posts.
+         */
+        __atomic_add_fetch(&queue->n_idle, 1, __ATOMIC_SEQ_CST);
+        if (! wolfidps_action_queue_run_1(wolfidps) && ! WOLFIDPS_ATOMIC_LOAD_ACQUIRE(queue->stopping))
+            (void)sem_wait(&queue->work);
+        __atomic_sub_fetch(&queue->n_idle, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+int wolfidps_action_queue_start(struct wolfidps_context *wolfidps, int n_cells, int n_workers, wolfidps_backpressure_t backpressure) {
+    struct wolfidps_action_queue *queue = &wolfidps->action_queue;
+    uint32_t i, n;
+    int ret = 0;
+
+    if ((n_cells <= 0) || (n_cells > (1 << 24)) || (n_workers <= 0) ||
+        ((backpressure != WOLFIDPS_BACKPRESSURE_DROP) && (backpressure != WOLFIDPS_BACKPRESSURE_BLOCK) && (backpressure != WOLFIDPS_BACKPRESSURE_COALESCE)))
+        return BAD_FUNC_ARG;
+    if (queue->running)
+        return BAD_STATE_E;
+    for (n = 2; n < (uint32_t)n_cells; n <<= 1)
+        ;
+
+    if (wolfidps->allocator.memalign)
+        queue->cells = (struct wolfidps_action_queue_cell *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, (size_t)n * sizeof *queue->cells);
+    else
+        queue->cells = (struct wolfidps_action_queue_cell *)wolfidps->allocator.malloc(wolfidps->allocator.context, (size_t)n * sizeof *queue->cells);
+    queue->workers = (pthread_t *)wolfidps->allocator.malloc(wolfidps->allocator.context, (size_t)n_workers * sizeof *queue->workers);
+    if ((queue->cells == NULL) || (queue->workers == NULL)) {
+        ret = MEMORY_E;
+        goto out;
+    }
+    if (sem_init(&queue->work, 0 /* pshared */, 0) < 0) {
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < n; ++i)
+        queue->cells[i].seq = i;
+    queue->n_cells = n;
+    queue->head = queue->tail = 0;
+    queue->n_idle = 0;
+    queue->stopping = 0;
+    queue->backpressure = backpressure;
+
+    for (queue->n_workers = 0; queue->n_workers < n_workers; ++queue->n_workers) {
+        if (pthread_create(&queue->workers[queue->n_workers], NULL, wolfidps_action_queue_worker, wolfidps) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    queue->running = 1;
+    if (ret < 0)
+        (void)wolfidps_action_queue_stop(wolfidps);
+    return ret;
+
+out:
+    if (queue->cells)
+        wolfidps->allocator.free(wolfidps->allocator.context, queue->cells);
+    if (queue->workers)
+        wolfidps->allocator.free(wolfidps->allocator.context, queue->workers);
+    queue->cells = NULL;
+    queue->workers = NULL;
+    return ret;
+}
+
+int wolfidps_action_queue_stop(struct wolfidps_context *wolfidps) {
+    struct wolfidps_action_queue *queue = &wolfidps->action_queue;
+    int i;
+
+    if (! queue->running)
+        return 0;
+    WOLFIDPS_ATOMIC_STORE_RELEASE(queue->stopping, 1);
+    for (i = 0; i < queue->n_workers; ++i)
+        (void)sem_post(&queue->work);
+    for (i = 0; i < queue->n_workers; ++i)
+        (void)pthread_join(queue->workers[i], NULL);
+    /* with no workers, run what is left here. */
+    while (wolfidps_action_queue_run_1(wolfidps))
+        ;
+    (void)sem_destroy(&queue->work);
+    wolfidps->allocator.free(wolfidps->allocator.context, queue->cells);
+    wolfidps->allocator.free(wolfidps->allocator.context, queue->workers);
+    queue->cells = NULL;
+    queue->workers = NULL;
+    queue->n_workers = 0;
+    queue->running = 0;
+    return 0;
+}
+
+int wolfidps_action_set_async(struct wolfidps_context *wolfidps, int label_len, const char *label, int async) {
+    struct wolfidps_action *action;
+    int ret = 0;
+
+    if ((label == NULL) || (label_len <= 0) || (label_len > 255))
+        return BAD_FUNC_ARG;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((action = wolfidps_action_get(wolfidps, label_len, label)))
+        action->async = async ? 1 : 0;
+    else
+        ret = -1;
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+int wolfidps_action_get_queue_stats(struct wolfidps_context *wolfidps, int label_len, const char *label, struct wolfidps_action_queue_stats *stats) {
+    struct wolfidps_action *action;
+    int ret = 0;
+
+    if ((label == NULL) || (stats == NULL) || (label_len <= 0) || (label_len > 255))
+        return BAD_FUNC_ARG;
+    if (wolfidps_lock_readonly(&wolfidps->lock) < 0)
+        return -1;
+    if ((action = wolfidps_action_get(wolfidps, label_len, label))) {
+        stats->depth = __atomic_load_n(&action->queue_refs, __ATOMIC_RELAXED) - 1;
+        stats->max_depth = __atomic_load_n(&action->queue_max_depth, __ATOMIC_RELAXED);
+        if ((wolfidps_counter_get(wolfidps, action->n_queued, &stats->n_queued) < 0) ||
+            (wolfidps_counter_get(wolfidps, action->n_dropped, &stats->n_dropped) < 0) ||
+            (wolfidps_counter_get(wolfidps, action->n_coalesced, &stats->n_coalesced) < 0) ||
+            (wolfidps_counter_get(wolfidps, action->n_dropped_coalesce, &stats->n_dropped_coalesce) < 0))
+            ret = -1;
+    } else
+        ret = -1;
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
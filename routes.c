@@ -1,139 +1,327 @@
 #include "wolfidps_internal.h"
 
+/* orders the ents of one trie node, which share a family, an index and a
+ * prefix, so only { proto, port } is left to compare, the port being that
+ * of the endpoint the index is keyed on.
+ */
 int wolfidps_route_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right) {
     struct wolfidps_route *left_route = ((struct wolfidps_route_table_ent *)left)->route;
     struct wolfidps_route *right_route = ((struct wolfidps_route_table_ent *)right)->route;
-    struct wolfidps_route_endpoint *left_endpoint, *right_endpoint;
-    u_char *left_addr, *right_addr;
-    int left_addr_len, right_addr_len;
-    int cmp;
+    wolfidps_port_t left_port, right_port;
 
-    /* { family, address/block, proto, port } */
-
-    if (left_route->sa_family != right_route->sa_family) {
-        if (left_route->sa_family < right_route->sa_family)
+    if (left_route->sa_proto != right_route->sa_proto) {
+        if (left_route->sa_proto < right_route->sa_proto)
             return -1;
         else
             return 1;
     }
 
-    left_endpoint =
-        (((struct wolfidps_route_table_ent *)left)->ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) ?
-        &left_route->src :
-        &left_route->dst;
-    right_endpoint =
-        (((struct wolfidps_route_table_ent *)right)->ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) ?
-        &right_route->src :
-        &right_route->dst;
-    left_addr =
-        (((struct wolfidps_route_table_ent *)left)->ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) ?
-        &left_route->addr_buf[0] :
-        &left_route->addr_buf[WOLFIDPS_ADDR_BITS_TO_BYTES(left_route->src.addr_len)];
-    left_addr_len = WOLFIDPS_ADDR_BITS_TO_BYTES(left_endpoint->addr_len);
-    right_addr =
-        (((struct wolfidps_route_table_ent *)right)->ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) ?
-        &right_route->addr_buf[0] :
-        &right_route->addr_buf[WOLFIDPS_ADDR_BITS_TO_BYTES(right_route->src.addr_len)];
-    right_addr_len = WOLFIDPS_ADDR_BITS_TO_BYTES(right_endpoint->addr_len);
-
-    if (left_addr_len != right_addr_len) {
-        int min_addr_len = (left_addr_len < right_addr_len) ? left_addr_len : right_addr_len;
-        if ((cmp = memcmp(left_addr, right_addr, min_addr_len)))
-            return cmp;
-        else if (left_addr_len < right_addr_len)
-            return -1;
-        else
-            return 1;
+    if (((struct wolfidps_route_table_ent *)left)->ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) {
+        left_port = left_route->src.sa_port;
+        right_port = right_route->src.sa_port;
+    } else {
+        left_port = left_route->dst.sa_port;
+        right_port = right_route->dst.sa_port;
     }
-
-    if ((cmp = memcmp(left_addr, right_addr, left_addr_len)))
-        return cmp;
-
-    if (left_route->sa_proto != right_route->sa_proto) {
-        if (left_route->sa_proto < right_route->sa_proto)
+    if (left_port != right_port) {
+        if (left_port < right_port)
             return -1;
         else
             return 1;
     }
 
-    if (left_endpoint->sa_port != right_endpoint->sa_port) {
-        if (left_endpoint->sa_port < right_endpoint->sa_port)
-            return -1;
-        else
-            return 1;
+    /* then on the other endpoint, so that of two routes that could both
+     * match a flow, the more specific there comes first: the longer
+     * prefix, then the higher port, wildcards (zero) last.  the policy
+     * image orders its rules the same way.
+     */
+    if (((struct wolfidps_route_table_ent *)left)->ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) {
+        if (left_route->dst.addr_len != right_route->dst.addr_len)
+            return (left_route->dst.addr_len < right_route->dst.addr_len) ? -1 : 1;
+        left_port = left_route->dst.sa_port;
+        right_port = right_route->dst.sa_port;
+    } else {
+        left_port = left_route->src.sa_port;
+        right_port = right_route->src.sa_port;
     }
+    if (left_port != right_port)
+        return (left_port < right_port) ? -1 : 1;
 
     return 0;
 }
 
-int wolfidps_route_insert_1(
-    struct wolfidps_context *wolfidps,
-    struct wolfidps_sockaddr *src,
-    struct wolfidps_sockaddr *dst,
-    wolfidps_route_flags_t flags,
-    struct wolfidps_event *parent_event,
-    woldidps_time_t ttl
-    ) {
-    size_t new_size;
-    struct wolfidps_route *new;
-    int ret;
+/* populate the key fields and addr_buf of route from a src/dst pair, and
+ * pick the index its ent belongs in -- see struct wolfidps_route_table.
+ * route must have room for the addresses in its addr_buf.
+ */
+static int wolfidps_route_init_key(
+    struct wolfidps_route *route,
+    const struct wolfidps_sockaddr *src,
+    const struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags)
+{
+    u_char *addr;
 
     if ((src->sa_family != dst->sa_family) ||
         (src->sa_proto != dst->sa_proto))
-        return -1;
+        return BAD_FUNC_ARG;
 
     if ((flags.src_if_id_wildcard && (src->if_id != 0)) ||
         (flags.dst_if_id_wildcard && (dst->if_id != 0)) ||
         (flags.sa_family_wildcard && (src->sa_family != 0)) ||
         (flags.sa_src_addr_wildcard && (src->addr_len != 0)) ||
         (flags.sa_dst_addr_wildcard && (dst->addr_len != 0)) ||
+        (flags.sa_proto_wildcard && (src->sa_proto != 0)) ||
         (flags.sa_src_port_wildcard && (src->sa_port != 0)) ||
         (flags.sa_dst_port_wildcard && (dst->sa_port != 0)))
-        return -1;
+        return BAD_FUNC_ARG;
+
+    route->flags = flags;
+    route->sa_family = src->sa_family;
+    route->sa_proto = src->sa_proto;
+    route->src.sa_port = src->sa_port;
+    route->src.addr_len = src->addr_len;
+    route->src.if_id = src->if_id;
+    route->dst.sa_port = dst->sa_port;
+    route->dst.addr_len = dst->addr_len;
+    route->dst.if_id = dst->if_id;
+    route->ent.route = route;
+    route->ent.ent_type = ((src->addr_len == 0) && (dst->addr_len != 0)) ?
+        WOLFIDPS_ROUTE_TABLE_DST_ENT :
+        WOLFIDPS_ROUTE_TABLE_SRC_ENT;
+
+    /* copy in the addresses, zeroing any bits past the prefix length. */
+    addr = WOLFIDPS_ROUTE_SRC_ADDR(route);
+    memcpy(addr, src->addr, WOLFIDPS_BITS_TO_BYTES(src->addr_len));
+    if (src->addr_len & 7)
+        addr[src->addr_len >> 3] &= (u_char)(0xff << (8 - (src->addr_len & 7)));
+    addr = WOLFIDPS_ROUTE_DST_ADDR(route);
+    memcpy(addr, dst->addr, WOLFIDPS_BITS_TO_BYTES(dst->addr_len));
+    if (dst->addr_len & 7)
+        addr[dst->addr_len >> 3] &= (u_char)(0xff << (8 - (dst->addr_len & 7)));
+
+    return 0;
+}
+
+/* true if left and right have the same family, addresses, proto, ports,
+ * interfaces, and wildcard flags.  parent_event is not compared.
+ */
+static int wolfidps_route_key_eq(const struct wolfidps_route *left, const struct wolfidps_route *right) {
+    wolfidps_route_flags_t left_flags = left->flags, right_flags = right->flags;
+    left_flags.dont_count = right_flags.dont_count = 0;
+    return (left_flags.flags == right_flags.flags) &&
+        (left->sa_family == right->sa_family) &&
+        (left->sa_proto == right->sa_proto) &&
+        (left->src.sa_port == right->src.sa_port) &&
+        (left->src.addr_len == right->src.addr_len) &&
+        (left->src.if_id == right->src.if_id) &&
+        (left->dst.sa_port == right->dst.sa_port) &&
+        (left->dst.addr_len == right->dst.addr_len) &&
+        (left->dst.if_id == right->dst.if_id) &&
+        (! memcmp(left->addr_buf, right->addr_buf, WOLFIDPS_ROUTE_SRC_ADDR_BYTES(left) + WOLFIDPS_ROUTE_DST_ADDR_BYTES(left)));
+}
+
+static int wolfidps_route_event_eq(const struct wolfidps_route *route, int event_label_len, const char *event_label) {
+    if (route->parent_event == NULL)
+        return event_label == NULL;
+    if (event_label == NULL)
+        return 0;
+    return (route->parent_event->keyword_len == event_label_len) &&
+        (! memcmp(route->parent_event->keyword, event_label, (size_t)event_label_len));
+}
+
+/* exact match on key and event, in the index key would be placed in, or
+ * failing that, among the rules of the compiled policy.  *rule is set to
+ * the index of a matching rule, or WOLFIDPS_POLICY_NONE.  a rule with no
+ * route is a match, but returns NULL.
+ */
+static struct wolfidps_route *wolfidps_route_get(
+    struct wolfidps_context *wolfidps,
+    const struct wolfidps_route *key,
+    int event_label_len,
+    const char *event_label,
+    uint32_t *rule)
+{
+    struct wolfidps_route_trie_node *node = (key->ent.ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) ?
+        wolfidps_route_trie_get(&wolfidps->routes, WOLFIDPS_ROUTE_TABLE_SRC_ENT, key->sa_family, WOLFIDPS_ROUTE_SRC_ADDR(key), key->src.addr_len) :
+        wolfidps_route_trie_get(&wolfidps->routes, WOLFIDPS_ROUTE_TABLE_DST_ENT, key->sa_family, WOLFIDPS_ROUTE_DST_ADDR(key), key->dst.addr_len);
+    struct wolfidps_policy_image *image = wolfidps->policy;
+    struct wolfidps_table_ent_generic *i;
+
+    *rule = WOLFIDPS_POLICY_NONE;
+    if (node) {
+        for (i = node->ents.head; i; i = i->generic.next) {
+            if (wolfidps_route_key_eq(i->route.route, key) &&
+                wolfidps_route_event_eq(i->route.route, event_label_len, event_label))
+                return i->route.route;
+        }
+    }
+    if (image && (wolfidps_policy_find(image, key, event_label_len, event_label, rule) == 0))
+        return image->routes ? image->routes[*rule] : NULL;
+    return NULL;
+}
+
+/* retire callback -- the route is no longer reachable by any reader. */
+static void wolfidps_route_free(struct wolfidps_context *wolfidps, void *ptr) {
+    struct wolfidps_route *route = (struct wolfidps_route *)ptr;
+    wolfidps_counter_release(wolfidps, route->n_hits);
+    if (route->extra_ports[WOLFIDPS_ROUTE_TABLE_SRC_ENT])
+        wolfidps_port_set_free(wolfidps, route->extra_ports[WOLFIDPS_ROUTE_TABLE_SRC_ENT]);
+    if (route->extra_ports[WOLFIDPS_ROUTE_TABLE_DST_ENT])
+        wolfidps_port_set_free(wolfidps, route->extra_ports[WOLFIDPS_ROUTE_TABLE_DST_ENT]);
+    wolfidps->allocator.free(wolfidps->allocator.context, route);
+}
+
+/* allocate a route keyed on src and dst, linked nowhere yet. */
+int wolfidps_route_new(
+    struct wolfidps_context *wolfidps,
+    const struct wolfidps_sockaddr *src,
+    const struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    struct wolfidps_route **route
+    ) {
+    size_t new_size;
+    struct wolfidps_route *new;
+    uint64_t start;
+    int ret;
 
     new_size = sizeof *new + WOLFIDPS_BITS_TO_BYTES(src->addr_len) + WOLFIDPS_BITS_TO_BYTES(dst->addr_len);
     if (new_size >= (size_t)(uint16_t)~0UL)
         return -1;
 
+    start = wolfidps_probe_begin(wolfidps, NULL, WOLFIDPS_PROBE_ALLOC);
     new = wolfidps->allocator.malloc(wolfidps->allocator.context, new_size);
+    wolfidps_probe_end(wolfidps, NULL, WOLFIDPS_PROBE_ALLOC, start);
+    if (new == NULL)
+        return MEMORY_E;
     memset(new, 0, new_size);
     new->buf_alloced = (uint16_t)new_size;
 
-    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &new->last_transition_time) < 0) {
+    if ((ret = wolfidps_route_init_key(new, src, dst, flags)) < 0) {
         wolfidps->allocator.free(wolfidps->allocator.context, new);
-        return -1;
+        return ret;
     }
+    *route = new;
+    return 0;
+}
+
+/* true if a route or compiled rule with the key of new and parent_event
+ * is in place already.
+ */
+int wolfidps_route_present(
+    struct wolfidps_context *wolfidps,
+    const struct wolfidps_route *new,
+    const struct wolfidps_event *parent_event
+    ) {
+    uint32_t rule;
+    return (wolfidps_route_get(wolfidps, new,
+                               parent_event ? parent_event->keyword_len : 0,
+                               parent_event ? parent_event->keyword : NULL,
+                               &rule) != NULL) ||
+        (rule != WOLFIDPS_POLICY_NONE);
+}
+
+/* the id and hit counter of a new route.  its expiry timer waits for
+ * wolfidps_route_arm(), once it is linked, so that nothing reached
+ * through the timer wheel, such as an eviction victim, is ever half
+ * built.  on failure, new holds nothing, and can just be discarded.
+ * called with the table lock held for writing.
+ */
+int wolfidps_route_attach(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_route *new,
+    struct wolfidps_event *parent_event,
+    wolfidps_time_t ttl,
+    woldidps_time_t now
+    ) {
+    int ret;
+
+    new->id = ++wolfidps->routes.next_id;
+    new->last_transition_time = (wolfidps_time_t)now;
     new->ttl = ttl;
     new->parent_event = parent_event;
-    new->flags = flags;
-    new->sa_family = src->sa_family;
-    new->sa_proto = src->sa_proto;
-    new->src.sa_port = src->sa_port;
-    new->src.addr_len = src->addr_len;
-    new->src.if_id = src->if_id;
-    new->dst.sa_port = dst->sa_port;
-    new->dst.addr_len = dst->addr_len;
-    new->dst.if_id = dst->if_id;
-
-    new->src_ent.route = new->dst_ent.route = new;
-    new->src_ent.ent_type = WOLFIDPS_ROUTE_TABLE_SRC_ENT;
-    new->dst_ent.ent_type = WOLFIDPS_ROUTE_TABLE_DST_ENT;
-
-    ret = wolfidps_table_ent_insert((struct wolfidps_table_ent_generic *)&new->src_ent, (struct wolfidps_table_generic *)&wolfidps->routes);
-    if (ret < 0) {
-        wolfidps->allocator.free(wolfidps->allocator.context, new);
+
+    if ((! new->flags.dont_count) &&
+        ((ret = wolfidps_counter_alloc(wolfidps, &new->n_hits)) < 0))
         return ret;
+    return 0;
+}
+
+/* start the expiry timer of route, attached at now and since linked.
+ * this can only fail if the timer wheel has yet to be started -- see
+ * wolfidps_timer_start().
+ */
+int wolfidps_route_arm(struct wolfidps_context *wolfidps, struct wolfidps_route *route, woldidps_time_t now) {
+    if (route->ttl == WOLFIDPS_TIME_NEVER)
+        return 0;
+    return wolfidps_timer_add(wolfidps, &route->expiry, wolfidps->timecbs.add_time(now, (woldidps_time_t)route->ttl));
+}
+
+/* undo wolfidps_route_attach(), for a route not yet in the trie. */
+void wolfidps_route_detach(struct wolfidps_context *wolfidps, struct wolfidps_route *route) {
+    wolfidps_counter_release(wolfidps, route->n_hits);
+    route->n_hits = 0;
+    route->parent_event = NULL;
+}
+
+/* free a route from wolfidps_route_new() that was never attached, or has
+ * been detached.
+ */
+void wolfidps_route_discard(struct wolfidps_context *wolfidps, struct wolfidps_route *route) {
+    wolfidps->allocator.free(wolfidps->allocator.context, route);
+}
+
+int wolfidps_route_insert_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    struct wolfidps_event *parent_event,
+    wolfidps_time_t ttl,
+    struct wolfidps_route **route
+    ) {
+    struct wolfidps_route *new;
+    woldidps_time_t now;
+    int ret;
+
+    if ((ret = wolfidps_route_new(wolfidps, src, dst, flags, &new)) < 0)
+        return ret;
+    if (wolfidps_route_present(wolfidps, new, parent_event)) {
+        wolfidps_route_discard(wolfidps, new);
+        return WOLFIDPS_ROUTE_EXISTS_E;
     }
-    ret = wolfidps_table_ent_insert((struct wolfidps_table_ent_generic *)&new->dst_ent, (struct wolfidps_table_generic *)&wolfidps->routes);
-    if (ret < 0) {
-        wolfidps_table_ent_delete_1((struct wolfidps_table_generic *)&wolfidps->routes, (struct wolfidps_table_ent_generic *)&new->src_ent);
-        wolfidps->allocator.free(wolfidps->allocator.context, new);
+    /* with the wheel started, arming new once it is linked can't fail. */
+    if ((wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0) ||
+        ((ttl != WOLFIDPS_TIME_NEVER) && (wolfidps_timer_start(wolfidps) < 0))) {
+        wolfidps_route_discard(wolfidps, new);
+        return -1;
+    }
+    if ((ret = wolfidps_route_attach(wolfidps, new, parent_event, ttl, now)) < 0) {
+        wolfidps_route_discard(wolfidps, new);
+        return ret;
+    }
+    /* new is on neither the eviction ring nor the timer wheel yet, so it
+     * can't be chosen as the victim.
+     */
+    if (((ret = wolfidps_evict_make_room(wolfidps, 1)) < 0) ||
+        ((ret = wolfidps_route_trie_insert(wolfidps, &wolfidps->routes, &new->ent)) < 0)) {
+        wolfidps_route_detach(wolfidps, new);
+        wolfidps_route_discard(wolfidps, new);
         return ret;
     }
 
+    wolfidps_evict_link(&wolfidps->routes, new);
+    (void)wolfidps_route_arm(wolfidps, new, now);
+
+    if (route)
+        *route = new;
     return 0;
 }
 
+#ifndef WOLFIDPS_EVICT_MAX_RETRIES
+#define WOLFIDPS_EVICT_MAX_RETRIES 4
+#endif
+
 int wolfidps_route_insert(
     struct wolfidps_context *wolfidps,
     struct wolfidps_sockaddr *src,
@@ -141,20 +329,38 @@ int wolfidps_route_insert(
     wolfidps_route_flags_t flags,
     int event_label_len,
     const char *event_label,
-    woldidps_time_t ttl
+    wolfidps_time_t ttl
     ) {
-    int ret;
+    int ret, tries;
     struct wolfidps_event *event = NULL;
+    uint64_t start = wolfidps_probe_begin(wolfidps, NULL, WOLFIDPS_PROBE_INSERT);
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
     if (event_label) {
         if ((ret = wolfidps_event_getreference(wolfidps, event_label_len, event_label, &event)) < 0)
-            return ret;
+            goto out;
+    }
+    ret = wolfidps_route_insert_1(wolfidps, src, dst, flags, event, ttl, NULL);
+    /* out of memory -- evict and retry.  with lockless dispatch, evicted
+     * routes are only freed after a grace period, so this may not help
+     * right away.
+     */
+    for (tries = 0; (ret == MEMORY_E) && (tries < WOLFIDPS_EVICT_MAX_RETRIES); ++tries) {
+        if (wolfidps_evict_1(wolfidps) < 0)
+            break;
+        ret = wolfidps_route_insert_1(wolfidps, src, dst, flags, event, ttl, NULL);
     }
-    ret = wolfidps_route_insert_1(wolfidps, src, dst, flags, event, ttl);
-    if (ret < 0)
+    if ((ret < 0) && event)
         wolfidps_event_dropreference(wolfidps, event);
+  out:
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    wolfidps_probe_end(wolfidps, NULL, WOLFIDPS_PROBE_INSERT, start);
     return ret;
 }
 
+/* room for a route key with maximum-length src and dst addresses. */
+#define WOLFIDPS_ROUTE_KEY_BUF_WORDS ((sizeof(struct wolfidps_route) + (2 * sizeof(wolfidps_address_mask_t)) + 7) / 8)
+
 int wolfidps_route_lookup(
     struct wolfidps_context *wolfidps,
     struct wolfidps_sockaddr *src,
@@ -162,14 +368,36 @@ int wolfidps_route_lookup(
     wolfidps_route_flags_t dst_flags,
     int event_label_len,
     const char *event_label,
-    struct wolfidps_route **route) {
+    struct wolfidps_route **route,
+    uint32_t *rule) {
+    uint64_t key_buf[WOLFIDPS_ROUTE_KEY_BUF_WORDS];
+    struct wolfidps_route *key = (struct wolfidps_route *)key_buf;
+    int ret;
 
+    memset(key, 0, sizeof *key);
+    if ((ret = wolfidps_route_init_key(key, src, dst, dst_flags)) < 0)
+        return ret;
+    if (((*route = wolfidps_route_get(wolfidps, key, event_label_len, event_label, rule)) == NULL) &&
+        (*rule == WOLFIDPS_POLICY_NONE))
+        return -1;
+    return 0;
 }
 
 int wolfidps_route_delete_1(
     struct wolfidps_context *wolfidps,
     struct wolfidps_route *route) {
-
+    if (route->compiled)
+        wolfidps_policy_rule_delete(wolfidps, route->policy_rule);
+    else
+        wolfidps_route_trie_delete_1(wolfidps, &wolfidps->routes, &route->ent);
+    wolfidps_timer_del(wolfidps, &route->expiry);
+    wolfidps_evict_unlink(&wolfidps->routes, route);
+    if (route->parent_event)
+        wolfidps_event_dropreference(wolfidps, route->parent_event);
+    if (route->action)
+        (void)wolfidps_action_dropreference(wolfidps, route->action);
+    wolfidps_epoch_retire_cb(wolfidps, route, wolfidps_route_free);
+    return 0;
 }
 
 int wolfidps_route_delete(
@@ -182,16 +410,552 @@ int wolfidps_route_delete(
     )
 {
     struct wolfidps_route *route;
+    uint32_t rule;
+    int ret;
+    uint64_t start = wolfidps_probe_begin(wolfidps, NULL, WOLFIDPS_PROBE_DELETE);
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((ret = wolfidps_route_lookup(wolfidps, src, dst, dst_flags, event_label_len, event_label, &route, &rule)) == 0) {
+        if (route)
+            ret = wolfidps_route_delete_1(wolfidps, route);
+        else
+            wolfidps_policy_rule_delete(wolfidps, rule);
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    wolfidps_probe_end(wolfidps, NULL, WOLFIDPS_PROBE_DELETE, start);
+    return ret;
+}
+
+/* delete every route, then release the tries themselves. */
+void wolfidps_route_table_flush(struct wolfidps_context *wolfidps) {
+    struct wolfidps_route_trie_family *family;
+    int ent_type;
+    wolfidps_policy_flush(wolfidps);
+    for (ent_type = 0; ent_type < 2; ++ent_type) {
+        for (family = wolfidps->routes.families[ent_type]; family; family = family->next) {
+            while (family->root) {
+                struct wolfidps_route_trie_node *node = family->root;
+                /* a node with no ents always has two children. */
+                while (node->ents.head == NULL)
+                    node = node->child[0];
+                (void)wolfidps_route_delete_1(wolfidps, node->ents.head->route.route);
+            }
+        }
+    }
+    wolfidps_route_trie_free(wolfidps, &wolfidps->routes);
+}
+
+/* take route out of the compiled policy, if it is there, and put it back
+ * in the trie.
+ */
+static int wolfidps_route_decompile(struct wolfidps_context *wolfidps, struct wolfidps_route *route) {
     int ret;
-    if ((ret = wolfidps_route_lookup(wolfidps, src, dst, dst_flags, event_label_len, event_label)) < 0)
+    /* into the trie first, so that readers always find it in one or the
+     * other.
+     */
+    if ((ret = wolfidps_route_trie_insert(wolfidps, &wolfidps->routes, &route->ent)) < 0)
         return ret;
-    return wolfidps_route_delete_1(wolfidps, route);
+    wolfidps_policy_rule_delete(wolfidps, route->policy_rule);
+    route->compiled = 0;
+    return 0;
+}
+
+int wolfidps_route_set_extra_ports(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t dst_flags,
+    int event_label_len,
+    const char *event_label,
+    int n_src_ranges,
+    const struct wolfidps_port_range *src_ranges,
+    int n_dst_ranges,
+    const struct wolfidps_port_range *dst_ranges
+    )
+{
+    struct wolfidps_port_set *sets[2] = { NULL, NULL }, *old;
+    struct wolfidps_route *route;
+    uint32_t rule;
+    int ret, i;
+
+    if (((n_src_ranges != 0) && dst_flags.sa_src_port_wildcard) ||
+        ((n_dst_ranges != 0) && dst_flags.sa_dst_port_wildcard))
+        return BAD_FUNC_ARG;
+    /* built before taking the lock. */
+    if (((ret = wolfidps_port_set_new(wolfidps, n_src_ranges, src_ranges, &sets[WOLFIDPS_ROUTE_TABLE_SRC_ENT])) < 0) ||
+        ((ret = wolfidps_port_set_new(wolfidps, n_dst_ranges, dst_ranges, &sets[WOLFIDPS_ROUTE_TABLE_DST_ENT])) < 0))
+        goto out;
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0) {
+        ret = -1;
+        goto out;
+    }
+    if ((ret = wolfidps_route_lookup(wolfidps, src, dst, dst_flags, event_label_len, event_label, &route, &rule)) == 0) {
+        if (route == NULL)
+            ret = BAD_STATE_E; /* a rule loaded with no route */
+        else if ((sets[0] || sets[1]) && route->compiled)
+            ret = wolfidps_route_decompile(wolfidps, route);
+        if (ret == 0) {
+            for (i = 0; i < 2; ++i) {
+                old = route->extra_ports[i];
+                WOLFIDPS_ATOMIC_STORE_RELEASE(route->extra_ports[i], sets[i]);
+                sets[i] = NULL;
+                if (old)
+                    wolfidps_epoch_retire_cb(wolfidps, old, wolfidps_port_set_free);
+            }
+            wolfidps_route_table_changed(&wolfidps->routes);
+        }
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+
+  out:
+    for (i = 0; i < 2; ++i) {
+        if (sets[i])
+            wolfidps_port_set_free(wolfidps, sets[i]);
+    }
+    return ret;
+}
+
+int wolfidps_route_set_rate_limit(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t dst_flags,
+    int event_label_len,
+    const char *event_label,
+    wolfidps_time_t interval,
+    uint32_t burst
+    )
+{
+    struct wolfidps_route *route;
+    uint32_t rule;
+    int ret;
+
+    if (interval && ((burst == 0) || (interval > (uint64_t)INT64_MAX / burst)))
+        return BAD_FUNC_ARG;
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((ret = wolfidps_route_lookup(wolfidps, src, dst, dst_flags, event_label_len, event_label, &route, &rule)) == 0) {
+        if (route == NULL)
+            ret = BAD_STATE_E; /* a rule loaded with no route */
+        else if (interval && route->compiled)
+            ret = wolfidps_route_decompile(wolfidps, route);
+        if (ret == 0)
+            wolfidps_route_rate_limit_1(route, interval, burst);
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return ret;
+}
+
+/* the bucket starts full.  called with the table lock held. */
+void wolfidps_route_rate_limit_1(struct wolfidps_route *route, wolfidps_time_t interval, uint32_t burst) {
+    __atomic_store_n(&route->rate_burst, burst, __ATOMIC_RELAXED);
+    __atomic_store_n(&route->rate_tat, 0, __ATOMIC_RELAXED);
+    WOLFIDPS_ATOMIC_STORE_RELEASE(route->rate_interval, interval);
+}
+
+/* take a token from the bucket of route, if there is one. */
+static int wolfidps_route_rate_conforms(struct wolfidps_route *route, woldidps_time_t interval, woldidps_time_t now) {
+    woldidps_time_t limit = interval * (woldidps_time_t)__atomic_load_n(&route->rate_burst, __ATOMIC_RELAXED);
+    woldidps_time_t tat = __atomic_load_n(&route->rate_tat, __ATOMIC_RELAXED), next;
+
+    do {
+        /* an idle bucket refills to full, and no further. */
+        next = ((tat - now < 0) ? now : tat) + interval;
+        if (next - now > limit)
+            return 0;
+    } while (! __atomic_compare_exchange_n(&route->rate_tat, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/* addr's port is among the extra ports of the endpoint of route keyed on
+ * ent_type.
+ */
+static int wolfidps_route_extra_port_match(const struct wolfidps_route *route, int ent_type, const struct wolfidps_sockaddr *addr) {
+    const struct wolfidps_port_set *set = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(route->extra_ports[ent_type]);
+    if (set == NULL)
+        return 0;
+    if (route->flags.tcplike_port_numbers && (! wolfidps_proto_is_tcplike(addr->sa_proto)))
+        return 0;
+    return wolfidps_port_set_contains(set, addr->sa_port);
+}
+
+/* the address the route is keyed on is already known to match, by virtue
+ * of the trie descent on it, and a dst-keyed route has no src address to
+ * match.  check everything else.
+ */
+int wolfidps_route_matches(const struct wolfidps_route *route, void *match_context) {
+    const struct wolfidps_route_match_context *match = (const struct wolfidps_route_match_context *)match_context;
+    const struct wolfidps_sockaddr *src = match->src, *dst = match->dst;
+
+    if ((! route->flags.sa_proto_wildcard) && (route->sa_proto != src->sa_proto))
+        return 0;
+    if ((! route->flags.sa_src_port_wildcard) && (route->src.sa_port != src->sa_port) &&
+        (! wolfidps_route_extra_port_match(route, WOLFIDPS_ROUTE_TABLE_SRC_ENT, src)))
+        return 0;
+    if ((! route->flags.sa_dst_port_wildcard) && (route->dst.sa_port != dst->sa_port) &&
+        (! wolfidps_route_extra_port_match(route, WOLFIDPS_ROUTE_TABLE_DST_ENT, dst)))
+        return 0;
+    if ((! route->flags.src_if_id_wildcard) && (route->src.if_id != src->if_id))
+        return 0;
+    if ((! route->flags.dst_if_id_wildcard) && (route->dst.if_id != dst->if_id))
+        return 0;
+    if ((route->ent.ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) &&
+        (! route->flags.sa_dst_addr_wildcard) &&
+        ((dst->addr_len < route->dst.addr_len) ||
+         (! wolfidps_addr_prefix_match(dst->addr, WOLFIDPS_ROUTE_DST_ADDR(route), route->dst.addr_len))))
+        return 0;
+    return ! wolfidps_route_expired(route, match->now);
+}
+
+/* account for a hit on route, and work out its disposition.  a matched
+ * route rejects by default, or accepts within its rate limit and drops
+ * past it, but its action handler, if any, has the final say, unless it
+ * is queued or coalesced.  called with the table lock held.
+ */
+int wolfidps_route_dispatch_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_route *route,
+    woldidps_time_t now,
+    void *context,
+    wolfidps_disposition_t *disposition,
+    wolfidps_time_t *ttl)
+{
+    woldidps_time_t rate_interval;
+
+    if (! route->referenced)
+        route->referenced = 1;
+    if (! route->flags.dont_count) {
+        wolfidps_counter_inc(wolfidps, slot, route->n_hits);
+        if (route->parent_event)
+            wolfidps_counter_inc(wolfidps, slot, route->parent_event->hitcount);
+        if (route->action)
+            wolfidps_counter_inc(wolfidps, slot, route->action->hitcount);
+    }
+
+    /* a rate limited route only acts on hits over the limit. */
+    rate_interval = (woldidps_time_t)WOLFIDPS_ATOMIC_LOAD_ACQUIRE(route->rate_interval);
+    *disposition = rate_interval ? WOLFIDPS_DROP : WOLFIDPS_REJECT;
+    if (rate_interval && wolfidps_route_rate_conforms(route, rate_interval, now))
+        *disposition = WOLFIDPS_ACCEPT;
+    else if (route->action && wolfidps_action_is_coalesced(route->action))
+        (void)wolfidps_action_coalesce(wolfidps, slot, route->action, route->parent_event, route, WOLFIDPS_POLICY_NONE, now);
+    else if (route->action && route->action->handler && wolfidps_action_is_queued(wolfidps, route->action))
+        (void)wolfidps_action_queue_push(wolfidps, slot, route->action, route->parent_event, route, context, NULL);
+    else if (route->action && route->action->handler) {
+        wolfidps_disposition_t *action_disposition = route->action->handler(route->action->handler_context, context, route->parent_event, route);
+        if (action_disposition)
+            *disposition = *action_disposition;
+    }
+
+    if (ttl) {
+        if (route->ttl == WOLFIDPS_TIME_NEVER)
+            *ttl = WOLFIDPS_TIME_NEVER;
+        else
+            *ttl = (wolfidps_time_t)((woldidps_time_t)route->last_transition_time + (woldidps_time_t)route->ttl - now);
+    }
+
+    return 0;
+}
+
+/* the better of a trie match (ent, NULL for none) and a compiled policy
+ * match within one family: the longer src prefix, or on a tie, whichever
+ * a single trie node would list first -- the trie's, if their keys are
+ * equal or it's keyed on its dst prefix.  *route is the winner, or NULL
+ * for a rule with no route, whose index is left in *rule.  returns -1 if
+ * neither matched.
+ */
+static int wolfidps_route_match_merge(
+    const struct wolfidps_policy_image *image,
+    wolfidps_family_t sa_family,
+    const struct wolfidps_route_table_ent *ent,
+    struct wolfidps_route_match_context *match,
+    struct wolfidps_route **route,
+    uint32_t *rule)
+{
+    unsigned int compiled_len;
+    if ((image == NULL) ||
+        (wolfidps_policy_match(image, sa_family, match, rule, &compiled_len) < 0) ||
+        (ent && (ent->route->src.addr_len > compiled_len)) ||
+        (ent && (ent->route->src.addr_len == compiled_len) &&
+         ((ent->ent_type == WOLFIDPS_ROUTE_TABLE_DST_ENT) ||
+          (! wolfidps_policy_rule_precedes(&image->rules[*rule], ent->route))))) {
+        *route = ent ? ent->route : NULL;
+        return ent ? 0 : -1;
+    }
+    *route = image->routes ? image->routes[*rule] : NULL;
+    return 0;
+}
+
+/* the route within one family matching both src and dst, given the
+ * result of the src index probe, src_ent (NULL for none).  every
+ * candidate on the way up either index is checked against the other
+ * endpoint, so what comes back matches both.  a route on any src prefix
+ * beats one on a dst prefix alone, so the dst index is only probed when
+ * src_ent is missing or has no src address either, and then only if it
+ * has routes for the family at all -- thus a typical flow makes one
+ * descent.  on a tie, the dst-keyed route, being the more specific, wins.
+ */
+static struct wolfidps_route_table_ent *wolfidps_route_classify(
+    struct wolfidps_context *wolfidps,
+    wolfidps_family_t sa_family,
+    struct wolfidps_route_match_context *match,
+    struct wolfidps_route_table_ent *src_ent)
+{
+    struct wolfidps_route_trie_family *family;
+    struct wolfidps_route_table_ent *ent;
+
+    if ((src_ent && (src_ent->route->src.addr_len > 0)) ||
+        ((family = wolfidps_route_trie_family_get(&wolfidps->routes, WOLFIDPS_ROUTE_TABLE_DST_ENT, sa_family)) == NULL))
+        return src_ent;
+    ent = wolfidps_route_trie_match_1(family, match->dst->addr, match->dst->addr_len, wolfidps_route_matches, match);
+    return ent ? ent : src_ent;
+}
+
+static int wolfidps_route_match_family(
+    struct wolfidps_context *wolfidps,
+    const struct wolfidps_policy_image *image,
+    wolfidps_family_t sa_family,
+    struct wolfidps_route_match_context *match,
+    struct wolfidps_route **route,
+    uint32_t *rule)
+{
+    struct wolfidps_route_table_ent *ent = wolfidps_route_trie_match_1(wolfidps_route_trie_family_get(&wolfidps->routes, WOLFIDPS_ROUTE_TABLE_SRC_ENT, sa_family), match->src->addr, match->src->addr_len, wolfidps_route_matches, match);
+    return wolfidps_route_match_merge(image, sa_family, wolfidps_route_classify(wolfidps, sa_family, match, ent), match, route, rule);
+}
+
+/* the lookup half of wolfidps_route_dispatch(): the winning route, or
+ * compiled rule with no route, for the flow in match, through slot's
+ * dispatch cache if it has one.  *image is the policy image it was found
+ * in.  returns 1 on a match.  called within an epoch or with the table
+ * lock held.
+ */
+int wolfidps_route_match_flow(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_route_match_context *match,
+    struct wolfidps_policy_image **image,
+    struct wolfidps_route **route,
+    uint32_t *rule)
+{
+    const struct wolfidps_sockaddr *src = match->src;
+    struct wolfidps_dispatch_cache_ent *cache_ent = NULL;
+    uint64_t generation = 0;
+    int matched;
+
+    *route = NULL;
+    *rule = WOLFIDPS_POLICY_NONE;
+    /* the generation is read first, so that a lookup is never cached
+     * under a generation newer than the table it walked.
+     */
+    if (slot && slot->dispatch_cache)
+        generation = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->routes.generation);
+    *image = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->policy);
+    if (slot && slot->dispatch_cache &&
+        wolfidps_dispatch_cache_get(slot->dispatch_cache, generation, *image, src, match->dst, match->now, &cache_ent, route, rule))
+        return (*route != NULL) || (*rule != WOLFIDPS_POLICY_NONE);
+
+    /* fall back to routes with a wildcard family. */
+    matched = (wolfidps_route_match_family(wolfidps, *image, src->sa_family, match, route, rule) == 0) ||
+        ((src->sa_family != 0) &&
+         (wolfidps_route_match_family(wolfidps, *image, 0, match, route, rule) == 0));
+    if (cache_ent)
+        wolfidps_dispatch_cache_put(cache_ent, generation, *image, matched ? *route : NULL, matched ? *rule : WOLFIDPS_POLICY_NONE);
+    return matched;
 }
 
 int wolfidps_route_dispatch(
     struct wolfidps_context *wolfidps,
     struct wolfidps_sockaddr *src,
     struct wolfidps_sockaddr *dst,
+    void *context,
     wolfidps_disposition_t *disposition,
     wolfidps_time_t *ttl
-    );
+    ) {
+    struct wolfidps_route_match_context match;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_route *route;
+    struct wolfidps_epoch_slot *epoch_slot;
+    uint64_t start;
+    uint32_t rule;
+    int ret, matched, scanned = 0;
+
+    if (src->sa_family != dst->sa_family)
+        return BAD_FUNC_ARG;
+
+    match.src = src;
+    match.dst = dst;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &match.now) < 0)
+        return -1;
+
+    if (((epoch_slot = wolfidps_epoch_enter(wolfidps)) == NULL) &&
+        (wolfidps_lock_readonly(&wolfidps->lock) < 0))
+        return -1;
+
+    start = wolfidps_probe_begin(wolfidps, epoch_slot, WOLFIDPS_PROBE_DISPATCH);
+    matched = wolfidps_route_match_flow(wolfidps, epoch_slot, &match, &image, &route, &rule);
+    if (! matched) {
+        *disposition = WOLFIDPS_UNSPEC;
+        if (ttl)
+            *ttl = WOLFIDPS_TIME_NEVER;
+        scanned = wolfidps_scan_observe_1(wolfidps, epoch_slot, src, dst, match.now);
+        ret = 0;
+    } else if (route)
+        ret = wolfidps_route_dispatch_1(wolfidps, epoch_slot, route, match.now, context, disposition, ttl);
+    else
+        ret = wolfidps_policy_dispatch_1(wolfidps, epoch_slot, image, rule, match.now, context, disposition, ttl);
+    if (ret == 0)
+        wolfidps_stats_disposition(wolfidps, epoch_slot, *disposition);
+    /* the slot's shard is only safe to touch until it's left. */
+    wolfidps_probe_end(wolfidps, epoch_slot, WOLFIDPS_PROBE_DISPATCH, start);
+
+    if (epoch_slot)
+        wolfidps_epoch_leave(epoch_slot);
+    else
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    wolfidps_action_queue_flush(wolfidps);
+    /* penalty routes need the table lock for writing. */
+    if (scanned > 0)
+        (void)wolfidps_scan_penalize(wolfidps);
+    return ret;
+}
+
+/* number of trie descents kept in flight at once by
+ * wolfidps_route_dispatch_batch().
+ */
+#ifndef WOLFIDPS_DISPATCH_BATCH_WIDTH
+#define WOLFIDPS_DISPATCH_BATCH_WIDTH 8
+#endif
+
+int wolfidps_route_dispatch_batch(
+    struct wolfidps_context *wolfidps,
+    int n_flows,
+    struct wolfidps_sockaddr * const *srcs,
+    struct wolfidps_sockaddr * const *dsts,
+    void * const *contexts,
+    wolfidps_disposition_t *dispositions,
+    wolfidps_time_t *ttls
+    ) {
+    struct wolfidps_route_trie_walk walks[WOLFIDPS_DISPATCH_BATCH_WIDTH];
+    struct wolfidps_dispatch_cache_ent *cache_ents[WOLFIDPS_DISPATCH_BATCH_WIDTH];
+    struct wolfidps_route *routes[WOLFIDPS_DISPATCH_BATCH_WIDTH];
+    uint32_t rules[WOLFIDPS_DISPATCH_BATCH_WIDTH];
+    u_char cached[WOLFIDPS_DISPATCH_BATCH_WIDTH];
+    struct wolfidps_route_match_context match;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_epoch_slot *epoch_slot;
+    struct wolfidps_dispatch_cache *cache;
+    uint64_t start, generation = 0;
+    woldidps_time_t now;
+    int base, i, flow = 0, ret = 0, scanned = 0;
+
+    if (n_flows < 0)
+        return BAD_FUNC_ARG;
+    for (i = 0; i < n_flows; ++i) {
+        if (srcs[i]->sa_family != dsts[i]->sa_family)
+            return BAD_FUNC_ARG;
+    }
+
+    /* one clock read and one lock acquisition for the whole batch. */
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0)
+        return -1;
+
+    if (((epoch_slot = wolfidps_epoch_enter(wolfidps)) == NULL) &&
+        (wolfidps_lock_readonly(&wolfidps->lock) < 0))
+        return -1;
+
+    start = wolfidps_probe_begin(wolfidps, epoch_slot, WOLFIDPS_PROBE_DISPATCH_BATCH);
+    match.now = now;
+    /* as in wolfidps_route_match_flow(), the generation comes first. */
+    cache = epoch_slot ? epoch_slot->dispatch_cache : NULL;
+    if (cache)
+        generation = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->routes.generation);
+    image = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(wolfidps->policy);
+
+    for (base = 0; base < n_flows; base += WOLFIDPS_DISPATCH_BATCH_WIDTH) {
+        int width = n_flows - base, active;
+        if (width > WOLFIDPS_DISPATCH_BATCH_WIDTH)
+            width = WOLFIDPS_DISPATCH_BATCH_WIDTH;
+
+        /* flows found in the dispatch cache sit out the walk. */
+        for (i = 0; i < width; ++i) {
+            const struct wolfidps_sockaddr *src = srcs[base + i];
+            routes[i] = NULL;
+            rules[i] = WOLFIDPS_POLICY_NONE;
+            cache_ents[i] = NULL;
+            cached[i] = cache &&
+                wolfidps_dispatch_cache_get(cache, generation, image, src, dsts[base + i], now, &cache_ents[i], &routes[i], &rules[i]);
+            wolfidps_route_trie_walk_init(&walks[i], cached[i] ? NULL : wolfidps_route_trie_family_get(&wolfidps->routes, WOLFIDPS_ROUTE_TABLE_SRC_ENT, src->sa_family), src->addr, src->addr_len);
+            if (walks[i].node)
+                WOLFIDPS_PREFETCH(walks[i].node);
+            if (base + WOLFIDPS_DISPATCH_BATCH_WIDTH + i < n_flows) {
+                WOLFIDPS_PREFETCH(srcs[base + WOLFIDPS_DISPATCH_BATCH_WIDTH + i]);
+                WOLFIDPS_PREFETCH(dsts[base + WOLFIDPS_DISPATCH_BATCH_WIDTH + i]);
+            }
+        }
+
+        /* step all walks in lockstep, so that each one's next node load
+         * overlaps with work on the others.
+         */
+        do {
+            active = 0;
+            for (i = 0; i < width; ++i)
+                active |= wolfidps_route_trie_walk_step(&walks[i]);
+        } while (active);
+
+        for (i = 0; i < width; ++i) {
+            int matched;
+            flow = base + i;
+            match.src = srcs[flow];
+            match.dst = dsts[flow];
+            if (cached[i])
+                matched = (routes[i] != NULL) || (rules[i] != WOLFIDPS_POLICY_NONE);
+            else {
+                matched = (wolfidps_route_match_merge(image, match.src->sa_family, wolfidps_route_classify(wolfidps, match.src->sa_family, &match, wolfidps_route_trie_walk_match(&walks[i], wolfidps_route_matches, &match)), &match, &routes[i], &rules[i]) == 0) ||
+                    ((match.src->sa_family != 0) &&
+                     (wolfidps_route_match_family(wolfidps, image, 0, &match, &routes[i], &rules[i]) == 0));
+                /* a missed entry is keyed to the last flow in the walk to
+                 * miss on it, and puts go in flow order, so that's whose
+                 * result it's left with.
+                 */
+                if (cache_ents[i])
+                    wolfidps_dispatch_cache_put(cache_ents[i], generation, image, matched ? routes[i] : NULL, matched ? rules[i] : WOLFIDPS_POLICY_NONE);
+            }
+            if (! matched) {
+                dispositions[flow] = WOLFIDPS_UNSPEC;
+                if (ttls)
+                    ttls[flow] = WOLFIDPS_TIME_NEVER;
+                wolfidps_stats_disposition(wolfidps, epoch_slot, WOLFIDPS_UNSPEC);
+                scanned |= wolfidps_scan_observe_1(wolfidps, epoch_slot, match.src, match.dst, now);
+                continue;
+            }
+            if (routes[i])
+                ret = wolfidps_route_dispatch_1(wolfidps, epoch_slot, routes[i], now, contexts ? contexts[flow] : NULL, &dispositions[flow], ttls ? &ttls[flow] : NULL);
+            else
+                ret = wolfidps_policy_dispatch_1(wolfidps, epoch_slot, image, rules[i], now, contexts ? contexts[flow] : NULL, &dispositions[flow], ttls ? &ttls[flow] : NULL);
+            if (ret < 0)
+                goto out;
+            wolfidps_stats_disposition(wolfidps, epoch_slot, dispositions[flow]);
+        }
+    }
+
+  out:
+    /* flows left undispatched by an error, the failed one included. */
+    if (ret < 0) {
+        for (; flow < n_flows; ++flow) {
+            dispositions[flow] = WOLFIDPS_UNSPEC;
+            if (ttls)
+                ttls[flow] = WOLFIDPS_TIME_NEVER;
+        }
+    }
+    wolfidps_probe_end(wolfidps, epoch_slot, WOLFIDPS_PROBE_DISPATCH_BATCH, start);
+    if (epoch_slot)
+        wolfidps_epoch_leave(epoch_slot);
+    else
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    wolfidps_action_queue_flush(wolfidps);
+    if (scanned > 0)
+        (void)wolfidps_scan_penalize(wolfidps);
+    return ret;
+}
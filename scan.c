@@ -0,0 +1,365 @@
+#include "wolfidps_internal.h"
+
+#include <sched.h>
+
+/* port scan detection -- see wolfidps_scan_detect_start().
+ *
+ * each source tracked has an ent, found by a hash of its address among
+ * WOLFIDPS_SCAN_MAX_PROBES consecutive ents, holding a linear counting
+ * sketch of the dst ports it has tried this window: a bit per hash bucket
+ * of { proto, port }.  the distinct port count that would leave n bits set
+ * on average is worked out up front, so that the hot path only counts
+ * bits.  ents are updated under a spin lock of their own.
+ *
+ * sources found scanning are put on a short pending list, and their
+ * penalty routes inserted by wolfidps_scan_penalize() once the dispatch
+ * that found them has left its epoch or dropped the table lock.
+ */
+
+#ifndef WOLFIDPS_SCAN_SKETCH_BITS
+#define WOLFIDPS_SCAN_SKETCH_BITS 256 /* a power of 2, at least 64 */
+#endif
+#ifndef WOLFIDPS_SCAN_MAX_THRESHOLD
+#define WOLFIDPS_SCAN_MAX_THRESHOLD (2 * WOLFIDPS_SCAN_SKETCH_BITS)
+#endif
+#ifndef WOLFIDPS_SCAN_MAX_PROBES
+#define WOLFIDPS_SCAN_MAX_PROBES 4
+#endif
+
+struct wolfidps_scan_ent {
+    volatile int lock;
+    u_char triggered; /* this window */
+    uint64_t key; /* of the source, 0 while free */
+    woldidps_time_t window_start;
+    uint64_t ports[WOLFIDPS_SCAN_SKETCH_BITS / 64];
+};
+
+static void wolfidps_scan_lock(volatile int *lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        (void)sched_yield();
+}
+
+static void wolfidps_scan_unlock(volatile int *lock) {
+    WOLFIDPS_ATOMIC_STORE_RELEASE(*lock, 0);
+}
+
+/* fnv-1a over family and address, never 0. */
+static uint64_t wolfidps_scan_key(const struct wolfidps_sockaddr *src) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned int i, n = WOLFIDPS_BITS_TO_BYTES(src->addr_len);
+
+    hash = (hash ^ (src->sa_family & 0xff)) * 0x100000001b3ULL;
+    hash = (hash ^ (src->sa_family >> 8)) * 0x100000001b3ULL;
+    hash = (hash ^ src->addr_len) * 0x100000001b3ULL;
+    for (i = 0; i < n; ++i)
+        hash = (hash ^ src->addr[i]) * 0x100000001b3ULL;
+    return hash ? hash : 1;
+}
+
+static unsigned int wolfidps_scan_bit(const struct wolfidps_sockaddr *dst) {
+    uint32_t x = ((uint32_t)dst->sa_proto << 16) | dst->sa_port;
+    return (unsigned int)((x * 0x9E3779B1U) >> (32 - __builtin_ctz(WOLFIDPS_SCAN_SKETCH_BITS)));
+}
+
+/* the expected number of bits set by threshold distinct ports. */
+static uint32_t wolfidps_scan_trigger_bits(int threshold) {
+    double clear = 1.0;
+    uint32_t bits;
+    int i;
+
+    for (i = 0; i < threshold; ++i)
+        clear *= 1.0 - (1.0 / WOLFIDPS_SCAN_SKETCH_BITS);
+    bits = (uint32_t)(WOLFIDPS_SCAN_SKETCH_BITS * (1.0 - clear) + 0.5);
+    return bits ? bits : 1;
+}
+
+static void wolfidps_scan_pend(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, const struct wolfidps_sockaddr *src) {
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    struct wolfidps_scan_penalty *penalty;
+
+    wolfidps_scan_lock(&scanner->pending_lock);
+    if (scanner->n_pending == WOLFIDPS_SCAN_MAX_PENDING) {
+        wolfidps_scan_unlock(&scanner->pending_lock);
+        wolfidps_counter_inc(wolfidps, slot, scanner->n_penalties_dropped);
+        return;
+    }
+    penalty = &scanner->pending[scanner->n_pending++];
+    penalty->sa_family = src->sa_family;
+    penalty->addr_len = src->addr_len;
+    memcpy(penalty->addr, src->addr, WOLFIDPS_BITS_TO_BYTES(src->addr_len));
+    wolfidps_scan_unlock(&scanner->pending_lock);
+}
+
+/* count the attempt, in an epoch or with the table lock held.  returns 1
+ * if it put src over the threshold, and queued its penalty.
+ */
+int wolfidps_scan_observe_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    const struct wolfidps_sockaddr *src,
+    const struct wolfidps_sockaddr *dst,
+    woldidps_time_t now)
+{
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    struct wolfidps_scan_ent *ents = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(scanner->ents), *ent = NULL, *victim = NULL;
+    wolfidps_time_t victim_age = 0;
+    uint64_t key, mask;
+    unsigned int bit, i, n_bits;
+    int crossed = 0;
+
+    if (ents == NULL)
+        return 0;
+    wolfidps_counter_inc(wolfidps, slot, scanner->n_observed);
+    key = wolfidps_scan_key(src);
+    for (i = 0; i < WOLFIDPS_SCAN_MAX_PROBES; ++i) {
+        struct wolfidps_scan_ent *probe = &ents[(key + i) & (scanner->n_ents - 1)];
+        uint64_t probe_key = __atomic_load_n(&probe->key, __ATOMIC_RELAXED);
+        wolfidps_time_t age;
+        if (probe_key == key) {
+            wolfidps_scan_lock(&probe->lock);
+            if (probe->key == key) {
+                ent = probe;
+                break;
+            }
+            wolfidps_scan_unlock(&probe->lock);
+        }
+        /* failing a match, the ent whose window is oldest, free ents
+         * first.  a window started in the future, the clock having gone
+         * back, counts as age 0.
+         */
+        if (probe_key == 0)
+            age = UINT64_MAX;
+        else if (now > probe->window_start)
+            age = (wolfidps_time_t)(now - probe->window_start);
+        else
+            age = 0;
+        if ((victim == NULL) || (age > victim_age)) {
+            victim = probe;
+            victim_age = age;
+        }
+    }
+    if (ent == NULL) {
+        ent = victim;
+        wolfidps_scan_lock(&ent->lock);
+        if ((ent->key != 0) && (now - ent->window_start < (woldidps_time_t)scanner->window))
+            wolfidps_counter_inc(wolfidps, slot, scanner->n_evicted);
+        __atomic_store_n(&ent->key, key, __ATOMIC_RELAXED);
+        memset(ent->ports, 0, sizeof ent->ports);
+        ent->window_start = now;
+        ent->triggered = 0;
+    }
+
+    if (now - ent->window_start >= (woldidps_time_t)scanner->window) {
+        memset(ent->ports, 0, sizeof ent->ports);
+        ent->window_start = now;
+        ent->triggered = 0;
+    }
+    bit = wolfidps_scan_bit(dst);
+    mask = (uint64_t)1 << (bit & 63);
+    if (! (ent->ports[bit >> 6] & mask)) {
+        ent->ports[bit >> 6] |= mask;
+        if (! ent->triggered) {
+            for (i = 0, n_bits = 0; i < WOLFIDPS_SCAN_SKETCH_BITS / 64; ++i)
+                n_bits += (unsigned int)__builtin_popcountll(ent->ports[i]);
+            if (n_bits >= scanner->trigger_bits)
+                crossed = ent->triggered = 1;
+        }
+    }
+    wolfidps_scan_unlock(&ent->lock);
+
+    if (crossed) {
+        wolfidps_counter_inc(wolfidps, slot, scanner->n_triggered);
+        wolfidps_scan_pend(wolfidps, slot, src);
+    }
+    return crossed;
+}
+
+/* count a hit on the event, and insert the penalty route.  called with
+ * the table lock held.
+ */
+static int wolfidps_scan_penalize_1(struct wolfidps_context *wolfidps, const struct wolfidps_scan_penalty *penalty) {
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    uint64_t src_buf[(sizeof(struct wolfidps_sockaddr) + sizeof penalty->addr + 7) / 8];
+    uint64_t dst_buf[(sizeof(struct wolfidps_sockaddr) + 7) / 8];
+    struct wolfidps_sockaddr *src = (struct wolfidps_sockaddr *)src_buf, *dst = (struct wolfidps_sockaddr *)dst_buf;
+    wolfidps_route_flags_t flags;
+    struct wolfidps_event *event;
+    struct wolfidps_route *route;
+    int ret;
+
+    if (scanner->event_label_len == 0)
+        return 0; /* stopped since */
+    if ((ret = wolfidps_event_getreference(wolfidps, scanner->event_label_len, scanner->event_label, &event)) < 0)
+        return ret;
+    wolfidps_counter_inc(wolfidps, NULL, event->hitcount);
+    if (scanner->penalty_ttl == WOLFIDPS_TIME_NEVER) {
+        wolfidps_event_dropreference(wolfidps, event);
+        return 0;
+    }
+
+    memset(src, 0, sizeof *src);
+    memset(dst, 0, sizeof *dst);
+    src->sa_family = dst->sa_family = penalty->sa_family;
+    src->addr_len = penalty->addr_len;
+    memcpy(src->addr, penalty->addr, WOLFIDPS_BITS_TO_BYTES(penalty->addr_len));
+    flags.flags = 0;
+    flags.src_if_id_wildcard = flags.dst_if_id_wildcard = 1;
+    flags.sa_dst_addr_wildcard = 1;
+    flags.sa_proto_wildcard = 1;
+    flags.sa_src_port_wildcard = flags.sa_dst_port_wildcard = 1;
+    /* an existing penalty route is left as it is. */
+    if ((ret = wolfidps_route_insert_1(wolfidps, src, dst, flags, event, scanner->penalty_ttl, &route)) < 0) {
+        wolfidps_event_dropreference(wolfidps, event);
+        return ret;
+    }
+    if ((scanner->action_label_len > 0) &&
+        (wolfidps_action_getreference(wolfidps, scanner->action_label_len, scanner->action_label, &route->action) < 0))
+        route->action = NULL;
+    return 0;
+}
+
+/* insert the penalty routes of sources found scanning.  called by
+ * dispatch, with no epoch entered and no lock held.
+ */
+int wolfidps_scan_penalize(struct wolfidps_context *wolfidps) {
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    struct wolfidps_scan_penalty penalty;
+    int n = 0;
+
+    for (;;) {
+        wolfidps_scan_lock(&scanner->pending_lock);
+        if (scanner->n_pending == 0) {
+            wolfidps_scan_unlock(&scanner->pending_lock);
+            return n;
+        }
+        penalty = scanner->pending[--scanner->n_pending];
+        wolfidps_scan_unlock(&scanner->pending_lock);
+        if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+            return -1;
+        if (wolfidps_scan_penalize_1(wolfidps, &penalty) == 0)
+            ++n;
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    }
+}
+
+int wolfidps_scan_observe(struct wolfidps_context *wolfidps, const struct wolfidps_sockaddr *src, const struct wolfidps_sockaddr *dst) {
+    struct wolfidps_epoch_slot *epoch_slot;
+    woldidps_time_t now;
+    int ret;
+
+    if (src->sa_family != dst->sa_family)
+        return BAD_FUNC_ARG;
+    if (wolfidps->timecbs.get_time(wolfidps->timecbs.context, &now) < 0)
+        return -1;
+    if (((epoch_slot = wolfidps_epoch_enter(wolfidps)) == NULL) &&
+        (wolfidps_lock_readonly(&wolfidps->lock) < 0))
+        return -1;
+    ret = wolfidps_scan_observe_1(wolfidps, epoch_slot, src, dst, now);
+    if (epoch_slot)
+        wolfidps_epoch_leave(epoch_slot);
+    else
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+    if (ret > 0)
+        (void)wolfidps_scan_penalize(wolfidps);
+    return ret;
+}
+
+int wolfidps_scan_detect_start(struct wolfidps_context *wolfidps, const struct wolfidps_scan_params *params) {
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    struct wolfidps_scan_ent *ents;
+    uint32_t n_ents = 1;
+    size_t size;
+    int ret = 0;
+
+    if ((params == NULL) || (params->n_sources <= 0) || (params->n_sources > (1 << 30)) ||
+        (params->threshold <= 0) || (params->threshold > WOLFIDPS_SCAN_MAX_THRESHOLD) ||
+        (params->window == 0) ||
+        (params->event_label == NULL) || (params->event_label_len <= 0) || (params->event_label_len > 255) ||
+        (params->action_label && ((params->action_label_len <= 0) || (params->action_label_len > 255))))
+        return BAD_FUNC_ARG;
+    while (n_ents < (uint32_t)params->n_sources)
+        n_ents <<= 1;
+    if (n_ents < WOLFIDPS_SCAN_MAX_PROBES)
+        n_ents = WOLFIDPS_SCAN_MAX_PROBES;
+
+    size = (size_t)n_ents * sizeof *ents;
+    if (wolfidps->allocator.memalign)
+        ents = (struct wolfidps_scan_ent *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, size);
+    else
+        ents = (struct wolfidps_scan_ent *)wolfidps->allocator.malloc(wolfidps->allocator.context, size);
+    if (ents == NULL)
+        return MEMORY_E;
+    memset(ents, 0, size);
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0) {
+        wolfidps->allocator.free(wolfidps->allocator.context, ents);
+        return -1;
+    }
+    if (scanner->ents)
+        ret = BAD_STATE_E;
+    else if ((scanner->n_observed == 0) &&
+             ((ret = wolfidps_counter_alloc_range(wolfidps, 4, &scanner->n_observed)) == 0)) {
+        scanner->n_triggered = scanner->n_observed + 1;
+        scanner->n_evicted = scanner->n_observed + 2;
+        scanner->n_penalties_dropped = scanner->n_observed + 3;
+    }
+    if (ret < 0) {
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+        wolfidps->allocator.free(wolfidps->allocator.context, ents);
+        return ret;
+    }
+    scanner->n_ents = n_ents;
+    scanner->trigger_bits = wolfidps_scan_trigger_bits(params->threshold);
+    scanner->window = params->window;
+    scanner->penalty_ttl = params->penalty_ttl;
+    scanner->event_label_len = (byte)params->event_label_len;
+    memcpy(scanner->event_label, params->event_label, (size_t)params->event_label_len);
+    scanner->action_label_len = params->action_label ? (byte)params->action_label_len : 0;
+    if (params->action_label)
+        memcpy(scanner->action_label, params->action_label, (size_t)params->action_label_len);
+    WOLFIDPS_ATOMIC_STORE_RELEASE(scanner->ents, ents);
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return 0;
+}
+
+int wolfidps_scan_detect_stop(struct wolfidps_context *wolfidps) {
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    struct wolfidps_scan_ent *ents;
+
+    if (wolfidps_table_lock_readwrite(wolfidps) < 0)
+        return -1;
+    if ((ents = scanner->ents) == NULL) {
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+        return BAD_STATE_E;
+    }
+    WOLFIDPS_ATOMIC_STORE_RELEASE(scanner->ents, NULL);
+    scanner->event_label_len = scanner->action_label_len = 0;
+    wolfidps_epoch_retire(wolfidps, ents);
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return 0;
+}
+
+int wolfidps_scan_get_stats(struct wolfidps_context *wolfidps, struct wolfidps_scan_stats *stats) {
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    memset(stats, 0, sizeof *stats);
+    if (scanner->n_observed == 0)
+        return 0;
+    if ((wolfidps_counter_get(wolfidps, scanner->n_observed, &stats->n_observed) < 0) ||
+        (wolfidps_counter_get(wolfidps, scanner->n_triggered, &stats->n_triggered) < 0) ||
+        (wolfidps_counter_get(wolfidps, scanner->n_evicted, &stats->n_evicted) < 0) ||
+        (wolfidps_counter_get(wolfidps, scanner->n_penalties_dropped, &stats->n_penalties_dropped) < 0))
+        return -1;
+    return 0;
+}
+
+/* shutdown -- no dispatch is in progress. */
+void wolfidps_scanner_free(struct wolfidps_context *wolfidps) {
+    struct wolfidps_scanner *scanner = &wolfidps->scanner;
+    if (scanner->ents)
+        wolfidps->allocator.free(wolfidps->allocator.context, scanner->ents);
+    scanner->ents = NULL;
+    scanner->n_pending = 0;
+    if (scanner->n_observed)
+        wolfidps_counter_release_range(wolfidps, scanner->n_observed, 4);
+    scanner->n_observed = 0;
+}
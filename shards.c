@@ -0,0 +1,193 @@
+#include "wolfidps_internal.h"
+
+#include <sys/socket.h>
+
+/* sharded route tables.
+ *
+ * each shard is a whole context, so inserts, deletes and expiry in one
+ * shard take only its own table lock, and readers of the others never
+ * notice.  a source's shard is picked by a hash of its family and leading
+ * prefix bits, so that every route that can match a flow from the source
+ * lives in the same shard -- except those with a shorter src prefix,
+ * which are kept once in the shared tier rather than replicated.
+ */
+
+int wolfidps_shards_init(
+    struct wolfidps_allocator *allocator,
+    int n_shards,
+    unsigned int inet_prefix_bits,
+    unsigned int inet6_prefix_bits,
+    struct wolfidps_shards **shards)
+{
+    struct wolfidps_context *shared;
+    int i, ret;
+
+    if ((n_shards < 1) || (inet_prefix_bits > 32) || (inet6_prefix_bits > 128))
+        return BAD_FUNC_ARG;
+    /* the shared tier's allocator, defaulted if need be, serves for the rest. */
+    if ((ret = wolfidps_init(allocator, &shared)) < 0)
+        return ret;
+    *shards = (struct wolfidps_shards *)shared->allocator.malloc(shared->allocator.context, sizeof **shards + ((size_t)n_shards + 1) * sizeof (*shards)->contexts[0]);
+    if (*shards == NULL) {
+        (void)wolfidps_shutdown(&shared);
+        return MEMORY_E;
+    }
+    memset(*shards, 0, sizeof **shards + ((size_t)n_shards + 1) * sizeof (*shards)->contexts[0]);
+    (*shards)->allocator = shared->allocator;
+    (*shards)->n_shards = n_shards;
+    (*shards)->inet_prefix_bits = inet_prefix_bits;
+    (*shards)->inet6_prefix_bits = inet6_prefix_bits;
+    (*shards)->contexts[n_shards] = shared;
+    for (i = 0; i < n_shards; ++i) {
+        if ((ret = wolfidps_init(&(*shards)->allocator, &(*shards)->contexts[i])) < 0) {
+            (void)wolfidps_shards_shutdown(shards);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int wolfidps_shards_shutdown(struct wolfidps_shards **shards) {
+    struct wolfidps_allocator allocator = (*shards)->allocator;
+    int i;
+
+    for (i = 0; i <= (*shards)->n_shards; ++i) {
+        if ((*shards)->contexts[i])
+            (void)wolfidps_shutdown(&(*shards)->contexts[i]);
+    }
+    allocator.free(allocator.context, *shards);
+    *shards = NULL;
+    return 0;
+}
+
+struct wolfidps_context *wolfidps_shards_context(struct wolfidps_shards *shards, const struct wolfidps_sockaddr *src) {
+    u_char key[sizeof(wolfidps_family_t) + 128/8];
+    unsigned int prefix_bits, prefix_bytes;
+
+    if (src->sa_family == AF_INET)
+        prefix_bits = shards->inet_prefix_bits;
+    else if (src->sa_family == AF_INET6)
+        prefix_bits = shards->inet6_prefix_bits;
+    else
+        return WOLFIDPS_SHARDS_SHARED(shards);
+    if (src->addr_len < prefix_bits)
+        return WOLFIDPS_SHARDS_SHARED(shards);
+
+    /* family, then the prefix, with any bits past it zeroed. */
+    prefix_bytes = WOLFIDPS_BITS_TO_BYTES(prefix_bits);
+    memcpy(key, &src->sa_family, sizeof src->sa_family);
+    memcpy(key + sizeof src->sa_family, src->addr, prefix_bytes);
+    if (prefix_bits & 7)
+        key[sizeof src->sa_family + (prefix_bits >> 3)] &= (u_char)(0xff << (8 - (prefix_bits & 7)));
+    return shards->contexts[wolfidps_name_hash((const char *)key, (uint32_t)(sizeof src->sa_family + prefix_bytes)) % (uint32_t)shards->n_shards];
+}
+
+int wolfidps_shards_route_insert(
+    struct wolfidps_shards *shards,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label,
+    wolfidps_time_t ttl
+    ) {
+    return wolfidps_route_insert(wolfidps_shards_context(shards, src), src, dst, flags, event_label_len, event_label, ttl);
+}
+
+int wolfidps_shards_route_delete(
+    struct wolfidps_shards *shards,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label
+    ) {
+    return wolfidps_route_delete(wolfidps_shards_context(shards, src), src, dst, flags, event_label_len, event_label);
+}
+
+static int wolfidps_shards_enter(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot **slot) {
+    if (((*slot = wolfidps_epoch_enter(wolfidps)) == NULL) &&
+        (wolfidps_lock_readonly(&wolfidps->lock) < 0))
+        return -1;
+    return 0;
+}
+
+static void wolfidps_shards_leave(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    if (slot)
+        wolfidps_epoch_leave(slot);
+    else
+        (void)wolfidps_lock_unlock(&wolfidps->lock);
+}
+
+int wolfidps_shards_route_dispatch(
+    struct wolfidps_shards *shards,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    void *context,
+    wolfidps_disposition_t *disposition,
+    wolfidps_time_t *ttl
+    ) {
+    struct wolfidps_context *shard, *shared = WOLFIDPS_SHARDS_SHARED(shards), *owner;
+    struct wolfidps_route_match_context match;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_route *route;
+    struct wolfidps_epoch_slot *shard_slot, *shared_slot = NULL, *slot;
+    uint64_t start;
+    uint32_t rule;
+    int ret, matched, scanned = 0;
+
+    if (src->sa_family != dst->sa_family)
+        return BAD_FUNC_ARG;
+    if ((shard = wolfidps_shards_context(shards, src)) == shared)
+        return wolfidps_route_dispatch(shared, src, dst, context, disposition, ttl);
+
+    match.src = src;
+    match.dst = dst;
+    if (shard->timecbs.get_time(shard->timecbs.context, &match.now) < 0)
+        return -1;
+
+    if (wolfidps_shards_enter(shard, &shard_slot) < 0)
+        return -1;
+    owner = shard;
+    slot = shard_slot;
+    start = wolfidps_probe_begin(shard, shard_slot, WOLFIDPS_PROBE_DISPATCH);
+    matched = wolfidps_route_match_flow(shard, shard_slot, &match, &image, &route, &rule);
+    /* the shared tier is only entered on a miss, and always after the
+     * shard, so readers holding both never deadlock with each other.
+     */
+    if (! matched) {
+        if (wolfidps_shards_enter(shared, &shared_slot) < 0) {
+            wolfidps_shards_leave(shard, shard_slot);
+            return -1;
+        }
+        owner = shared;
+        slot = shared_slot;
+        matched = wolfidps_route_match_flow(shared, shared_slot, &match, &image, &route, &rule);
+    }
+
+    if (! matched) {
+        *disposition = WOLFIDPS_UNSPEC;
+        if (ttl)
+            *ttl = WOLFIDPS_TIME_NEVER;
+        scanned = wolfidps_scan_observe_1(shard, shard_slot, src, dst, match.now);
+        ret = 0;
+    } else if (route)
+        ret = wolfidps_route_dispatch_1(owner, slot, route, match.now, context, disposition, ttl);
+    else
+        ret = wolfidps_policy_dispatch_1(owner, slot, image, rule, match.now, context, disposition, ttl);
+    /* the whole dispatch is charged to the shard. */
+    if (ret == 0)
+        wolfidps_stats_disposition(shard, shard_slot, *disposition);
+    wolfidps_probe_end(shard, shard_slot, WOLFIDPS_PROBE_DISPATCH, start);
+
+    if (owner == shared)
+        wolfidps_shards_leave(shared, shared_slot);
+    wolfidps_shards_leave(shard, shard_slot);
+    wolfidps_action_queue_flush(shard);
+    if (owner == shared)
+        wolfidps_action_queue_flush(shared);
+    /* penalty routes need the shard's table lock for writing. */
+    if (scanned > 0)
+        (void)wolfidps_scan_penalize(shard);
+    return ret;
+}
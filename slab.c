@@ -0,0 +1,358 @@
+#include "wolfidps_internal.h"
+
+#include <sched.h>
+#ifndef WOLFIDPS_NO_MMAP
+#include <sys/mman.h>
+#endif
+
+/* slab allocator -- see struct wolfidps_slab.
+ *
+ * pages are aligned to WOLFIDPS_SLAB_PAGE_SIZE, so the page header of any
+ * object is found by masking its address.  objects larger than a page get
+ * a dedicated mapping, with a page header of its own, in mapped mode, and
+ * are refused in static buffer mode.
+ */
+
+#ifndef WOLFIDPS_SLAB_CHUNK_PAGES
+#define WOLFIDPS_SLAB_CHUNK_PAGES 16 /* pages per mapping in mapped mode */
+#endif
+
+#define WOLFIDPS_SLAB_ALIGN 16
+#define WOLFIDPS_SLAB_ROUND_UP(x, a) (((x) + ((a) - 1)) & ~((a) - 1))
+#define WOLFIDPS_SLAB_PAGE_OF(ptr) ((struct wolfidps_slab_page *)((uintptr_t)(ptr) & ~(uintptr_t)(WOLFIDPS_SLAB_PAGE_SIZE - 1)))
+#define WOLFIDPS_SLAB_PAGE_ROOM (WOLFIDPS_SLAB_PAGE_SIZE - WOLFIDPS_SLAB_PAGE_HDR)
+
+static void wolfidps_slab_lock(struct wolfidps_slab *slab) {
+    while (__atomic_exchange_n(&slab->lock, 1, __ATOMIC_ACQUIRE))
+        (void)sched_yield();
+}
+
+static void wolfidps_slab_unlock(struct wolfidps_slab *slab) {
+    WOLFIDPS_ATOMIC_STORE_RELEASE(slab->lock, 0);
+}
+
+static void wolfidps_slab_page_link(struct wolfidps_slab_page **head, struct wolfidps_slab_page *page) {
+    page->next = *head;
+    if (page->next)
+        page->next->pprev = &page->next;
+    page->pprev = head;
+    *head = page;
+}
+
+static void wolfidps_slab_page_unlink(struct wolfidps_slab_page *page) {
+    *page->pprev = page->next;
+    if (page->next)
+        page->next->pprev = page->pprev;
+    page->next = NULL;
+    page->pprev = NULL;
+}
+
+/* insert a size class, keeping the classes sorted by size. */
+static void wolfidps_slab_class_add(struct wolfidps_slab *slab, size_t obj_size) {
+    int i;
+
+    obj_size = WOLFIDPS_SLAB_ROUND_UP(obj_size, (size_t)WOLFIDPS_SLAB_ALIGN);
+    if (obj_size > WOLFIDPS_SLAB_PAGE_ROOM)
+        return;
+    for (i = 0; i < slab->n_classes; ++i) {
+        if (slab->classes[i].obj_size == obj_size)
+            return;
+        if (slab->classes[i].obj_size > obj_size)
+            break;
+    }
+    if (slab->n_classes == WOLFIDPS_SLAB_MAX_CLASSES)
+        return;
+    memmove(&slab->classes[i + 1], &slab->classes[i], (size_t)(slab->n_classes - i) * sizeof slab->classes[0]);
+    memset(&slab->classes[i], 0, sizeof slab->classes[i]);
+    slab->classes[i].obj_size = (uint32_t)obj_size;
+    slab->classes[i].objs_per_page = (uint32_t)(WOLFIDPS_SLAB_PAGE_ROOM / obj_size);
+    ++slab->n_classes;
+}
+
+#ifndef WOLFIDPS_NO_MMAP
+
+/* map a chunk of pages.  the chunk header sits in the slack below the
+ * first aligned page.
+ */
+static int wolfidps_slab_chunk_map(struct wolfidps_slab *slab) {
+    size_t map_len = (WOLFIDPS_SLAB_CHUNK_PAGES + 1) * WOLFIDPS_SLAB_PAGE_SIZE;
+    struct wolfidps_slab_chunk *chunk;
+    void *p;
+
+    p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return MEMORY_E;
+    chunk = (struct wolfidps_slab_chunk *)p;
+    chunk->map_len = map_len;
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    slab->carve_next = (u_char *)WOLFIDPS_SLAB_ROUND_UP((uintptr_t)(chunk + 1), (uintptr_t)WOLFIDPS_SLAB_PAGE_SIZE);
+    slab->carve_end = slab->carve_next + (WOLFIDPS_SLAB_CHUNK_PAGES * WOLFIDPS_SLAB_PAGE_SIZE);
+    return 0;
+}
+
+/* dedicated, page-aligned mapping for an object too big for any class. */
+static void *wolfidps_slab_large_alloc(struct wolfidps_slab *slab, size_t size) {
+    size_t need = WOLFIDPS_SLAB_ROUND_UP(size + WOLFIDPS_SLAB_PAGE_HDR, WOLFIDPS_SLAB_PAGE_SIZE);
+    size_t map_len = need + WOLFIDPS_SLAB_PAGE_SIZE;
+    struct wolfidps_slab_page *page;
+    u_char *p, *start;
+
+    if ((! slab->mapped) || (need < size) || (slab->footprint + need > slab->max_bytes))
+        return NULL;
+    p = (u_char *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == (u_char *)MAP_FAILED)
+        return NULL;
+    start = (u_char *)WOLFIDPS_SLAB_ROUND_UP((uintptr_t)p, (uintptr_t)WOLFIDPS_SLAB_PAGE_SIZE);
+    if (start > p)
+        (void)munmap(p, (size_t)(start - p));
+    if (start + need < p + map_len)
+        (void)munmap(start + need, (size_t)((p + map_len) - (start + need)));
+
+    page = (struct wolfidps_slab_page *)start;
+    memset(page, 0, sizeof *page);
+    page->size_class = -1;
+    page->map_len = need;
+    slab->footprint += need;
+    slab->in_use += need;
+    return start + WOLFIDPS_SLAB_PAGE_HDR;
+}
+
+#endif /* !WOLFIDPS_NO_MMAP */
+
+static struct wolfidps_slab_page *wolfidps_slab_page_get(struct wolfidps_slab *slab) {
+    struct wolfidps_slab_page *page;
+
+    if ((page = slab->free_pages)) {
+        slab->free_pages = page->next;
+        --slab->n_free_pages;
+        return page;
+    }
+    if (slab->footprint + WOLFIDPS_SLAB_PAGE_SIZE > slab->max_bytes)
+        return NULL;
+#ifndef WOLFIDPS_NO_MMAP
+    if (slab->mapped &&
+        (slab->carve_next == slab->carve_end) &&
+        (wolfidps_slab_chunk_map(slab) < 0))
+        return NULL;
+#endif
+    if (slab->carve_next == slab->carve_end)
+        return NULL;
+    page = (struct wolfidps_slab_page *)slab->carve_next;
+    slab->carve_next += WOLFIDPS_SLAB_PAGE_SIZE;
+    slab->footprint += WOLFIDPS_SLAB_PAGE_SIZE;
+    ++slab->n_pages;
+    return page;
+}
+
+static void *wolfidps_slab_alloc_class(struct wolfidps_slab *slab, int size_class) {
+    struct wolfidps_slab_class *class = &slab->classes[size_class];
+    struct wolfidps_slab_page *page = class->partial;
+    void *obj;
+
+    if (page == NULL) {
+        if ((page = wolfidps_slab_page_get(slab)) == NULL)
+            return NULL;
+        memset(page, 0, sizeof *page);
+        page->size_class = size_class;
+        wolfidps_slab_page_link(&class->partial, page);
+    }
+
+    if ((obj = page->free_objs))
+        page->free_objs = *(void **)obj;
+    else
+        obj = (u_char *)page + WOLFIDPS_SLAB_PAGE_HDR + ((size_t)page->n_carved++ * class->obj_size);
+    if (++page->n_used == class->objs_per_page)
+        wolfidps_slab_page_unlink(page);
+
+    ++class->n_objs;
+    slab->in_use += class->obj_size;
+    return obj;
+}
+
+/* smallest class that fits size, with objects aligned to alignment, or -1. */
+static int wolfidps_slab_class_find(struct wolfidps_slab *slab, size_t size, size_t alignment) {
+    int i;
+    for (i = 0; i < slab->n_classes; ++i) {
+        if ((slab->classes[i].obj_size >= size) &&
+            ((slab->classes[i].obj_size & (alignment - 1)) == 0))
+            return i;
+    }
+    return -1;
+}
+
+static void *wolfidps_slab_alloc(struct wolfidps_slab *slab, size_t size, size_t alignment) {
+    void *ret = NULL;
+    int size_class;
+
+    if (size == 0)
+        size = 1;
+    wolfidps_slab_lock(slab);
+    if ((size_class = wolfidps_slab_class_find(slab, size, alignment)) >= 0)
+        ret = wolfidps_slab_alloc_class(slab, size_class);
+#ifndef WOLFIDPS_NO_MMAP
+    else
+        ret = wolfidps_slab_large_alloc(slab, size);
+#endif
+    if (ret == NULL)
+        ++slab->n_failures;
+    wolfidps_slab_unlock(slab);
+    return ret;
+}
+
+static void *wolfidps_slab_malloc_cb(void *context, size_t size) {
+    return wolfidps_slab_alloc((struct wolfidps_slab *)context, size, WOLFIDPS_SLAB_ALIGN);
+}
+
+/* objects are aligned to their class size, up to the page header size. */
+static void *wolfidps_slab_memalign_cb(void *context, size_t alignment, size_t size) {
+    if ((alignment & (alignment - 1)) || (alignment > WOLFIDPS_SLAB_PAGE_HDR))
+        return NULL;
+    if (alignment < WOLFIDPS_SLAB_ALIGN)
+        alignment = WOLFIDPS_SLAB_ALIGN;
+    return wolfidps_slab_alloc((struct wolfidps_slab *)context, size, alignment);
+}
+
+static void wolfidps_slab_free_cb(void *context, void *ptr) {
+    struct wolfidps_slab *slab = (struct wolfidps_slab *)context;
+    struct wolfidps_slab_page *page;
+    struct wolfidps_slab_class *class;
+
+    if (ptr == NULL)
+        return;
+    page = WOLFIDPS_SLAB_PAGE_OF(ptr);
+
+    wolfidps_slab_lock(slab);
+#ifndef WOLFIDPS_NO_MMAP
+    if (page->size_class < 0) {
+        slab->footprint -= page->map_len;
+        slab->in_use -= page->map_len;
+        (void)munmap(page, page->map_len);
+        wolfidps_slab_unlock(slab);
+        return;
+    }
+#endif
+    class = &slab->classes[page->size_class];
+    *(void **)ptr = page->free_objs;
+    page->free_objs = ptr;
+    if (page->n_used-- == class->objs_per_page)
+        wolfidps_slab_page_link(&class->partial, page);
+    --class->n_objs;
+    slab->in_use -= class->obj_size;
+    if (page->n_used == 0) {
+        wolfidps_slab_page_unlink(page);
+        page->next = slab->free_pages;
+        slab->free_pages = page;
+        ++slab->n_free_pages;
+    }
+    wolfidps_slab_unlock(slab);
+}
+
+static void *wolfidps_slab_realloc_cb(void *context, void *ptr, size_t size) {
+    struct wolfidps_slab *slab = (struct wolfidps_slab *)context;
+    struct wolfidps_slab_page *page;
+    size_t old_size;
+    void *new;
+
+    if (ptr == NULL)
+        return wolfidps_slab_malloc_cb(context, size);
+    if (size == 0) {
+        wolfidps_slab_free_cb(context, ptr);
+        return NULL;
+    }
+    page = WOLFIDPS_SLAB_PAGE_OF(ptr);
+    if (page->size_class < 0)
+        old_size = page->map_len - WOLFIDPS_SLAB_PAGE_HDR;
+    else
+        old_size = slab->classes[page->size_class].obj_size;
+    if (size <= old_size)
+        return ptr;
+    if ((new = wolfidps_slab_malloc_cb(context, size)) == NULL)
+        return NULL;
+    memcpy(new, ptr, old_size);
+    wolfidps_slab_free_cb(context, ptr);
+    return new;
+}
+
+int wolfidps_slab_init(struct wolfidps_slab *slab, void *buf, size_t buf_size, size_t max_bytes, struct wolfidps_allocator *allocator) {
+    size_t obj_size;
+
+    if (slab == NULL)
+        return BAD_FUNC_ARG;
+    memset(slab, 0, sizeof *slab);
+
+    if (buf) {
+        u_char *start = (u_char *)WOLFIDPS_SLAB_ROUND_UP((uintptr_t)buf, (uintptr_t)WOLFIDPS_SLAB_PAGE_SIZE);
+        u_char *end = (u_char *)buf + buf_size;
+        if ((end < start) || ((size_t)(end - start) < WOLFIDPS_SLAB_PAGE_SIZE))
+            return BAD_FUNC_ARG;
+        slab->carve_next = start;
+        slab->carve_end = start + (((size_t)(end - start)) & ~(WOLFIDPS_SLAB_PAGE_SIZE - 1));
+        if ((max_bytes == 0) || (max_bytes > (size_t)(slab->carve_end - start)))
+            max_bytes = (size_t)(slab->carve_end - start);
+    } else {
+#ifdef WOLFIDPS_NO_MMAP
+        return BAD_FUNC_ARG;
+#else
+        slab->mapped = 1;
+        if (max_bytes == 0)
+            max_bytes = ~(size_t)0;
+#endif
+    }
+    slab->max_bytes = max_bytes;
+
+    for (obj_size = 16; obj_size <= 8192; obj_size <<= 1)
+        wolfidps_slab_class_add(slab, obj_size);
+    /* exact fits for IPv4 and IPv6 routes and trie nodes. */
+    wolfidps_slab_class_add(slab, sizeof(struct wolfidps_route) + (2 * 4));
+    wolfidps_slab_class_add(slab, sizeof(struct wolfidps_route) + (2 * 16));
+    wolfidps_slab_class_add(slab, sizeof(struct wolfidps_route_trie_node) + 4);
+    wolfidps_slab_class_add(slab, sizeof(struct wolfidps_route_trie_node) + 16);
+    /* anything else up to a whole page. */
+    wolfidps_slab_class_add(slab, WOLFIDPS_SLAB_PAGE_ROOM);
+
+    if (allocator) {
+        allocator->context = slab;
+        allocator->malloc = wolfidps_slab_malloc_cb;
+        allocator->free = wolfidps_slab_free_cb;
+        allocator->realloc = wolfidps_slab_realloc_cb;
+        allocator->memalign = wolfidps_slab_memalign_cb;
+    }
+    return 0;
+}
+
+int wolfidps_slab_get_stats(struct wolfidps_slab *slab, struct wolfidps_slab_stats *stats) {
+    int i;
+
+    if ((slab == NULL) || (stats == NULL))
+        return BAD_FUNC_ARG;
+    memset(stats, 0, sizeof *stats);
+    wolfidps_slab_lock(slab);
+    stats->max_bytes = slab->max_bytes;
+    stats->footprint = slab->footprint;
+    stats->in_use = slab->in_use;
+    stats->n_pages = slab->n_pages;
+    stats->n_free_pages = slab->n_free_pages;
+    stats->n_failures = slab->n_failures;
+    stats->n_classes = slab->n_classes;
+    for (i = 0; i < slab->n_classes; ++i) {
+        stats->classes[i].obj_size = slab->classes[i].obj_size;
+        stats->classes[i].n_objs = slab->classes[i].n_objs;
+    }
+    wolfidps_slab_unlock(slab);
+    return 0;
+}
+
+int wolfidps_slab_destroy(struct wolfidps_slab *slab) {
+    if (slab == NULL)
+        return BAD_FUNC_ARG;
+#ifndef WOLFIDPS_NO_MMAP
+    while (slab->chunks) {
+        struct wolfidps_slab_chunk *chunk = slab->chunks;
+        slab->chunks = chunk->next;
+        (void)munmap(chunk, chunk->map_len);
+    }
+#endif
+    memset(slab, 0, sizeof *slab);
+    return 0;
+}
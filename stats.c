@@ -0,0 +1,155 @@
+#include "wolfidps_internal.h"
+
+/* hot path probes -- see wolfidps_probe_t.
+ *
+ * like the hit counters, probes land in the caller's reader slot shard if
+ * it has one, else in the shared shard with atomic adds.  a slot shard is
+ * folded into the shared one when its slot goes away, so totals survive
+ * wolfidps_set_lockless_dispatch().  snapshots read every shard with
+ * relaxed loads, so never stall a probe.
+ */
+
+#ifndef WOLFIDPS_NO_STATS
+
+int wolfidps_stats_slot_init(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    if (wolfidps->allocator.memalign)
+        slot->stats = (struct wolfidps_stats *)wolfidps->allocator.memalign(wolfidps->allocator.context, WOLFIDPS_CACHE_LINE_SIZE, sizeof *slot->stats);
+    else
+        slot->stats = (struct wolfidps_stats *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *slot->stats);
+    if (slot->stats == NULL)
+        return MEMORY_E;
+    memset(slot->stats, 0, sizeof *slot->stats);
+    return 0;
+}
+
+static void wolfidps_stats_fold_counts(wolfidps_count_t *to, const wolfidps_count_t *from, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (from[i])
+            WOLFIDPS_ATOMIC_ADD(to[i], from[i]);
+    }
+}
+
+/* fold a reader shard into the shared shard and free it.  no reader may
+ * be using the slot.
+ */
+void wolfidps_stats_slot_fold(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    int i;
+
+    if (slot->stats == NULL)
+        return;
+    for (i = 0; i < WOLFIDPS_N_PROBES; ++i) {
+        WOLFIDPS_ATOMIC_ADD(wolfidps->stats.probes[i].n_calls, slot->stats->probes[i].n_calls);
+        WOLFIDPS_ATOMIC_ADD(wolfidps->stats.probes[i].total_ns, slot->stats->probes[i].total_ns);
+        wolfidps_stats_fold_counts(wolfidps->stats.probes[i].hist, slot->stats->probes[i].hist, WOLFIDPS_STATS_BUCKETS);
+    }
+    wolfidps_stats_fold_counts(wolfidps->stats.dispositions, slot->stats->dispositions, WOLFIDPS_N_DISPOSITIONS);
+    wolfidps->allocator.free(wolfidps->allocator.context, slot->stats);
+    slot->stats = NULL;
+}
+
+uint64_t wolfidps_stats_bucket_max(unsigned int i) {
+    unsigned int shift;
+    if (i >= WOLFIDPS_STATS_BUCKETS)
+        return 0;
+    if (i < (1U << WOLFIDPS_STATS_SUB_BITS))
+        return i;
+    shift = (i >> WOLFIDPS_STATS_SUB_BITS) - 1;
+    return ((((uint64_t)(i & ((1U << WOLFIDPS_STATS_SUB_BITS) - 1)) | (1U << WOLFIDPS_STATS_SUB_BITS)) + 1) << shift) - 1;
+}
+
+static void wolfidps_stats_sum(wolfidps_count_t *to, const wolfidps_count_t *from, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i)
+        to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static void wolfidps_stats_sum_shard(struct wolfidps_stats_snapshot *snapshot, const struct wolfidps_stats *stats) {
+    int i;
+    for (i = 0; i < WOLFIDPS_N_PROBES; ++i) {
+        snapshot->probes[i].n_calls += __atomic_load_n(&stats->probes[i].n_calls, __ATOMIC_RELAXED);
+        snapshot->probes[i].total_ns += __atomic_load_n(&stats->probes[i].total_ns, __ATOMIC_RELAXED);
+        wolfidps_stats_sum(snapshot->probes[i].hist, stats->probes[i].hist, WOLFIDPS_STATS_BUCKETS);
+    }
+    wolfidps_stats_sum(snapshot->dispositions, stats->dispositions, WOLFIDPS_N_DISPOSITIONS);
+}
+
+/* the upper bound of the bucket holding the rank'th timed call. */
+static uint64_t wolfidps_stats_rank(const struct wolfidps_probe_snapshot *probe, wolfidps_count_t rank) {
+    wolfidps_count_t seen = 0;
+    unsigned int i;
+    if (rank == 0)
+        rank = 1;
+    for (i = 0; i < WOLFIDPS_STATS_BUCKETS; ++i) {
+        if ((seen += probe->hist[i]) >= rank)
+            return wolfidps_stats_bucket_max(i);
+    }
+    return 0;
+}
+
+int wolfidps_stats_snapshot(struct wolfidps_context *wolfidps, struct wolfidps_stats_snapshot *snapshot) {
+    struct wolfidps_epoch *epoch = &wolfidps->epoch;
+    struct wolfidps_probe_snapshot *probe;
+    int i, n_slots_used;
+    unsigned int j;
+
+    if ((wolfidps == NULL) || (snapshot == NULL))
+        return BAD_FUNC_ARG;
+    memset(snapshot, 0, sizeof *snapshot);
+
+    wolfidps_stats_sum_shard(snapshot, &wolfidps->stats);
+    n_slots_used = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(epoch->n_slots_used);
+    for (i = 0; i < n_slots_used; ++i) {
+        if (epoch->slots[i].stats)
+            wolfidps_stats_sum_shard(snapshot, epoch->slots[i].stats);
+    }
+    snapshot->n_reader_slots = n_slots_used;
+    snapshot->n_routes = __atomic_load_n(&wolfidps->routes.n_routes, __ATOMIC_RELAXED);
+    snapshot->n_evictions = __atomic_load_n(&wolfidps->routes.n_evictions, __ATOMIC_RELAXED);
+
+    /* percentiles are taken from the summed histogram, not the live
+     * shards, so they always agree with it.
+     */
+    for (i = 0; i < WOLFIDPS_N_PROBES; ++i) {
+        probe = &snapshot->probes[i];
+        for (j = 0; j < WOLFIDPS_STATS_BUCKETS; ++j) {
+            if (probe->hist[j]) {
+                probe->n_timed += probe->hist[j];
+                probe->max_ns = wolfidps_stats_bucket_max(j);
+            }
+        }
+        if (probe->n_timed == 0)
+            continue;
+        probe->p50_ns = wolfidps_stats_rank(probe, (probe->n_timed * 50 + 99) / 100);
+        probe->p90_ns = wolfidps_stats_rank(probe, (probe->n_timed * 90 + 99) / 100);
+        probe->p99_ns = wolfidps_stats_rank(probe, (probe->n_timed * 99 + 99) / 100);
+        probe->p999_ns = wolfidps_stats_rank(probe, (probe->n_timed * 999 + 999) / 1000);
+    }
+    return 0;
+}
+
+#else /* WOLFIDPS_NO_STATS */
+
+int wolfidps_stats_slot_init(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    (void)wolfidps;
+    slot->stats = NULL;
+    return 0;
+}
+
+void wolfidps_stats_slot_fold(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    (void)wolfidps;
+    (void)slot;
+}
+
+uint64_t wolfidps_stats_bucket_max(unsigned int i) {
+    (void)i;
+    return 0;
+}
+
+int wolfidps_stats_snapshot(struct wolfidps_context *wolfidps, struct wolfidps_stats_snapshot *snapshot) {
+    (void)wolfidps;
+    (void)snapshot;
+    return NOT_COMPILED_IN;
+}
+
+#endif /* WOLFIDPS_NO_STATS */
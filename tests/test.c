@@ -0,0 +1,232 @@
+#include "test.h"
+
+#include <string.h>
+
+/* runs every test, or those named on the command line, and exits 0 if
+ * they all pass.  nothing is printed but failures.
+ */
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    { "evict", test_evict },
+    { "scan", test_scan },
+    { "bulk", test_bulk },
+    { "counters", test_counters },
+    { "batch", test_batch },
+    { "policy", test_policy },
+    { "persist", test_persist },
+    { "config", test_config },
+    { "queue", test_queue },
+    { "lock", test_lock },
+    { "linear", test_linear },
+    { "cache", test_cache },
+    { "shards", test_shards },
+    { "index", test_index },
+};
+
+void test_addr_set(struct test_addr *a, int family, int addr_len, const u_char *addr) {
+    memset(a, 0, sizeof *a);
+    a->u.sa.sa_family = (wolfidps_family_t)family;
+    a->u.sa.addr_len = (u_char)addr_len;
+    if (addr)
+        memcpy(a->u.sa.addr, addr, (family == 10) ? 16 : 4);
+}
+
+void test_addr_inet(struct test_addr *a, int b0, int b1, int b2, int b3, int addr_len) {
+    u_char addr[4];
+    addr[0] = (u_char)b0;
+    addr[1] = (u_char)b1;
+    addr[2] = (u_char)b2;
+    addr[3] = (u_char)b3;
+    test_addr_set(a, 2, addr_len, addr);
+}
+
+wolfidps_route_flags_t test_flags_any(void) {
+    wolfidps_route_flags_t flags;
+    flags.flags = 0;
+    flags.src_if_id_wildcard = flags.dst_if_id_wildcard = 1;
+    flags.sa_proto_wildcard = 1;
+    flags.sa_src_port_wildcard = flags.sa_dst_port_wildcard = 1;
+    return flags;
+}
+
+wolfidps_disposition_t test_dispatch(struct wolfidps_context *wolfidps, struct test_addr *src, struct test_addr *dst) {
+    wolfidps_disposition_t disposition;
+    TEST_SA(src)->sa_proto = TEST_SA(dst)->sa_proto = 6;
+    TEST_CHECK(wolfidps_route_dispatch(wolfidps, TEST_SA(src), TEST_SA(dst), NULL, &disposition, NULL) == 0);
+    return disposition;
+}
+
+uint64_t test_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* a prefix of addr_len bits of a.b.c.d, host bits cleared. */
+static void test_addr_prefix(struct test_addr *a, int b0, int b1, int b2, int b3, int addr_len) {
+    int i;
+    test_addr_inet(a, b0, b1, b2, b3, addr_len);
+    for (i = addr_len; i < 32; ++i)
+        a->u.sa.addr[i >> 3] &= (u_char)~(0x80 >> (i & 7));
+}
+
+void test_route_random(uint64_t *state, struct test_route *route) {
+    static const int src_lens[] = { 16, 20, 24, 28, 28, 32, 32 }, dst_lens[] = { 16, 24, 28, 32 };
+    uint64_t r = test_rand(state);
+    int which = (int)(r % 4);
+
+    route->flags = test_flags_any();
+    r >>= 2;
+    if (which == 0) {
+        test_addr_inet(&route->src, 0, 0, 0, 0, 0);
+        route->flags.sa_src_addr_wildcard = 1;
+    } else
+        test_addr_prefix(&route->src, 10, (int)(r & 3), (int)((r >> 2) & 7), (int)((r >> 5) & 15), src_lens[(r >> 9) % 7]);
+    r >>= 12;
+    if (which == 1) {
+        test_addr_inet(&route->dst, 0, 0, 0, 0, 0);
+        route->flags.sa_dst_addr_wildcard = 1;
+    } else
+        test_addr_prefix(&route->dst, 192, 168 + (int)(r & 3), (int)((r >> 2) & 3), (int)((r >> 4) & 15), dst_lens[(r >> 8) % 4]);
+    r >>= 12;
+    if (r % 3) {
+        route->flags.sa_proto_wildcard = 0;
+        TEST_SA(&route->src)->sa_proto = TEST_SA(&route->dst)->sa_proto = (r % 3 == 1) ? 6 : 17;
+    }
+    r >>= 2;
+    if (r % 3) {
+        route->flags.sa_dst_port_wildcard = 0;
+        TEST_SA(&route->dst)->sa_port = (r % 3 == 1) ? 22 : 80;
+    }
+}
+
+void test_flow_random(uint64_t *state, struct test_addr *src, struct test_addr *dst) {
+    static const wolfidps_port_t ports[] = { 22, 80, 443 };
+    uint64_t r = test_rand(state);
+
+    test_addr_inet(src, 10, (int)(r & 3), (int)((r >> 2) & 7), (int)((r >> 5) & 15), 32);
+    r >>= 9;
+    test_addr_inet(dst, 192, 168 + (int)(r & 3), (int)((r >> 2) & 3), (int)((r >> 4) & 15), 32);
+    r >>= 8;
+    TEST_SA(src)->sa_proto = TEST_SA(dst)->sa_proto = (r & 1) ? 6 : 17;
+    TEST_SA(src)->sa_port = 1024;
+    TEST_SA(dst)->sa_port = ports[(r >> 1) % 3];
+}
+
+int test_route_insert(struct wolfidps_context *wolfidps, struct test_route *route, wolfidps_time_t ttl) {
+    return wolfidps_route_insert(wolfidps, TEST_SA(&route->src), TEST_SA(&route->dst), route->flags, 1, "t", ttl);
+}
+
+int test_route_delete(struct wolfidps_context *wolfidps, struct test_route *route) {
+    return wolfidps_route_delete(wolfidps, TEST_SA(&route->src), TEST_SA(&route->dst), route->flags, 1, "t");
+}
+
+static int test_route_is(const struct test_route *test_route, const struct wolfidps_route *route) {
+    const struct wolfidps_sockaddr *src = &test_route->src.u.sa, *dst = &test_route->dst.u.sa;
+    return (route->src.addr_len == src->addr_len) &&
+        (memcmp(WOLFIDPS_ROUTE_SRC_ADDR(route), src->addr, WOLFIDPS_BITS_TO_BYTES(src->addr_len)) == 0) &&
+        (route->dst.addr_len == dst->addr_len) &&
+        (memcmp(WOLFIDPS_ROUTE_DST_ADDR(route), dst->addr, WOLFIDPS_BITS_TO_BYTES(dst->addr_len)) == 0) &&
+        (route->flags.sa_proto_wildcard == test_route->flags.sa_proto_wildcard) &&
+        (route->flags.sa_proto_wildcard || (route->sa_proto == src->sa_proto)) &&
+        (route->flags.sa_dst_port_wildcard == test_route->flags.sa_dst_port_wildcard) &&
+        (route->flags.sa_dst_port_wildcard || (route->dst.sa_port == dst->sa_port));
+}
+
+/* whether rule, matched by a flow from src, is test_route's.  the rule
+ * doesn't hold its src prefix, so of several routes it could be, only the
+ * one on the longest prefix covering src is.
+ */
+static int test_rule_is(const struct test_route *test_route, const struct wolfidps_policy_image *image, const struct wolfidps_policy_rule *rule, const struct test_addr *src) {
+    const struct wolfidps_sockaddr *route_src = &test_route->src.u.sa, *route_dst = &test_route->dst.u.sa;
+    wolfidps_route_flags_t flags;
+    flags.flags = rule->flags;
+    return wolfidps_addr_prefix_match(src->u.sa.addr, route_src->addr, route_src->addr_len) &&
+        (rule->dst_len == route_dst->addr_len) &&
+        (memcmp(image->prefixes + rule->dst_prefix, route_dst->addr, WOLFIDPS_BITS_TO_BYTES(route_dst->addr_len)) == 0) &&
+        (flags.sa_proto_wildcard == test_route->flags.sa_proto_wildcard) &&
+        (flags.sa_proto_wildcard || (rule->sa_proto == route_src->sa_proto)) &&
+        (flags.sa_dst_port_wildcard == test_route->flags.sa_dst_port_wildcard) &&
+        (flags.sa_dst_port_wildcard || (rule->dst_port == route_dst->sa_port));
+}
+
+int test_route_match(struct wolfidps_context *wolfidps, struct test_addr *src, struct test_addr *dst, const struct test_route *routes, int n_routes) {
+    struct wolfidps_route_match_context match;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_route *route;
+    uint32_t rule;
+    int i, found = -1;
+
+    match.src = TEST_SA(src);
+    match.dst = TEST_SA(dst);
+    TEST_CHECK(wolfidps->timecbs.get_time(wolfidps->timecbs.context, &match.now) == 0);
+    TEST_CHECK(wolfidps_lock_readonly(&wolfidps->lock) == 0);
+    if (wolfidps_route_match_flow(wolfidps, NULL, &match, &image, &route, &rule)) {
+        found = n_routes;
+        for (i = 0; i < n_routes; ++i) {
+            if (route ? test_route_is(&routes[i], route) :
+                (test_rule_is(&routes[i], image, &image->rules[rule], src) &&
+                 ((found == n_routes) || (routes[i].src.u.sa.addr_len > routes[found].src.u.sa.addr_len))))
+                found = i;
+        }
+        TEST_CHECK((route == NULL) || (found < n_routes));
+    }
+    (void)wolfidps_lock_unlock(&wolfidps->lock);
+    return found;
+}
+
+long test_alloc_budget = -1;
+
+static int test_alloc_spend(void) {
+    if (test_alloc_budget == 0)
+        return 0;
+    if (test_alloc_budget > 0)
+        --test_alloc_budget;
+    return 1;
+}
+
+static void *test_malloc(void *context, size_t size) {
+    (void)context;
+    return test_alloc_spend() ? malloc(size) : NULL;
+}
+
+static void test_free(void *context, void *ptr) {
+    (void)context;
+    free(ptr);
+}
+
+static void *test_realloc(void *context, void *ptr, size_t size) {
+    (void)context;
+    return test_alloc_spend() ? realloc(ptr, size) : NULL;
+}
+
+static void *test_memalign(void *context, size_t alignment, size_t size) {
+    void *ret;
+    (void)context;
+    if ((! test_alloc_spend()) || (posix_memalign(&ret, alignment, size) != 0))
+        return NULL;
+    return ret;
+}
+
+struct wolfidps_allocator test_allocator = { NULL, test_malloc, test_free, test_realloc, test_memalign };
+
+int main(int argc, char **argv) {
+    size_t i;
+    int j, run;
+
+    for (i = 0; i < sizeof tests / sizeof tests[0]; ++i) {
+        run = (argc < 2);
+        for (j = 1; j < argc; ++j) {
+            if (strcmp(argv[j], tests[i].name) == 0)
+                run = 1;
+        }
+        if (run)
+            tests[i].fn();
+    }
+    exit(0);
+}
@@ -0,0 +1,83 @@
+#ifndef WOLFIDPS_TEST_H
+#define WOLFIDPS_TEST_H
+
+#include "wolfidps_internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* the test program -- see test.c.  a failed check reports where, and the
+ * program exits 1 on the spot.
+ */
+
+#define TEST_CHECK(x) do { if (! (x)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); exit(1); } } while (0)
+
+#define TEST_SECONDS(n) ((wolfidps_time_t)(n) * 1000000)
+
+/* a struct wolfidps_sockaddr with room for an IPv6 address. */
+struct test_addr {
+    union {
+        struct wolfidps_sockaddr sa;
+        u_char buf[sizeof(struct wolfidps_sockaddr) + 16];
+    } u;
+};
+
+#define TEST_SA(a) (&(a)->u.sa)
+
+/* family 2 (inet) addresses, 4 bytes; family 10 (inet6), 16. */
+void test_addr_set(struct test_addr *a, int family, int addr_len, const u_char *addr);
+/* a.b.c.d/addr_len. */
+void test_addr_inet(struct test_addr *a, int b0, int b1, int b2, int b3, int addr_len);
+
+/* flags matching any interface, protocol and port. */
+wolfidps_route_flags_t test_flags_any(void);
+
+/* dispatch a tcp flow from src to dst, returning the disposition. */
+wolfidps_disposition_t test_dispatch(struct wolfidps_context *wolfidps, struct test_addr *src, struct test_addr *dst);
+
+/* xorshift64. */
+uint64_t test_rand(uint64_t *state);
+
+/* a route as inserted, for tests that check which route a flow found. */
+struct test_route {
+    struct test_addr src, dst;
+    wolfidps_route_flags_t flags;
+};
+
+/* a random inet route on an address space small enough that random flows
+ * hit several routes at once, though not every flow hits one: a src
+ * prefix in 10.0/14, a dst prefix in 192.168/14, or both; tcp, udp or any
+ * proto; dst port 22, 80 or any.
+ */
+void test_route_random(uint64_t *state, struct test_route *route);
+/* a random inet flow over the same space. */
+void test_flow_random(uint64_t *state, struct test_addr *src, struct test_addr *dst);
+int test_route_insert(struct wolfidps_context *wolfidps, struct test_route *route, wolfidps_time_t ttl);
+int test_route_delete(struct wolfidps_context *wolfidps, struct test_route *route);
+/* the index in routes of the route, or compiled rule, src/dst matches,
+ * -1 for none, or n_routes for a rule that isn't in routes.
+ */
+int test_route_match(struct wolfidps_context *wolfidps, struct test_addr *src, struct test_addr *dst, const struct test_route *routes, int n_routes);
+
+/* an allocator whose allocations fail once test_alloc_budget is spent,
+ * or never with it at -1.
+ */
+extern long test_alloc_budget;
+extern struct wolfidps_allocator test_allocator;
+
+void test_evict(void);
+void test_scan(void);
+void test_bulk(void);
+void test_counters(void);
+void test_batch(void);
+void test_policy(void);
+void test_persist(void);
+void test_config(void);
+void test_queue(void);
+void test_lock(void);
+void test_linear(void);
+void test_cache(void);
+void test_shards(void);
+void test_index(void);
+
+#endif /* WOLFIDPS_TEST_H */
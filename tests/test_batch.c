@@ -0,0 +1,113 @@
+#include "test.h"
+
+/* batch dispatch: the same answers as one flow at a time, through the
+ * dispatch cache, with flows sharing a cache entry in one batch leaving it
+ * to the last of them.
+ */
+
+#define TEST_BATCH_ROUTES 4
+#define TEST_BATCH_FLOWS 64
+
+static void test_batch_flow(struct test_addr *src, struct test_addr *dst, int net, int host) {
+    test_addr_inet(src, 10, 0, net, host, 32);
+    test_addr_inet(dst, 192, 0, 2, 1, 32);
+    TEST_SA(src)->sa_proto = TEST_SA(dst)->sa_proto = 6;
+}
+
+static void test_batch_run(struct wolfidps_context *wolfidps, int n_flows, struct test_addr *srcs, struct test_addr *dsts, wolfidps_disposition_t *dispositions, wolfidps_time_t *ttls) {
+    struct wolfidps_sockaddr *src_ptrs[TEST_BATCH_FLOWS], *dst_ptrs[TEST_BATCH_FLOWS];
+    int i;
+
+    for (i = 0; i < n_flows; ++i) {
+        src_ptrs[i] = TEST_SA(&srcs[i]);
+        dst_ptrs[i] = TEST_SA(&dsts[i]);
+    }
+    TEST_CHECK(wolfidps_route_dispatch_batch(wolfidps, n_flows, src_ptrs, dst_ptrs, NULL, dispositions, ttls) == 0);
+}
+
+static wolfidps_count_t test_batch_calls(struct wolfidps_context *wolfidps, wolfidps_probe_t probe) {
+    struct wolfidps_stats_snapshot snapshot;
+    TEST_CHECK(wolfidps_stats_snapshot(wolfidps, &snapshot) == 0);
+    return snapshot.probes[probe].n_calls;
+}
+
+/* whether src/dst has a live entry in the calling thread's cache.  a miss
+ * takes over the entry, as any lookup would.
+ */
+static int test_batch_cached(struct wolfidps_context *wolfidps, struct test_addr *src, struct test_addr *dst) {
+    struct wolfidps_epoch_slot *slot;
+    struct wolfidps_dispatch_cache_ent *ent;
+    struct wolfidps_route *route;
+    uint32_t rule;
+    int hit;
+
+    TEST_CHECK((slot = wolfidps_epoch_enter(wolfidps)) != NULL);
+    hit = wolfidps_dispatch_cache_get(slot->dispatch_cache, wolfidps->routes.generation, wolfidps->policy, TEST_SA(src), TEST_SA(dst), 0, &ent, &route, &rule);
+    wolfidps_epoch_leave(slot);
+    return hit;
+}
+
+static void test_batch_with_cache(int n_cache_entries) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct test_addr srcs[TEST_BATCH_FLOWS], dsts[TEST_BATCH_FLOWS], src, dst;
+    wolfidps_disposition_t dispositions[TEST_BATCH_FLOWS];
+    wolfidps_time_t ttls[TEST_BATCH_FLOWS];
+    wolfidps_route_flags_t flags;
+    wolfidps_count_t n_batches, n_single;
+    uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+    int i;
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_set_lockless_dispatch(wolfidps, 1) == 0);
+    TEST_CHECK(wolfidps_set_dispatch_cache(wolfidps, n_cache_entries) == 0);
+    for (i = 0; i < TEST_BATCH_ROUTES; ++i) {
+        flags = test_flags_any();
+        flags.sa_dst_addr_wildcard = 1;
+        test_addr_inet(&src, 10, 0, i, 0, 24);
+        test_addr_inet(&dst, 0, 0, 0, 0, 0);
+        TEST_CHECK(wolfidps_route_insert(wolfidps, TEST_SA(&src), TEST_SA(&dst), flags, 1, "b", (i & 1) ? TEST_SECONDS(60) : WOLFIDPS_TIME_NEVER) == 0);
+    }
+
+    /* random flows, half of them unrouted, twice over so that the second
+     * batch runs off the cache, agree with single dispatches.
+     */
+    for (i = 0; i < TEST_BATCH_FLOWS; ++i)
+        test_batch_flow(&srcs[i], &dsts[i], (int)(test_rand(&rand_state) % (2 * TEST_BATCH_ROUTES)), (int)(test_rand(&rand_state) % 4));
+    n_batches = test_batch_calls(wolfidps, WOLFIDPS_PROBE_DISPATCH_BATCH);
+    n_single = test_batch_calls(wolfidps, WOLFIDPS_PROBE_DISPATCH);
+    test_batch_run(wolfidps, TEST_BATCH_FLOWS, srcs, dsts, dispositions, ttls);
+    test_batch_run(wolfidps, TEST_BATCH_FLOWS, srcs, dsts, dispositions, ttls);
+    TEST_CHECK(test_batch_calls(wolfidps, WOLFIDPS_PROBE_DISPATCH_BATCH) == n_batches + 2);
+    TEST_CHECK(test_batch_calls(wolfidps, WOLFIDPS_PROBE_DISPATCH) == n_single);
+    for (i = 0; i < TEST_BATCH_FLOWS; ++i) {
+        wolfidps_disposition_t disposition;
+        wolfidps_time_t ttl;
+        TEST_CHECK(wolfidps_route_dispatch(wolfidps, TEST_SA(&srcs[i]), TEST_SA(&dsts[i]), NULL, &disposition, &ttl) == 0);
+        TEST_CHECK(dispositions[i] == disposition);
+        TEST_CHECK((dispositions[i] == WOLFIDPS_REJECT) == (srcs[i].u.sa.addr[2] < TEST_BATCH_ROUTES));
+        TEST_CHECK((ttls[i] == WOLFIDPS_TIME_NEVER) == (ttl == WOLFIDPS_TIME_NEVER));
+    }
+
+    /* a batch fills in the cache... */
+    test_batch_flow(&srcs[0], &dsts[0], 0, 1);
+    test_batch_flow(&srcs[1], &dsts[1], TEST_BATCH_ROUTES, 1);
+    test_batch_run(wolfidps, 1, srcs, dsts, dispositions, NULL);
+    TEST_CHECK(test_batch_cached(wolfidps, &srcs[0], &dsts[0]));
+
+    /* ...but with two flows on one entry, only for the last of them. */
+    if (n_cache_entries == 1) {
+        test_batch_run(wolfidps, 2, srcs, dsts, dispositions, NULL);
+        TEST_CHECK(dispositions[0] == WOLFIDPS_REJECT);
+        TEST_CHECK(dispositions[1] == WOLFIDPS_UNSPEC);
+        TEST_CHECK(test_batch_cached(wolfidps, &srcs[1], &dsts[1]));
+        TEST_CHECK(test_dispatch(wolfidps, &srcs[1], &dsts[1]) == WOLFIDPS_UNSPEC);
+        TEST_CHECK(test_dispatch(wolfidps, &srcs[0], &dsts[0]) == WOLFIDPS_REJECT);
+    }
+
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
+
+void test_batch(void) {
+    test_batch_with_cache(1);
+    test_batch_with_cache(256);
+}
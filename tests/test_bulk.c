@@ -0,0 +1,89 @@
+#include "test.h"
+
+/* bulk insert is all or nothing, at every point an allocation can fail,
+ * and never evicts a route of its own batch.
+ */
+
+#define TEST_BULK_OLD 300
+#define TEST_BULK_NEW 200
+
+/* n /24s, 10.base.i.0 on up. */
+static void test_bulk_prefixes(struct wolfidps_route_prefix *prefixes, int n, int base) {
+    int i;
+    memset(prefixes, 0, (size_t)n * sizeof *prefixes);
+    for (i = 0; i < n; ++i) {
+        prefixes[i].sa_family = 2;
+        prefixes[i].addr_len = 24;
+        prefixes[i].addr[0] = 10;
+        prefixes[i].addr[1] = (u_char)(base + (i >> 8));
+        prefixes[i].addr[2] = (u_char)i;
+    }
+}
+
+/* whether a flow from within prefix hits a route. */
+static int test_bulk_routed(struct wolfidps_context *wolfidps, const struct wolfidps_route_prefix *prefix) {
+    struct test_addr src, dst;
+
+    test_addr_inet(&src, prefix->addr[0], prefix->addr[1], prefix->addr[2], 1, 32);
+    test_addr_inet(&dst, 192, 0, 2, 1, 32);
+    return test_dispatch(wolfidps, &src, &dst) != WOLFIDPS_UNSPEC;
+}
+
+void test_bulk(void) {
+    static struct wolfidps_route_prefix old[TEST_BULK_OLD], new[TEST_BULK_NEW];
+    struct wolfidps_context *wolfidps = NULL;
+    wolfidps_route_flags_t flags;
+    wolfidps_count_t n_evictions;
+    long budget;
+    int i, ret;
+
+    flags.flags = 0;
+    test_bulk_prefixes(old, TEST_BULK_OLD, 0);
+    test_bulk_prefixes(new, TEST_BULK_NEW, 100);
+
+    /* a batch that needs evictions. */
+    TEST_CHECK(wolfidps_init(&test_allocator, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_set_eviction_policy(wolfidps, WOLFIDPS_EVICT_CLOCK, TEST_BULK_OLD) == 0);
+    TEST_CHECK(wolfidps_route_insert_bulk(wolfidps, TEST_BULK_OLD, old, flags, 3, "old", WOLFIDPS_TIME_NEVER) == TEST_BULK_OLD);
+    for (budget = 0; ; ++budget) {
+        n_evictions = wolfidps->routes.n_evictions;
+        test_alloc_budget = budget;
+        ret = wolfidps_route_insert_bulk(wolfidps, TEST_BULK_NEW, new, flags, 3, "new", WOLFIDPS_TIME_NEVER);
+        test_alloc_budget = -1;
+        if (ret >= 0)
+            break;
+        TEST_CHECK(ret == MEMORY_E);
+        TEST_CHECK(wolfidps->routes.n_routes == TEST_BULK_OLD);
+        TEST_CHECK(wolfidps->routes.n_evictions == n_evictions);
+        for (i = 0; i < TEST_BULK_OLD; ++i)
+            TEST_CHECK(test_bulk_routed(wolfidps, &old[i]));
+        for (i = 0; i < TEST_BULK_NEW; ++i)
+            TEST_CHECK(! test_bulk_routed(wolfidps, &new[i]));
+    }
+    TEST_CHECK(budget > 0);
+    TEST_CHECK(ret == TEST_BULK_NEW);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_BULK_OLD);
+    TEST_CHECK(wolfidps->routes.n_evictions == n_evictions + TEST_BULK_NEW);
+    for (i = 0; i < TEST_BULK_NEW; ++i)
+        TEST_CHECK(test_bulk_routed(wolfidps, &new[i]));
+
+    /* inserting them again is a no-op, not an error. */
+    TEST_CHECK(wolfidps_route_insert_bulk(wolfidps, TEST_BULK_NEW, new, flags, 3, "new", WOLFIDPS_TIME_NEVER) == 0);
+    /* with eviction off, a batch that doesn't fit changes nothing. */
+    TEST_CHECK(wolfidps_set_eviction_policy(wolfidps, WOLFIDPS_EVICT_NONE, TEST_BULK_OLD) == 0);
+    TEST_CHECK(wolfidps_route_insert_bulk(wolfidps, TEST_BULK_OLD, old, flags, 3, "old", WOLFIDPS_TIME_NEVER) == MEMORY_E);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_BULK_OLD);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+
+    /* evicting by soonest expiry never picks a route being inserted, even
+     * one due sooner than any in place.
+     */
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_set_eviction_policy(wolfidps, WOLFIDPS_EVICT_SOONEST_EXPIRY, TEST_BULK_OLD) == 0);
+    TEST_CHECK(wolfidps_route_insert_bulk(wolfidps, TEST_BULK_OLD, old, flags, 0, NULL, TEST_SECONDS(3600)) == TEST_BULK_OLD);
+    TEST_CHECK(wolfidps_route_insert_bulk(wolfidps, TEST_BULK_NEW, new, flags, 0, NULL, TEST_SECONDS(60)) == TEST_BULK_NEW);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_BULK_OLD);
+    for (i = 0; i < TEST_BULK_NEW; ++i)
+        TEST_CHECK(test_bulk_routed(wolfidps, &new[i]));
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
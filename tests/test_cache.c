@@ -0,0 +1,136 @@
+#include "test.h"
+
+/* the dispatch cache never serves a stale lookup: a flow is looked up
+ * through the cache, the table changes under it -- by insert, delete,
+ * expiry, eviction, extra ports, or a policy reload -- and the next lookup
+ * has to agree with one that bypasses the cache.
+ */
+
+static woldidps_time_t test_cache_now = 1;
+
+static int test_cache_get_time(void *context, woldidps_time_t *ts) {
+    (void)context;
+    *ts = test_cache_now;
+    return 0;
+}
+
+/* the src prefix length of the route the flow from src to dst matches, or
+ * -1 for none, looked up through the cache, which has to agree with a
+ * lookup around it, and then hold the flow.
+ */
+static int test_cache_lookup(struct wolfidps_context *wolfidps, struct test_addr *src, struct test_addr *dst) {
+    struct wolfidps_route_match_context match;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_epoch_slot *slot;
+    struct wolfidps_dispatch_cache_ent *ent;
+    struct wolfidps_route *cached = NULL, *route = NULL, *hit_route = NULL;
+    uint32_t cached_rule = 0, rule = 0, hit_rule = 0;
+    int cached_matched, matched;
+
+    match.src = TEST_SA(src);
+    match.dst = TEST_SA(dst);
+    match.now = test_cache_now;
+    TEST_CHECK((slot = wolfidps_epoch_enter(wolfidps)) != NULL);
+    TEST_CHECK(slot->dispatch_cache != NULL);
+    cached_matched = wolfidps_route_match_flow(wolfidps, slot, &match, &image, &cached, &cached_rule);
+    matched = wolfidps_route_match_flow(wolfidps, NULL, &match, &image, &route, &rule);
+    TEST_CHECK(cached_matched == matched);
+    if (matched) {
+        TEST_CHECK(cached == route);
+        TEST_CHECK(cached_rule == rule);
+        TEST_CHECK(route != NULL);
+    }
+    TEST_CHECK(wolfidps_dispatch_cache_get(slot->dispatch_cache, wolfidps->routes.generation, image, TEST_SA(src), TEST_SA(dst), test_cache_now, &ent, &hit_route, &hit_rule));
+    TEST_CHECK(hit_route == (matched ? route : NULL));
+    wolfidps_epoch_leave(slot);
+    return matched ? route->src.addr_len : -1;
+}
+
+static void test_cache_route(struct test_route *route, int b2, int src_len, int port) {
+    test_addr_inet(&route->src, 10, 0, b2, 0, src_len);
+    test_addr_inet(&route->dst, 0, 0, 0, 0, 0);
+    route->flags = test_flags_any();
+    route->flags.sa_dst_addr_wildcard = 1;
+    route->flags.sa_proto_wildcard = 0;
+    TEST_SA(&route->src)->sa_proto = TEST_SA(&route->dst)->sa_proto = 6;
+    route->flags.sa_dst_port_wildcard = 0;
+    TEST_SA(&route->dst)->sa_port = (wolfidps_port_t)port;
+}
+
+static int test_cache_set_ports(struct wolfidps_context *wolfidps, struct test_route *route, int n_ranges, const struct wolfidps_port_range *ranges) {
+    return wolfidps_route_set_extra_ports(wolfidps, TEST_SA(&route->src), TEST_SA(&route->dst), route->flags, 1, "t", 0, NULL, n_ranges, ranges);
+}
+
+void test_cache(void) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct test_route r16, r24, r28, r20;
+    struct test_addr src, dst;
+    static const struct wolfidps_port_range port_80 = { 80, 80 };
+    static const char policy[] = "route inet tcp 10.0.1.0/22 * * 22\n";
+    int error_line;
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_set_callback_get_time(wolfidps, test_cache_get_time, NULL) == 0);
+    TEST_CHECK(wolfidps_set_lockless_dispatch(wolfidps, 1) == 0);
+    TEST_CHECK(wolfidps_set_dispatch_cache(wolfidps, 64) == 0);
+
+    test_addr_inet(&src, 10, 0, 1, 7, 32);
+    test_addr_inet(&dst, 192, 0, 2, 1, 32);
+    TEST_SA(&src)->sa_proto = TEST_SA(&dst)->sa_proto = 6;
+    TEST_SA(&src)->sa_port = 1024;
+    TEST_SA(&dst)->sa_port = 22;
+    test_cache_route(&r16, 0, 16, 22);
+    test_cache_route(&r24, 1, 24, 22);
+    test_cache_route(&r28, 1, 28, 22);
+    test_cache_route(&r20, 0, 20, 80);
+
+    /* insert, over a cached miss, then over a cached hit. */
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == -1);
+    TEST_CHECK(test_route_insert(wolfidps, &r16, WOLFIDPS_TIME_NEVER) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 16);
+    TEST_CHECK(test_route_insert(wolfidps, &r24, WOLFIDPS_TIME_NEVER) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 24);
+
+    /* delete. */
+    TEST_CHECK(test_route_delete(wolfidps, &r24) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 16);
+
+    /* expiry, before the route is reaped, and after. */
+    TEST_CHECK(test_route_insert(wolfidps, &r28, TEST_SECONDS(1)) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 28);
+    test_cache_now += TEST_SECONDS(2);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 16);
+    TEST_CHECK(wolfidps_expire(wolfidps, WOLFIDPS_TIME_NEVER, 16) == 1);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 16);
+
+    /* extra ports, set and cleared. */
+    TEST_SA(&dst)->sa_port = 80;
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == -1);
+    TEST_CHECK(test_cache_set_ports(wolfidps, &r16, 1, &port_80) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 16);
+    TEST_CHECK(test_cache_set_ports(wolfidps, &r16, 0, NULL) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == -1);
+    TEST_SA(&dst)->sa_port = 22;
+
+    /* eviction, of the one route there's room for. */
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 16);
+    TEST_CHECK(wolfidps_set_eviction_policy(wolfidps, WOLFIDPS_EVICT_CLOCK, 1) == 0);
+    TEST_CHECK(test_route_insert(wolfidps, &r20, WOLFIDPS_TIME_NEVER) == 0);
+    TEST_CHECK(wolfidps->routes.n_routes == 1);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == -1);
+    TEST_CHECK(wolfidps_set_eviction_policy(wolfidps, WOLFIDPS_EVICT_NONE, 0) == 0);
+
+    /* a policy loaded, compiled, and taken away. */
+    TEST_CHECK(wolfidps_config_load(wolfidps, policy, strlen(policy), &error_line) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 22);
+    TEST_CHECK(wolfidps_policy_compile(wolfidps) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 22);
+    TEST_CHECK(test_route_insert(wolfidps, &r24, WOLFIDPS_TIME_NEVER) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 24);
+    TEST_CHECK(test_route_delete(wolfidps, &r24) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == 22);
+    TEST_CHECK(wolfidps_config_load(wolfidps, "", 0, &error_line) == 0);
+    TEST_CHECK(test_cache_lookup(wolfidps, &src, &dst) == -1);
+
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
@@ -0,0 +1,172 @@
+#include "test.h"
+
+/* text policies: syntax errors are reported on the right line and change
+ * nothing, and a reload touches only what it changes.
+ */
+
+static int test_config_load(struct wolfidps_context *wolfidps, const char *text, int *error_line) {
+    *error_line = 0;
+    return wolfidps_config_load(wolfidps, text, strlen(text), error_line);
+}
+
+/* the line a text with an error is turned away at. */
+static int test_config_error_line(struct wolfidps_context *wolfidps, const char *text) {
+    int error_line;
+    TEST_CHECK(test_config_load(wolfidps, text, &error_line) < 0);
+    return error_line;
+}
+
+/* the route a tcp flow from a.b.c.d to 192.0.2.1 port 22 matches. */
+static struct wolfidps_route *test_config_route(struct wolfidps_context *wolfidps, int b0, int b1, int b2, int b3) {
+    struct wolfidps_route_match_context match;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_route *route;
+    struct test_addr src, dst;
+    uint32_t rule;
+
+    test_addr_inet(&src, b0, b1, b2, b3, 32);
+    test_addr_inet(&dst, 192, 0, 2, 1, 32);
+    TEST_SA(&src)->sa_proto = TEST_SA(&dst)->sa_proto = 6;
+    TEST_SA(&dst)->sa_port = 22;
+    match.src = TEST_SA(&src);
+    match.dst = TEST_SA(&dst);
+    match.now = 0;
+    if (! wolfidps_route_match_flow(wolfidps, NULL, &match, &image, &route, &rule))
+        return NULL;
+    TEST_CHECK(route != NULL);
+    return route;
+}
+
+static wolfidps_count_t test_config_hits(struct wolfidps_context *wolfidps, int b0, int b1, int b2, int b3) {
+    struct wolfidps_route *route = test_config_route(wolfidps, b0, b1, b2, b3);
+    struct test_addr src, dst;
+    wolfidps_count_t count;
+
+    test_addr_inet(&src, b0, b1, b2, b3, 32);
+    test_addr_inet(&dst, 192, 0, 2, 1, 32);
+    TEST_SA(&dst)->sa_port = 22;
+    (void)test_dispatch(wolfidps, &src, &dst);
+    TEST_CHECK(wolfidps_counter_get(wolfidps, route->n_hits, &count) == 0);
+    return count;
+}
+
+static int test_config_n_actions(const struct wolfidps_event *event) {
+    const struct wolfidps_action_list_ent *i;
+    int n = 0;
+    for (i = (const struct wolfidps_action_list_ent *)event->action_list.header.head; i;
+         i = (const struct wolfidps_action_list_ent *)i->header.next)
+        ++n;
+    return n;
+}
+
+static const char test_config_base[] =
+    "# a policy to reload\n"
+    "action block\n"
+    "action log\n"
+    "event ssh action block\n"
+    "route inet tcp 10.0.0.0/24 * * 22 event ssh\n"
+    "route inet tcp 10.0.1.0/24 * * 22 event ssh action log\n"
+    "\n"
+    "route inet tcp 10.0.2.0/24 * * 22 event ssh\n";
+
+void test_config(void) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct wolfidps_route *kept, *changed;
+    struct wolfidps_event *event;
+    int error_line;
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+
+    /* errors, by the line they're on. */
+    TEST_CHECK(test_config_error_line(wolfidps, "action a\nfrobnicate\n") == 2);
+    TEST_CHECK(test_config_error_line(wolfidps, "action a\n\n# comment\nroute inet tcp 10.0.0.0/33 * * 22\n") == 4);
+    TEST_CHECK(test_config_error_line(wolfidps, "route inet tcp 10.0.0.256 * * 22\n") == 1);
+    TEST_CHECK(test_config_error_line(wolfidps, "route inet tcp 10.0.0.0/24 * * 65536\n") == 1);
+    TEST_CHECK(test_config_error_line(wolfidps, "route inet tcp 10.0.0.0/24 * *\n") == 1);
+    TEST_CHECK(test_config_error_line(wolfidps, "route inet tcp 10.0.0.0/24 * * 22 bogus\n") == 1);
+    TEST_CHECK(test_config_error_line(wolfidps, "action a\nevent e action a\nevent f action b\n") == 3);
+    TEST_CHECK(test_config_error_line(wolfidps, "route inet tcp 10.0.0.0/24 * * 22 action nope\naction a\n") == 1);
+    TEST_CHECK(test_config_error_line(wolfidps, "rule r inet * 22\n") == 1);
+    /* of two statements with the same key, the second is the error. */
+    TEST_CHECK(test_config_error_line(wolfidps, "action a\nevent e\naction b\nevent e action a\n") == 4);
+    TEST_CHECK(wolfidps->config == NULL);
+    TEST_CHECK(wolfidps->routes.n_routes == 0);
+
+    TEST_CHECK(test_config_load(wolfidps, test_config_base, &error_line) == 0);
+    TEST_CHECK(wolfidps->routes.n_routes == 3);
+    TEST_CHECK(test_config_hits(wolfidps, 10, 0, 0, 1) == 1);
+    TEST_CHECK(test_config_hits(wolfidps, 10, 0, 1, 1) == 1);
+    TEST_CHECK(test_config_hits(wolfidps, 10, 0, 1, 1) == 2);
+    kept = test_config_route(wolfidps, 10, 0, 0, 1);
+
+    /* a bad reload leaves the policy as it was. */
+    TEST_CHECK(test_config_error_line(wolfidps, "action block\nroute inet tcp 10.0.9.0/24 * * 22\nroute x\n") == 3);
+    TEST_CHECK(wolfidps->routes.n_routes == 3);
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 9, 1) == NULL);
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 0, 1) == kept);
+
+    /* nor does the same text again touch anything. */
+    TEST_CHECK(test_config_load(wolfidps, test_config_base, &error_line) == 0);
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 0, 1) == kept);
+    TEST_CHECK(test_config_hits(wolfidps, 10, 0, 0, 1) == 2);
+
+    /* a route changed keeps its hit count, one removed is gone, one added
+     * is there, one untouched is the same route, and the event changed
+     * has its new actions.
+     */
+    TEST_CHECK(test_config_load(wolfidps,
+        "action block\n"
+        "action log\n"
+        "event ssh action block action log\n"
+        "route inet tcp 10.0.0.0/24 * * 22 event ssh\n"
+        "route inet tcp 10.0.1.0/24 * * 22 event ssh\n"
+        "route inet tcp 10.0.3.0/24 * * 22 event ssh\n", &error_line) == 0);
+    TEST_CHECK(wolfidps->routes.n_routes == 3);
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 0, 1) == kept);
+    TEST_CHECK((changed = test_config_route(wolfidps, 10, 0, 1, 1)) != NULL);
+    TEST_CHECK(changed->action == NULL);
+    TEST_CHECK(test_config_hits(wolfidps, 10, 0, 1, 1) == 3);
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 2, 1) == NULL);
+    TEST_CHECK(test_config_hits(wolfidps, 10, 0, 3, 1) == 1);
+    event = kept->parent_event;
+    TEST_CHECK((event->keyword_len == 3) && (memcmp(event->keyword, "ssh", 3) == 0));
+    TEST_CHECK(test_config_n_actions(event) == 2);
+
+    /* a static route deleted by other means isn't put back by a reload of
+     * the same statement, but is once its statement changes.
+     */
+    {
+        struct test_addr src, dst;
+        wolfidps_route_flags_t flags = test_flags_any();
+        test_addr_inet(&src, 10, 0, 3, 0, 24);
+        test_addr_inet(&dst, 0, 0, 0, 0, 0);
+        TEST_SA(&src)->sa_proto = TEST_SA(&dst)->sa_proto = 6;
+        TEST_SA(&dst)->sa_port = 22;
+        flags.sa_proto_wildcard = flags.sa_dst_port_wildcard = 0;
+        flags.sa_dst_addr_wildcard = 1;
+        TEST_CHECK(wolfidps_route_delete(wolfidps, TEST_SA(&src), TEST_SA(&dst), flags, 3, "ssh") == 0);
+    }
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 3, 1) == NULL);
+    TEST_CHECK(test_config_load(wolfidps,
+        "action block\n"
+        "action log\n"
+        "event ssh action block action log\n"
+        "route inet tcp 10.0.0.0/24 * * 22 event ssh\n"
+        "route inet tcp 10.0.1.0/24 * * 22 event ssh\n"
+        "route inet tcp 10.0.3.0/24 * * 22 event ssh\n", &error_line) == 0);
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 3, 1) == NULL);
+    TEST_CHECK(test_config_load(wolfidps,
+        "action block\n"
+        "action log\n"
+        "event ssh action block action log\n"
+        "route inet tcp 10.0.0.0/24 * * 22 event ssh\n"
+        "route inet tcp 10.0.1.0/24 * * 22 event ssh\n"
+        "route inet tcp 10.0.3.0/24 * * 22 event ssh action log\n", &error_line) == 0);
+    TEST_CHECK(test_config_route(wolfidps, 10, 0, 3, 1) != NULL);
+
+    /* and an empty policy removes the lot. */
+    TEST_CHECK(test_config_load(wolfidps, "", &error_line) == 0);
+    TEST_CHECK(wolfidps->routes.n_routes == 0);
+
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
@@ -0,0 +1,86 @@
+#include "test.h"
+
+/* sharded hit counters: ids past what a single chunk directory used to
+ * hold, reader shards that only grow the chunks they count on, released
+ * ids reading zero, and folding on the way out of lockless mode.
+ */
+
+#define TEST_COUNTERS_RANGE (1U << 22) /* the old id cap, less id 0 */
+
+static wolfidps_count_t test_counters_get(struct wolfidps_context *wolfidps, wolfidps_counter_id_t id) {
+    wolfidps_count_t count;
+    TEST_CHECK(wolfidps_counter_get(wolfidps, id, &count) == 0);
+    return count;
+}
+
+static uint32_t test_counters_n_chunks(struct wolfidps_counter_shard *shard) {
+    uint32_t i, j, n = 0;
+    for (i = 0; i < WOLFIDPS_COUNTER_DIR_SIZE; ++i) {
+        for (j = 0; shard->pages[i] && (j < WOLFIDPS_COUNTER_PAGE_SIZE); ++j)
+            n += (shard->pages[i][j] != NULL);
+    }
+    return n;
+}
+
+void test_counters(void) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct wolfidps_epoch_slot *slot;
+    wolfidps_counter_id_t base, id, id2;
+    wolfidps_count_t count;
+
+    TEST_CHECK(wolfidps_init(&test_allocator, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_set_lockless_dispatch(wolfidps, 2) == 0);
+
+    TEST_CHECK(wolfidps_counter_alloc_range(wolfidps, TEST_COUNTERS_RANGE, &base) == 0);
+    TEST_CHECK(base == 1);
+    TEST_CHECK(wolfidps_counter_alloc(wolfidps, &id) == 0);
+    TEST_CHECK(id == TEST_COUNTERS_RANGE + 1);
+    TEST_CHECK(wolfidps_counter_get(wolfidps, id + 1, &count) == BAD_FUNC_ARG);
+    TEST_CHECK(wolfidps_counter_get(wolfidps, 0, &count) == BAD_FUNC_ARG);
+
+    /* a reader shard starts empty, and gets a chunk per id counted on. */
+    TEST_CHECK((slot = wolfidps_epoch_enter(wolfidps)) != NULL);
+    TEST_CHECK(test_counters_n_chunks(slot->counters) == 0);
+    wolfidps_counter_inc(wolfidps, slot, id);
+    wolfidps_counter_inc(wolfidps, slot, id);
+    wolfidps_counter_inc(wolfidps, slot, base);
+    wolfidps_counter_inc(wolfidps, slot, base + 1);
+    TEST_CHECK(test_counters_n_chunks(slot->counters) == 2);
+
+    /* if a chunk can't be had, the count goes to the shared shard. */
+    test_alloc_budget = 0;
+    wolfidps_counter_inc(wolfidps, slot, base + WOLFIDPS_COUNTER_CHUNK_SIZE);
+    test_alloc_budget = -1;
+    TEST_CHECK(test_counters_n_chunks(slot->counters) == 2);
+    wolfidps_epoch_leave(slot);
+    wolfidps_counter_inc(wolfidps, NULL, id);
+    wolfidps_counter_add(wolfidps, base + 1, 10);
+
+    TEST_CHECK(test_counters_get(wolfidps, id) == 3);
+    TEST_CHECK(test_counters_get(wolfidps, base) == 1);
+    TEST_CHECK(test_counters_get(wolfidps, base + 1) == 11);
+    TEST_CHECK(test_counters_get(wolfidps, base + WOLFIDPS_COUNTER_CHUNK_SIZE) == 1);
+    TEST_CHECK(test_counters_get(wolfidps, base + 2) == 0);
+
+    /* a released id reads zero, in every shard, and is reused first. */
+    wolfidps_counter_release(wolfidps, id);
+    TEST_CHECK(test_counters_get(wolfidps, id) == 0);
+    wolfidps_counter_release_range(wolfidps, base, 2);
+    TEST_CHECK(test_counters_get(wolfidps, base) == 0);
+    TEST_CHECK(test_counters_get(wolfidps, base + 1) == 0);
+    TEST_CHECK(wolfidps_counter_alloc(wolfidps, &id2) == 0);
+    TEST_CHECK(id2 == base + 1);
+    TEST_CHECK(test_counters_get(wolfidps, id2) == 0);
+
+    /* leaving lockless mode folds the reader shards into the shared one. */
+    TEST_CHECK((slot = wolfidps_epoch_enter(wolfidps)) != NULL);
+    wolfidps_counter_inc(wolfidps, slot, id2);
+    wolfidps_counter_inc(wolfidps, slot, base + 3);
+    wolfidps_epoch_leave(slot);
+    TEST_CHECK(wolfidps_set_lockless_dispatch(wolfidps, 0) == 0);
+    TEST_CHECK(test_counters_get(wolfidps, id2) == 1);
+    TEST_CHECK(test_counters_get(wolfidps, base + 3) == 1);
+    TEST_CHECK(test_counters_get(wolfidps, base + WOLFIDPS_COUNTER_CHUNK_SIZE) == 1);
+
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
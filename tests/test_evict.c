@@ -0,0 +1,95 @@
+#include "test.h"
+
+/* eviction victims, and the route being inserted never being one. */
+
+#define TEST_MAX_ROUTES 4
+
+static int test_evict_insert(struct wolfidps_context *wolfidps, int i, wolfidps_time_t ttl) {
+    struct test_addr src, dst;
+    wolfidps_route_flags_t flags = test_flags_any();
+
+    test_addr_inet(&src, 10, 0, i, 0, 24);
+    test_addr_inet(&dst, 0, 0, 0, 0, 0);
+    flags.sa_dst_addr_wildcard = 1;
+    return wolfidps_route_insert(wolfidps, TEST_SA(&src), TEST_SA(&dst), flags, 1, "e", ttl);
+}
+
+/* dispatch a flow from route i's prefix, counting a hit on the route if
+ * it's there.
+ */
+static int test_evict_hit(struct wolfidps_context *wolfidps, int i) {
+    struct test_addr src, dst;
+
+    test_addr_inet(&src, 10, 0, i, 1, 32);
+    test_addr_inet(&dst, 192, 0, 2, 1, 32);
+    return test_dispatch(wolfidps, &src, &dst) != WOLFIDPS_UNSPEC;
+}
+
+static struct wolfidps_context *test_evict_fill(wolfidps_eviction_policy_t policy, const wolfidps_time_t *ttls) {
+    struct wolfidps_context *wolfidps = NULL;
+    int i;
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_set_eviction_policy(wolfidps, policy, TEST_MAX_ROUTES) == 0);
+    for (i = 0; i < TEST_MAX_ROUTES; ++i)
+        TEST_CHECK(test_evict_insert(wolfidps, i, ttls ? ttls[i] : WOLFIDPS_TIME_NEVER) == 0);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_MAX_ROUTES);
+    return wolfidps;
+}
+
+/* insert one route more than fits, and return which of the old ones went,
+ * checking that the new one stayed.
+ */
+static int test_evict_victim(struct wolfidps_context *wolfidps, wolfidps_time_t new_ttl) {
+    int i, victim = -1;
+
+    TEST_CHECK(test_evict_insert(wolfidps, TEST_MAX_ROUTES, new_ttl) == 0);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_MAX_ROUTES);
+    TEST_CHECK(wolfidps->routes.n_evictions == 1);
+    TEST_CHECK(test_evict_hit(wolfidps, TEST_MAX_ROUTES));
+    for (i = 0; i < TEST_MAX_ROUTES; ++i) {
+        if (! test_evict_hit(wolfidps, i)) {
+            TEST_CHECK(victim < 0);
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+void test_evict(void) {
+    static const wolfidps_time_t ttls[TEST_MAX_ROUTES] = { TEST_SECONDS(3600), TEST_SECONDS(600), TEST_SECONDS(3600), TEST_SECONDS(3600) };
+    struct wolfidps_context *wolfidps;
+
+    /* the clock passes over routes hit since it last came by. */
+    wolfidps = test_evict_fill(WOLFIDPS_EVICT_CLOCK, NULL);
+    TEST_CHECK(test_evict_hit(wolfidps, 0));
+    TEST_CHECK(test_evict_hit(wolfidps, 1));
+    TEST_CHECK(test_evict_victim(wolfidps, WOLFIDPS_TIME_NEVER) == 2);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+
+    /* the new route, with no hits, isn't a candidate. */
+    wolfidps = test_evict_fill(WOLFIDPS_EVICT_LOWEST_HITS, NULL);
+    TEST_CHECK(test_evict_hit(wolfidps, 0) && test_evict_hit(wolfidps, 0));
+    TEST_CHECK(test_evict_hit(wolfidps, 1));
+    TEST_CHECK(test_evict_hit(wolfidps, 3));
+    TEST_CHECK(test_evict_victim(wolfidps, WOLFIDPS_TIME_NEVER) == 2);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+
+    /* nor is it when it's due before any of the old ones. */
+    wolfidps = test_evict_fill(WOLFIDPS_EVICT_SOONEST_EXPIRY, ttls);
+    TEST_CHECK(test_evict_victim(wolfidps, TEST_SECONDS(1)) == 1);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+
+    /* with eviction off, the insert fails and the table is left alone. */
+    wolfidps = test_evict_fill(WOLFIDPS_EVICT_NONE, NULL);
+    TEST_CHECK(test_evict_insert(wolfidps, TEST_MAX_ROUTES, WOLFIDPS_TIME_NEVER) == MEMORY_E);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_MAX_ROUTES);
+    TEST_CHECK(! test_evict_hit(wolfidps, TEST_MAX_ROUTES));
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+
+    /* a duplicate is told apart from other failures. */
+    wolfidps = test_evict_fill(WOLFIDPS_EVICT_CLOCK, NULL);
+    TEST_CHECK(test_evict_insert(wolfidps, 0, WOLFIDPS_TIME_NEVER) == WOLFIDPS_ROUTE_EXISTS_E);
+    TEST_CHECK(wolfidps->routes.n_evictions == 0);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
@@ -0,0 +1,116 @@
+#include "test.h"
+
+/* the src and dst indexes: a route with a src prefix is keyed on it, one
+ * with only a dst prefix on that, and one with neither at the root of the
+ * src index.  lookups find each through its own index, with any src
+ * prefix beating a dst prefix alone, and a dst prefix beating neither.
+ */
+
+enum {
+    TEST_INDEX_SRC = 0, /* 10.1.0.0/16 -> * */
+    TEST_INDEX_BOTH, /* 10.1.2.0/24 -> 192.168.0.0/16 */
+    TEST_INDEX_DST, /* * -> 192.168.1.0/24 */
+    TEST_INDEX_DST6, /* * -> 2001:db8::/32 */
+    TEST_INDEX_ANY, /* * -> * */
+    TEST_INDEX_N_ROUTES
+};
+
+static struct test_route test_index_routes[TEST_INDEX_N_ROUTES];
+
+static void test_index_route(struct test_route *route, const struct test_addr *src, const struct test_addr *dst) {
+    route->src = *src;
+    route->dst = *dst;
+    route->flags = test_flags_any();
+    route->flags.sa_src_addr_wildcard = (src->u.sa.addr_len == 0);
+    route->flags.sa_dst_addr_wildcard = (dst->u.sa.addr_len == 0);
+}
+
+/* the number of routes keyed on exactly prefix in the ent_type index. */
+static int test_index_count(struct wolfidps_context *wolfidps, int ent_type, const struct test_addr *prefix) {
+    struct wolfidps_route_trie_node *node;
+    struct wolfidps_table_ent_generic *i;
+    int n = 0;
+
+    TEST_CHECK(wolfidps_lock_readonly(&wolfidps->lock) == 0);
+    node = wolfidps_route_trie_get(&wolfidps->routes, ent_type, prefix->u.sa.sa_family, prefix->u.sa.addr, prefix->u.sa.addr_len);
+    for (i = node ? node->ents.head : NULL; i; i = i->generic.next) {
+        TEST_CHECK((int)((struct wolfidps_route_table_ent *)i)->ent_type == ent_type);
+        ++n;
+    }
+    TEST_CHECK(wolfidps_lock_unlock(&wolfidps->lock) == 0);
+    return n;
+}
+
+static int test_index_match(struct wolfidps_context *wolfidps, const struct test_addr *src, const struct test_addr *dst) {
+    struct test_addr flow_src = *src, flow_dst = *dst;
+    return test_route_match(wolfidps, &flow_src, &flow_dst, test_index_routes, TEST_INDEX_N_ROUTES);
+}
+
+void test_index(void) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct test_addr src16, src24, dst16, dst24, dst6, none, none6;
+    struct test_addr in_src24, in_src16, elsewhere, in_dst24, in_dst16, in_dst6, elsewhere6;
+    static const u_char dst6_addr[16] = { 0x20, 0x01, 0x0d, 0xb8 }, in_dst6_addr[16] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 },
+        elsewhere6_addr[16] = { 0x20, 0x01, 0x0d, 0xb9, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    int i;
+
+    test_addr_inet(&src16, 10, 1, 0, 0, 16);
+    test_addr_inet(&src24, 10, 1, 2, 0, 24);
+    test_addr_inet(&dst16, 192, 168, 0, 0, 16);
+    test_addr_inet(&dst24, 192, 168, 1, 0, 24);
+    test_addr_set(&dst6, 10, 32, dst6_addr);
+    test_addr_inet(&none, 0, 0, 0, 0, 0);
+    test_addr_set(&none6, 10, 0, dst6_addr);
+    test_index_route(&test_index_routes[TEST_INDEX_SRC], &src16, &none);
+    test_index_route(&test_index_routes[TEST_INDEX_BOTH], &src24, &dst16);
+    test_index_route(&test_index_routes[TEST_INDEX_DST], &none, &dst24);
+    test_index_route(&test_index_routes[TEST_INDEX_DST6], &none6, &dst6);
+    test_index_route(&test_index_routes[TEST_INDEX_ANY], &none, &none);
+
+    test_addr_inet(&in_src24, 10, 1, 2, 3, 32);
+    test_addr_inet(&in_src16, 10, 1, 3, 3, 32);
+    test_addr_inet(&elsewhere, 172, 16, 0, 1, 32);
+    test_addr_inet(&in_dst24, 192, 168, 1, 1, 32);
+    test_addr_inet(&in_dst16, 192, 168, 2, 1, 32);
+    test_addr_set(&in_dst6, 10, 128, in_dst6_addr);
+    test_addr_set(&elsewhere6, 10, 128, elsewhere6_addr);
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    for (i = 0; i < TEST_INDEX_N_ROUTES; ++i)
+        TEST_CHECK(test_route_insert(wolfidps, &test_index_routes[i], WOLFIDPS_TIME_NEVER) == 0);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_INDEX_N_ROUTES);
+
+    /* each route is in one index, under the prefix it's keyed on. */
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_SRC_ENT, &src16) == 1);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_SRC_ENT, &src24) == 1);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_SRC_ENT, &none) == 1);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_SRC_ENT, &none6) == 0);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_DST_ENT, &dst24) == 1);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_DST_ENT, &dst6) == 1);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_DST_ENT, &dst16) == 0);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_DST_ENT, &src16) == 0);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_DST_ENT, &none) == 0);
+
+    /* any src prefix beats a dst prefix alone, which beats neither. */
+    TEST_CHECK(test_index_match(wolfidps, &in_src24, &in_dst16) == TEST_INDEX_BOTH);
+    TEST_CHECK(test_index_match(wolfidps, &in_src24, &in_dst24) == TEST_INDEX_BOTH);
+    TEST_CHECK(test_index_match(wolfidps, &in_src24, &elsewhere) == TEST_INDEX_SRC);
+    TEST_CHECK(test_index_match(wolfidps, &in_src16, &in_dst24) == TEST_INDEX_SRC);
+    TEST_CHECK(test_index_match(wolfidps, &elsewhere, &in_dst24) == TEST_INDEX_DST);
+    TEST_CHECK(test_index_match(wolfidps, &elsewhere, &in_dst16) == TEST_INDEX_ANY);
+    TEST_CHECK(test_index_match(wolfidps, &elsewhere6, &in_dst6) == TEST_INDEX_DST6);
+    TEST_CHECK(test_index_match(wolfidps, &in_dst6, &elsewhere6) == -1);
+
+    /* deleted from the index it's in, its flows fall through. */
+    TEST_CHECK(test_route_delete(wolfidps, &test_index_routes[TEST_INDEX_DST]) == 0);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_DST_ENT, &dst24) == 0);
+    TEST_CHECK(test_index_match(wolfidps, &elsewhere, &in_dst24) == TEST_INDEX_ANY);
+    TEST_CHECK(test_route_delete(wolfidps, &test_index_routes[TEST_INDEX_SRC]) == 0);
+    TEST_CHECK(test_index_count(wolfidps, WOLFIDPS_ROUTE_TABLE_SRC_ENT, &src16) == 0);
+    TEST_CHECK(test_index_match(wolfidps, &in_src16, &in_dst24) == TEST_INDEX_ANY);
+    TEST_CHECK(test_route_delete(wolfidps, &test_index_routes[TEST_INDEX_DST6]) == 0);
+    TEST_CHECK(test_index_match(wolfidps, &elsewhere6, &in_dst6) == -1);
+    TEST_CHECK(wolfidps->routes.n_routes == TEST_INDEX_N_ROUTES - 3);
+
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
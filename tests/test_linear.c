@@ -0,0 +1,102 @@
+#include "test.h"
+
+/* the vector matcher's kernels agree with each other and with the
+ * compiled trie: the same random rules are compiled, and every flow has
+ * to find the same rule whichever kernel scans, and with the vector
+ * matcher out of the way.  a few dozen rules leave a part-filled last
+ * block; a couple of hundred, many blocks.
+ */
+
+#define TEST_LINEAR_MAX_ROUTES 200
+#define TEST_LINEAR_FLOWS 4000
+
+struct test_linear_result {
+    int ret;
+    uint32_t rule;
+    unsigned int prefix_len;
+};
+
+static void test_linear_match(const struct wolfidps_policy_image *image, struct test_addr *src, struct test_addr *dst, struct test_linear_result *result) {
+    struct wolfidps_route_match_context match;
+    match.src = TEST_SA(src);
+    match.dst = TEST_SA(dst);
+    match.now = 0;
+    result->rule = 0;
+    result->prefix_len = 0;
+    result->ret = wolfidps_policy_match(image, TEST_SA(src)->sa_family, &match, &result->rule, &result->prefix_len);
+}
+
+/* some routes on a src port too, so that every lane field is tried. */
+static void test_linear_route_random(uint64_t *state, struct test_route *route) {
+    uint64_t r;
+    test_route_random(state, route);
+    r = test_rand(state);
+    if (r % 3 == 0) {
+        route->flags.sa_src_port_wildcard = 0;
+        TEST_SA(&route->src)->sa_port = (r & 8) ? 1024 : 2048;
+    }
+}
+
+static void test_linear_run(int n_routes, uint64_t seed) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_policy_linear **linear;
+    struct test_route route;
+    struct test_addr src, dst;
+    struct test_linear_result trie, result;
+    uint64_t rand_state = seed;
+    int i, ret, kernel, n_kernels = 0, n_matched = 0;
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    for (i = 0; i < n_routes; ++i) {
+        do {
+            test_linear_route_random(&rand_state, &route);
+            ret = test_route_insert(wolfidps, &route, WOLFIDPS_TIME_NEVER);
+        } while (ret == WOLFIDPS_ROUTE_EXISTS_E);
+        TEST_CHECK(ret == 0);
+    }
+    TEST_CHECK(wolfidps_policy_compile(wolfidps) == 0);
+    TEST_CHECK((image = wolfidps->policy) != NULL);
+    TEST_CHECK(image->linear != NULL);
+    for (i = 0; i < image->n_families; ++i)
+        TEST_CHECK(image->linear[i] != NULL);
+
+    for (kernel = 0; kernel < WOLFIDPS_LINEAR_N_KERNELS; ++kernel)
+        n_kernels += (wolfidps_policy_linear_set_kernel(image, (wolfidps_linear_kernel_t)kernel) == 0);
+    /* the scalar kernel is always there. */
+    TEST_CHECK(n_kernels >= 1);
+
+    for (i = 0; i < TEST_LINEAR_FLOWS; ++i) {
+        test_flow_random(&rand_state, &src, &dst);
+        TEST_SA(&src)->sa_port = (test_rand(&rand_state) & 1) ? 1024 : 2048;
+
+        linear = image->linear;
+        image->linear = NULL;
+        test_linear_match(image, &src, &dst, &trie);
+        image->linear = linear;
+        n_matched += (trie.ret == 0);
+
+        for (kernel = 0; kernel < WOLFIDPS_LINEAR_N_KERNELS; ++kernel) {
+            if (wolfidps_policy_linear_set_kernel(image, (wolfidps_linear_kernel_t)kernel) < 0)
+                continue;
+            test_linear_match(image, &src, &dst, &result);
+            TEST_CHECK(result.ret == trie.ret);
+            if (trie.ret == 0) {
+                TEST_CHECK(result.rule == trie.rule);
+                TEST_CHECK(result.prefix_len == trie.prefix_len);
+            }
+        }
+    }
+    /* neither hopeless nor trivial. */
+    TEST_CHECK(n_matched > 0);
+    TEST_CHECK(n_matched < TEST_LINEAR_FLOWS);
+
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
+
+void test_linear(void) {
+    TEST_CHECK(wolfidps_policy_linear_set_kernel(NULL, WOLFIDPS_LINEAR_N_KERNELS) == BAD_FUNC_ARG);
+    test_linear_run(5, 0x9e3779b97f4a7c15ULL);
+    test_linear_run(37, 0xd1b54a32d192ed03ULL);
+    test_linear_run(TEST_LINEAR_MAX_ROUTES, 0x853c49e6748fea9bULL);
+}
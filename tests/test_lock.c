@@ -0,0 +1,166 @@
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+/* the table lock under contention: readers and writers exclude each
+ * other, a waiting writer holds off new readers and goes ahead of those
+ * parked behind it, and every parked thread is woken in the end.  built
+ * with WOLFIDPS_NO_FUTEX, parked threads poll, and a woken writer only
+ * races the readers, so its going first isn't checked.
+ */
+
+#define TEST_LOCK_THREADS 8
+#define TEST_LOCK_ROUNDS 20000
+#define TEST_LOCK_PARK_MS 200
+
+struct test_lock_shared {
+    struct wolfidps_rwlock lock;
+    volatile int n_readers, n_writers; /* holding the lock now */
+    long value[2]; /* kept equal by writers */
+    long n_writes;
+    volatile int n_acquired; /* by the threads of the ordering tests */
+    volatile int writer_turn, reader_turn; /* 1 + n_acquired when each got in */
+};
+
+static void test_lock_sleep(int ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    (void)nanosleep(&ts, NULL);
+}
+
+/* wait up to 10s for *flag to be set. */
+static void test_lock_await(volatile int *flag) {
+    int i;
+    for (i = 0; (i < 10000) && (__atomic_load_n(flag, __ATOMIC_ACQUIRE) == 0); ++i)
+        test_lock_sleep(1);
+    TEST_CHECK(__atomic_load_n(flag, __ATOMIC_ACQUIRE) != 0);
+}
+
+static void test_lock_write_1(struct test_lock_shared *shared) {
+    TEST_CHECK(__atomic_add_fetch(&shared->n_writers, 1, __ATOMIC_ACQ_REL) == 1);
+    TEST_CHECK(__atomic_load_n(&shared->n_readers, __ATOMIC_ACQUIRE) == 0);
+    ++shared->value[0];
+    ++shared->value[1];
+    ++shared->n_writes;
+    __atomic_sub_fetch(&shared->n_writers, 1, __ATOMIC_ACQ_REL);
+}
+
+static void test_lock_read_1(struct test_lock_shared *shared) {
+    __atomic_add_fetch(&shared->n_readers, 1, __ATOMIC_ACQ_REL);
+    TEST_CHECK(__atomic_load_n(&shared->n_writers, __ATOMIC_ACQUIRE) == 0);
+    TEST_CHECK(shared->value[0] == shared->value[1]);
+    __atomic_sub_fetch(&shared->n_readers, 1, __ATOMIC_ACQ_REL);
+}
+
+static void *test_lock_stress(void *arg) {
+    struct test_lock_shared *shared = (struct test_lock_shared *)arg;
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)(uintptr_t)&state;
+    int i;
+
+    for (i = 0; i < TEST_LOCK_ROUNDS; ++i) {
+        uint64_t r = test_rand(&state) % 16;
+        if (r < 2) {
+            TEST_CHECK(wolfidps_lock_readwrite(&shared->lock) == 0);
+            test_lock_write_1(shared);
+            if (r == 1) {
+                TEST_CHECK(wolfidps_lock_write2read(&shared->lock) == 0);
+                test_lock_read_1(shared);
+            }
+        } else {
+            TEST_CHECK(wolfidps_lock_readonly(&shared->lock) == 0);
+            test_lock_read_1(shared);
+            if (r == 2)
+                (void)sched_yield();
+        }
+        TEST_CHECK(wolfidps_lock_unlock(&shared->lock) == 0);
+    }
+    return NULL;
+}
+
+static void *test_lock_writer(void *arg) {
+    struct test_lock_shared *shared = (struct test_lock_shared *)arg;
+    TEST_CHECK(wolfidps_lock_readwrite(&shared->lock) == 0);
+    __atomic_store_n(&shared->writer_turn, __atomic_add_fetch(&shared->n_acquired, 1, __ATOMIC_ACQ_REL), __ATOMIC_RELEASE);
+    test_lock_write_1(shared);
+    test_lock_sleep(10);
+    TEST_CHECK(wolfidps_lock_unlock(&shared->lock) == 0);
+    return NULL;
+}
+
+static void *test_lock_reader(void *arg) {
+    struct test_lock_shared *shared = (struct test_lock_shared *)arg;
+    TEST_CHECK(wolfidps_lock_readonly(&shared->lock) == 0);
+    __atomic_store_n(&shared->reader_turn, __atomic_add_fetch(&shared->n_acquired, 1, __ATOMIC_ACQ_REL), __ATOMIC_RELEASE);
+    test_lock_read_1(shared);
+    TEST_CHECK(wolfidps_lock_unlock(&shared->lock) == 0);
+    return NULL;
+}
+
+/* a writer waiting on a read lock holds off a reader that comes after it,
+ * and gets the lock first when it's let go.
+ */
+static void test_lock_writer_preference(struct test_lock_shared *shared) {
+    pthread_t writer, reader;
+
+    shared->n_acquired = shared->writer_turn = shared->reader_turn = 0;
+    TEST_CHECK(wolfidps_lock_readonly(&shared->lock) == 0);
+    TEST_CHECK(pthread_create(&writer, NULL, test_lock_writer, shared) == 0);
+    test_lock_sleep(TEST_LOCK_PARK_MS);
+    TEST_CHECK(pthread_create(&reader, NULL, test_lock_reader, shared) == 0);
+    test_lock_sleep(TEST_LOCK_PARK_MS);
+    TEST_CHECK(__atomic_load_n(&shared->n_acquired, __ATOMIC_ACQUIRE) == 0);
+    TEST_CHECK(wolfidps_lock_unlock(&shared->lock) == 0);
+
+    test_lock_await(&shared->writer_turn);
+    test_lock_await(&shared->reader_turn);
+    TEST_CHECK(pthread_join(writer, NULL) == 0);
+    TEST_CHECK(pthread_join(reader, NULL) == 0);
+#if defined(__linux__) && ! defined(WOLFIDPS_NO_FUTEX)
+    TEST_CHECK(shared->writer_turn == 1);
+    TEST_CHECK(shared->reader_turn == 2);
+#endif
+}
+
+/* readers parked behind a write lock are let in by its downgrade, while
+ * the downgraded holder still has it.
+ */
+static void test_lock_downgrade(struct test_lock_shared *shared) {
+    pthread_t readers[2];
+    int i;
+
+    shared->n_acquired = shared->reader_turn = 0;
+    TEST_CHECK(wolfidps_lock_readwrite(&shared->lock) == 0);
+    for (i = 0; i < 2; ++i)
+        TEST_CHECK(pthread_create(&readers[i], NULL, test_lock_reader, shared) == 0);
+    test_lock_sleep(TEST_LOCK_PARK_MS);
+    TEST_CHECK(__atomic_load_n(&shared->n_acquired, __ATOMIC_ACQUIRE) == 0);
+    TEST_CHECK(wolfidps_lock_write2read(&shared->lock) == 0);
+    for (i = 0; (i < 10000) && (__atomic_load_n(&shared->n_acquired, __ATOMIC_ACQUIRE) < 2); ++i)
+        test_lock_sleep(1);
+    TEST_CHECK(shared->n_acquired == 2);
+    TEST_CHECK(wolfidps_lock_unlock(&shared->lock) == 0);
+    for (i = 0; i < 2; ++i)
+        TEST_CHECK(pthread_join(readers[i], NULL) == 0);
+}
+
+void test_lock(void) {
+    static struct test_lock_shared shared;
+    pthread_t threads[TEST_LOCK_THREADS];
+    int i;
+
+    TEST_CHECK(wolfidps_lock_init(&shared.lock) == 0);
+    for (i = 0; i < TEST_LOCK_THREADS; ++i)
+        TEST_CHECK(pthread_create(&threads[i], NULL, test_lock_stress, &shared) == 0);
+    for (i = 0; i < TEST_LOCK_THREADS; ++i)
+        TEST_CHECK(pthread_join(threads[i], NULL) == 0);
+    TEST_CHECK(shared.value[0] == shared.n_writes);
+    TEST_CHECK(shared.value[1] == shared.n_writes);
+    TEST_CHECK(shared.n_writes > 0);
+
+    test_lock_writer_preference(&shared);
+    test_lock_downgrade(&shared);
+    TEST_CHECK(wolfidps_lock_destroy(&shared.lock) == 0);
+}
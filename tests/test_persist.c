@@ -0,0 +1,248 @@
+#include "test.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* policy files: an exported policy loads back to the same lookups, and
+ * one damaged in any of the ways the loader checks for is turned away,
+ * leaving the context as it was.
+ */
+
+#define TEST_PERSIST_STATIC 40
+#define TEST_PERSIST_DYNAMIC 10
+#define TEST_PERSIST_ROUTES (TEST_PERSIST_STATIC + TEST_PERSIST_DYNAMIC)
+#define TEST_PERSIST_FLOWS 500
+
+static struct test_route test_persist_routes[TEST_PERSIST_ROUTES];
+static u_char *test_persist_file;
+static size_t test_persist_size;
+
+#define TEST_PERSIST_HEADER(buf) ((struct wolfidps_policy_header *)(buf))
+#define TEST_PERSIST_NODES(buf) ((struct wolfidps_policy_node *)((buf) + TEST_PERSIST_HEADER(buf)->nodes))
+#define TEST_PERSIST_RULES(buf) ((struct wolfidps_policy_rule *)((buf) + TEST_PERSIST_HEADER(buf)->rules))
+#define TEST_PERSIST_NAMES(buf) ((struct wolfidps_policy_name *)((buf) + TEST_PERSIST_HEADER(buf)->names))
+#define TEST_PERSIST_FAMILIES(buf) ((struct wolfidps_policy_family *)((buf) + TEST_PERSIST_HEADER(buf)->families))
+
+/* a fresh copy of the exported file, to damage. */
+static u_char *test_persist_copy(void) {
+    u_char *buf = (u_char *)malloc(test_persist_size);
+    TEST_CHECK(buf != NULL);
+    memcpy(buf, test_persist_file, test_persist_size);
+    return buf;
+}
+
+/* load len bytes of buf, which must be turned away. */
+static void test_persist_reject(u_char *buf, size_t len) {
+    struct wolfidps_context *wolfidps = NULL;
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_policy_load(wolfidps, buf, len) == BAD_FUNC_ARG);
+    TEST_CHECK(wolfidps->policy == NULL);
+    TEST_CHECK(wolfidps->routes.n_routes == 0);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+    free(buf);
+}
+
+static void test_persist_export(struct wolfidps_context *wolfidps, char *path) {
+    struct stat st;
+    int fd;
+
+    TEST_CHECK((fd = mkstemp(path)) >= 0);
+    (void)close(fd);
+    TEST_CHECK(wolfidps_policy_export(wolfidps, path) == 0);
+    TEST_CHECK((fd = open(path, O_RDONLY)) >= 0);
+    TEST_CHECK(fstat(fd, &st) == 0);
+    test_persist_size = (size_t)st.st_size;
+    TEST_CHECK((test_persist_file = (u_char *)malloc(test_persist_size)) != NULL);
+    TEST_CHECK(read(fd, test_persist_file, test_persist_size) == (ssize_t)test_persist_size);
+    (void)close(fd);
+}
+
+/* a node with a free child slot, and a node it could legally point there
+ * but for already having a parent.
+ */
+static int test_persist_dag(u_char *buf, uint32_t *parent, int *k, uint32_t *child) {
+    const struct wolfidps_policy_header *header = TEST_PERSIST_HEADER(buf);
+    struct wolfidps_policy_node *nodes = TEST_PERSIST_NODES(buf);
+    uint32_t i, j;
+
+    for (i = 0; i < header->n_nodes; ++i) {
+        for (*k = 0; *k < 2; ++*k) {
+            if (nodes[i].child[*k] != 0)
+                continue;
+            for (j = 0; j < header->n_nodes; ++j) {
+                if ((nodes[j].child[0] > i) && (nodes[nodes[j].child[0]].prefix_len > nodes[i].prefix_len) && (j != i)) {
+                    *parent = i;
+                    *child = nodes[j].child[0];
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+void test_persist(void) {
+    struct wolfidps_context *wolfidps = NULL, *loaded = NULL;
+    struct wolfidps_policy_record *record;
+    struct test_addr src, dst;
+    char path[] = "/tmp/wolfidps_test_XXXXXX";
+    uint64_t rand_state = 0xda942042e4dd58b5ULL;
+    uint32_t parent, child;
+    u_char *buf;
+    size_t last;
+    int i, k, ret, fd;
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    for (i = 0; i < TEST_PERSIST_ROUTES; ++i) {
+        do {
+            test_route_random(&rand_state, &test_persist_routes[i]);
+            /* only src-keyed routes are compiled. */
+            if (test_persist_routes[i].flags.sa_src_addr_wildcard)
+                continue;
+            ret = test_route_insert(wolfidps, &test_persist_routes[i], (i < TEST_PERSIST_STATIC) ? WOLFIDPS_TIME_NEVER : TEST_SECONDS(3600));
+        } while (test_persist_routes[i].flags.sa_src_addr_wildcard || (ret == WOLFIDPS_ROUTE_EXISTS_E));
+        TEST_CHECK(ret == 0);
+    }
+    TEST_CHECK(wolfidps_policy_compile(wolfidps) == 0);
+    test_persist_export(wolfidps, path);
+
+    /* what's exported loads back, static and dynamic routes alike, from
+     * a file or from memory.
+     */
+    TEST_CHECK(wolfidps_init(NULL, &loaded) == 0);
+    TEST_CHECK((fd = open(path, O_RDONLY)) >= 0);
+    TEST_CHECK(wolfidps_policy_load_fd(loaded, fd) == 0);
+    (void)close(fd);
+    TEST_CHECK(loaded->routes.n_routes == TEST_PERSIST_DYNAMIC);
+    for (i = 0; i < TEST_PERSIST_FLOWS; ++i) {
+        test_flow_random(&rand_state, &src, &dst);
+        TEST_CHECK(test_route_match(loaded, &src, &dst, test_persist_routes, TEST_PERSIST_ROUTES) ==
+                   test_route_match(wolfidps, &src, &dst, test_persist_routes, TEST_PERSIST_ROUTES));
+    }
+    TEST_CHECK(wolfidps_shutdown(&loaded) == 0);
+    TEST_CHECK(wolfidps_init(NULL, &loaded) == 0);
+    TEST_CHECK(wolfidps_policy_load(loaded, test_persist_file, test_persist_size) == 0);
+    TEST_CHECK(wolfidps_shutdown(&loaded) == 0);
+
+    /* truncated files: short of the header, of the size it gives, or
+     * with the size patched to match, of the records it promises.
+     */
+    TEST_CHECK(wolfidps_init(NULL, &loaded) == 0);
+    TEST_CHECK(truncate(path, (off_t)(test_persist_size - 1)) == 0);
+    TEST_CHECK((fd = open(path, O_RDONLY)) >= 0);
+    TEST_CHECK(wolfidps_policy_load_fd(loaded, fd) == BAD_FUNC_ARG);
+    TEST_CHECK(loaded->policy == NULL);
+    (void)close(fd);
+    TEST_CHECK(truncate(path, 10) == 0);
+    TEST_CHECK((fd = open(path, O_RDONLY)) >= 0);
+    TEST_CHECK(wolfidps_policy_load_fd(loaded, fd) == BAD_FUNC_ARG);
+    (void)close(fd);
+    TEST_CHECK(wolfidps_shutdown(&loaded) == 0);
+    (void)unlink(path);
+    test_persist_reject(test_persist_copy(), sizeof(struct wolfidps_policy_header) - 1);
+    test_persist_reject(test_persist_copy(), test_persist_size / 2);
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->size = TEST_PERSIST_HEADER(buf)->records;
+    test_persist_reject(buf, TEST_PERSIST_HEADER(buf)->records);
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->size = test_persist_size - 8;
+    test_persist_reject(buf, test_persist_size - 8);
+
+    /* the wrong magic, version, or byte order. */
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->magic ^= 1;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    ++TEST_PERSIST_HEADER(buf)->version;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->byte_order = ~TEST_PERSIST_HEADER(buf)->byte_order;
+    test_persist_reject(buf, test_persist_size);
+
+    /* section offsets out of order, misaligned, or past the end, and
+     * sections too small for their counts.
+     */
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->nodes = TEST_PERSIST_HEADER(buf)->rules + 8;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->rules += 4;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->records = test_persist_size + 8;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->families = 0;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    ++TEST_PERSIST_HEADER(buf)->n_rules;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_HEADER(buf)->n_nodes = 0x7fffffff;
+    test_persist_reject(buf, test_persist_size);
+
+    /* indices and offsets within sections out of bounds. */
+    buf = test_persist_copy();
+    TEST_PERSIST_FAMILIES(buf)[0].root = TEST_PERSIST_HEADER(buf)->n_nodes;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_NODES(buf)[0].prefix = (uint32_t)(TEST_PERSIST_HEADER(buf)->strings - TEST_PERSIST_HEADER(buf)->prefixes);
+    TEST_PERSIST_NODES(buf)[0].prefix_len = 8;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_NODES(buf)[0].prefix_len = 1024;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_NODES(buf)[0].n_rules = TEST_PERSIST_HEADER(buf)->n_rules + 1;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_RULES(buf)[0].dst_prefix = (uint32_t)(TEST_PERSIST_HEADER(buf)->strings - TEST_PERSIST_HEADER(buf)->prefixes);
+    TEST_PERSIST_RULES(buf)[0].dst_len = 32;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_RULES(buf)[0].event = TEST_PERSIST_HEADER(buf)->n_events;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_PERSIST_NAMES(buf)[0].offset = (uint32_t)(TEST_PERSIST_HEADER(buf)->records - TEST_PERSIST_HEADER(buf)->strings);
+    test_persist_reject(buf, test_persist_size);
+
+    /* a node that's its own child, a child with a prefix no longer than
+     * its parent's, and a child with two parents.
+     */
+    buf = test_persist_copy();
+    TEST_CHECK(TEST_PERSIST_HEADER(buf)->n_nodes > 2);
+    TEST_PERSIST_NODES(buf)[1].child[0] = 1;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    for (i = 0; TEST_PERSIST_NODES(buf)[i].child[0] == 0; ++i)
+        ;
+    TEST_PERSIST_NODES(buf)[TEST_PERSIST_NODES(buf)[i].child[0]].prefix_len = TEST_PERSIST_NODES(buf)[i].prefix_len;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    TEST_CHECK(test_persist_dag(buf, &parent, &k, &child));
+    TEST_PERSIST_NODES(buf)[parent].child[k] = child;
+    test_persist_reject(buf, test_persist_size);
+
+    /* a record whose length runs past the end, or falls short of it. */
+    buf = test_persist_copy();
+    record = (struct wolfidps_policy_record *)(buf + TEST_PERSIST_HEADER(buf)->records);
+    TEST_CHECK(TEST_PERSIST_HEADER(buf)->n_records == TEST_PERSIST_DYNAMIC);
+    for (last = TEST_PERSIST_HEADER(buf)->records, i = 1; i < TEST_PERSIST_DYNAMIC; ++i) {
+        last += WOLFIDPS_POLICY_RECORD_SIZE(record->src_len, record->dst_len);
+        record = (struct wolfidps_policy_record *)(buf + last);
+    }
+    record->src_len = 255;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    record = (struct wolfidps_policy_record *)(buf + last);
+    record->src_len = 0;
+    record->dst_len = 0;
+    test_persist_reject(buf, test_persist_size);
+    buf = test_persist_copy();
+    ++TEST_PERSIST_HEADER(buf)->n_records;
+    test_persist_reject(buf, test_persist_size);
+
+    free(test_persist_file);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
@@ -0,0 +1,75 @@
+#include "test.h"
+
+/* compiled policy lookups agree with the live trie's: two contexts get the
+ * same random routes, only one has them compiled, and every flow has to
+ * find the same route in both, through dynamic routes added on top,
+ * deletions, and a recompile.
+ */
+
+#define TEST_POLICY_STATIC 300
+#define TEST_POLICY_DYNAMIC 60
+#define TEST_POLICY_ROUTES (TEST_POLICY_STATIC + TEST_POLICY_DYNAMIC)
+#define TEST_POLICY_FLOWS 2000
+
+static struct test_route test_policy_routes[TEST_POLICY_ROUTES];
+
+/* insert random routes from first up to last into both contexts. */
+static void test_policy_insert(struct wolfidps_context *compiled, struct wolfidps_context *live, uint64_t *rand_state, int first, int last, wolfidps_time_t ttl) {
+    int i, ret;
+
+    for (i = first; i < last; ++i) {
+        do {
+            test_route_random(rand_state, &test_policy_routes[i]);
+            ret = test_route_insert(compiled, &test_policy_routes[i], ttl);
+        } while (ret == WOLFIDPS_ROUTE_EXISTS_E);
+        TEST_CHECK(ret == 0);
+        TEST_CHECK(test_route_insert(live, &test_policy_routes[i], ttl) == 0);
+    }
+}
+
+static void test_policy_compare(struct wolfidps_context *compiled, struct wolfidps_context *live, int n_routes) {
+    struct test_addr src, dst;
+    uint64_t rand_state = 0x2545f4914f6cdd1dULL;
+    int i, n_matched = 0, found;
+
+    for (i = 0; i < TEST_POLICY_FLOWS; ++i) {
+        test_flow_random(&rand_state, &src, &dst);
+        found = test_route_match(live, &src, &dst, test_policy_routes, n_routes);
+        TEST_CHECK(test_route_match(compiled, &src, &dst, test_policy_routes, n_routes) == found);
+        n_matched += (found >= 0);
+    }
+    /* neither hopeless nor trivial. */
+    TEST_CHECK(n_matched > TEST_POLICY_FLOWS / 10);
+    TEST_CHECK(n_matched < TEST_POLICY_FLOWS);
+}
+
+void test_policy(void) {
+    struct wolfidps_context *compiled = NULL, *live = NULL;
+    uint64_t rand_state = 0x853c49e6748fea9bULL;
+    int i;
+
+    TEST_CHECK(wolfidps_init(NULL, &compiled) == 0);
+    TEST_CHECK(wolfidps_init(NULL, &live) == 0);
+
+    test_policy_insert(compiled, live, &rand_state, 0, TEST_POLICY_STATIC, WOLFIDPS_TIME_NEVER);
+    test_policy_compare(compiled, live, TEST_POLICY_STATIC);
+    TEST_CHECK(wolfidps_policy_compile(compiled) == 0);
+    TEST_CHECK(compiled->policy != NULL);
+    test_policy_compare(compiled, live, TEST_POLICY_STATIC);
+
+    /* dynamic routes stay in the trie, and are merged with the image. */
+    test_policy_insert(compiled, live, &rand_state, TEST_POLICY_STATIC, TEST_POLICY_ROUTES, TEST_SECONDS(3600));
+    test_policy_compare(compiled, live, TEST_POLICY_ROUTES);
+
+    /* deleting a compiled route kills its rule until the next compile. */
+    for (i = 0; i < TEST_POLICY_ROUTES; i += 7) {
+        TEST_CHECK(test_route_delete(compiled, &test_policy_routes[i]) == 0);
+        TEST_CHECK(test_route_delete(live, &test_policy_routes[i]) == 0);
+    }
+    test_policy_compare(compiled, live, TEST_POLICY_ROUTES);
+    TEST_CHECK(wolfidps_policy_compile(compiled) == 0);
+    test_policy_compare(compiled, live, TEST_POLICY_ROUTES);
+
+    TEST_CHECK(wolfidps_shutdown(&compiled) == 0);
+    TEST_CHECK(wolfidps_shutdown(&live) == 0);
+}
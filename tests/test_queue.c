@@ -0,0 +1,85 @@
+#include "test.h"
+
+/* the action queue under backpressure: a full ring makes dispatch wait
+ * only once it has let go of the table, so that handlers taking the
+ * table lock for writing still get it, and nothing is lost.
+ */
+
+#define TEST_QUEUE_FLOWS 256
+
+struct test_queue_context {
+    struct wolfidps_context *wolfidps;
+    volatile int n_calls;
+};
+
+/* insert a route of its own, which needs the table lock for writing. */
+static wolfidps_disposition_t *test_queue_handler(void *handler_context, void *caller_context, const struct wolfidps_event *event, const struct wolfidps_route *route) {
+    struct test_queue_context *context = (struct test_queue_context *)handler_context;
+    int n = __atomic_fetch_add(&context->n_calls, 1, __ATOMIC_RELAXED);
+    struct test_route insert;
+
+    (void)caller_context;
+    (void)event;
+    (void)route;
+    test_addr_inet(&insert.src, 172, 16, (n >> 8) & 0xff, n & 0xff, 32);
+    test_addr_inet(&insert.dst, 192, 0, 2, 0, 24);
+    insert.flags = test_flags_any();
+    TEST_CHECK(test_route_insert(context->wolfidps, &insert, WOLFIDPS_TIME_NEVER) == 0);
+    return NULL;
+}
+
+static void test_queue_run(wolfidps_backpressure_t backpressure, int batch) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct wolfidps_action_queue_stats stats;
+    struct test_queue_context context;
+    struct test_addr srcs[TEST_QUEUE_FLOWS], dsts[TEST_QUEUE_FLOWS];
+    struct wolfidps_sockaddr *src_ptrs[TEST_QUEUE_FLOWS], *dst_ptrs[TEST_QUEUE_FLOWS];
+    wolfidps_disposition_t dispositions[TEST_QUEUE_FLOWS];
+    static const char text[] =
+        "action a\n"
+        "route inet tcp 10.0.0.0/16 * * 22 action a\n";
+    int error_line, i;
+
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_config_load(wolfidps, text, strlen(text), &error_line) == 0);
+    context.wolfidps = wolfidps;
+    context.n_calls = 0;
+    TEST_CHECK(wolfidps_action_set_handler(wolfidps, 1, "a", test_queue_handler, &context) == 0);
+    TEST_CHECK(wolfidps_action_set_async(wolfidps, 1, "a", 1) == 0);
+    TEST_CHECK(wolfidps_action_queue_start(wolfidps, 2, 1, backpressure) == 0);
+
+    for (i = 0; i < TEST_QUEUE_FLOWS; ++i) {
+        test_addr_inet(&srcs[i], 10, 0, i >> 8, i & 0xff, 32);
+        test_addr_inet(&dsts[i], 192, 0, 2, 1, 32);
+        TEST_SA(&srcs[i])->sa_proto = TEST_SA(&dsts[i])->sa_proto = 6;
+        TEST_SA(&dsts[i])->sa_port = 22;
+        src_ptrs[i] = TEST_SA(&srcs[i]);
+        dst_ptrs[i] = TEST_SA(&dsts[i]);
+    }
+    if (batch)
+        TEST_CHECK(wolfidps_route_dispatch_batch(wolfidps, TEST_QUEUE_FLOWS, src_ptrs, dst_ptrs, NULL, dispositions, NULL) == 0);
+    else {
+        for (i = 0; i < TEST_QUEUE_FLOWS; ++i)
+            TEST_CHECK(wolfidps_route_dispatch(wolfidps, src_ptrs[i], dst_ptrs[i], NULL, &dispositions[i], NULL) == 0);
+    }
+    for (i = 0; i < TEST_QUEUE_FLOWS; ++i)
+        TEST_CHECK(dispositions[i] == WOLFIDPS_REJECT);
+    TEST_CHECK(wolfidps_action_queue_stop(wolfidps) == 0);
+
+    TEST_CHECK(wolfidps_action_get_queue_stats(wolfidps, 1, "a", &stats) == 0);
+    TEST_CHECK(stats.n_dropped == 0);
+    TEST_CHECK(stats.depth == 0);
+    TEST_CHECK(stats.n_queued == (wolfidps_count_t)context.n_calls);
+    if (backpressure == WOLFIDPS_BACKPRESSURE_BLOCK)
+        TEST_CHECK(context.n_calls == TEST_QUEUE_FLOWS);
+    else
+        TEST_CHECK(stats.n_queued + stats.n_dropped_coalesce == TEST_QUEUE_FLOWS);
+    TEST_CHECK(wolfidps->routes.n_routes == 1 + context.n_calls);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
+
+void test_queue(void) {
+    test_queue_run(WOLFIDPS_BACKPRESSURE_BLOCK, 0);
+    test_queue_run(WOLFIDPS_BACKPRESSURE_BLOCK, 1);
+    test_queue_run(WOLFIDPS_BACKPRESSURE_COALESCE, 0);
+}
@@ -0,0 +1,69 @@
+#include "test.h"
+
+/* scan sketch victims.  with as few ents as there are probes, every source
+ * contends for all of them, and whether a source is still tracked shows
+ * in whether observing it again evicts another.
+ */
+
+#define TEST_SCAN_SOURCES 6
+#define TEST_SCAN_PROBES 4 /* WOLFIDPS_SCAN_MAX_PROBES */
+
+static struct test_addr test_scan_src[TEST_SCAN_SOURCES], test_scan_dst;
+
+static wolfidps_count_t test_scan_evicted(struct wolfidps_context *wolfidps) {
+    struct wolfidps_scan_stats stats;
+    TEST_CHECK(wolfidps_scan_get_stats(wolfidps, &stats) == 0);
+    return stats.n_evicted;
+}
+
+static void test_scan_observe(struct wolfidps_context *wolfidps, int i, woldidps_time_t now) {
+    TEST_CHECK(wolfidps_scan_observe_1(wolfidps, NULL, TEST_SA(&test_scan_src[i]), TEST_SA(&test_scan_dst), now) == 0);
+}
+
+void test_scan(void) {
+    struct wolfidps_context *wolfidps = NULL;
+    struct wolfidps_scan_params params;
+    int i;
+
+    for (i = 0; i < TEST_SCAN_SOURCES; ++i)
+        test_addr_inet(&test_scan_src[i], 10, 0, 0, i + 1, 32);
+    test_addr_inet(&test_scan_dst, 192, 0, 2, 1, 32);
+    TEST_SA(&test_scan_dst)->sa_proto = 6;
+    TEST_SA(&test_scan_dst)->sa_port = 22;
+
+    memset(&params, 0, sizeof params);
+    params.n_sources = TEST_SCAN_PROBES;
+    params.threshold = 16;
+    params.window = TEST_SECONDS(1);
+    params.event_label = "scan";
+    params.event_label_len = 4;
+    params.penalty_ttl = WOLFIDPS_TIME_NEVER;
+    TEST_CHECK(wolfidps_init(NULL, &wolfidps) == 0);
+    TEST_CHECK(wolfidps_scan_detect_start(wolfidps, &params) == 0);
+    TEST_CHECK(wolfidps->scanner.n_ents == TEST_SCAN_PROBES);
+
+    /* free ents are taken before any in use. */
+    for (i = 0; i < TEST_SCAN_PROBES; ++i)
+        test_scan_observe(wolfidps, i, 100 * (i + 1));
+    TEST_CHECK(test_scan_evicted(wolfidps) == 0);
+
+    /* then the one whose window is oldest. */
+    test_scan_observe(wolfidps, 4, 500);
+    TEST_CHECK(test_scan_evicted(wolfidps) == 1);
+    for (i = 1; i < 5; ++i)
+        test_scan_observe(wolfidps, i, 600);
+    TEST_CHECK(test_scan_evicted(wolfidps) == 1);
+    test_scan_observe(wolfidps, 0, 700);
+    TEST_CHECK(test_scan_evicted(wolfidps) == 2);
+
+    /* with the clock gone back before every window, there's still a
+     * victim, and the new source is tracked from then on.
+     */
+    test_scan_observe(wolfidps, 5, 50);
+    TEST_CHECK(test_scan_evicted(wolfidps) == 3);
+    test_scan_observe(wolfidps, 5, 60);
+    TEST_CHECK(test_scan_evicted(wolfidps) == 3);
+
+    TEST_CHECK(wolfidps_scan_detect_stop(wolfidps) == 0);
+    TEST_CHECK(wolfidps_shutdown(&wolfidps) == 0);
+}
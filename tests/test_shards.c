@@ -0,0 +1,128 @@
+#include "test.h"
+
+/* sharded route tables: a source's routes land in the shard its leading
+ * bits pick, or in the shared tier when their prefix is shorter, and
+ * dispatch finds them there, with the shard's match ahead of the shared
+ * tier's.
+ */
+
+#define TEST_SHARDS_N 4
+#define TEST_SHARDS_SOURCES 64
+
+static void test_shards_route(struct test_route *route, int b0, int b1, int b2, int src_len) {
+    test_addr_inet(&route->src, b0, b1, b2, 0, src_len);
+    test_addr_inet(&route->dst, 0, 0, 0, 0, 0);
+    route->flags = test_flags_any();
+    route->flags.sa_dst_addr_wildcard = 1;
+}
+
+static int test_shards_insert(struct wolfidps_shards *shards, struct test_route *route) {
+    return wolfidps_shards_route_insert(shards, TEST_SA(&route->src), TEST_SA(&route->dst), route->flags, 1, "t", WOLFIDPS_TIME_NEVER);
+}
+
+static int test_shards_delete(struct wolfidps_shards *shards, struct test_route *route) {
+    return wolfidps_shards_route_delete(shards, TEST_SA(&route->src), TEST_SA(&route->dst), route->flags, 1, "t");
+}
+
+/* the hits so far on the route of wolfidps the flow from src matches. */
+static wolfidps_count_t test_shards_hits(struct wolfidps_context *wolfidps, struct test_addr *src, struct test_addr *dst) {
+    struct wolfidps_route_match_context match;
+    struct wolfidps_policy_image *image;
+    struct wolfidps_route *route = NULL;
+    wolfidps_count_t count;
+    uint32_t rule;
+
+    match.src = TEST_SA(src);
+    match.dst = TEST_SA(dst);
+    match.now = 0;
+    TEST_CHECK(wolfidps_lock_readonly(&wolfidps->lock) == 0);
+    TEST_CHECK(wolfidps_route_match_flow(wolfidps, NULL, &match, &image, &route, &rule));
+    TEST_CHECK(route != NULL);
+    TEST_CHECK(wolfidps_counter_get(wolfidps, route->n_hits, &count) == 0);
+    TEST_CHECK(wolfidps_lock_unlock(&wolfidps->lock) == 0);
+    return count;
+}
+
+static wolfidps_disposition_t test_shards_dispatch(struct wolfidps_shards *shards, struct test_addr *src, struct test_addr *dst) {
+    wolfidps_disposition_t disposition;
+    TEST_SA(src)->sa_proto = TEST_SA(dst)->sa_proto = 6;
+    TEST_CHECK(wolfidps_shards_route_dispatch(shards, TEST_SA(src), TEST_SA(dst), NULL, &disposition, NULL) == 0);
+    return disposition;
+}
+
+void test_shards(void) {
+    struct wolfidps_shards *shards = NULL;
+    struct wolfidps_context *shard, *shared, *used[TEST_SHARDS_N];
+    struct test_route wide, narrow;
+    struct test_addr src, other, dst;
+    static const u_char inet6_a[16] = { 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x01, 0xff }, inet6_b[16] = { 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x01 };
+    int i, j, n_used = 0;
+
+    TEST_CHECK(wolfidps_shards_init(NULL, 0, 16, 48, &shards) == BAD_FUNC_ARG);
+    TEST_CHECK(wolfidps_shards_init(NULL, TEST_SHARDS_N, 33, 48, &shards) == BAD_FUNC_ARG);
+    TEST_CHECK(wolfidps_shards_init(NULL, TEST_SHARDS_N, 16, 48, &shards) == 0);
+    shared = WOLFIDPS_SHARDS_SHARED(shards);
+
+    /* only the leading bits pick the shard, ... */
+    test_addr_inet(&src, 10, 1, 2, 3, 32);
+    test_addr_inet(&other, 10, 1, 255, 0, 17);
+    TEST_CHECK((shard = wolfidps_shards_context(shards, TEST_SA(&src))) != shared);
+    TEST_CHECK(wolfidps_shards_context(shards, TEST_SA(&other)) == shard);
+    test_addr_set(&src, 10, 128, inet6_a);
+    test_addr_set(&other, 10, 48, inet6_b);
+    TEST_CHECK(wolfidps_shards_context(shards, TEST_SA(&src)) != shared);
+    TEST_CHECK(wolfidps_shards_context(shards, TEST_SA(&other)) == wolfidps_shards_context(shards, TEST_SA(&src)));
+    /* ...a shorter prefix, or another family, is shared, ... */
+    test_addr_inet(&other, 10, 1, 0, 0, 15);
+    TEST_CHECK(wolfidps_shards_context(shards, TEST_SA(&other)) == shared);
+    test_addr_set(&other, 10, 47, inet6_b);
+    TEST_CHECK(wolfidps_shards_context(shards, TEST_SA(&other)) == shared);
+    TEST_SA(&other)->sa_family = 1;
+    TEST_SA(&other)->addr_len = 64;
+    TEST_CHECK(wolfidps_shards_context(shards, TEST_SA(&other)) == shared);
+    /* ...and sources spread over the shards. */
+    for (i = 0; i < TEST_SHARDS_SOURCES; ++i) {
+        test_addr_inet(&other, 10, i, 0, 1, 32);
+        shard = wolfidps_shards_context(shards, TEST_SA(&other));
+        for (j = 0; (j < n_used) && (used[j] != shard); ++j)
+            ;
+        if (j == n_used)
+            used[n_used++] = shard;
+    }
+    TEST_CHECK(n_used == TEST_SHARDS_N);
+
+    /* a route lands where its src is sharded, and nowhere else. */
+    test_shards_route(&narrow, 10, 1, 2, 24);
+    test_shards_route(&wide, 10, 0, 0, 8);
+    TEST_CHECK(test_shards_insert(shards, &narrow) == 0);
+    TEST_CHECK(test_shards_insert(shards, &wide) == 0);
+    TEST_CHECK(test_shards_insert(shards, &narrow) == WOLFIDPS_ROUTE_EXISTS_E);
+    shard = wolfidps_shards_context(shards, TEST_SA(&narrow.src));
+    for (i = 0; i <= TEST_SHARDS_N; ++i)
+        TEST_CHECK(shards->contexts[i]->routes.n_routes == ((shards->contexts[i] == shard) || (shards->contexts[i] == shared)));
+
+    /* the shard's match wins, the shared tier catches what it misses, and
+     * a flow missing both is unmatched.
+     */
+    test_addr_inet(&src, 10, 1, 2, 3, 32);
+    test_addr_inet(&other, 10, 1, 3, 3, 32);
+    test_addr_inet(&dst, 192, 0, 2, 1, 32);
+    TEST_CHECK(test_shards_dispatch(shards, &src, &dst) == WOLFIDPS_REJECT);
+    TEST_CHECK(test_shards_hits(shard, &src, &dst) == 1);
+    TEST_CHECK(test_shards_hits(shared, &src, &dst) == 0);
+    TEST_CHECK(test_shards_dispatch(shards, &other, &dst) == WOLFIDPS_REJECT);
+    TEST_CHECK(test_shards_hits(shared, &other, &dst) == 1);
+    test_addr_inet(&other, 11, 1, 2, 3, 32);
+    TEST_CHECK(test_shards_dispatch(shards, &other, &dst) == WOLFIDPS_UNSPEC);
+
+    /* deletes go to the same place, after which the shared tier answers. */
+    TEST_CHECK(test_shards_delete(shards, &narrow) == 0);
+    TEST_CHECK(shard->routes.n_routes == 0);
+    TEST_CHECK(test_shards_dispatch(shards, &src, &dst) == WOLFIDPS_REJECT);
+    TEST_CHECK(test_shards_hits(shared, &src, &dst) == 2);
+    TEST_CHECK(test_shards_delete(shards, &wide) == 0);
+    TEST_CHECK(test_shards_dispatch(shards, &src, &dst) == WOLFIDPS_UNSPEC);
+
+    TEST_CHECK(wolfidps_shards_shutdown(&shards) == 0);
+    TEST_CHECK(shards == NULL);
+}
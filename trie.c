@@ -0,0 +1,607 @@
+#include "wolfidps_internal.h"
+
+/* per-family longest-prefix-match tries for the route table.
+ *
+ * each route table ent is keyed on the address of the endpoint it
+ * represents (src or dst, per ent_type), and lives in the index of that
+ * ent_type.  ents with identical { family, prefix } share a trie node, on
+ * whose list they are kept in route_key_cmp order, so that lookups
+ * descend the trie in O(address bits) and then narrow by proto and port
+ * on a short list.
+ *
+ * mutations are made under the table write lock, but are published with
+ * release stores and freed via wolfidps_epoch_retire(), so that
+ * wolfidps_route_trie_match() is safe for lockless readers.
+ */
+
+static void wolfidps_route_ent_key(struct wolfidps_route_table_ent *ent, const u_char **addr, unsigned int *addr_len) {
+    struct wolfidps_route *route = ent->route;
+    if (ent->ent_type == WOLFIDPS_ROUTE_TABLE_SRC_ENT) {
+        *addr = WOLFIDPS_ROUTE_SRC_ADDR(route);
+        *addr_len = route->src.addr_len;
+    } else {
+        *addr = WOLFIDPS_ROUTE_DST_ADDR(route);
+        *addr_len = route->dst.addr_len;
+    }
+}
+
+struct wolfidps_route_trie_family *wolfidps_route_trie_family_get(struct wolfidps_route_table *table, int ent_type, wolfidps_family_t sa_family) {
+    struct wolfidps_route_trie_family *i;
+    for (i = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(table->families[ent_type]); i; i = i->next) {
+        if (i->sa_family == sa_family)
+            return i;
+    }
+    return NULL;
+}
+
+static struct wolfidps_route_trie_node *wolfidps_route_trie_node_new(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, const u_char *prefix, unsigned int prefix_len) {
+    size_t prefix_bytes = WOLFIDPS_BITS_TO_BYTES(prefix_len);
+    uint64_t start = wolfidps_probe_begin(wolfidps, NULL, WOLFIDPS_PROBE_ALLOC);
+    struct wolfidps_route_trie_node *node = (struct wolfidps_route_trie_node *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *node + prefix_bytes);
+    wolfidps_probe_end(wolfidps, NULL, WOLFIDPS_PROBE_ALLOC, start);
+    if (node == NULL)
+        return NULL;
+    memset(node, 0, sizeof *node);
+    node->ents.cmp_fn = table->header.cmp_fn;
+    node->prefix_len = (uint16_t)prefix_len;
+    memcpy(node->prefix, prefix, prefix_bytes);
+    return node;
+}
+
+int wolfidps_route_trie_insert(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route_table_ent *ent) {
+    struct wolfidps_route_trie_family *family;
+    struct wolfidps_route_trie_node **slot, *parent = NULL, *node;
+    const u_char *addr;
+    unsigned int addr_len;
+    int ret;
+
+    wolfidps_route_ent_key(ent, &addr, &addr_len);
+
+    if ((family = wolfidps_route_trie_family_get(table, ent->ent_type, ent->route->sa_family)) == NULL) {
+        family = (struct wolfidps_route_trie_family *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *family);
+        if (family == NULL)
+            return MEMORY_E;
+        memset(family, 0, sizeof *family);
+        family->sa_family = ent->route->sa_family;
+        family->next = table->families[ent->ent_type];
+        WOLFIDPS_ATOMIC_STORE_RELEASE(table->families[ent->ent_type], family);
+    }
+
+    slot = &family->root;
+    for (;;) {
+        unsigned int common;
+        node = *slot;
+        if (node == NULL) {
+            if ((node = wolfidps_route_trie_node_new(wolfidps, table, addr, addr_len)) == NULL)
+                return MEMORY_E;
+            node->parent = parent;
+            WOLFIDPS_ATOMIC_STORE_RELEASE(*slot, node);
+            break;
+        }
+        common = wolfidps_addr_common_bits(addr, node->prefix, parent ? parent->prefix_len : 0, (addr_len < node->prefix_len) ? addr_len : node->prefix_len);
+        if (common < node->prefix_len) {
+            /* the key diverges from, or ends within, node's prefix -- split. */
+            struct wolfidps_route_trie_node *branch, *leaf;
+            if (common == addr_len) {
+                if ((leaf = wolfidps_route_trie_node_new(wolfidps, table, addr, addr_len)) == NULL)
+                    return MEMORY_E;
+                leaf->child[wolfidps_addr_bit(node->prefix, addr_len)] = node;
+                branch = leaf;
+            } else {
+                if ((branch = wolfidps_route_trie_node_new(wolfidps, table, addr, common)) == NULL)
+                    return MEMORY_E;
+                if ((leaf = wolfidps_route_trie_node_new(wolfidps, table, addr, addr_len)) == NULL) {
+                    wolfidps->allocator.free(wolfidps->allocator.context, branch);
+                    return MEMORY_E;
+                }
+                leaf->parent = branch;
+                branch->child[wolfidps_addr_bit(addr, common)] = leaf;
+                branch->child[wolfidps_addr_bit(node->prefix, common)] = node;
+            }
+            /* branch is fully formed before it is published, so lockless
+             * readers see either the old or the new subtree.
+             */
+            branch->parent = parent;
+            WOLFIDPS_ATOMIC_STORE_RELEASE(node->parent, branch);
+            WOLFIDPS_ATOMIC_STORE_RELEASE(*slot, branch);
+            node = leaf;
+            break;
+        }
+        if (addr_len == node->prefix_len)
+            break;
+        parent = node;
+        slot = &node->child[wolfidps_addr_bit(addr, node->prefix_len)];
+    }
+
+    if ((ret = wolfidps_table_ent_insert((struct wolfidps_table_ent_generic *)ent, (struct wolfidps_table_generic *)&node->ents)) < 0)
+        return ret;
+    ent->node = node;
+    wolfidps_route_table_changed(table);
+    return 0;
+}
+
+/* unlink ent from its node, then prune or collapse any nodes left with no
+ * ents and fewer than two children.
+ */
+void wolfidps_route_trie_delete_1(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route_table_ent *ent) {
+    struct wolfidps_route_trie_node *node = ent->node;
+    struct wolfidps_route_trie_family *family;
+
+    if (node == NULL)
+        return;
+    wolfidps_table_ent_delete_1((struct wolfidps_table_generic *)&node->ents, (struct wolfidps_table_ent_generic *)ent);
+    ent->node = NULL;
+    wolfidps_route_table_changed(table);
+
+    family = wolfidps_route_trie_family_get(table, ent->ent_type, ent->route->sa_family);
+
+    while (node &&
+           (node->ents.head == NULL) &&
+           ((node->child[0] == NULL) || (node->child[1] == NULL))) {
+        struct wolfidps_route_trie_node *parent = node->parent;
+        struct wolfidps_route_trie_node *child = node->child[0] ? node->child[0] : node->child[1];
+        if (child)
+            WOLFIDPS_ATOMIC_STORE_RELEASE(child->parent, parent);
+        if (parent == NULL)
+            WOLFIDPS_ATOMIC_STORE_RELEASE(family->root, child);
+        else if (parent->child[0] == node)
+            WOLFIDPS_ATOMIC_STORE_RELEASE(parent->child[0], child);
+        else
+            WOLFIDPS_ATOMIC_STORE_RELEASE(parent->child[1], child);
+        wolfidps_epoch_retire(wolfidps, node);
+        node = parent;
+    }
+}
+
+/* exact-prefix node lookup in the index of ent_type. */
+struct wolfidps_route_trie_node *wolfidps_route_trie_get(struct wolfidps_route_table *table, int ent_type, wolfidps_family_t sa_family, const u_char *addr, unsigned int addr_len) {
+    struct wolfidps_route_trie_family *family = wolfidps_route_trie_family_get(table, ent_type, sa_family);
+    struct wolfidps_route_trie_node *node;
+    unsigned int start_bit = 0;
+
+    if (family == NULL)
+        return NULL;
+    node = family->root;
+    while (node && (node->prefix_len <= addr_len)) {
+        if (wolfidps_addr_common_bits(addr, node->prefix, start_bit, node->prefix_len) < node->prefix_len)
+            return NULL;
+        if (node->prefix_len == addr_len)
+            return node;
+        start_bit = node->prefix_len;
+        node = node->child[wolfidps_addr_bit(addr, node->prefix_len)];
+    }
+    return NULL;
+}
+
+void wolfidps_route_trie_walk_init(struct wolfidps_route_trie_walk *walk, struct wolfidps_route_trie_family *family, const u_char *addr, unsigned int addr_len) {
+    walk->addr = addr;
+    walk->addr_len = addr_len;
+    walk->start_bit = 0;
+    walk->deepest = NULL;
+    walk->node = family ? WOLFIDPS_ATOMIC_LOAD_ACQUIRE(family->root) : NULL;
+}
+
+/* advance one level toward the deepest node whose prefix covers the walk
+ * address, prefetching the next node.  returns nonzero while there are
+ * levels left, so that callers can interleave several walks and overlap
+ * their cache misses.
+ */
+int wolfidps_route_trie_walk_step(struct wolfidps_route_trie_walk *walk) {
+    struct wolfidps_route_trie_node *node = walk->node;
+
+    if (node == NULL)
+        return 0;
+    if ((node->prefix_len > walk->addr_len) ||
+        (wolfidps_addr_common_bits(walk->addr, node->prefix, walk->start_bit, node->prefix_len) < node->prefix_len)) {
+        walk->node = NULL;
+        return 0;
+    }
+    walk->deepest = node;
+    if (node->prefix_len == walk->addr_len) {
+        walk->node = NULL;
+        return 0;
+    }
+    walk->start_bit = node->prefix_len;
+    walk->node = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(node->child[wolfidps_addr_bit(walk->addr, node->prefix_len)]);
+    if (walk->node == NULL)
+        return 0;
+    WOLFIDPS_PREFETCH(walk->node);
+    return 1;
+}
+
+/* climb from the deepest covering node back toward the root, returning
+ * the first ent accepted by match_fn.  thus the result is the longest
+ * matching prefix, and within that prefix, the first match in proto/port
+ * order (specific before wildcard).
+ */
+struct wolfidps_route_table_ent *wolfidps_route_trie_walk_match(
+    struct wolfidps_route_trie_walk *walk,
+    wolfidps_route_match_fn_t match_fn,
+    void *match_context)
+{
+    struct wolfidps_route_trie_node *node;
+
+    for (node = walk->deepest; node; node = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(node->parent)) {
+        struct wolfidps_table_ent_generic *i;
+        for (i = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(node->ents.head); i; i = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(i->generic.next)) {
+            struct wolfidps_route_table_ent *ent = &i->route;
+            if ((match_fn == NULL) || match_fn(ent->route, match_context))
+                return ent;
+        }
+    }
+    return NULL;
+}
+
+/* as for wolfidps_route_trie_match(), within one family (NULL for none). */
+struct wolfidps_route_table_ent *wolfidps_route_trie_match_1(
+    struct wolfidps_route_trie_family *family,
+    const u_char *addr,
+    unsigned int addr_len,
+    wolfidps_route_match_fn_t match_fn,
+    void *match_context)
+{
+    struct wolfidps_route_trie_walk walk;
+    if (family == NULL)
+        return NULL;
+    wolfidps_route_trie_walk_init(&walk, family, addr, addr_len);
+    while (wolfidps_route_trie_walk_step(&walk))
+        ;
+    return wolfidps_route_trie_walk_match(&walk, match_fn, match_context);
+}
+
+int wolfidps_route_trie_match(
+    struct wolfidps_route_table *table,
+    wolfidps_family_t sa_family,
+    const u_char *addr,
+    unsigned int addr_len,
+    int ent_type,
+    wolfidps_route_match_fn_t match_fn,
+    void *match_context,
+    struct wolfidps_route_table_ent **ent)
+{
+    struct wolfidps_route_trie_family *family;
+
+    if ((*ent = wolfidps_route_trie_match_1(wolfidps_route_trie_family_get(table, ent_type, sa_family), addr, addr_len, match_fn, match_context)))
+        return 0;
+    /* fall back to routes with a wildcard family. */
+    if ((sa_family != 0) &&
+        (family = wolfidps_route_trie_family_get(table, ent_type, 0)) &&
+        ((*ent = wolfidps_route_trie_match_1(family, addr, addr_len, match_fn, match_context))))
+        return 0;
+    *ent = NULL;
+    return -1;
+}
+
+/* the deepest path in a trie has a node for each prefix length. */
+#define WOLFIDPS_ROUTE_TRIE_MAX_DEPTH ((8 * sizeof(wolfidps_address_mask_t)) + 1)
+
+/* build the src index of table, which must be private and empty,
+ * bottom-up from src-keyed routes sorted by family and then src prefix,
+ * in preorder, with each prefix ahead of its extensions.  the ents are
+ * laid down in one pass, with a stack holding the path to the last one,
+ * so that no node is searched for.  on failure, what was built is left
+ * for wolfidps_route_trie_free().
+ */
+int wolfidps_route_trie_build(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route * const *routes, size_t n_routes) {
+    struct wolfidps_route_trie_node *stack[WOLFIDPS_ROUTE_TRIE_MAX_DEPTH];
+    struct wolfidps_route_trie_family *family;
+    size_t i;
+    int ret;
+
+    for (i = 0; i < n_routes; ++i) {
+        if (routes[i]->ent.ent_type != WOLFIDPS_ROUTE_TABLE_SRC_ENT)
+            return BAD_FUNC_ARG;
+    }
+
+    i = 0;
+    while (i < n_routes) {
+        struct wolfidps_route_trie_node *root;
+        int depth = 1;
+
+        family = (struct wolfidps_route_trie_family *)wolfidps->allocator.malloc(wolfidps->allocator.context, sizeof *family);
+        if (family == NULL)
+            return MEMORY_E;
+        memset(family, 0, sizeof *family);
+        family->sa_family = routes[i]->sa_family;
+        family->next = table->families[WOLFIDPS_ROUTE_TABLE_SRC_ENT];
+        table->families[WOLFIDPS_ROUTE_TABLE_SRC_ENT] = family;
+        /* a /0 root covers every prefix, so the stack never empties. */
+        if ((root = wolfidps_route_trie_node_new(wolfidps, table, WOLFIDPS_ROUTE_SRC_ADDR(routes[i]), 0)) == NULL)
+            return MEMORY_E;
+        family->root = stack[0] = root;
+
+        for (; (i < n_routes) && (routes[i]->sa_family == family->sa_family); ++i) {
+            struct wolfidps_route *route = routes[i];
+            const u_char *addr = WOLFIDPS_ROUTE_SRC_ADDR(route);
+            unsigned int addr_len = route->src.addr_len, common;
+            struct wolfidps_route_trie_node *top = stack[depth - 1], *last = NULL, *node;
+
+            /* everything on the stack covers the previous prefix, so a
+             * node covers this one too if it is no longer than what the
+             * two have in common.
+             */
+            common = wolfidps_addr_common_bits(addr, top->prefix, 0, (addr_len < top->prefix_len) ? addr_len : top->prefix_len);
+            while (stack[depth - 1]->prefix_len > common)
+                last = stack[--depth];
+            top = stack[depth - 1];
+
+            if (top->prefix_len == addr_len)
+                node = top;
+            else {
+                if ((node = wolfidps_route_trie_node_new(wolfidps, table, addr, addr_len)) == NULL)
+                    return MEMORY_E;
+                if (last &&
+                    ((common = wolfidps_addr_common_bits(addr, last->prefix, top->prefix_len, (addr_len < last->prefix_len) ? addr_len : last->prefix_len)) > top->prefix_len)) {
+                    /* the key diverges from the subtree left behind --
+                     * branch off it.  sorting rules out the key covering it.
+                     */
+                    struct wolfidps_route_trie_node *branch = wolfidps_route_trie_node_new(wolfidps, table, addr, common);
+                    if (branch == NULL) {
+                        wolfidps->allocator.free(wolfidps->allocator.context, node);
+                        return MEMORY_E;
+                    }
+                    branch->parent = top;
+                    top->child[wolfidps_addr_bit(addr, top->prefix_len)] = branch;
+                    last->parent = branch;
+                    branch->child[wolfidps_addr_bit(last->prefix, common)] = last;
+                    stack[depth++] = branch;
+                    top = branch;
+                }
+                /* later keys only ever land to the right, so the slot is free. */
+                node->parent = top;
+                top->child[wolfidps_addr_bit(addr, top->prefix_len)] = node;
+                stack[depth++] = node;
+            }
+            if ((ret = wolfidps_table_ent_insert((struct wolfidps_table_ent_generic *)&route->ent, (struct wolfidps_table_generic *)&node->ents)) < 0)
+                return ret;
+            route->ent.node = node;
+        }
+    }
+
+    /* the root is the only node that can have been left unused.  with no
+     * ents, it is kept only as a branch point.
+     */
+    for (family = table->families[WOLFIDPS_ROUTE_TABLE_SRC_ENT]; family; family = family->next) {
+        struct wolfidps_route_trie_node *root = family->root, *child;
+        if ((root->ents.head == NULL) &&
+            ((root->child[0] == NULL) || (root->child[1] == NULL))) {
+            child = root->child[0] ? root->child[0] : root->child[1];
+            child->parent = NULL;
+            family->root = child;
+            wolfidps->allocator.free(wolfidps->allocator.context, root);
+        }
+    }
+    return 0;
+}
+
+/* the number of branch nodes wolfidps_route_trie_merge() will need to
+ * merge the tries at a and b, whose prefixes agree up to start_bit, and
+ * the longest prefix among them.
+ */
+static size_t wolfidps_route_trie_merge_count(const struct wolfidps_route_trie_node *a, const struct wolfidps_route_trie_node *b, unsigned int start_bit, unsigned int *max_len) {
+    unsigned int common;
+
+    if ((a == NULL) || (b == NULL))
+        return 0;
+    common = wolfidps_addr_common_bits(a->prefix, b->prefix, start_bit, (a->prefix_len < b->prefix_len) ? a->prefix_len : b->prefix_len);
+    if ((common < a->prefix_len) && (common < b->prefix_len)) {
+        if (common > *max_len)
+            *max_len = common;
+        return 1;
+    }
+    if (a->prefix_len == b->prefix_len)
+        return wolfidps_route_trie_merge_count(a->child[0], b->child[0], a->prefix_len, max_len) +
+            wolfidps_route_trie_merge_count(a->child[1], b->child[1], a->prefix_len, max_len);
+    if (a->prefix_len < b->prefix_len)
+        return wolfidps_route_trie_merge_count(a->child[wolfidps_addr_bit(b->prefix, a->prefix_len)], b, a->prefix_len, max_len);
+    return wolfidps_route_trie_merge_count(b->child[wolfidps_addr_bit(a->prefix, b->prefix_len)], a, b->prefix_len, max_len);
+}
+
+/* move the ents of from, in route_key_cmp order, into the same order on
+ * into, in one pass over both.
+ */
+static void wolfidps_route_trie_ents_merge(struct wolfidps_table_header *into, struct wolfidps_table_header *from, struct wolfidps_route_trie_node *node) {
+    struct wolfidps_table_ent_generic *i = into->head, *ent, *next;
+
+    for (ent = from->head; ent; ent = next) {
+        next = ent->generic.next;
+        while (i && (into->cmp_fn((struct wolfidps_ent_generic *)ent, (struct wolfidps_ent_generic *)i) < 0))
+            i = i->generic.next;
+        wolfidps_table_ent_insert_after(ent, (struct wolfidps_table_generic *)into, i ? i->generic.prev : into->tail);
+        ent->route.node = node;
+    }
+    from->head = from->tail = NULL;
+}
+
+/* merge the trie at incoming into the one at *slot, below parent.  one
+ * side is the live trie and the other is private, per incoming_is_new.
+ * where they share a prefix, the live node is kept, so that readers
+ * standing on it are never stranded.  every change to the live trie is a
+ * release store of something fully formed, as for
+ * wolfidps_route_trie_insert().  branch nodes come from *spares.
+ */
+static void wolfidps_route_trie_merge(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_route_trie_node **slot,
+    struct wolfidps_route_trie_node *parent,
+    struct wolfidps_route_trie_node *incoming,
+    int incoming_is_new,
+    struct wolfidps_route_trie_node **spares)
+{
+    struct wolfidps_route_trie_node *node = *slot, *live, *new, *branch;
+    unsigned int common;
+    int i;
+
+    if (node == NULL) {
+        WOLFIDPS_ATOMIC_STORE_RELEASE(incoming->parent, parent);
+        WOLFIDPS_ATOMIC_STORE_RELEASE(*slot, incoming);
+        return;
+    }
+    common = wolfidps_addr_common_bits(incoming->prefix, node->prefix, parent ? parent->prefix_len : 0, (incoming->prefix_len < node->prefix_len) ? incoming->prefix_len : node->prefix_len);
+
+    if ((common < incoming->prefix_len) && (common < node->prefix_len)) {
+        branch = *spares;
+        *spares = branch->child[0];
+        branch->child[0] = NULL;
+        branch->prefix_len = (uint16_t)common;
+        memcpy(branch->prefix, incoming->prefix, WOLFIDPS_BITS_TO_BYTES(common));
+        branch->parent = parent;
+        branch->child[wolfidps_addr_bit(incoming->prefix, common)] = incoming;
+        branch->child[wolfidps_addr_bit(node->prefix, common)] = node;
+        WOLFIDPS_ATOMIC_STORE_RELEASE(incoming->parent, branch);
+        WOLFIDPS_ATOMIC_STORE_RELEASE(node->parent, branch);
+        WOLFIDPS_ATOMIC_STORE_RELEASE(*slot, branch);
+        return;
+    }
+
+    if (incoming->prefix_len == node->prefix_len) {
+        live = incoming_is_new ? node : incoming;
+        new = incoming_is_new ? incoming : node;
+        WOLFIDPS_ATOMIC_STORE_RELEASE(live->parent, parent);
+        wolfidps_route_trie_ents_merge(&live->ents, &new->ents, live);
+        for (i = 0; i < 2; ++i) {
+            if (new->child[i])
+                wolfidps_route_trie_merge(wolfidps, &live->child[i], live, new->child[i], 1, spares);
+        }
+        WOLFIDPS_ATOMIC_STORE_RELEASE(*slot, live);
+        wolfidps->allocator.free(wolfidps->allocator.context, new);
+        return;
+    }
+
+    if (node->prefix_len < incoming->prefix_len) {
+        wolfidps_route_trie_merge(wolfidps, &node->child[wolfidps_addr_bit(incoming->prefix, node->prefix_len)], node, incoming, incoming_is_new, spares);
+        return;
+    }
+
+    /* incoming covers node, and takes its place once node is merged in
+     * below it.  its parent is set first, so that readers climbing from
+     * node never leave the trie.
+     */
+    WOLFIDPS_ATOMIC_STORE_RELEASE(incoming->parent, parent);
+    wolfidps_route_trie_merge(wolfidps, &incoming->child[wolfidps_addr_bit(node->prefix, incoming->prefix_len)], incoming, node, ! incoming_is_new, spares);
+    WOLFIDPS_ATOMIC_STORE_RELEASE(*slot, incoming);
+}
+
+/* merge the private tries of from, built by wolfidps_route_trie_build(),
+ * into the same indexes of table, leaving from empty.  the branch nodes
+ * needed are counted and allocated up front, so that on failure nothing
+ * has changed.  called with the table lock held for writing.
+ */
+int wolfidps_route_trie_splice(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route_table *from) {
+    struct wolfidps_route_trie_node *spares = NULL, *branch;
+    struct wolfidps_route_trie_family *family, *into;
+    static const wolfidps_address_mask_t zeros;
+    unsigned int max_len = 0;
+    size_t n_spares = 0;
+    int ent_type;
+
+    for (ent_type = 0; ent_type < 2; ++ent_type) {
+        for (family = from->families[ent_type]; family; family = family->next) {
+            if ((into = wolfidps_route_trie_family_get(table, ent_type, family->sa_family)))
+                n_spares += wolfidps_route_trie_merge_count(into->root, family->root, 0, &max_len);
+        }
+    }
+    for (; n_spares > 0; --n_spares) {
+        if ((branch = wolfidps_route_trie_node_new(wolfidps, table, zeros.address, max_len)) == NULL) {
+            while ((branch = spares)) {
+                spares = branch->child[0];
+                wolfidps->allocator.free(wolfidps->allocator.context, branch);
+            }
+            return MEMORY_E;
+        }
+        branch->child[0] = spares;
+        spares = branch;
+    }
+
+    for (ent_type = 0; ent_type < 2; ++ent_type) {
+        while ((family = from->families[ent_type])) {
+            from->families[ent_type] = family->next;
+            if ((into = wolfidps_route_trie_family_get(table, ent_type, family->sa_family)) == NULL) {
+                /* a whole new family goes in with one store. */
+                family->next = table->families[ent_type];
+                WOLFIDPS_ATOMIC_STORE_RELEASE(table->families[ent_type], family);
+                continue;
+            }
+            if (family->root)
+                wolfidps_route_trie_merge(wolfidps, &into->root, NULL, family->root, 1, &spares);
+            wolfidps->allocator.free(wolfidps->allocator.context, family);
+        }
+    }
+    wolfidps_route_table_changed(table);
+    return 0;
+}
+
+/* the node following node in preorder, if any. */
+static struct wolfidps_route_trie_node *wolfidps_route_trie_preorder_next(struct wolfidps_route_trie_node *node) {
+    struct wolfidps_route_trie_node *parent;
+
+    if (node->child[0])
+        return node->child[0];
+    if (node->child[1])
+        return node->child[1];
+    for (; (parent = node->parent); node = parent) {
+        if ((parent->child[0] == node) && parent->child[1])
+            return parent->child[1];
+    }
+    return NULL;
+}
+
+/* the first node of family, in preorder, with ents and a prefix
+ * after { prefix, prefix_len }, or with after NULL, the first of all.
+ * the prefix need not be in the trie, so that a walk can resume from one
+ * since deleted.  called with the table lock held.
+ */
+struct wolfidps_route_trie_node *wolfidps_route_trie_next(struct wolfidps_route_trie_family *family, const u_char *after, unsigned int after_len) {
+    struct wolfidps_route_trie_node *node = family->root, *fallback = NULL;
+
+    while (after && node) {
+        unsigned int common = wolfidps_addr_common_bits(after, node->prefix, 0, (after_len < node->prefix_len) ? after_len : node->prefix_len);
+        int bit;
+        if (common < node->prefix_len) {
+            /* node extends the key, or diverges from it after or before. */
+            if ((common == after_len) || wolfidps_addr_bit(node->prefix, common))
+                break;
+            node = fallback;
+            break;
+        }
+        if (node->prefix_len == after_len) {
+            /* this climbs past the subtree, so the fallback is not needed. */
+            node = wolfidps_route_trie_preorder_next(node);
+            break;
+        }
+        bit = wolfidps_addr_bit(after, node->prefix_len);
+        if ((bit == 0) && node->child[1])
+            fallback = node->child[1];
+        if ((node = node->child[bit]) == NULL) {
+            node = fallback;
+            break;
+        }
+    }
+    while (node && (node->ents.head == NULL))
+        node = wolfidps_route_trie_preorder_next(node);
+    return node;
+}
+
+static void wolfidps_route_trie_free_1(struct wolfidps_context *wolfidps, struct wolfidps_route_trie_node *node) {
+    while (node) {
+        struct wolfidps_route_trie_node *next = node->child[1];
+        wolfidps_route_trie_free_1(wolfidps, node->child[0]);
+        wolfidps->allocator.free(wolfidps->allocator.context, node);
+        node = next;
+    }
+}
+
+/* frees the trie nodes and family roots of both indexes only -- the
+ * routes themselves are owned by the caller.
+ */
+void wolfidps_route_trie_free(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table) {
+    int ent_type;
+    for (ent_type = 0; ent_type < 2; ++ent_type) {
+        while (table->families[ent_type]) {
+            struct wolfidps_route_trie_family *next = table->families[ent_type]->next;
+            wolfidps_route_trie_free_1(wolfidps, table->families[ent_type]->root);
+            wolfidps->allocator.free(wolfidps->allocator.context, table->families[ent_type]);
+            table->families[ent_type] = next;
+        }
+    }
+}
@@ -70,11 +70,37 @@ static int wolfidps_builtin_epoch_time(woldidps_time_t when, long *epoch_secs, l
 
 #endif /* !WOLFIDPS_NO_CLOCK_BUILTIN */
 
+static int wolfidps_label_cmp(int left_len, const char *left, int right_len, const char *right) {
+    int cmp = memcmp(left, right, (size_t)((left_len < right_len) ? left_len : right_len));
+    if (cmp)
+        return cmp;
+    return left_len - right_len;
+}
+
 int wolfidps_event_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right) {
-    return 0;
+    return wolfidps_label_cmp(left->event.keyword_len, left->event.keyword, right->event.keyword_len, right->event.keyword);
 }
 
 int wolfidps_action_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right) {
+    return wolfidps_label_cmp(left->action.label_len, left->action.label, right->action.label_len, right->action.label);
+}
+
+/* { keyword, family, proto, port, id }, with wildcards sorting by flags. */
+int wolfidps_rule_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right) {
+    const struct wolfidps_rule *l = &left->rule, *r = &right->rule;
+    int cmp = wolfidps_label_cmp(l->event->keyword_len, l->event->keyword, r->event->keyword_len, r->event->keyword);
+    if (cmp)
+        return cmp;
+    if (l->sa_family != r->sa_family)
+        return (l->sa_family < r->sa_family) ? -1 : 1;
+    if (l->sa_proto != r->sa_proto)
+        return (l->sa_proto < r->sa_proto) ? -1 : 1;
+    if (l->sa_port != r->sa_port)
+        return (l->sa_port < r->sa_port) ? -1 : 1;
+    if (l->flags.flags != r->flags.flags)
+        return (l->flags.flags < r->flags.flags) ? -1 : 1;
+    if (l->id != r->id)
+        return (l->id < r->id) ? -1 : 1;
     return 0;
 }
 
@@ -97,12 +123,44 @@ int wolfidps_init(struct wolfidps_allocator *allocator, struct wolfidps_context
 #endif
     (*wolfidps)->events.header.cmp_fn = (wolfidps_ent_cmp_fn_t)wolfidps_event_key_cmp;
     (*wolfidps)->actions.header.cmp_fn = (wolfidps_ent_cmp_fn_t)wolfidps_action_key_cmp;
+    (*wolfidps)->rules.header.cmp_fn = (wolfidps_ent_cmp_fn_t)wolfidps_rule_key_cmp;
     (*wolfidps)->routes.header.cmp_fn = (wolfidps_ent_cmp_fn_t)wolfidps_route_key_cmp;
+    wolfidps_timer_wheel_init(*wolfidps);
+    if (wolfidps_lock_init(&(*wolfidps)->lock) < 0) {
+        allocator->free(allocator->context, *wolfidps);
+        *wolfidps = NULL;
+        return -1;
+    }
+    if (wolfidps_lock_init(&(*wolfidps)->config_lock) < 0) {
+        (void)wolfidps_lock_destroy(&(*wolfidps)->lock);
+        allocator->free(allocator->context, *wolfidps);
+        *wolfidps = NULL;
+        return -1;
+    }
+    if (wolfidps_counters_init(*wolfidps) < 0) {
+        (void)wolfidps_lock_destroy(&(*wolfidps)->config_lock);
+        (void)wolfidps_lock_destroy(&(*wolfidps)->lock);
+        allocator->free(allocator->context, *wolfidps);
+        *wolfidps = NULL;
+        return MEMORY_E;
+    }
     return 0;
 }
 
 int wolfidps_shutdown(struct wolfidps_context **wolfidps) {
     wolfidps_free_cb_t free_cb = (*wolfidps)->allocator.free;
+    (void)wolfidps_action_coalesce_flush_1(*wolfidps, 0, 1);
+    (void)wolfidps_action_queue_stop(*wolfidps);
+    wolfidps_coalescer_free(*wolfidps);
+    wolfidps_scanner_free(*wolfidps);
+    wolfidps_admission_free(*wolfidps);
+    wolfidps_route_table_flush(*wolfidps);
+    wolfidps_config_free(*wolfidps);
+    wolfidps_epoch_free(*wolfidps);
+    wolfidps_event_table_free(*wolfidps);
+    wolfidps_counters_free(*wolfidps);
+    (void)wolfidps_lock_destroy(&(*wolfidps)->config_lock);
+    (void)wolfidps_lock_destroy(&(*wolfidps)->lock);
     free_cb((*wolfidps)->allocator.context, *wolfidps);
     *wolfidps = NULL;
     return 0;
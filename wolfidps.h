@@ -2,6 +2,7 @@
 #define WOLFIDPS_H
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <semaphore.h>
 #include <wolfssl/options.h>
 #include <wolfssl/wolfcrypt/error-crypt.h>
@@ -12,6 +13,8 @@ typedef uint16_t wolfidps_port_t;
 typedef uint16_t wolfidps_ent_id_t;
 typedef uint64_t wolfidps_count_t;
 typedef uint64_t wolfidps_time_t;
+typedef int64_t woldidps_time_t;
+typedef uint32_t wolfidps_counter_id_t; /* 0 is never allocated. */
 
 struct wolfidps_table_ent_header {
     struct wolfidps_table_ent_generic *prev, *next; /* these will be replaced by red-black table elements later. */
@@ -44,34 +47,59 @@ typedef enum wolfidps_disposition {
     WOLFIDPS_DROP
 } wolfidps_disposition_t;
 
+#define WOLFIDPS_N_DISPOSITIONS (WOLFIDPS_DROP + 1)
+
 struct wolfidps_route;
 struct wolfidps_event;
 
 typedef wolfidps_disposition_t *(wolfidps_action_callback_t)(void *handler_context, void *caller_context, const struct wolfidps_event *event, const struct wolfidps_route *route);
 
+/* what a coalescing action delivers: count triggers of it on route (a
+ * snapshot, or NULL for a compiled rule with no route), all with event,
+ * seen between first_seen and last_seen.
+ */
+struct wolfidps_action_trigger {
+    const struct wolfidps_event *event;
+    const struct wolfidps_route *route;
+    wolfidps_count_t count;
+    wolfidps_time_t first_seen, last_seen;
+};
+
+typedef void (wolfidps_action_coalesced_callback_t)(void *handler_context, const struct wolfidps_action_trigger *trigger);
+
 struct wolfidps_action {
     struct wolfidps_table_ent_header header;
     int refcount;
     wolfidps_ent_id_t id;
 
-    wolfidps_count_t hitcount;
+    wolfidps_counter_id_t hitcount; /* read with wolfidps_counter_get(). */
     void *handler_context;
     wolfidps_action_callback_t *handler;
+    int async; /* handler runs on the action queue */
+    wolfidps_action_coalesced_callback_t *coalesced_handler; /* replaces handler while set */
+    wolfidps_time_t coalesce_window;
+    volatile int queue_refs; /* 1 while live, plus 1 per record queued for it */
+    volatile int queue_max_depth;
+    wolfidps_counter_id_t n_queued, n_dropped, n_coalesced, n_dropped_coalesce;
     byte label_len;
     char label[];
 };
 
 struct wolfidps_action_table {
     struct wolfidps_table_header header;
+    wolfidps_ent_id_t next_id;
 };
 
+struct wolfidps_route_trie_node;
+
 struct wolfidps_route_table_ent {
     struct wolfidps_table_ent_header header;
     struct wolfidps_route *route;
+    struct wolfidps_route_trie_node *node; /* trie node whose ent list holds this ent. */
     enum {
         WOLFIDPS_ROUTE_TABLE_SRC_ENT, /* this ent is keyed on wolfidps_route.src. */
-        WOLFIDPS_ROUTE_TABLE_DST_ENT /* this ent is keyed on wolfidps_route.dst. */
-    } ent_type;
+        WOLFIDPS_ROUTE_TABLE_DST_ENT /* this ent is keyed on wolfidps_route.dst, for routes with no src prefix. */
+    } ent_type; /* also the index it lives in. */
 };
 
 typedef struct wolfidps_route_flags {
@@ -107,11 +135,57 @@ struct wolfidps_route_endpoint {
     u_char if_id;
 };
 
+struct wolfidps_port_range {
+    wolfidps_port_t lo, hi; /* inclusive */
+};
+
+/* a set of ports, as sorted ranges, none overlapping or adjacent, or when
+ * there are too many of them to bisect quickly, as a bitmap over the whole
+ * port space.
+ */
+struct wolfidps_port_set {
+    uint32_t n_ports;
+    uint32_t n_ranges; /* 0 for a bitmap */
+    uint64_t buf[]; /* the ranges, or WOLFIDPS_PORT_SET_BITMAP_WORDS of bitmap */
+};
+
+#define WOLFIDPS_PORT_SET_BITMAP_WORDS ((1 << 16) / 64)
+#define WOLFIDPS_PORT_SET_RANGES(s) ((const struct wolfidps_port_range *)(s)->buf)
+
 struct wolfidps_event;
 
+/* timer wheel linkage.  pprev points at whichever pointer points at this
+ * timer, so that it can be unlinked without knowing which list it is on.
+ */
+struct wolfidps_timer {
+    struct wolfidps_timer *next, **pprev;
+    uint64_t expires_tick;
+    int level; /* -1 when on the overflow or expired list. */
+};
+
+#define WOLFIDPS_TIMER_LEVELS 6
+#define WOLFIDPS_TIMER_SLOT_BITS 6
+#define WOLFIDPS_TIMER_SLOTS (1U << WOLFIDPS_TIMER_SLOT_BITS)
+
+/* hierarchical timing wheel.  level n slots are
+ * WOLFIDPS_TIMER_SLOTS^n ticks wide; timers cascade down a level each time
+ * the level below wraps, so each is touched at most
+ * WOLFIDPS_TIMER_LEVELS times between insertion and expiry.
+ */
+struct wolfidps_timer_wheel {
+    int started;
+    woldidps_time_t base_time; /* time of tick 0 */
+    woldidps_time_t tick_len;
+    uint64_t now_tick;
+    struct wolfidps_timer *slots[WOLFIDPS_TIMER_LEVELS][WOLFIDPS_TIMER_SLOTS];
+    long n_timers[WOLFIDPS_TIMER_LEVELS];
+    struct wolfidps_timer *overflow; /* beyond the top level */
+    struct wolfidps_timer *expired; /* due, awaiting wolfidps_expire() */
+};
+
 struct wolfidps_route {
-    struct wolfidps_route_table_ent src_ent, dst_ent;
-    wolfidps_ent_id_t id;
+    struct wolfidps_route_table_ent ent;
+    uint32_t id; /* distinct among live routes, short of wraparound */
 
     struct wolfidps_event *parent_event;
     struct wolfidps_action *action;
@@ -125,27 +199,176 @@ struct wolfidps_route {
     uint16_t buf_alloced;
 
     wolfidps_time_t last_transition_time;
-    wolfidps_count_t n_hits;
+    wolfidps_counter_id_t n_hits; /* read with wolfidps_counter_get(). */
+    /* token bucket, kept as the time its bucket would next be full: a hit
+     * conforms, and moves rate_tat on by rate_interval, as long as that
+     * leaves it at most rate_burst intervals ahead.  see
+     * wolfidps_route_set_rate_limit().
+     */
+    wolfidps_time_t rate_interval; /* 0 for no limit */
+    uint32_t rate_burst;
+    volatile woldidps_time_t rate_tat;
     wolfidps_time_t ttl;
+    struct wolfidps_timer expiry;
+    struct wolfidps_route *clock_prev, *clock_next; /* eviction ring */
+    volatile u_char referenced; /* set on each hit, cleared as the clock hand passes. */
+    u_char compiled; /* served from the compiled policy image rather than the trie. */
+    uint32_t policy_rule; /* index of its rule in the image, when compiled. */
+    struct wolfidps_port_set *extra_ports[2]; /* by ent_type, matched besides sa_port, NULL for none.  see wolfidps_route_set_extra_ports(). */
     u_char addr_buf[]; /* first the src addr in big endian padded up to nearest byte, then dst addr, then src_extra_ports, then dst_extra_ports. */
 };
 
 #define WOLFIDPS_BITS_TO_BYTES(x) (((x) + 7) >> 3)
 #define WOLFIDPS_ROUTE_SRC_ADDR(r) r->addr_buf
-#define WOLFIDPS_ROUTE_SRC_ADDR_BYTES(r) WOLFIDPS_BITS_TO_BYTES(r->src_addr_len)
-#define WOLFIDPS_ROUTE_DST_ADDR(r) r->addr_buf + WOLFIDPS_ROUTE_SRC_ADDR_BYTES(r)
-#define WOLFIDPS_ROUTE_DST_ADDR_BYTES(r) WOLFIDPS_BITS_TO_BYTES(r->dst_addr_len)
-#define WOLFIDPS_ROUTE_SRC_PORT_COUNT(r) (1 + r->src_extra_port_count)
-#define WOLFIDPS_ROUTE_DST_PORT_COUNT(r) (1 + r->dst_extra_port_count)
+#define WOLFIDPS_ROUTE_SRC_ADDR_BYTES(r) WOLFIDPS_BITS_TO_BYTES((r)->src.addr_len)
+#define WOLFIDPS_ROUTE_DST_ADDR(r) ((r)->addr_buf + WOLFIDPS_ROUTE_SRC_ADDR_BYTES(r))
+#define WOLFIDPS_ROUTE_DST_ADDR_BYTES(r) WOLFIDPS_BITS_TO_BYTES((r)->dst.addr_len)
+#define WOLFIDPS_ROUTE_SRC_PORT_COUNT(r) (1 + (r)->src.extra_port_count)
+#define WOLFIDPS_ROUTE_DST_PORT_COUNT(r) (1 + (r)->dst.extra_port_count)
 #define WOLFIDPS_ROUTE_SRC_EXTRA_PORTS(r) ((wolfidps_port_t *)(WOLFIDPS_ROUTE_DST_ADDR(r) + WOLFIDPS_ROUTE_DST_ADDR_BYTES(r) + ((WOLFIDPS_ROUTE_SRC_ADDR_BYTES(r) + WOLFIDPS_ROUTE_DST_ADDR_BYTES(r)) & 1)))
 #define WOLFIDPS_ROUTE_DST_EXTRA_PORTS(r) (WOLFIDPS_ROUTE_SRC_EXTRA_PORTS(r) + WOLFIDPS_ROUTE_SRC_PORT_COUNT(r))
 #define WOLFIDPS_ROUTE_BUF_SIZE(r) (WOLFIDPS_ROUTE_SRC_ADDR_BYTES(r) + WOLFIDPS_ROUTE_DST_ADDR_BYTES(r) + ((WOLFIDPS_ROUTE_SRC_ADDR_BYTES(r) + WOLFIDPS_ROUTE_DST_ADDR_BYTES(r)) & 1) + (WOLFIDPS_ROUTE_SRC_PORT_COUNT(r) * sizeof(wolfidps_port_t)) + (WOLFIDPS_ROUTE_DST_PORT_COUNT(r) * sizeof(wolfidps_port_t)))
 
-#define WOLFIDPS_ROUTE_SRC_PORT_GET(r, i) (i ? WOLFIDPS_ROUTE_SRC_EXTRA_PORTS(r)[i-1] : r->sa_src_port)
-#define WOLFIDPS_ROUTE_DST_PORT_GET(r, i) (i ? WOLFIDPS_ROUTE_DST_EXTRA_PORTS(r)[i-1] : r->sa_dst_port)
+#define WOLFIDPS_ROUTE_SRC_PORT_GET(r, i) (i ? WOLFIDPS_ROUTE_SRC_EXTRA_PORTS(r)[i-1] : (r)->src.sa_port)
+#define WOLFIDPS_ROUTE_DST_PORT_GET(r, i) (i ? WOLFIDPS_ROUTE_DST_EXTRA_PORTS(r)[i-1] : (r)->dst.sa_port)
 
+/* path-compressed binary (patricia) trie node, keyed on the big endian
+ * address prefix of the route ents hanging off it.  nodes with no ents are
+ * pure branch points, and always have two children.
+ */
+struct wolfidps_route_trie_node {
+    struct wolfidps_route_trie_node *parent, *child[2];
+    struct wolfidps_table_header ents; /* route table ents with exactly this prefix, sorted by proto and port. */
+    uint16_t prefix_len; /* in bits */
+    u_char prefix[];
+};
+
+struct wolfidps_route_trie_family {
+    struct wolfidps_route_trie_family *next;
+    wolfidps_family_t sa_family; /* 0 holds the family-wildcard routes. */
+    struct wolfidps_route_trie_node *root;
+};
+
+typedef enum wolfidps_eviction_policy {
+    WOLFIDPS_EVICT_NONE = 0, /* inserts fail when the table is full. */
+    WOLFIDPS_EVICT_CLOCK, /* approximate LRU on last hit. */
+    WOLFIDPS_EVICT_LOWEST_HITS, /* fewest hits among a sample. */
+    WOLFIDPS_EVICT_SOONEST_EXPIRY /* nearest ttl expiry, then as for WOLFIDPS_EVICT_CLOCK. */
+} wolfidps_eviction_policy_t;
+
+/* each route is in exactly one index: keyed on its src prefix, or, if it
+ * has none but does have a dst prefix, on that, so that dst-only routes
+ * are found by a descent of their own rather than by scanning the root of
+ * the src index.
+ */
 struct wolfidps_route_table {
-    struct wolfidps_table_header header;
+    struct wolfidps_table_header header; /* cmp_fn orders the ents at each trie node. */
+    struct wolfidps_route_trie_family *families[2]; /* by ent_type: the src-keyed and dst-keyed indexes. */
+    long n_routes;
+    long max_routes; /* 0 for no limit */
+    wolfidps_eviction_policy_t eviction_policy;
+    struct wolfidps_route *clock_hand; /* every route is on a ring through here. */
+    wolfidps_count_t n_evictions;
+    uint32_t next_id;
+    volatile uint64_t generation; /* bumped on every change to what dispatch can match. */
+};
+
+/* compiled policy image -- see wolfidps_policy_compile() and
+ * wolfidps_policy_load_fd().  a read-only copy of the static routes,
+ * flattened into index-linked arrays in a single position-independent
+ * block, which is also the policy file format: a header giving the offset
+ * of each section, then a patricia trie of src prefixes over nodes[],
+ * whose rules[] hold everything needed to match a flow, the event and
+ * action names the rules refer to, and, in exported files, the dynamic
+ * routes.  everything is in the writer's byte order.
+ */
+#define WOLFIDPS_POLICY_MAGIC 0x50444977U /* "wIDP" */
+#define WOLFIDPS_POLICY_VERSION 1
+#define WOLFIDPS_POLICY_BYTE_ORDER 0x01020304U
+#define WOLFIDPS_POLICY_NONE 0xffffffffU /* no event or action */
+
+struct wolfidps_policy_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t byte_order; /* WOLFIDPS_POLICY_BYTE_ORDER, as written */
+    uint32_t n_families, n_nodes, n_rules, n_events, n_actions, n_records;
+    uint32_t reserved;
+    uint64_t size; /* of the whole block */
+    /* section offsets from the start of the block, in this order. */
+    uint64_t families, nodes, rules, names, prefixes, strings, records;
+};
+
+struct wolfidps_policy_node {
+    uint32_t child[2]; /* node indices, 0 for none -- roots are never children. */
+    uint32_t prefix; /* offset of the src prefix in prefixes[] */
+    uint32_t rules; /* index of the first rule with exactly this prefix */
+    uint32_t n_rules;
+    uint16_t prefix_len; /* in bits */
+};
+
+struct wolfidps_policy_rule {
+    uint32_t flags; /* struct wolfidps_route_flags */
+    uint32_t dst_prefix; /* offset of the dst prefix in prefixes[] */
+    uint32_t event, action; /* names[event] and names[n_events + action], or WOLFIDPS_POLICY_NONE */
+    wolfidps_proto_t sa_proto;
+    wolfidps_port_t src_port, dst_port;
+    u_char dst_len, src_if_id, dst_if_id;
+    volatile u_char dead; /* the route has since been deleted. */
+};
+
+struct wolfidps_policy_family {
+    wolfidps_family_t sa_family;
+    uint32_t root;
+};
+
+/* an event keyword or action label. */
+struct wolfidps_policy_name {
+    uint32_t offset; /* in strings[] */
+    uint32_t len;
+};
+
+/* a route with a ttl, followed by its src and then dst address, padded
+ * out to 8 bytes.
+ */
+struct wolfidps_policy_record {
+    uint32_t flags;
+    uint32_t event, action;
+    wolfidps_family_t sa_family;
+    wolfidps_proto_t sa_proto;
+    wolfidps_port_t src_port, dst_port;
+    u_char src_len, dst_len, src_if_id, dst_if_id;
+    uint64_t expires; /* in the units of the time callbacks */
+    wolfidps_count_t n_hits;
+};
+
+#define WOLFIDPS_POLICY_RECORD_SIZE(src_len, dst_len) (sizeof(struct wolfidps_policy_record) + ((WOLFIDPS_BITS_TO_BYTES(src_len) + WOLFIDPS_BITS_TO_BYTES(dst_len) + 7) & ~(size_t)7))
+
+struct wolfidps_policy_linear;
+
+/* the in-memory handle on a block, allocated or mapped. */
+struct wolfidps_policy_image {
+    struct wolfidps_policy_header *header;
+    size_t map_len; /* nonzero if the block is a file mapping */
+    uint32_t n_dead;
+    int n_families;
+    uint32_t n_nodes, n_rules, n_events, n_actions;
+    struct wolfidps_policy_family *families;
+    struct wolfidps_policy_node *nodes;
+    struct wolfidps_policy_rule *rules;
+    struct wolfidps_policy_name *names;
+    u_char *prefixes;
+    const char *strings;
+    /* routes[] parallels rules[], and is only touched once a rule has
+     * matched.  rules with no route -- those loaded from a file, and
+     * carried over from one by later compiles -- count their hits in
+     * counter_base + i, and use the events and actions resolved by name
+     * when the image was opened.
+     */
+    struct wolfidps_route **routes; /* NULL if no rule has a route */
+    wolfidps_counter_id_t counter_base; /* 0 if every rule has a route */
+    struct wolfidps_event **events;
+    struct wolfidps_action **actions; /* NULL where no such action is registered */
+    struct wolfidps_policy_linear **linear; /* parallels families[], NULL where a family uses its trie */
 };
 
 struct wolfidps_action_list_ent {
@@ -164,13 +387,61 @@ struct wolfidps_event {
 
     struct wolfidps_action_list action_list;
 
-    wolfidps_count_t hitcount;
+    wolfidps_counter_id_t hitcount; /* read with wolfidps_counter_get(). */
+    volatile int queue_refs; /* 1 while live, plus 1 per record queued for it */
+    uint32_t hash; /* of keyword */
     byte keyword_len;
     char keyword[];
 };
 
+/* events by id, for lockless readers.  replaced with a larger copy when
+ * full, and the old copy retired.
+ */
+struct wolfidps_event_ids {
+    uint32_t n_ids;
+    struct wolfidps_event *events[];
+};
+
+/* events are found by keyword in an open addressed hash of n_slots (a
+ * power of 2) slots, probed linearly, and by id in ids.  ids of freed
+ * events are reused.
+ */
 struct wolfidps_event_table {
+    struct wolfidps_table_header header; /* unused -- events are not listed */
+    struct wolfidps_event **slots; /* each NULL, WOLFIDPS_EVENT_TOMBSTONE, or an event */
+    uint32_t n_slots, n_events, n_tombstones;
+    struct wolfidps_event_ids * volatile ids;
+    wolfidps_ent_id_t *free_ids;
+    uint32_t n_free_ids;
+    wolfidps_ent_id_t next_id;
+};
+
+/* a policy rule, keyed on { keyword, family, proto, port, id }, with the
+ * parameters of the routes it instantiates.  rules are only ever added,
+ * changed, and deleted by wolfidps_config_load().
+ */
+struct wolfidps_rule {
+    struct wolfidps_table_ent_header header;
+    int refcount; /* routes instantiated from this rule */
+    uint32_t id;
+    struct wolfidps_event *event; /* its keyword */
+    struct wolfidps_route_flags flags; /* sa_family_wildcard, sa_proto_wildcard, and sa_dst_port_wildcard */
+    wolfidps_family_t sa_family;
+    wolfidps_proto_t sa_proto;
+    wolfidps_port_t sa_port;
+
+    u_char prefix_len; /* of the src prefix of its routes, in bits, or 0 for the full address */
+    wolfidps_disposition_t disposition;
+    wolfidps_count_t threshold; /* matches before it triggers */
+    wolfidps_time_t duration; /* ttl of its routes */
+    struct wolfidps_action *action;
+
+    wolfidps_counter_id_t hitcount; /* read with wolfidps_counter_get(). */
+};
+
+struct wolfidps_rule_table {
     struct wolfidps_table_header header;
+    long n_rules;
 };
 
 struct wolfidps_table_ent_generic {
@@ -178,6 +449,7 @@ struct wolfidps_table_ent_generic {
         struct wolfidps_table_ent_header generic;
         struct wolfidps_event event;
         struct wolfidps_action action;
+        struct wolfidps_rule rule;
         struct wolfidps_route_table_ent route;
     };
 };
@@ -187,6 +459,7 @@ struct wolfidps_table_generic {
         struct wolfidps_table_header generic;
         struct wolfidps_event_table events;
         struct wolfidps_action_table actions;
+        struct wolfidps_rule_table rules;
         struct wolfidps_route_table routes;
     };
 };
@@ -200,21 +473,165 @@ struct wolfidps_sockaddr {
     u_char addr[];
 };
 
+/* state holds the reader count, or WOLFIDPS_LOCK_WRITE_LOCKED, in its
+ * low bits, and a bit each for parked readers and writers.  readers park
+ * on state itself, writers on writer_notify, so that an unlock can wake a
+ * single writer without stirring the readers.
+ */
 struct wolfidps_rwlock {
-    sem_t sem;
-    sem_t sem_read_waiters;
-    sem_t sem_write_waiters;
-    volatile int shared_count;
-    volatile int read_waiter_count;
-    volatile int write_waiter_count;
-    volatile enum {
-        WOLFIDPS_LOCK_UNLOCKED = 0,
-        WOLFIDPS_LOCK_SHARED,
-        WOLFIDPS_LOCK_EXCLUSIVE
-    } state;
+    volatile uint32_t state;
+    volatile uint32_t writer_notify;
 };
 
-typedef int64_t woldidps_time_t;
+#define WOLFIDPS_CACHE_LINE_SIZE 64
+
+struct wolfidps_context;
+
+/* direct-mapped cache of route lookups, one per reader slot -- see
+ * wolfidps_set_dispatch_cache().  an entry holds the winning route, or
+ * compiled rule, or neither, for one flow, and is good for as long as the
+ * route table generation and policy image it was looked up under.
+ */
+#define WOLFIDPS_DISPATCH_CACHE_ADDR_BYTES 16 /* longer addresses are never cached */
+#define WOLFIDPS_DISPATCH_CACHE_KEY_WORDS 6
+
+union wolfidps_dispatch_cache_key {
+    struct {
+        wolfidps_family_t sa_family;
+        wolfidps_proto_t sa_proto;
+        wolfidps_port_t src_port, dst_port;
+        u_char src_if_id, dst_if_id;
+        u_char src_len, dst_len; /* in bits */
+        u_char src_addr[WOLFIDPS_DISPATCH_CACHE_ADDR_BYTES];
+        u_char dst_addr[WOLFIDPS_DISPATCH_CACHE_ADDR_BYTES];
+    } flow;
+    uint64_t words[WOLFIDPS_DISPATCH_CACHE_KEY_WORDS];
+};
+
+struct wolfidps_policy_image;
+
+struct wolfidps_dispatch_cache_ent {
+    union wolfidps_dispatch_cache_key key;
+    uint64_t generation;
+    const struct wolfidps_policy_image *image;
+    struct wolfidps_route *route; /* NULL for a rule with no route, or no match. */
+    uint32_t rule; /* WOLFIDPS_POLICY_NONE for no match. */
+};
+
+struct wolfidps_dispatch_cache {
+    uint32_t mask;
+    struct wolfidps_dispatch_cache_ent ents[];
+};
+
+/* per-thread reader slot for lockless dispatch.  each slot is owned by one
+ * thread at a time, and padded out to a cache line so that readers never
+ * write to a line shared with another thread.
+ */
+struct wolfidps_epoch_slot {
+    volatile uint64_t state; /* (epoch << 1) | active */
+    void * volatile owner;
+    struct wolfidps_counter_shard *counters; /* this thread's counter shard. */
+    struct wolfidps_dispatch_cache *dispatch_cache; /* NULL if disabled. */
+    struct wolfidps_stats *stats; /* this thread's probe shard. */
+    u_char pad[WOLFIDPS_CACHE_LINE_SIZE - sizeof(uint64_t) - (4 * sizeof(void *))];
+};
+
+typedef void (*wolfidps_retire_cb_t)(struct wolfidps_context *wolfidps, void *ptr);
+
+struct wolfidps_epoch_limbo {
+    struct wolfidps_epoch_limbo *next;
+    uint64_t epoch;
+    void *ptr;
+    wolfidps_retire_cb_t free_cb; /* NULL for plain allocator.free */
+};
+
+/* sharded hit counters.  each counter is a slot in a set of shards: one
+ * per reader thread (see wolfidps_set_lockless_dispatch()), incremented
+ * without atomic read-modify-write, and a shared shard, incremented
+ * atomically, for everyone else.  totals are folded on read.
+ *
+ * a shard is a fixed directory of pages of chunk pointers, all filled in
+ * as needed and never moved, so that ids can go up to the width of
+ * wolfidps_counter_id_t and readers need no lock to follow them.  the
+ * shared shard has a chunk for every id handed out; a reader shard only
+ * has chunks for the ids its thread has counted on.
+ */
+#define WOLFIDPS_COUNTER_CHUNK_BITS 12
+#define WOLFIDPS_COUNTER_CHUNK_SIZE (1U << WOLFIDPS_COUNTER_CHUNK_BITS)
+#define WOLFIDPS_COUNTER_PAGE_BITS 10
+#define WOLFIDPS_COUNTER_PAGE_SIZE (1U << WOLFIDPS_COUNTER_PAGE_BITS)
+#define WOLFIDPS_COUNTER_DIR_SIZE (1U << (32 - WOLFIDPS_COUNTER_PAGE_BITS - WOLFIDPS_COUNTER_CHUNK_BITS))
+
+struct wolfidps_counter_shard {
+    wolfidps_count_t **pages[WOLFIDPS_COUNTER_DIR_SIZE];
+};
+
+struct wolfidps_counters {
+    struct wolfidps_counter_shard *shared;
+    uint64_t next_id; /* ids below this have been handed out */
+    wolfidps_counter_id_t *free_ids; /* released ids, for reuse */
+    uint32_t n_free_ids, free_ids_alloced;
+};
+
+/* hot path instrumentation -- see wolfidps_stats_snapshot().  each probe
+ * counts calls, and keeps a log-linear latency histogram, in ns, of those
+ * it times: WOLFIDPS_STATS_SUB_BITS significant bits, up to
+ * 2^WOLFIDPS_STATS_MAX_BITS ns, past which values land in the last bucket.
+ * like the hit counters, there is a shard per reader slot, and a shared
+ * one.  probes compile away under WOLFIDPS_NO_STATS.
+ */
+typedef enum wolfidps_probe {
+    WOLFIDPS_PROBE_DISPATCH = 0, /* single flows, one in 2^WOLFIDPS_STATS_SAMPLE_SHIFT timed */
+    WOLFIDPS_PROBE_INSERT,
+    WOLFIDPS_PROBE_DELETE,
+    WOLFIDPS_PROBE_EXPIRE,
+    WOLFIDPS_PROBE_LOCK_WAIT, /* writers waiting for the table lock */
+    WOLFIDPS_PROBE_ALLOC, /* route and trie node allocation */
+    WOLFIDPS_PROBE_DISPATCH_BATCH, /* wolfidps_route_dispatch_batch(), each call timed as a whole */
+    WOLFIDPS_N_PROBES
+} wolfidps_probe_t;
+
+#define WOLFIDPS_STATS_SUB_BITS 3
+#define WOLFIDPS_STATS_MAX_BITS 36
+#define WOLFIDPS_STATS_BUCKETS ((WOLFIDPS_STATS_MAX_BITS - WOLFIDPS_STATS_SUB_BITS + 1) << WOLFIDPS_STATS_SUB_BITS)
+
+struct wolfidps_probe_stats {
+    wolfidps_count_t n_calls;
+    wolfidps_count_t total_ns; /* of those timed */
+    wolfidps_count_t hist[WOLFIDPS_STATS_BUCKETS];
+};
+
+struct wolfidps_stats {
+    struct wolfidps_probe_stats probes[WOLFIDPS_N_PROBES];
+    wolfidps_count_t dispositions[WOLFIDPS_N_DISPOSITIONS];
+};
+
+struct wolfidps_probe_snapshot {
+    wolfidps_count_t n_calls;
+    wolfidps_count_t n_timed; /* the histogram total */
+    wolfidps_count_t total_ns;
+    uint64_t p50_ns, p90_ns, p99_ns, p999_ns, max_ns; /* bucket upper bounds, 0 if none timed */
+    wolfidps_count_t hist[WOLFIDPS_STATS_BUCKETS];
+};
+
+struct wolfidps_stats_snapshot {
+    struct wolfidps_probe_snapshot probes[WOLFIDPS_N_PROBES];
+    wolfidps_count_t dispositions[WOLFIDPS_N_DISPOSITIONS]; /* of dispatched flows */
+    long n_routes;
+    wolfidps_count_t n_evictions;
+    int n_reader_slots; /* in use */
+};
+
+struct wolfidps_epoch {
+    int enabled;
+    uint64_t serial;
+    volatile uint64_t global_epoch;
+    struct wolfidps_epoch_slot *slots;
+    int n_slots;
+    volatile int n_slots_used; /* high water mark */
+    int dispatch_cache_size; /* entries per slot, 0 for none */
+    struct wolfidps_epoch_limbo *limbo_head, *limbo_tail; /* retired pointers, oldest first. */
+};
 
 typedef int (*wolfidps_get_time_cb_t)(void *context, woldidps_time_t *ts);
 typedef woldidps_time_t (*wolfidps_diff_time_cb_t)(woldidps_time_t earlier, woldidps_time_t later);
@@ -234,6 +651,66 @@ struct wolfidps_allocator {
     wolfidps_memalign_cb_t memalign;
 };
 
+/* slab allocator, usable as a struct wolfidps_allocator -- see
+ * wolfidps_slab_init().  memory is carved into WOLFIDPS_SLAB_PAGE_SIZE
+ * pages, each dedicated to one size class, so that allocation and free are
+ * O(1) and a freed object is always reusable by the next allocation of its
+ * class.  pages that empty out are returned to a shared free page list.
+ */
+#define WOLFIDPS_SLAB_PAGE_BITS 16
+#define WOLFIDPS_SLAB_PAGE_SIZE ((size_t)1 << WOLFIDPS_SLAB_PAGE_BITS)
+#define WOLFIDPS_SLAB_PAGE_HDR WOLFIDPS_CACHE_LINE_SIZE /* objects start this far into their page. */
+#define WOLFIDPS_SLAB_MAX_CLASSES 16
+
+struct wolfidps_slab_page {
+    struct wolfidps_slab_page *next, **pprev; /* on its class's partial list, or the free page list. */
+    void *free_objs;
+    uint32_t n_used;
+    uint32_t n_carved; /* objects are carved from the page lazily. */
+    int size_class; /* -1 for a dedicated mapping. */
+    size_t map_len; /* dedicated mappings only */
+};
+
+struct wolfidps_slab_chunk {
+    struct wolfidps_slab_chunk *next;
+    size_t map_len;
+};
+
+struct wolfidps_slab_class {
+    uint32_t obj_size;
+    uint32_t objs_per_page;
+    struct wolfidps_slab_page *partial; /* pages with free objects */
+    size_t n_objs;
+};
+
+struct wolfidps_slab {
+    volatile int lock;
+    int mapped; /* pages come from anonymous mappings rather than a static buffer. */
+    u_char *carve_next, *carve_end; /* uncarved pages */
+    size_t max_bytes;
+    size_t footprint; /* pages carved plus dedicated mappings */
+    size_t in_use; /* bytes in live objects, rounded up to their size class */
+    size_t n_pages, n_free_pages;
+    size_t n_failures;
+    struct wolfidps_slab_page *free_pages;
+    struct wolfidps_slab_chunk *chunks;
+    int n_classes;
+    struct wolfidps_slab_class classes[WOLFIDPS_SLAB_MAX_CLASSES];
+};
+
+struct wolfidps_slab_stats {
+    size_t max_bytes;
+    size_t footprint;
+    size_t in_use;
+    size_t n_pages, n_free_pages;
+    size_t n_failures; /* allocations refused for want of memory. */
+    int n_classes;
+    struct {
+        uint32_t obj_size;
+        size_t n_objs;
+    } classes[WOLFIDPS_SLAB_MAX_CLASSES];
+};
+
 struct wolfidps_timecbs {
     void *context;
     wolfidps_get_time_cb_t get_time;
@@ -242,23 +719,354 @@ struct wolfidps_timecbs {
     wolfidps_epoch_time_cb_t epoch_time;
 };
 
+/* what dispatch does with a record for a full ring.  it never waits in
+ * its epoch or with the table lock held, where it could stall writers,
+ * or deadlock with a handler taking the lock, so a record to wait for
+ * room is kept aside and pushed once dispatch has let go, before it
+ * returns.  one that can't be kept, for want of memory, is discarded and
+ * counted in n_dropped.
+ */
+typedef enum wolfidps_backpressure {
+    WOLFIDPS_BACKPRESSURE_DROP = 0, /* discard the record */
+    WOLFIDPS_BACKPRESSURE_BLOCK, /* wait for room */
+    WOLFIDPS_BACKPRESSURE_COALESCE /* discard it if its action has one queued already, else wait */
+} wolfidps_backpressure_t;
+
+struct wolfidps_action_queue_cell;
+
+/* bounded lock-free ring of handler invocations, pushed by dispatch and
+ * drained by worker threads.  each cell carries a sequence number, as in
+ * vyukov's bounded queue, so that producers and workers only ever
+ * contend on tail and head respectively.
+ */
+struct wolfidps_action_queue {
+    volatile uint64_t tail;
+    u_char pad0[WOLFIDPS_CACHE_LINE_SIZE - sizeof(uint64_t)];
+    volatile uint64_t head;
+    u_char pad1[WOLFIDPS_CACHE_LINE_SIZE - sizeof(uint64_t)];
+    volatile int n_idle; /* workers waiting on work */
+    volatile int stopping;
+    struct wolfidps_action_queue_cell *cells;
+    uint32_t n_cells; /* a power of 2 */
+    wolfidps_backpressure_t backpressure;
+    sem_t work;
+    pthread_t *workers;
+    int n_workers;
+    int running;
+};
+
+struct wolfidps_action_queue_stats {
+    long depth; /* records queued now */
+    long max_depth;
+    wolfidps_count_t n_queued, n_dropped;
+    wolfidps_count_t n_coalesced; /* triggers merged by wolfidps_action_set_coalescing() */
+    wolfidps_count_t n_dropped_coalesce; /* records discarded under WOLFIDPS_BACKPRESSURE_COALESCE */
+};
+
+struct wolfidps_coalesce_ent;
+
+/* pending triggers of coalescing actions, in a fixed open addressed
+ * table keyed on { action, route }.
+ */
+struct wolfidps_coalescer {
+    struct wolfidps_coalesce_ent * volatile ents;
+    uint32_t n_ents; /* a power of 2 */
+};
+
+struct wolfidps_admission_sketch;
+
+/* count-min sketch of event reports by { family, src prefix, event },
+ * halved every half_life.  see wolfidps_event_report().
+ */
+struct wolfidps_admission {
+    struct wolfidps_admission_sketch * volatile sketch;
+    wolfidps_time_t half_life; /* 0 for no decay */
+    volatile woldidps_time_t decay_at;
+    volatile int decaying;
+};
+
+struct wolfidps_scan_ent;
+
+/* a source found scanning, for a penalty route to be inserted once the
+ * dispatch that found it is done with the table.
+ */
+struct wolfidps_scan_penalty {
+    wolfidps_family_t sa_family;
+    u_char addr_len; /* in bits */
+    u_char addr[256/8];
+};
+
+#ifndef WOLFIDPS_SCAN_MAX_PENDING
+#define WOLFIDPS_SCAN_MAX_PENDING 64
+#endif
+
+struct wolfidps_scan_params {
+    int n_sources; /* tracked at once, rounded up to a power of 2 */
+    int threshold; /* distinct dst ports in a window */
+    wolfidps_time_t window;
+    int event_label_len;
+    const char *event_label; /* counted on, and parent of the penalty route */
+    int action_label_len;
+    const char *action_label; /* of the penalty route, or NULL for none */
+    wolfidps_time_t penalty_ttl; /* of the penalty route, or WOLFIDPS_TIME_NEVER for none */
+};
+
+struct wolfidps_scan_stats {
+    wolfidps_count_t n_observed, n_triggered, n_evicted, n_penalties_dropped;
+};
+
+/* the port scan detector -- see wolfidps_scan_detect_start(). */
+struct wolfidps_scanner {
+    struct wolfidps_scan_ent * volatile ents;
+    uint32_t n_ents; /* a power of 2 */
+    uint32_t trigger_bits; /* sketch bits set at threshold */
+    wolfidps_time_t window;
+    wolfidps_time_t penalty_ttl;
+    byte event_label_len, action_label_len;
+    char event_label[255], action_label[255];
+    wolfidps_counter_id_t n_observed, n_triggered, n_evicted, n_penalties_dropped;
+    volatile int pending_lock;
+    int n_pending;
+    struct wolfidps_scan_penalty pending[WOLFIDPS_SCAN_MAX_PENDING];
+};
+
+struct wolfidps_config;
+
 struct wolfidps_context {
     struct wolfidps_rwlock lock;
     struct wolfidps_allocator allocator;
     struct wolfidps_timecbs timecbs;
     struct wolfidps_event_table events;
     struct wolfidps_action_table actions;
+    struct wolfidps_rule_table rules;
     struct wolfidps_route_table routes;
+    struct wolfidps_policy_image * volatile policy;
+    struct wolfidps_rwlock config_lock; /* serializes wolfidps_config_load() */
+    struct wolfidps_config *config; /* the text policy last loaded */
+    struct wolfidps_epoch epoch;
+    struct wolfidps_counters counters;
+    struct wolfidps_timer_wheel timers;
+    struct wolfidps_action_queue action_queue;
+    struct wolfidps_coalescer coalescer;
+    struct wolfidps_scanner scanner;
+    struct wolfidps_admission admission;
+#ifndef WOLFIDPS_NO_STATS
+    struct wolfidps_stats stats; /* shared probe shard */
+#endif
 };
 
 int wolfidps_init(struct wolfidps_allocator *allocator, struct wolfidps_context **wolfidps);
 int wolfidps_shutdown(struct wolfidps_context **wolfidps);
 
+/* a route table partitioned by source across independent contexts -- see
+ * wolfidps_shards_init().  routes whose src prefix is at least as long as
+ * their family's shard prefix live in the shard its leading bits hash to.
+ * all others, including wide netblocks and wildcards, live in the shared
+ * tier.
+ */
+struct wolfidps_shards {
+    struct wolfidps_allocator allocator;
+    int n_shards;
+    unsigned int inet_prefix_bits, inet6_prefix_bits;
+    struct wolfidps_context *contexts[]; /* n_shards partitions, then the shared tier. */
+};
+
+#define WOLFIDPS_SHARDS_SHARED(s) ((s)->contexts[(s)->n_shards])
+
+/* set up slab to allocate from buf, or, if buf is NULL, from anonymous
+ * mappings obtained as needed.  the footprint never exceeds max_bytes (or
+ * buf_size), and allocations that would exceed it fail.  in static buffer
+ * mode, no single allocation may exceed a page.  *allocator is filled in
+ * for passing to wolfidps_init().
+ */
+int wolfidps_slab_init(struct wolfidps_slab *slab, void *buf, size_t buf_size, size_t max_bytes, struct wolfidps_allocator *allocator);
+int wolfidps_slab_get_stats(struct wolfidps_slab *slab, struct wolfidps_slab_stats *stats);
+/* release all mappings.  every context using slab must have been shut down. */
+int wolfidps_slab_destroy(struct wolfidps_slab *slab);
+
 int wolfidps_set_callback_get_time(struct wolfidps_context *wolfidps, wolfidps_get_time_cb_t handler, void *context);
 int wolfidps_set_callback_diff_time(struct wolfidps_context *wolfidps, wolfidps_diff_time_cb_t handler);
 int wolfidps_set_callback_add_time(struct wolfidps_context *wolfidps, wolfidps_add_time_cb_t handler);
 int wolfidps_set_callback_epoch_time(struct wolfidps_context *wolfidps, wolfidps_epoch_time_cb_t handler);
 
+/* enable lockless wolfidps_route_dispatch() for up to max_threads
+ * concurrent dispatching threads, using epoch-based reclamation.  threads
+ * beyond max_threads fall back to the table lock.  must be called before
+ * the context is shared between threads.
+ */
+int wolfidps_set_lockless_dispatch(struct wolfidps_context *wolfidps, int max_threads);
+/* release the calling thread's reader slot, if any. */
+int wolfidps_thread_detach(struct wolfidps_context *wolfidps);
+/* give each lockless dispatching thread a private cache of its last route
+ * lookups, n_entries (rounded up to a power of two) direct-mapped by flow,
+ * so that repeated flows skip the table walk.  any change to the routes or
+ * the compiled policy invalidates every cache at once.  hits are counted
+ * and actioned as usual.  0 disables.  must be called before the context
+ * is shared between threads.
+ */
+int wolfidps_set_dispatch_cache(struct wolfidps_context *wolfidps, int n_entries);
+
+int wolfidps_counter_get(struct wolfidps_context *wolfidps, wolfidps_counter_id_t id, wolfidps_count_t *count);
+
+/* fold the probe shards into snapshot, without allocating or locking.
+ * each probe's percentiles agree with its histogram, though probes still
+ * running may land on either side of the snapshot.  returns
+ * NOT_COMPILED_IN under WOLFIDPS_NO_STATS.
+ */
+int wolfidps_stats_snapshot(struct wolfidps_context *wolfidps, struct wolfidps_stats_snapshot *snapshot);
+/* the upper bound, in ns, of histogram bucket i. */
+uint64_t wolfidps_stats_bucket_max(unsigned int i);
+
+/* granularity of route expiry, in the units of the time callbacks.  can
+ * only be changed while no routes with a ttl are present.
+ */
+int wolfidps_set_expiry_resolution(struct wolfidps_context *wolfidps, wolfidps_time_t tick_len);
+/* delete at most budget routes whose ttl has run out as of now (or as of
+ * the current time, if now is WOLFIDPS_TIME_NEVER).  returns the number
+ * deleted.  call again to continue where a budget-limited call left off.
+ */
+int wolfidps_expire(struct wolfidps_context *wolfidps, wolfidps_time_t now, int budget);
+
+/* make room for new routes, when the table holds max_routes routes (0 for
+ * no limit) or a route allocation fails, by deleting a victim chosen by
+ * policy.  each eviction examines a bounded number of routes.
+ */
+int wolfidps_set_eviction_policy(struct wolfidps_context *wolfidps, wolfidps_eviction_policy_t policy, long max_routes);
+
+/* compile the static routes (those with no ttl) into a fresh policy
+ * image, and swap it in.  compiled routes are matched against the image
+ * instead of the trie, and can still be looked up and deleted as before.
+ * routes inserted since the last compile are served from the trie until
+ * the next.  on a tie in prefix length, trie routes take precedence.
+ */
+int wolfidps_policy_compile(struct wolfidps_context *wolfidps);
+
+/* replace the static policy -- every route with no ttl, compiled or not --
+ * with the one in a file written by wolfidps_policy_export(), and restore
+ * the routes with a ttl that it holds and that have yet to expire.  the
+ * file is mapped privately and used in place as the compiled policy
+ * image: nothing is parsed or allocated per static route, and later
+ * compiles carry its rules over as they are.  events and actions are
+ * bound by name.  ttls only carry over if the time callbacks give the
+ * same times across restarts, as the builtin clock does.
+ */
+int wolfidps_policy_load_fd(struct wolfidps_context *wolfidps, int fd);
+/* as for wolfidps_policy_load_fd(), from a copy of buf. */
+int wolfidps_policy_load(struct wolfidps_context *wolfidps, const void *buf, size_t len);
+/* write the static policy and the unexpired routes with a ttl to path, by
+ * way of a temporary file that is synced and then renamed over it, so
+ * that path always holds a complete policy.
+ */
+int wolfidps_policy_export(struct wolfidps_context *wolfidps, const char *path);
+
+/* bind handler to the action labeled label, creating the action if need
+ * be.  a NULL handler unbinds it.
+ */
+int wolfidps_action_set_handler(struct wolfidps_context *wolfidps, int label_len, const char *label, wolfidps_action_callback_t *handler, void *handler_context);
+
+/* look up the event for keyword, creating it if need be, and take a
+ * reference on it.  *id identifies it to the functions below, which cost
+ * no hashing, until the reference is dropped with wolfidps_event_release().
+ */
+int wolfidps_event_intern(struct wolfidps_context *wolfidps, int keyword_len, const char *keyword, wolfidps_ent_id_t *id);
+int wolfidps_event_release(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id);
+/* count a hit on an interned event.  lockless with lockless dispatch. */
+int wolfidps_event_hit(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id);
+int wolfidps_event_get_hitcount(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id, wolfidps_count_t *count);
+/* count a hit on the event interned as id by the flow src -> dst, and
+ * check it against each rule for the event that the flow matches.  reports
+ * are tallied by { family, src prefix of the rule, event } in a fixed size,
+ * decaying count-min sketch, and only once the estimate reaches a rule's
+ * threshold is a route allocated: src prefix to anywhere, on the rule's
+ * proto and dst port, with its ttl and action, and the event as parent.
+ * its tally is then taken back out.  estimates may run high, never low.
+ * returns the number of routes inserted.
+ */
+int wolfidps_event_report(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id, const struct wolfidps_sockaddr *src, const struct wolfidps_sockaddr *dst);
+/* size the sketch used by wolfidps_event_report() (width rounded up to a
+ * power of 2, per row), and set how often it is halved.  estimates stay
+ * close while width is a few times the number of { prefix, event } keys
+ * reported on within a half life.  tallies so far are dropped.  a sketch
+ * of WOLFIDPS_ADMISSION_WIDTH, with no decay, is made on the first report
+ * otherwise.
+ */
+int wolfidps_admission_configure(struct wolfidps_context *wolfidps, int width, wolfidps_time_t half_life);
+
+/* run the handlers of async actions (see wolfidps_action_set_async()) on
+ * n_workers threads, fed through a ring of n_cells records (rounded up to
+ * a power of 2).  backpressure says what dispatch does when the ring is
+ * full.
+ */
+int wolfidps_action_queue_start(struct wolfidps_context *wolfidps, int n_cells, int n_workers, wolfidps_backpressure_t backpressure);
+/* run whatever is queued, then stop the workers.  no dispatch may be in
+ * progress.  called by wolfidps_shutdown().
+ */
+int wolfidps_action_queue_stop(struct wolfidps_context *wolfidps);
+/* when async, the handler of the action labeled label is queued for the
+ * workers rather than called by dispatch, which then returns
+ * WOLFIDPS_REJECT, and its return is ignored.  handlers see a snapshot of
+ * the matched route, with no links to follow but parent_event.  a handler
+ * may run once after being unbound, so handler_context must outlive the
+ * next wolfidps_action_queue_stop().  without a running queue, handlers
+ * are called inline as before.
+ */
+int wolfidps_action_set_async(struct wolfidps_context *wolfidps, int label_len, const char *label, int async);
+/* merge the triggers of the action labeled label on each route that fall
+ * within window of the first, and deliver them to handler (in place of
+ * the action's own handler) as one, once the window has passed -- on the
+ * next trigger, or on wolfidps_action_coalesce_flush().  dispatch returns
+ * WOLFIDPS_REJECT for them.  handler runs on the action queue if the
+ * action is async.  a window of 0 stops coalescing.  triggers that find
+ * no room in the table are delivered on their own.  merged triggers are
+ * counted in the action's n_coalesced.
+ */
+int wolfidps_action_set_coalescing(struct wolfidps_context *wolfidps, int label_len, const char *label, wolfidps_time_t window, wolfidps_action_coalesced_callback_t *handler);
+/* deliver the merged triggers whose window has passed as of now (or as
+ * of the current time, if now is WOLFIDPS_TIME_NEVER).  returns the
+ * number delivered.  wolfidps_shutdown() delivers everything left.
+ */
+int wolfidps_action_coalesce_flush(struct wolfidps_context *wolfidps, wolfidps_time_t now);
+int wolfidps_action_get_queue_stats(struct wolfidps_context *wolfidps, int label_len, const char *label, struct wolfidps_action_queue_stats *stats);
+
+/* watch for sources trying more than params->threshold distinct dst
+ * ports within params->window, among the flows dispatch finds no route or
+ * rule for, and those passed to wolfidps_scan_observe().  each source
+ * tracked costs a fixed size approximate count of its ports, in a table of
+ * params->n_sources, so memory is bounded however many sources scan; when
+ * full, the source whose window is oldest gives way.  a source over the
+ * threshold counts a hit on the event labeled params->event_label, once
+ * per window, and unless params->penalty_ttl is WOLFIDPS_TIME_NEVER, gets
+ * a route rejecting everything from it, with that event as parent and
+ * params->action_label as action.  thresholds are capped at
+ * WOLFIDPS_SCAN_MAX_THRESHOLD, past which the count is too rough.
+ */
+int wolfidps_scan_detect_start(struct wolfidps_context *wolfidps, const struct wolfidps_scan_params *params);
+int wolfidps_scan_detect_stop(struct wolfidps_context *wolfidps);
+/* count an attempt from src on the dst port of dst, as for a flow known to
+ * have found no listener.  returns 1 if it put src over the threshold.
+ */
+int wolfidps_scan_observe(struct wolfidps_context *wolfidps, const struct wolfidps_sockaddr *src, const struct wolfidps_sockaddr *dst);
+int wolfidps_scan_get_stats(struct wolfidps_context *wolfidps, struct wolfidps_scan_stats *stats);
+
+/* load or reload a text policy of actions, events, rules, and static
+ * routes -- see config.c for the grammar.  the new policy is diffed
+ * against the one last loaded, and only what was added, removed, or
+ * changed is touched, so everything else keeps its hit counts and
+ * references, and the table lock is held for time proportional to the
+ * size of the diff.  static routes deleted by other means since the last
+ * load are only put back if their statement changes.  on a syntax error
+ * nothing is changed, and *error_line (if error_line is non-NULL) is set
+ * to the offending line.
+ */
+int wolfidps_config_load(struct wolfidps_context *wolfidps, const char *text, size_t len, int *error_line);
+/* as for wolfidps_config_load(), reading the text from fd. */
+int wolfidps_config_load_fd(struct wolfidps_context *wolfidps, int fd, int *error_line);
+
+/* returned by the route inserts when a route with the same key and
+ * event is in place already.
+ */
+#define WOLFIDPS_ROUTE_EXISTS_E (-1000)
+
 int wolfidps_route_insert(
     struct wolfidps_context *wolfidps,
     struct wolfidps_sockaddr *src,
@@ -278,6 +1086,46 @@ int wolfidps_route_delete(
     const char *event_label
     );
 
+/* match the route keyed on src, dst, and event_label on any port in the
+ * given ranges too, besides its src and dst sa_port, until the next call.
+ * no ranges clears them.  each set is tested in constant time when dense,
+ * or by bisection when it holds few ranges.  a route flagged tcplike only
+ * matches extra ports of protos that number ports as tcp does, so that a
+ * proto wildcard route does not match icmp types and the like.  routes
+ * with extra ports are never compiled, nor exported.
+ */
+int wolfidps_route_set_extra_ports(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t dst_flags,
+    int event_label_len,
+    const char *event_label,
+    int n_src_ranges,
+    const struct wolfidps_port_range *src_ranges,
+    int n_dst_ranges,
+    const struct wolfidps_port_range *dst_ranges
+    );
+
+/* rate limit the route keyed on src, dst, and event_label: dispatch
+ * returns WOLFIDPS_ACCEPT for its hits up to burst at once, refilled at one
+ * per interval (in the units of the time callbacks), and WOLFIDPS_DROP,
+ * or what its action says, past that.  its action only runs for hits over
+ * the limit.  an interval of 0 lifts the limit.  the bucket is refilled
+ * lazily by each hit, with no lock.  rate limited routes are never
+ * compiled, nor exported.
+ */
+int wolfidps_route_set_rate_limit(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t dst_flags,
+    int event_label_len,
+    const char *event_label,
+    wolfidps_time_t interval,
+    uint32_t burst
+    );
+
 int wolfidps_route_dispatch(
     struct wolfidps_context *wolfidps,
     struct wolfidps_sockaddr *src,
@@ -287,6 +1135,157 @@ int wolfidps_route_dispatch(
     wolfidps_time_t *ttl
     );
 
+/* classify n_flows src/dst pairs under a single lock acquisition and clock
+ * read.  contexts and ttls may be NULL.  results, and the dispatch cache,
+ * are as for n_flows calls to wolfidps_route_dispatch(), but the batch is
+ * timed as one call under WOLFIDPS_PROBE_DISPATCH_BATCH.  if a flow's
+ * dispatch fails, it and the flows after it are left WOLFIDPS_UNSPEC, with
+ * a ttl of WOLFIDPS_TIME_NEVER, and the error is returned.
+ */
+int wolfidps_route_dispatch_batch(
+    struct wolfidps_context *wolfidps,
+    int n_flows,
+    struct wolfidps_sockaddr * const *srcs,
+    struct wolfidps_sockaddr * const *dsts,
+    void * const *contexts,
+    wolfidps_disposition_t *dispositions,
+    wolfidps_time_t *ttls
+    );
+
+/* an entry in the packed prefix arrays of wolfidps_route_insert_bulk()
+ * and wolfidps_route_delete_bulk(): a src block, in big endian.
+ */
+struct wolfidps_route_prefix {
+    wolfidps_family_t sa_family;
+    u_char addr_len; /* in bits */
+    u_char addr[16];
+};
+
+/* insert a route from each of n_prefixes src blocks to anywhere, on any
+ * proto and port, as for a blocklist feed.  flags are or'd with the
+ * wildcards for all but the src address.  the prefixes are sorted and
+ * deduplicated, the routes allocated, and their index built bottom-up,
+ * all before the table lock is taken.  it is then held once, to splice
+ * the index in, and the clock is read once for every route.  prefixes
+ * with a route in place already are skipped.  it all goes in, or on
+ * error, none of it: routes are only evicted to make room once nothing
+ * else can fail.  returns the number of routes inserted.
+ */
+int wolfidps_route_insert_bulk(
+    struct wolfidps_context *wolfidps,
+    int n_prefixes,
+    const struct wolfidps_route_prefix *prefixes,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label,
+    wolfidps_time_t ttl
+    );
+
+/* delete the routes inserted by wolfidps_route_insert_bulk() for each of
+ * n_prefixes src blocks, under one hold of the table lock.  returns the
+ * number of routes deleted.
+ */
+int wolfidps_route_delete_bulk(
+    struct wolfidps_context *wolfidps,
+    int n_prefixes,
+    const struct wolfidps_route_prefix *prefixes,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label
+    );
+
+/* a route, as returned by wolfidps_route_export_next(). */
+struct wolfidps_route_export_ent {
+    wolfidps_route_flags_t flags;
+    wolfidps_family_t sa_family;
+    wolfidps_proto_t sa_proto;
+    wolfidps_port_t src_port, dst_port;
+    u_char src_if_id, dst_if_id;
+    u_char src_addr_len, dst_addr_len; /* in bits */
+    wolfidps_address_mask_t src_addr, dst_addr;
+    wolfidps_time_t ttl; /* left to run, or WOLFIDPS_TIME_NEVER */
+    byte event_label_len; /* 0 for none */
+    char event_label[255];
+};
+
+struct wolfidps_route_export;
+
+/* start (or with *export non-NULL, restart) a walk of the routes in the
+ * tries: the src-keyed routes by family and then src prefix, and then the
+ * dst-only routes likewise by dst prefix.  routes served from a compiled
+ * policy image are not walked -- see wolfidps_policy_export() for those.
+ */
+int wolfidps_route_export_init(struct wolfidps_context *wolfidps, struct wolfidps_route_export **export);
+/* copy out up to max_ents more unexpired routes, setting *n_ents, 0 once
+ * the walk is done.  the table lock is only held for the call, so the
+ * table may change between calls; the walk resumes after the last
+ * prefix copied.  all the routes on a prefix are copied together, and
+ * BUFFER_E is returned if max_ents can't hold them.
+ */
+int wolfidps_route_export_next(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_route_export *export,
+    int max_ents,
+    struct wolfidps_route_export_ent *ents,
+    int *n_ents
+    );
+int wolfidps_route_export_free(struct wolfidps_context *wolfidps, struct wolfidps_route_export **export);
+
+/* set up n_shards contexts, plus a shared tier, each with its own lock,
+ * reader slots, counters and expiry.  inserts into one shard never stall
+ * readers of another.  AF_INET and AF_INET6 sources are sharded on their
+ * leading inet_prefix_bits and inet6_prefix_bits; other families live in
+ * the shared tier.  the contexts are configured individually, through
+ * shards->contexts[], and must share a clock.  the shared tier is the
+ * place for static policy, and the shards for per-source routes, such as
+ * scan penalties.
+ */
+int wolfidps_shards_init(
+    struct wolfidps_allocator *allocator,
+    int n_shards,
+    unsigned int inet_prefix_bits,
+    unsigned int inet6_prefix_bits,
+    struct wolfidps_shards **shards);
+int wolfidps_shards_shutdown(struct wolfidps_shards **shards);
+
+/* the context holding routes whose src is src: a shard, or the shared tier. */
+struct wolfidps_context *wolfidps_shards_context(struct wolfidps_shards *shards, const struct wolfidps_sockaddr *src);
+
+/* as for wolfidps_route_insert() and wolfidps_route_delete(), in the
+ * context for src.
+ */
+int wolfidps_shards_route_insert(
+    struct wolfidps_shards *shards,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label,
+    wolfidps_time_t ttl
+    );
+int wolfidps_shards_route_delete(
+    struct wolfidps_shards *shards,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    int event_label_len,
+    const char *event_label
+    );
+
+/* as for wolfidps_route_dispatch(), across the flow's shard and the shared
+ * tier.  a match in the shard always has the longer src prefix, so the
+ * shared tier is only consulted on a miss.  flows that miss both are seen
+ * by the shard's scan detector, if any.
+ */
+int wolfidps_shards_route_dispatch(
+    struct wolfidps_shards *shards,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    void *context,
+    wolfidps_disposition_t *disposition,
+    wolfidps_time_t *ttl
+    );
+
 
 //    * manually get, set, increment, or decrement the current hit count for a family-address-keyword tuple.
 //    * manually remove a family-address or family-address-keyword tuple from the table, optionally qualified by associated disposition
@@ -1,26 +1,551 @@
 #ifndef WOLFIDPS_INTERNAL_H
 #define WOLFIDPS_INTERNAL_H
 
+#include <stddef.h>
+#include <time.h>
+
 #include "wolfidps.h"
 
+#define WOLFIDPS_ATOMIC_LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define WOLFIDPS_ATOMIC_STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define WOLFIDPS_ATOMIC_ADD(x, v) ((void)__atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED))
+
+#define WOLFIDPS_CONTAINER_OF(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#ifdef __GNUC__
+#define WOLFIDPS_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define WOLFIDPS_PREFETCH(p) do {} while (0)
+#endif
+
+struct wolfidps_epoch_slot *wolfidps_epoch_enter(struct wolfidps_context *wolfidps);
+void wolfidps_epoch_leave(struct wolfidps_epoch_slot *slot);
+void wolfidps_epoch_retire(struct wolfidps_context *wolfidps, void *ptr);
+void wolfidps_epoch_retire_cb(struct wolfidps_context *wolfidps, void *ptr, wolfidps_retire_cb_t free_cb);
+void wolfidps_epoch_synchronize(struct wolfidps_context *wolfidps);
+void wolfidps_epoch_free(struct wolfidps_context *wolfidps);
+
+int wolfidps_counters_init(struct wolfidps_context *wolfidps);
+void wolfidps_counters_free(struct wolfidps_context *wolfidps);
+int wolfidps_counter_alloc(struct wolfidps_context *wolfidps, wolfidps_counter_id_t *id);
+void wolfidps_counter_release(struct wolfidps_context *wolfidps, wolfidps_counter_id_t id);
+int wolfidps_counter_alloc_range(struct wolfidps_context *wolfidps, uint32_t n, wolfidps_counter_id_t *base);
+void wolfidps_counter_release_range(struct wolfidps_context *wolfidps, wolfidps_counter_id_t base, uint32_t n);
+void wolfidps_counter_add(struct wolfidps_context *wolfidps, wolfidps_counter_id_t id, wolfidps_count_t count);
+int wolfidps_counter_shard_init(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot);
+void wolfidps_counter_shard_fold(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot);
+
+/* id's count in shard, or NULL if its chunk has yet to be allocated. */
+static inline wolfidps_count_t *wolfidps_counter_ref(struct wolfidps_counter_shard *shard, wolfidps_counter_id_t id) {
+    wolfidps_count_t **page = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(shard->pages[id >> (WOLFIDPS_COUNTER_PAGE_BITS + WOLFIDPS_COUNTER_CHUNK_BITS)]);
+    wolfidps_count_t *chunk;
+    if (page == NULL)
+        return NULL;
+    if ((chunk = WOLFIDPS_ATOMIC_LOAD_ACQUIRE(page[(id >> WOLFIDPS_COUNTER_CHUNK_BITS) & (WOLFIDPS_COUNTER_PAGE_SIZE - 1)])) == NULL)
+        return NULL;
+    return &chunk[id & (WOLFIDPS_COUNTER_CHUNK_SIZE - 1)];
+}
+
+wolfidps_count_t *wolfidps_counter_shard_grow(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_counter_id_t id);
+
+/* hot path.  slot is the caller's reader slot, or NULL if it has none.
+ * a reader slot is only ever written by its owning thread, so a plain
+ * load and store suffice -- the store is atomic only so that concurrent
+ * folds never see a torn value.  the first count in a chunk it lacks
+ * allocates that chunk, or failing that, goes to the shared shard.
+ */
+static inline void wolfidps_counter_inc(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_counter_id_t id) {
+    wolfidps_count_t *count;
+    if (id == 0)
+        return;
+    if (slot &&
+        (((count = wolfidps_counter_ref(slot->counters, id)) != NULL) ||
+         ((count = wolfidps_counter_shard_grow(wolfidps, slot, id)) != NULL)))
+        __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    else
+        WOLFIDPS_ATOMIC_ADD(*wolfidps_counter_ref(wolfidps->counters.shared, id), 1);
+}
+
+void wolfidps_timer_wheel_init(struct wolfidps_context *wolfidps);
+int wolfidps_timer_start(struct wolfidps_context *wolfidps);
+int wolfidps_timer_add(struct wolfidps_context *wolfidps, struct wolfidps_timer *timer, woldidps_time_t expires);
+void wolfidps_timer_del(struct wolfidps_context *wolfidps, struct wolfidps_timer *timer);
+struct wolfidps_timer *wolfidps_timer_soonest(struct wolfidps_context *wolfidps, int max_scan);
+
+int wolfidps_lock_init(struct wolfidps_rwlock *lock);
+int wolfidps_lock_destroy(struct wolfidps_rwlock *lock);
 int wolfidps_lock_readonly(struct wolfidps_rwlock *lock);
 int wolfidps_lock_readwrite(struct wolfidps_rwlock *lock);
 int wolfidps_lock_unlock(struct wolfidps_rwlock *lock);
 int wolfidps_lock_write2read(struct wolfidps_rwlock *lock);
 
+int wolfidps_event_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right);
 int wolfidps_rule_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right);
 int wolfidps_action_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right);
 int wolfidps_route_key_cmp(struct wolfidps_table_ent_generic *left, struct wolfidps_table_ent_generic *right);
 
 int wolfidps_table_ent_insert(struct wolfidps_table_ent_generic *ent, struct wolfidps_table_generic *table);
+void wolfidps_table_ent_insert_after(struct wolfidps_table_ent_generic *ent, struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic *prev);
 int wolfidps_table_ent_get(struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic **ent);
 int wolfidps_table_ent_delete(struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic **ent);
 void wolfidps_table_ent_delete_1(struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic *ent);
 
+/* bit i of a big endian address, counting from the most significant bit. */
+static inline int wolfidps_addr_bit(const u_char *addr, unsigned int i) {
+    return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/* number of leading bits, from start_bit up to at most end_bit, shared by a and b. */
+static inline unsigned int wolfidps_addr_common_bits(const u_char *a, const u_char *b, unsigned int start_bit, unsigned int end_bit) {
+    unsigned int i = start_bit;
+    while (i < end_bit) {
+        u_char x = a[i >> 3] ^ b[i >> 3];
+        if (i & 7)
+            x &= (u_char)(0xff >> (i & 7));
+        if (x) {
+            unsigned int j = i & ~7U;
+            while (! (x & 0x80)) {
+                x <<= 1;
+                ++j;
+            }
+            return (j < end_bit) ? j : end_bit;
+        }
+        i = (i & ~7U) + 8;
+    }
+    return end_bit;
+}
+
+static inline int wolfidps_addr_prefix_match(const u_char *addr, const u_char *prefix, unsigned int prefix_len) {
+    return wolfidps_addr_common_bits(addr, prefix, 0, prefix_len) == prefix_len;
+}
+
+int wolfidps_route_trie_insert(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route_table_ent *ent);
+void wolfidps_route_trie_delete_1(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route_table_ent *ent);
+struct wolfidps_route_trie_node *wolfidps_route_trie_get(struct wolfidps_route_table *table, int ent_type, wolfidps_family_t sa_family, const u_char *addr, unsigned int addr_len);
+void wolfidps_route_trie_free(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table);
+int wolfidps_route_trie_build(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route * const *routes, size_t n_routes);
+int wolfidps_route_trie_splice(struct wolfidps_context *wolfidps, struct wolfidps_route_table *table, struct wolfidps_route_table *from);
+struct wolfidps_route_trie_node *wolfidps_route_trie_next(struct wolfidps_route_trie_family *family, const u_char *after, unsigned int after_len);
+
+/* invalidate every dispatch cache.  called by writers, after the change. */
+static inline void wolfidps_route_table_changed(struct wolfidps_route_table *table) {
+    WOLFIDPS_ATOMIC_STORE_RELEASE(table->generation, table->generation + 1);
+}
+
+typedef int (*wolfidps_route_match_fn_t)(const struct wolfidps_route *route, void *match_context);
+
+struct wolfidps_route_trie_family *wolfidps_route_trie_family_get(struct wolfidps_route_table *table, int ent_type, wolfidps_family_t sa_family);
+
+/* incremental longest-prefix descent, for interleaving several lookups. */
+struct wolfidps_route_trie_walk {
+    const u_char *addr;
+    unsigned int addr_len;
+    unsigned int start_bit;
+    struct wolfidps_route_trie_node *node, *deepest;
+};
+
+void wolfidps_route_trie_walk_init(struct wolfidps_route_trie_walk *walk, struct wolfidps_route_trie_family *family, const u_char *addr, unsigned int addr_len);
+int wolfidps_route_trie_walk_step(struct wolfidps_route_trie_walk *walk);
+struct wolfidps_route_table_ent *wolfidps_route_trie_walk_match(
+    struct wolfidps_route_trie_walk *walk,
+    wolfidps_route_match_fn_t match_fn,
+    void *match_context);
+
+struct wolfidps_route_table_ent *wolfidps_route_trie_match_1(
+    struct wolfidps_route_trie_family *family,
+    const u_char *addr,
+    unsigned int addr_len,
+    wolfidps_route_match_fn_t match_fn,
+    void *match_context);
+int wolfidps_route_trie_match(
+    struct wolfidps_route_table *table,
+    wolfidps_family_t sa_family,
+    const u_char *addr,
+    unsigned int addr_len,
+    int ent_type,
+    wolfidps_route_match_fn_t match_fn,
+    void *match_context,
+    struct wolfidps_route_table_ent **ent);
+
+struct wolfidps_route_match_context {
+    const struct wolfidps_sockaddr *src, *dst;
+    woldidps_time_t now;
+};
+
+int wolfidps_route_matches(const struct wolfidps_route *route, void *match_context);
+int wolfidps_route_match_flow(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_route_match_context *match,
+    struct wolfidps_policy_image **image,
+    struct wolfidps_route **route,
+    uint32_t *rule);
+
+/* expired routes are inert until reaped. */
+static inline int wolfidps_route_expired(const struct wolfidps_route *route, woldidps_time_t now) {
+    return (route->ttl != WOLFIDPS_TIME_NEVER) &&
+        (now - (woldidps_time_t)route->last_transition_time >= (woldidps_time_t)route->ttl);
+}
+
+int wolfidps_dispatch_cache_init(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot);
+void wolfidps_dispatch_cache_free(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot);
+int wolfidps_dispatch_cache_get(
+    struct wolfidps_dispatch_cache *cache,
+    uint64_t generation,
+    const struct wolfidps_policy_image *image,
+    const struct wolfidps_sockaddr *src,
+    const struct wolfidps_sockaddr *dst,
+    woldidps_time_t now,
+    struct wolfidps_dispatch_cache_ent **ent,
+    struct wolfidps_route **route,
+    uint32_t *rule);
+
+/* fill in the entry left by a missed wolfidps_dispatch_cache_get(). */
+static inline void wolfidps_dispatch_cache_put(
+    struct wolfidps_dispatch_cache_ent *ent,
+    uint64_t generation,
+    const struct wolfidps_policy_image *image,
+    struct wolfidps_route *route,
+    uint32_t rule)
+{
+    ent->generation = generation;
+    ent->image = image;
+    ent->route = route;
+    ent->rule = rule;
+}
+
+int wolfidps_stats_slot_init(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot);
+void wolfidps_stats_slot_fold(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot);
+
+#ifndef WOLFIDPS_NO_STATS
+
+/* dispatch is timed once per 2^WOLFIDPS_STATS_SAMPLE_SHIFT calls, keeping
+ * the clock off the hot path.  the other probes time every call.
+ */
+#ifndef WOLFIDPS_STATS_SAMPLE_SHIFT
+#define WOLFIDPS_STATS_SAMPLE_SHIFT 4
+#endif
+
+static inline uint64_t wolfidps_stats_ns(void) {
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+/* values below 2^WOLFIDPS_STATS_SUB_BITS get a bucket each.  above, each
+ * power of two is split WOLFIDPS_STATS_SUB_BITS ways.
+ */
+static inline unsigned int wolfidps_stats_bucket(uint64_t ns) {
+    unsigned int shift;
+    if (ns < (1U << WOLFIDPS_STATS_SUB_BITS))
+        return (unsigned int)ns;
+    if (ns >> WOLFIDPS_STATS_MAX_BITS)
+        return WOLFIDPS_STATS_BUCKETS - 1;
+    shift = (unsigned int)(63 - __builtin_clzll(ns)) - WOLFIDPS_STATS_SUB_BITS;
+    return ((shift + 1) << WOLFIDPS_STATS_SUB_BITS) + (unsigned int)((ns >> shift) & ((1U << WOLFIDPS_STATS_SUB_BITS) - 1));
+}
+
+/* as for wolfidps_counter_inc(), the slot shard is only written by its
+ * owner, so a plain increment suffices there.
+ */
+static inline void wolfidps_stats_add(struct wolfidps_epoch_slot *slot, wolfidps_count_t *count, wolfidps_count_t n) {
+    if (slot)
+        __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    else
+        WOLFIDPS_ATOMIC_ADD(*count, n);
+}
+
+static inline struct wolfidps_stats *wolfidps_stats_shard(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot) {
+    return slot ? slot->stats : &wolfidps->stats;
+}
+
+/* returns the start time to pass to wolfidps_probe_end(), or 0 if the
+ * call isn't timed.
+ */
+static inline uint64_t wolfidps_probe_begin(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_probe_t probe) {
+    struct wolfidps_probe_stats *stats = &wolfidps_stats_shard(wolfidps, slot)->probes[probe];
+    wolfidps_count_t n;
+    if (slot) {
+        n = __atomic_load_n(&stats->n_calls, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->n_calls, n + 1, __ATOMIC_RELAXED);
+    } else
+        n = __atomic_fetch_add(&stats->n_calls, 1, __ATOMIC_RELAXED);
+    if ((probe == WOLFIDPS_PROBE_DISPATCH) && (n & ((1U << WOLFIDPS_STATS_SAMPLE_SHIFT) - 1)))
+        return 0;
+    return wolfidps_stats_ns();
+}
+
+static inline void wolfidps_probe_end(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_probe_t probe, uint64_t start) {
+    struct wolfidps_probe_stats *stats;
+    uint64_t ns;
+    if (start == 0)
+        return;
+    ns = wolfidps_stats_ns() - start;
+    stats = &wolfidps_stats_shard(wolfidps, slot)->probes[probe];
+    wolfidps_stats_add(slot, &stats->total_ns, ns);
+    wolfidps_stats_add(slot, &stats->hist[wolfidps_stats_bucket(ns)], 1);
+}
+
+static inline void wolfidps_stats_disposition(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_disposition_t disposition) {
+    if ((unsigned int)disposition < WOLFIDPS_N_DISPOSITIONS)
+        wolfidps_stats_add(slot, &wolfidps_stats_shard(wolfidps, slot)->dispositions[disposition], 1);
+}
+
+#else /* WOLFIDPS_NO_STATS */
+
+static inline uint64_t wolfidps_probe_begin(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_probe_t probe) {
+    (void)wolfidps; (void)slot; (void)probe;
+    return 0;
+}
+
+static inline void wolfidps_probe_end(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_probe_t probe, uint64_t start) {
+    (void)wolfidps; (void)slot; (void)probe; (void)start;
+}
+
+static inline void wolfidps_stats_disposition(struct wolfidps_context *wolfidps, struct wolfidps_epoch_slot *slot, wolfidps_disposition_t disposition) {
+    (void)wolfidps; (void)slot; (void)disposition;
+}
+
+#endif /* WOLFIDPS_NO_STATS */
+
+/* writers take the table lock through here, so that waits for it are seen. */
+static inline int wolfidps_table_lock_readwrite(struct wolfidps_context *wolfidps) {
+    uint64_t start = wolfidps_probe_begin(wolfidps, NULL, WOLFIDPS_PROBE_LOCK_WAIT);
+    int ret = wolfidps_lock_readwrite(&wolfidps->lock);
+    wolfidps_probe_end(wolfidps, NULL, WOLFIDPS_PROBE_LOCK_WAIT, start);
+    return ret;
+}
+
+void wolfidps_route_rate_limit_1(struct wolfidps_route *route, wolfidps_time_t interval, uint32_t burst);
+
+int wolfidps_port_set_new(struct wolfidps_context *wolfidps, int n_ranges, const struct wolfidps_port_range *ranges, struct wolfidps_port_set **set);
+void wolfidps_port_set_free(struct wolfidps_context *wolfidps, void *ptr);
+
+static inline int wolfidps_port_set_contains(const struct wolfidps_port_set *set, wolfidps_port_t port) {
+    const struct wolfidps_port_range *ranges;
+    uint32_t lo = 0, hi;
+
+    if (set->n_ranges == 0)
+        return (int)((set->buf[port >> 6] >> (port & 63)) & 1);
+    /* find the last range starting at or below port. */
+    ranges = WOLFIDPS_PORT_SET_RANGES(set);
+    hi = set->n_ranges;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) >> 1;
+        if (ranges[mid].lo <= port)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo > 0) && (port <= ranges[lo - 1].hi);
+}
+
+/* true if the route is no more than its key, event, and action, so that
+ * a packed policy rule can stand for it.
+ */
+static inline int wolfidps_route_is_packable(const struct wolfidps_route *route) {
+    return (route->extra_ports[0] == NULL) && (route->extra_ports[1] == NULL) &&
+        (route->rate_interval == 0);
+}
+
+/* protos whose ports are numbered as tcp's are, for tcplike routes. */
+static inline int wolfidps_proto_is_tcplike(wolfidps_proto_t sa_proto) {
+    return (sa_proto == 6 /* tcp */) || (sa_proto == 17 /* udp */) ||
+        (sa_proto == 33 /* dccp */) || (sa_proto == 132 /* sctp */) ||
+        (sa_proto == 136 /* udplite */);
+}
+int wolfidps_route_dispatch_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_route *route,
+    woldidps_time_t now,
+    void *context,
+    wolfidps_disposition_t *disposition,
+    wolfidps_time_t *ttl);
+int wolfidps_route_lookup(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t dst_flags,
+    int event_label_len,
+    const char *event_label,
+    struct wolfidps_route **route,
+    uint32_t *rule);
+int wolfidps_route_new(
+    struct wolfidps_context *wolfidps,
+    const struct wolfidps_sockaddr *src,
+    const struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    struct wolfidps_route **route);
+int wolfidps_route_present(
+    struct wolfidps_context *wolfidps,
+    const struct wolfidps_route *new,
+    const struct wolfidps_event *parent_event);
+int wolfidps_route_attach(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_route *new,
+    struct wolfidps_event *parent_event,
+    wolfidps_time_t ttl,
+    woldidps_time_t now);
+int wolfidps_route_arm(struct wolfidps_context *wolfidps, struct wolfidps_route *route, woldidps_time_t now);
+void wolfidps_route_detach(struct wolfidps_context *wolfidps, struct wolfidps_route *route);
+void wolfidps_route_discard(struct wolfidps_context *wolfidps, struct wolfidps_route *route);
+int wolfidps_route_insert_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_sockaddr *src,
+    struct wolfidps_sockaddr *dst,
+    wolfidps_route_flags_t flags,
+    struct wolfidps_event *parent_event,
+    wolfidps_time_t ttl,
+    struct wolfidps_route **route);
+int wolfidps_route_delete_1(struct wolfidps_context *wolfidps, struct wolfidps_route *route);
+void wolfidps_route_table_flush(struct wolfidps_context *wolfidps);
+
+void wolfidps_evict_link(struct wolfidps_route_table *table, struct wolfidps_route *route);
+void wolfidps_evict_unlink(struct wolfidps_route_table *table, struct wolfidps_route *route);
+long wolfidps_evict_needed(struct wolfidps_context *wolfidps, long n);
+int wolfidps_evict_make_room(struct wolfidps_context *wolfidps, long n);
+int wolfidps_evict_1(struct wolfidps_context *wolfidps);
+
+int wolfidps_policy_match(
+    const struct wolfidps_policy_image *image,
+    wolfidps_family_t sa_family,
+    const struct wolfidps_route_match_context *match,
+    uint32_t *rule,
+    unsigned int *prefix_len);
+int wolfidps_policy_rule_matches(const struct wolfidps_policy_image *image, const struct wolfidps_policy_rule *rule, const struct wolfidps_route_match_context *match);
+int wolfidps_policy_rule_precedes(const struct wolfidps_policy_rule *rule, const struct wolfidps_route *route);
+/* the scan kernels of the vector matcher -- see match.c. */
+typedef enum wolfidps_linear_kernel {
+    WOLFIDPS_LINEAR_KERNEL_SCALAR = 0,
+    WOLFIDPS_LINEAR_KERNEL_SSE42,
+    WOLFIDPS_LINEAR_KERNEL_AVX2,
+    WOLFIDPS_LINEAR_N_KERNELS
+} wolfidps_linear_kernel_t;
+
+void wolfidps_policy_linear_build(struct wolfidps_context *wolfidps, struct wolfidps_policy_image *image);
+void wolfidps_policy_linear_free(struct wolfidps_context *wolfidps, struct wolfidps_policy_image *image);
+int wolfidps_policy_linear_set_kernel(struct wolfidps_policy_image *image, wolfidps_linear_kernel_t kernel);
+int wolfidps_policy_linear_match(
+    const struct wolfidps_policy_image *image,
+    const struct wolfidps_policy_linear *linear,
+    const struct wolfidps_route_match_context *match,
+    uint32_t *rule,
+    unsigned int *prefix_len);
+int wolfidps_policy_find(const struct wolfidps_policy_image *image, const struct wolfidps_route *key, int event_label_len, const char *event_label, uint32_t *rule);
+int wolfidps_policy_dispatch_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    const struct wolfidps_policy_image *image,
+    uint32_t rule,
+    woldidps_time_t now,
+    void *context,
+    wolfidps_disposition_t *disposition,
+    wolfidps_time_t *ttl);
+void wolfidps_policy_rule_delete(struct wolfidps_context *wolfidps, uint32_t rule);
+void wolfidps_policy_flush(struct wolfidps_context *wolfidps);
+int wolfidps_policy_image_open(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_policy_header *header,
+    size_t map_len,
+    int with_routes,
+    int with_counters,
+    struct wolfidps_policy_image **image);
+void wolfidps_policy_image_free(struct wolfidps_context *wolfidps, void *ptr);
+void wolfidps_policy_replace(struct wolfidps_context *wolfidps, struct wolfidps_policy_image *image);
+struct wolfidps_policy_header *wolfidps_policy_export_block(struct wolfidps_context *wolfidps, woldidps_time_t now);
+
+/* fnv-1a, for the event index and policy name tables. */
+static inline uint32_t wolfidps_name_hash(const char *name, uint32_t len) {
+    uint32_t hash = 2166136261U;
+    while (len-- > 0) {
+        hash ^= (u_char)*name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+#define WOLFIDPS_EVENT_TOMBSTONE ((struct wolfidps_event *)1)
+
+int wolfidps_event_getreference(struct wolfidps_context *wolfidps, int event_label_len, const char *event_label, struct wolfidps_event **event);
+int wolfidps_event_dropreference(struct wolfidps_context *wolfidps, struct wolfidps_event *event);
+struct wolfidps_event *wolfidps_event_get(struct wolfidps_context *wolfidps, int keyword_len, const char *keyword, uint32_t hash);
+struct wolfidps_action *wolfidps_action_get(struct wolfidps_context *wolfidps, int label_len, const char *label);
+int wolfidps_action_getreference(struct wolfidps_context *wolfidps, int label_len, const char *label, struct wolfidps_action **action);
+int wolfidps_action_dropreference(struct wolfidps_context *wolfidps, struct wolfidps_action *action);
+void wolfidps_action_list_clear(struct wolfidps_context *wolfidps, struct wolfidps_action_list *list);
+void wolfidps_event_table_free(struct wolfidps_context *wolfidps);
+
+void wolfidps_config_free(struct wolfidps_context *wolfidps);
+
+/* room for a route and WOLFIDPS_ROUTE_SNAPSHOT_BUF_SIZE bytes of its
+ * addr_buf, in uint64_t for alignment.
+ */
+#ifndef WOLFIDPS_ROUTE_SNAPSHOT_BUF_SIZE
+#define WOLFIDPS_ROUTE_SNAPSHOT_BUF_SIZE 64
+#endif
+#define WOLFIDPS_ROUTE_SNAPSHOT_WORDS ((sizeof(struct wolfidps_route) + WOLFIDPS_ROUTE_SNAPSHOT_BUF_SIZE + 7) / 8)
+
+void wolfidps_route_snapshot(uint64_t *buf, const struct wolfidps_route *route);
+int wolfidps_action_queue_push(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_action *action,
+    struct wolfidps_event *event,
+    const struct wolfidps_route *route,
+    void *caller_context,
+    const struct wolfidps_action_trigger *trigger);
+void wolfidps_action_queue_flush(struct wolfidps_context *wolfidps);
+void wolfidps_action_queue_unpin(struct wolfidps_context *wolfidps, volatile int *queue_refs, void *ptr);
+
+int wolfidps_action_coalesce(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    struct wolfidps_action *action,
+    struct wolfidps_event *event,
+    const struct wolfidps_route *route,
+    uint32_t rule,
+    woldidps_time_t now);
+int wolfidps_action_coalesce_flush_1(struct wolfidps_context *wolfidps, woldidps_time_t now, int all);
+void wolfidps_coalescer_free(struct wolfidps_context *wolfidps);
+
+struct wolfidps_event *wolfidps_event_by_id(struct wolfidps_context *wolfidps, wolfidps_ent_id_t id);
+void wolfidps_admission_free(struct wolfidps_context *wolfidps);
+
+int wolfidps_scan_observe_1(
+    struct wolfidps_context *wolfidps,
+    struct wolfidps_epoch_slot *slot,
+    const struct wolfidps_sockaddr *src,
+    const struct wolfidps_sockaddr *dst,
+    woldidps_time_t now);
+int wolfidps_scan_penalize(struct wolfidps_context *wolfidps);
+void wolfidps_scanner_free(struct wolfidps_context *wolfidps);
+
+/* whether action's triggers are merged before delivery. */
+static inline int wolfidps_action_is_coalesced(const struct wolfidps_action *action) {
+    return action->coalesced_handler && action->coalesce_window;
+}
+
+/* whether action's handler is to be queued rather than called. */
+static inline int wolfidps_action_is_queued(struct wolfidps_context *wolfidps, const struct wolfidps_action *action) {
+    return action->async && wolfidps->action_queue.running;
+}
+
 struct wolfidps_cursor {
     struct wolfidps_table_ent_generic *point;
 };
 
+/* where a route export walk stands: after the src prefix last copied. */
+struct wolfidps_route_export {
+    struct wolfidps_cursor ents; /* on the node being copied, while the lock is held */
+    int started; /* prefix holds the last one copied in sa_family */
+    int done;
+    int ent_type; /* the index being walked */
+    wolfidps_family_t sa_family;
+    uint16_t prefix_len;
+    wolfidps_address_mask_t prefix;
+};
+
 int wolfidps_table_cursor_init(struct wolfidps_context *wolfidps, struct wolfidps_cursor **cursor);
 int wolfidps_table_cursor_set(struct wolfidps_table_generic *table, struct wolfidps_table_ent_generic *ent, struct wolfidps_cursor *cursor, int *cursor_position);
 int wolfidps_table_cursor_current(struct wolfidps_cursor *cursor, struct wolfidps_table_ent_generic **ent);